@@ -1,6 +1,8 @@
 #include "Model.h"
 #include "labhelper.h"
 #include <iostream>
+// Before the implementation below, which must only be included once
+#include "objparser.h"
 #define TINYOBJLOADER_IMPLEMENTATION // define this in only *one* .cc
 #include <tiny_obj_loader.h>
 //#include <experimental/tinyobj_loader_opt.h>
@@ -8,7 +10,13 @@
 #include <sstream>
 #include <iomanip>
 #include <GL/glew.h>
-#include <stb_image.h>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include "filecache.h"
+#include "mappedfile.h"
+#include "meshoptimize.h"
+#include "texturecache.h"
 
 namespace labhelper
 {
@@ -17,39 +25,26 @@ bool Texture::load(const std::string& _directory, const std::string& _filename,
 	filename = _filename;
 	directory = _directory;
 	valid = true;
-	int components;
-	data = stbi_load((directory + filename).c_str(), &width, &height, &components, _components);
-	if(data == nullptr)
+	if(_components != 1 && _components != 3 && _components != 4)
+	{
+		std::cout << "Texture loading not implemented for this number of compenents.\n";
+		exit(1);
+	}
+	// The pixels go straight from the (usually memory mapped) texture cache to
+	// GL, so they are not kept around in data.
+	CachedTexture cached;
+	if(!loadCachedTexture(directory + filename, _components, cached))
 	{
 		std::cout << "ERROR: loadModelFromOBJ(): Failed to load texture: " << filename << " in " << _directory
 		          << "\n";
 		exit(1);
 	}
+	width = cached.width();
+	height = cached.height();
+	data = nullptr;
 	glGenTextures(1, &gl_id);
 	glBindTexture(GL_TEXTURE_2D, gl_id);
-	GLenum format, internal_format;
-	if(_components == 1)
-	{
-		format = GL_R;
-		internal_format = GL_R8;
-	}
-	else if(_components == 3)
-	{
-		format = GL_RGB;
-		internal_format = GL_RGB;
-	}
-	else if(_components == 4)
-	{
-		format = GL_RGBA;
-		internal_format = GL_RGBA;
-	}
-	else
-	{
-		std::cout << "Texture loading not implemented for this number of compenents.\n";
-		exit(1);
-	}
-	glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-	glGenerateMipmap(GL_TEXTURE_2D);
+	uploadCachedTexture(cached);
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
@@ -80,9 +75,471 @@ Model::~Model()
 		if(material.m_emission_texture.valid)
 			glDeleteTextures(1, &material.m_emission_texture.gl_id);
 	}
-	glDeleteBuffers(1, &m_positions_bo);
-	glDeleteBuffers(1, &m_normals_bo);
-	glDeleteBuffers(1, &m_texture_coordinates_bo);
+	// Models built for export never touch GL.
+	if(m_vaob != 0)
+	{
+		glDeleteBuffers(1, &m_positions_bo);
+		glDeleteBuffers(1, &m_normals_bo);
+		glDeleteBuffers(1, &m_texture_coordinates_bo);
+		glDeleteBuffers(1, &m_indices_bo);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Binary mesh cache
+//
+// loadModelFromOBJ() writes everything it derived from the text files to
+// <name>.objcache next to the OBJ, and later loads just map that file:
+//
+//	MeshCacheHeader
+//	MeshCacheDependency[nof_dependencies]   the OBJ and its MTL files
+//	MeshCacheMaterial[nof_materials]
+//	MeshCacheMesh[nof_meshes]
+//	char strings[strings_size]             names, referenced by offset
+//	vec3 positions[nof_vertices]           (16 byte aligned)
+//	vec3 normals[nof_vertices]
+//	vec2 texture_coordinates[nof_vertices]
+//	uint32 indices[nof_indices]
+//
+// The arrays are in exactly the layout the vertex/index buffers use, so
+// they go from the mapping to glBufferData as they are. An entry is valid
+// as long as every dependency has the same size and either the same
+// modification time or the same content hash (checkouts touch mtimes).
+///////////////////////////////////////////////////////////////////////////
+namespace
+{
+// Bump whenever the layout changes or the OBJ import produces different data.
+const uint32_t MESH_CACHE_MAGIC = 0x434d484c; // "LHMC"
+const uint32_t MESH_CACHE_VERSION = 3;
+bool s_mesh_cache_enabled = true;
+bool s_parallel_obj_parser_enabled = true;
+
+struct MeshCacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nof_dependencies;
+	uint32_t nof_materials;
+	uint32_t nof_meshes;
+	uint32_t nof_vertices;
+	uint32_t nof_indices;
+	uint32_t reserved;
+	uint64_t strings_offset;
+	uint64_t strings_size;
+	uint64_t positions_offset;
+	uint64_t normals_offset;
+	uint64_t texture_coordinates_offset;
+	uint64_t indices_offset;
+};
+
+struct MeshCacheString
+{
+	uint32_t offset;
+	uint32_t length;
+};
+
+struct MeshCacheDependency
+{
+	uint64_t size;
+	int64_t time;
+	uint64_t hash;
+	MeshCacheString name;
+};
+
+struct MeshCacheMaterial
+{
+	float color[3];
+	float reflectivity;
+	float shininess;
+	float metalness;
+	float fresnel;
+	float emission;
+	float transparency;
+	MeshCacheString name;
+	MeshCacheString textures[6];
+};
+
+struct MeshCacheMesh
+{
+	MeshCacheString name;
+	uint32_t material_idx;
+	uint32_t start_index;
+	uint32_t number_of_vertices;
+};
+
+// The material textures in cache order, with the components they load with.
+Texture& materialTexture(Material& material, int i)
+{
+	Texture* textures[] = { &material.m_color_texture,     &material.m_reflectivity_texture,
+		                    &material.m_metalness_texture, &material.m_fresnel_texture,
+		                    &material.m_shininess_texture, &material.m_emission_texture };
+	return *textures[i];
+}
+const int material_texture_components[6] = { 4, 1, 1, 1, 1, 4 };
+
+uint64_t hashFile(const std::string& filename)
+{
+	MappedFile file;
+	if(!file.open(filename))
+		return 0;
+	return hashBytes(file.data(), file.size());
+}
+
+// The MTL files named by the OBJ, which the cache entry also depends on.
+std::vector<std::string> findMaterialLibraries(const std::string& objPath, const std::string& directory)
+{
+	std::vector<std::string> libraries;
+	std::ifstream file(objPath);
+	std::string line;
+	while(std::getline(file, line))
+	{
+		size_t start = line.find_first_not_of(" \t");
+		if(start == std::string::npos || line.compare(start, 7, "mtllib ") != 0)
+			continue;
+		std::istringstream names(line.substr(start + 7));
+		std::string name;
+		while(names >> name)
+			libraries.push_back(directory + name);
+	}
+	return libraries;
+}
+
+class StringTable
+{
+public:
+	MeshCacheString add(const std::string& str)
+	{
+		MeshCacheString ref = { uint32_t(m_data.size()), uint32_t(str.size()) };
+		m_data += str;
+		return ref;
+	}
+	const std::string& data() const { return m_data; }
+
+private:
+	std::string m_data;
+};
+
+template<typename T>
+void append(std::vector<uint8_t>& out, const T* data, size_t count)
+{
+	const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+	out.insert(out.end(), bytes, bytes + count * sizeof(T));
+}
+
+void alignTo16(std::vector<uint8_t>& out)
+{
+	out.resize((out.size() + 15) & ~size_t(15), 0);
+}
+
+void writeModelCache(const Model* model, const std::string& cachePath, const std::vector<std::string>& dependencies)
+{
+	StringTable strings;
+	std::vector<MeshCacheDependency> deps;
+	for(const std::string& dependency : dependencies)
+	{
+		FileStamp stamp;
+		if(!getFileStamp(dependency, stamp))
+			continue;
+		deps.push_back({ stamp.size, stamp.time, hashFile(dependency), strings.add(dependency) });
+	}
+	std::vector<MeshCacheMaterial> materials;
+	for(const Material& m : model->m_materials)
+	{
+		MeshCacheMaterial material = {};
+		material.color[0] = m.m_color.x;
+		material.color[1] = m.m_color.y;
+		material.color[2] = m.m_color.z;
+		material.reflectivity = m.m_reflectivity;
+		material.shininess = m.m_shininess;
+		material.metalness = m.m_metalness;
+		material.fresnel = m.m_fresnel;
+		material.emission = m.m_emission;
+		material.transparency = m.m_transparency;
+		material.name = strings.add(m.m_name);
+		for(int i = 0; i < 6; i++)
+		{
+			const Texture& texture = materialTexture(const_cast<Material&>(m), i);
+			material.textures[i] = strings.add(texture.valid ? texture.filename : std::string());
+		}
+		materials.push_back(material);
+	}
+	std::vector<MeshCacheMesh> meshes;
+	for(const Mesh& m : model->m_meshes)
+	{
+		meshes.push_back({ strings.add(m.m_name), m.m_material_idx, m.m_start_index, m.m_number_of_vertices });
+	}
+
+	MeshCacheHeader header = {};
+	header.magic = MESH_CACHE_MAGIC;
+	header.version = MESH_CACHE_VERSION;
+	header.nof_dependencies = uint32_t(deps.size());
+	header.nof_materials = uint32_t(materials.size());
+	header.nof_meshes = uint32_t(meshes.size());
+	header.nof_vertices = uint32_t(model->m_positions.size());
+	header.nof_indices = uint32_t(model->m_indices.size());
+
+	std::vector<uint8_t> out(sizeof(header));
+	append(out, deps.data(), deps.size());
+	append(out, materials.data(), materials.size());
+	append(out, meshes.data(), meshes.size());
+	header.strings_offset = out.size();
+	header.strings_size = strings.data().size();
+	append(out, strings.data().data(), strings.data().size());
+	alignTo16(out);
+	header.positions_offset = out.size();
+	append(out, model->m_positions.data(), model->m_positions.size());
+	alignTo16(out);
+	header.normals_offset = out.size();
+	append(out, model->m_normals.data(), model->m_normals.size());
+	alignTo16(out);
+	header.texture_coordinates_offset = out.size();
+	append(out, model->m_texture_coordinates.data(), model->m_texture_coordinates.size());
+	header.indices_offset = out.size();
+	append(out, model->m_indices.data(), model->m_indices.size());
+	memcpy(out.data(), &header, sizeof(header));
+
+	writeFileAtomic(cachePath, out.data(), out.size());
+}
+
+void uploadModel(Model* model, const glm::vec3* positions, const glm::vec3* normals,
+                 const glm::vec2* texture_coordinates, size_t number_of_vertices, const uint32_t* indices,
+                 size_t number_of_indices)
+{
+	glGenVertexArrays(1, &model->m_vaob);
+	glBindVertexArray(model->m_vaob);
+	glGenBuffers(1, &model->m_positions_bo);
+	glBindBuffer(GL_ARRAY_BUFFER, model->m_positions_bo);
+	glBufferData(GL_ARRAY_BUFFER, number_of_vertices * sizeof(glm::vec3), positions, GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0);
+	glEnableVertexAttribArray(0);
+	glGenBuffers(1, &model->m_normals_bo);
+	glBindBuffer(GL_ARRAY_BUFFER, model->m_normals_bo);
+	glBufferData(GL_ARRAY_BUFFER, number_of_vertices * sizeof(glm::vec3), normals, GL_STATIC_DRAW);
+	glVertexAttribPointer(1, 3, GL_FLOAT, false, 0, 0);
+	glEnableVertexAttribArray(1);
+	glGenBuffers(1, &model->m_texture_coordinates_bo);
+	glBindBuffer(GL_ARRAY_BUFFER, model->m_texture_coordinates_bo);
+	glBufferData(GL_ARRAY_BUFFER, number_of_vertices * sizeof(glm::vec2), texture_coordinates, GL_STATIC_DRAW);
+	glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
+	glEnableVertexAttribArray(2);
+	if(number_of_indices > 0)
+	{
+		// The element array binding is part of the VAO state
+		glGenBuffers(1, &model->m_indices_bo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model->m_indices_bo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, number_of_indices * sizeof(uint32_t), indices, GL_STATIC_DRAW);
+	}
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Turns the vertex streams with three unique vertices per triangle into
+// shared vertices plus an index buffer, optimised per mesh.
+///////////////////////////////////////////////////////////////////////////
+struct VertexKey
+{
+	glm::vec3 position;
+	glm::vec3 normal;
+	glm::vec2 texture_coordinate;
+};
+
+struct IndexStats
+{
+	size_t nof_expanded, nof_used;
+	size_t shaded_before, shaded_after; // With a 16 entry FIFO
+};
+
+IndexStats indexModel(Model* model)
+{
+	size_t nof_expanded = model->m_positions.size();
+
+	///////////////////////////////////////////////////////////////////////
+	// Merge vertices whose attributes are bitwise identical, with an open
+	// addressing hash table over the key bytes
+	///////////////////////////////////////////////////////////////////////
+	size_t table_size = 1;
+	while(table_size < nof_expanded * 2)
+		table_size *= 2;
+	std::vector<uint32_t> table(table_size, ~0u);
+	std::vector<VertexKey> unique;
+	unique.reserve(nof_expanded);
+	std::vector<uint32_t> indices(nof_expanded);
+	for(size_t i = 0; i < nof_expanded; i++)
+	{
+		VertexKey key = { model->m_positions[i], model->m_normals[i], model->m_texture_coordinates[i] };
+		size_t slot = hashBytes(&key, sizeof(key)) & (table_size - 1);
+		while(table[slot] != ~0u && memcmp(&unique[table[slot]], &key, sizeof(key)) != 0)
+			slot = (slot + 1) & (table_size - 1);
+		if(table[slot] == ~0u)
+		{
+			table[slot] = uint32_t(unique.size());
+			unique.push_back(key);
+		}
+		indices[i] = table[slot];
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Reorder each mesh's triangles for the post-transform cache, then
+	// renumber all vertices in order of first use
+	///////////////////////////////////////////////////////////////////////
+	size_t shaded_before = simulateVertexCache(indices.data(), indices.size(), unique.size());
+	// optimizeVertexCache() works on arrays as large as the vertex count it
+	// is given, so hand it each mesh with its vertices numbered from 0.
+	std::vector<uint32_t> local(unique.size(), ~0u);
+	std::vector<uint32_t> global;
+	for(const Mesh& mesh : model->m_meshes)
+	{
+		uint32_t* mesh_indices = indices.data() + mesh.m_start_index;
+		size_t nof_indices = mesh.m_number_of_vertices;
+		global.clear();
+		for(size_t i = 0; i < nof_indices; i++)
+		{
+			uint32_t& l = local[mesh_indices[i]];
+			if(l == ~0u)
+			{
+				l = uint32_t(global.size());
+				global.push_back(mesh_indices[i]);
+			}
+			mesh_indices[i] = l;
+		}
+		optimizeVertexCache(mesh_indices, nof_indices, global.size());
+		for(size_t i = 0; i < nof_indices; i++)
+			mesh_indices[i] = global[mesh_indices[i]];
+		for(uint32_t v : global)
+			local[v] = ~0u;
+	}
+	size_t shaded_after = simulateVertexCache(indices.data(), indices.size(), unique.size());
+	std::vector<uint32_t> remap = optimizeVertexFetch(indices.data(), indices.size(), unique.size());
+
+	size_t nof_used = 0;
+	for(uint32_t target : remap)
+		nof_used += target != ~0u ? 1 : 0;
+	model->m_positions.resize(nof_used);
+	model->m_normals.resize(nof_used);
+	model->m_texture_coordinates.resize(nof_used);
+	for(size_t v = 0; v < unique.size(); v++)
+	{
+		if(remap[v] == ~0u)
+			continue;
+		model->m_positions[remap[v]] = unique[v].position;
+		model->m_normals[remap[v]] = unique[v].normal;
+		model->m_texture_coordinates[remap[v]] = unique[v].texture_coordinate;
+	}
+	model->m_indices.swap(indices);
+	return { nof_expanded, nof_used, shaded_before, shaded_after };
+}
+
+void printIndexStats(const IndexStats& stats)
+{
+	size_t nof_triangles = std::max<size_t>(stats.nof_expanded / 3, 1);
+	std::cout << "  " << stats.nof_expanded << " -> " << stats.nof_used << " vertices ("
+	          << 100.0f * (1.0f - float(stats.nof_used) / std::max<size_t>(stats.nof_expanded, 1)) << "% fewer), "
+	          << "shaded vertices with a 16 entry FIFO " << stats.shaded_before << " -> " << stats.shaded_after
+	          << " (ACMR " << float(stats.shaded_before) / nof_triangles << " -> "
+	          << float(stats.shaded_after) / nof_triangles << ")\n";
+}
+
+// Returns nullptr if there is no valid cache entry.
+Model* loadModelFromCache(const std::string& cachePath, const std::string& directory)
+{
+	MappedFile file;
+	if(!file.open(cachePath) || file.size() < sizeof(MeshCacheHeader))
+		return nullptr;
+	const uint8_t* data = file.data();
+	MeshCacheHeader header;
+	memcpy(&header, data, sizeof(header));
+	uint64_t tables_size = header.nof_dependencies * sizeof(MeshCacheDependency)
+	                       + header.nof_materials * sizeof(MeshCacheMaterial)
+	                       + header.nof_meshes * sizeof(MeshCacheMesh);
+	uint64_t n = header.nof_vertices;
+	uint64_t nof_indices = header.nof_indices;
+	if(header.magic != MESH_CACHE_MAGIC || header.version != MESH_CACHE_VERSION
+	   || sizeof(header) + tables_size > header.strings_offset
+	   || header.strings_offset + header.strings_size > header.positions_offset
+	   || header.positions_offset + n * sizeof(glm::vec3) > header.normals_offset
+	   || header.normals_offset + n * sizeof(glm::vec3) > header.texture_coordinates_offset
+	   || header.texture_coordinates_offset + n * sizeof(glm::vec2) > header.indices_offset
+	   || header.indices_offset + nof_indices * sizeof(uint32_t) > file.size())
+		return nullptr;
+
+	const char* strings = reinterpret_cast<const char*>(data + header.strings_offset);
+	auto str = [&](const MeshCacheString& s) -> std::string {
+		if(uint64_t(s.offset) + s.length > header.strings_size)
+			return std::string();
+		return std::string(strings + s.offset, s.length);
+	};
+
+	const uint8_t* p = data + sizeof(header);
+	for(uint32_t i = 0; i < header.nof_dependencies; i++, p += sizeof(MeshCacheDependency))
+	{
+		MeshCacheDependency dep;
+		memcpy(&dep, p, sizeof(dep));
+		std::string name = str(dep.name);
+		FileStamp stamp;
+		if(!getFileStamp(name, stamp) || stamp.size != dep.size)
+			return nullptr;
+		if(stamp.time != dep.time && hashFile(name) != dep.hash)
+			return nullptr;
+	}
+
+	Model* model = new Model;
+	for(uint32_t i = 0; i < header.nof_materials; i++, p += sizeof(MeshCacheMaterial))
+	{
+		MeshCacheMaterial m;
+		memcpy(&m, p, sizeof(m));
+		Material material;
+		material.m_name = str(m.name);
+		material.m_color = glm::vec3(m.color[0], m.color[1], m.color[2]);
+		material.m_reflectivity = m.reflectivity;
+		material.m_shininess = m.shininess;
+		material.m_metalness = m.metalness;
+		material.m_fresnel = m.fresnel;
+		material.m_emission = m.emission;
+		material.m_transparency = m.transparency;
+		for(int t = 0; t < 6; t++)
+		{
+			std::string texture = str(m.textures[t]);
+			if(!texture.empty())
+				materialTexture(material, t).load(directory, texture, material_texture_components[t]);
+		}
+		model->m_materials.push_back(material);
+	}
+	for(uint32_t i = 0; i < header.nof_meshes; i++, p += sizeof(MeshCacheMesh))
+	{
+		MeshCacheMesh m;
+		memcpy(&m, p, sizeof(m));
+		Mesh mesh;
+		mesh.m_name = str(m.name);
+		mesh.m_material_idx = m.material_idx;
+		mesh.m_start_index = m.start_index;
+		mesh.m_number_of_vertices = m.number_of_vertices;
+		model->m_meshes.push_back(mesh);
+	}
+
+	const glm::vec3* positions = reinterpret_cast<const glm::vec3*>(data + header.positions_offset);
+	const glm::vec3* normals = reinterpret_cast<const glm::vec3*>(data + header.normals_offset);
+	const glm::vec2* texture_coordinates =
+	    reinterpret_cast<const glm::vec2*>(data + header.texture_coordinates_offset);
+	const uint32_t* indices = reinterpret_cast<const uint32_t*>(data + header.indices_offset);
+	uploadModel(model, positions, normals, texture_coordinates, n, indices, nof_indices);
+	model->m_indices.assign(indices, indices + nof_indices);
+	model->m_positions.assign(positions, positions + n);
+	model->m_normals.assign(normals, normals + n);
+	model->m_texture_coordinates.assign(texture_coordinates, texture_coordinates + n);
+	return model;
+}
+} // namespace
+
+void setMeshCacheEnabled(bool enabled)
+{
+	s_mesh_cache_enabled = enabled;
+}
+
+void setParallelObjParserEnabled(bool enabled)
+{
+	s_parallel_obj_parser_enabled = enabled;
 }
 
 Model* loadModelFromOBJ(std::string path)
@@ -113,17 +570,36 @@ Model* loadModelFromOBJ(std::string path)
 	extension = filename.substr(separator, filename.size() - separator);
 	filename = filename.substr(0, separator);
 
+	std::cout << "Loading " << path << "..." << std::flush;
+	auto startTime = std::chrono::high_resolution_clock::now();
+	std::string cachePath = directory + filename + ".objcache";
+	if(s_mesh_cache_enabled)
+	{
+		Model* model = loadModelFromCache(cachePath, directory);
+		if(model != nullptr)
+		{
+			model->m_name = filename;
+			model->m_filename = path;
+			std::chrono::duration<float, std::milli> elapsed = std::chrono::high_resolution_clock::now() - startTime;
+			std::cout << "done (from " << cachePath << " in " << elapsed.count() << " ms).\n";
+			return model;
+		}
+	}
+
 	///////////////////////////////////////////////////////////////////////
-	// Parse the OBJ file using tinyobj
+	// Parse the OBJ file, on all threads or using tinyobj
 	///////////////////////////////////////////////////////////////////////
-	std::cout << "Loading " << path << "..." << std::flush;
 	tinyobj::attrib_t attrib;
 	std::vector<tinyobj::shape_t> shapes;
 	std::vector<tinyobj::material_t> materials;
 	std::string err;
 	// Expect '.mtl' file in the same directory and triangulate meshes
-	bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err,
-	                            (directory + filename + extension).c_str(), directory.c_str(), true);
+	bool ret;
+	if(s_parallel_obj_parser_enabled)
+		ret = parseObj(directory + filename + extension, directory, attrib, shapes, materials, err);
+	else
+		ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err, (directory + filename + extension).c_str(),
+		                       directory.c_str(), true);
 	if(!err.empty())
 	{ // `err` may contain warning message.
 		std::cerr << err << std::endl;
@@ -136,6 +612,30 @@ Model* loadModelFromOBJ(std::string path)
 	model->m_name = filename;
 	model->m_filename = path;
 
+	///////////////////////////////////////////////////////////////////////
+	// Faces before any usemtl (e.g. in files without materials) get a
+	// plain white material
+	///////////////////////////////////////////////////////////////////////
+	int default_material = -1;
+	for(auto& shape : shapes)
+	{
+		for(int& material_id : shape.mesh.material_ids)
+		{
+			if(material_id >= 0)
+				continue;
+			if(default_material < 0)
+			{
+				tinyobj::material_t material;
+				tinyobj::InitMaterial(&material);
+				material.name = "default";
+				material.diffuse[0] = material.diffuse[1] = material.diffuse[2] = 1.0f;
+				default_material = int(materials.size());
+				materials.push_back(material);
+			}
+			material_id = default_material;
+		}
+	}
+
 	///////////////////////////////////////////////////////////////////////
 	// Transform all materials into our datastructure
 	///////////////////////////////////////////////////////////////////////
@@ -179,8 +679,9 @@ Model* loadModelFromOBJ(std::string path)
 
 	///////////////////////////////////////////////////////////////////////
 	// A vertex in the OBJ file may have different indices for position,
-	// normal and texture coordinate. We will not even attempt to use
-	// indexed lookups, but will store a simple vertex stream per mesh.
+	// normal and texture coordinate, so first expand every face into a
+	// vertex stream per mesh. indexModel() then merges the identical
+	// vertices into an index buffer.
 	///////////////////////////////////////////////////////////////////////
 	uint64_t number_of_vertices = 0;
 	for(const auto& shape : shapes)
@@ -320,143 +821,24 @@ Model* loadModelFromOBJ(std::string path)
 		}
 	}
 
-	///////////////////////////////////////////////////////////////////////
-	// Upload to GPU
-	///////////////////////////////////////////////////////////////////////
-	glGenVertexArrays(1, &model->m_vaob);
-	glBindVertexArray(model->m_vaob);
-	glGenBuffers(1, &model->m_positions_bo);
-	glBindBuffer(GL_ARRAY_BUFFER, model->m_positions_bo);
-	glBufferData(GL_ARRAY_BUFFER, model->m_positions.size() * sizeof(glm::vec3), &model->m_positions[0].x,
-	             GL_STATIC_DRAW);
-	glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0);
-	glEnableVertexAttribArray(0);
-	glGenBuffers(1, &model->m_normals_bo);
-	glBindBuffer(GL_ARRAY_BUFFER, model->m_normals_bo);
-	glBufferData(GL_ARRAY_BUFFER, model->m_normals.size() * sizeof(glm::vec3), &model->m_normals[0].x,
-	             GL_STATIC_DRAW);
-	glVertexAttribPointer(1, 3, GL_FLOAT, false, 0, 0);
-	glEnableVertexAttribArray(1);
-	glGenBuffers(1, &model->m_texture_coordinates_bo);
-	glBindBuffer(GL_ARRAY_BUFFER, model->m_texture_coordinates_bo);
-	glBufferData(GL_ARRAY_BUFFER, model->m_texture_coordinates.size() * sizeof(glm::vec2),
-	             &model->m_texture_coordinates[0].x, GL_STATIC_DRAW);
-	glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
-	glEnableVertexAttribArray(2);
+	IndexStats index_stats = indexModel(model);
 
-	glBindVertexArray( 0 );
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	std::cout << "done.\n";
-	return model;
-}
-
-void saveModelToOBJ(Model* model, std::string path)
-{
 	///////////////////////////////////////////////////////////////////////
-	// Separate filename into directory, base filename and extension
-	// NOTE: This can be made a LOT simpler as soon as compilers properly
-	//		 support std::filesystem (C++17)
+	// Upload to GPU, and cache the result for the next load
 	///////////////////////////////////////////////////////////////////////
-	size_t separator = path.find_last_of("\\/");
-	std::string filename, extension, directory;
-	if(separator != std::string::npos)
-	{
-		filename = path.substr(separator + 1, path.size() - separator - 1);
-		directory = path.substr(0, separator + 1);
-	}
-	else
-	{
-		filename = path;
-		directory = "./";
-	}
-	separator = filename.find_last_of(".");
-	if(separator == std::string::npos)
+	uploadModel(model, model->m_positions.data(), model->m_normals.data(), model->m_texture_coordinates.data(),
+	            model->m_positions.size(), model->m_indices.data(), model->m_indices.size());
+	std::chrono::duration<float, std::milli> elapsed = std::chrono::high_resolution_clock::now() - startTime;
+	if(s_mesh_cache_enabled)
 	{
-		std::cout << "Fatal: loadModelFromOBJ(): Expecting filename ending in '.obj'\n";
-		exit(1);
+		std::vector<std::string> dependencies = findMaterialLibraries(path, directory);
+		dependencies.insert(dependencies.begin(), path);
+		writeModelCache(model, cachePath, dependencies);
 	}
-	extension = filename.substr(separator, filename.size() - separator);
-	filename = filename.substr(0, separator);
-
-	///////////////////////////////////////////////////////////////////////
-	// Save Materials
-	///////////////////////////////////////////////////////////////////////
-	std::ofstream mat_file(directory + filename + ".mtl");
-	if(!mat_file.is_open())
-	{
-		std::cout << "Could not open file " << filename << " for writing.\n";
-		return;
-	}
-	mat_file << "# Exported by Chalmers Graphics Group\n";
-	for(auto mat : model->m_materials)
-	{
-		mat_file << "newmtl " << mat.m_name << "\n";
-		mat_file << "Kd " << mat.m_color.x << " " << mat.m_color.y << " " << mat.m_color.z << "\n";
-		mat_file << "Ks " << mat.m_reflectivity << " " << mat.m_reflectivity << " " << mat.m_reflectivity
-		         << "\n";
-		mat_file << "Pm " << mat.m_metalness << "\n";
-		mat_file << "Ps " << mat.m_fresnel << "\n";
-		mat_file << "Pr " << mat.m_shininess << "\n";
-		mat_file << "Ke " << mat.m_emission << " " << mat.m_emission << " " << mat.m_emission << "\n";
-		mat_file << "Tf " << mat.m_transparency << " " << mat.m_transparency << " " << mat.m_transparency
-		         << "\n";
-		if(mat.m_color_texture.valid)
-			mat_file << "map_Kd " << mat.m_color_texture.filename << "\n";
-		if(mat.m_reflectivity_texture.valid)
-			mat_file << "map_Ks " << mat.m_reflectivity_texture.filename << "\n";
-		if(mat.m_metalness_texture.valid)
-			mat_file << "map_Pm " << mat.m_metalness_texture.filename << "\n";
-		if(mat.m_fresnel_texture.valid)
-			mat_file << "map_Ps " << mat.m_fresnel_texture.filename << "\n";
-		if(mat.m_shininess_texture.valid)
-			mat_file << "map_Pr " << mat.m_shininess_texture.filename << "\n";
-		if(mat.m_emission_texture.valid)
-			mat_file << "map_Ke " << mat.m_emission_texture.filename << "\n";
-	}
-	mat_file.close();
 
-	///////////////////////////////////////////////////////////////////////
-	// Save geometry
-	///////////////////////////////////////////////////////////////////////
-	std::ofstream obj_file(directory + filename + ".obj");
-	if(!obj_file.is_open())
-	{
-		std::cout << "Could not open file " << filename << " for writing.\n";
-		return;
-	}
-	obj_file << "# Exported by Chalmers Graphics Group\n";
-	obj_file << "mtllib " << filename << ".mtl\n";
-	int vertex_counter = 1;
-	for(auto mesh : model->m_meshes)
-	{
-		obj_file << "o " << mesh.m_name << "\n";
-		obj_file << "g " << mesh.m_name << "\n";
-		obj_file << "usemtl " << model->m_materials[mesh.m_material_idx].m_name << "\n";
-		for(uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
-		{
-			obj_file << "v " << model->m_positions[i].x << " " << model->m_positions[i].y << " "
-			         << model->m_positions[i].z << "\n";
-		}
-		for(uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
-		{
-			obj_file << "vn " << model->m_normals[i].x << " " << model->m_normals[i].y << " "
-			         << model->m_normals[i].z << "\n";
-		}
-		for(uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
-		{
-			obj_file << "vt " << model->m_texture_coordinates[i].x << " " << model->m_texture_coordinates[i].y
-			         << "\n";
-		}
-		int number_of_faces = mesh.m_number_of_vertices / 3;
-		for(int i = 0; i < number_of_faces; i++)
-		{
-			obj_file << "f " << vertex_counter << "/" << vertex_counter << "/" << vertex_counter << " "
-			         << vertex_counter + 1 << "/" << vertex_counter + 1 << "/" << vertex_counter + 1 << " "
-			         << vertex_counter + 2 << "/" << vertex_counter + 2 << "/" << vertex_counter + 2 << "\n";
-			vertex_counter += 3;
-		}
-	}
+	std::cout << "done (parsed OBJ in " << elapsed.count() << " ms).\n";
+	printIndexStats(index_stats);
+	return model;
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -537,7 +919,15 @@ void render(const Model* model, const bool submitMaterials)
 			setUniformSlow( current_program, "has_shininess_texture", has_shininess_texture );
 
 		}
-		glDrawArrays(GL_TRIANGLES, mesh.m_start_index, (GLsizei)mesh.m_number_of_vertices);
+		if(model->m_indices.empty())
+		{
+			glDrawArrays(GL_TRIANGLES, mesh.m_start_index, (GLsizei)mesh.m_number_of_vertices);
+		}
+		else
+		{
+			glDrawElements(GL_TRIANGLES, (GLsizei)mesh.m_number_of_vertices, GL_UNSIGNED_INT,
+			               (const void*)(mesh.m_start_index * sizeof(uint32_t)));
+		}
 	}
 	glBindVertexArray(0);
 }
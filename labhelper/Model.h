@@ -12,6 +12,7 @@ struct Texture
 	std::string filename;
 	std::string directory;
 	int width, height;
+	// Not kept after load(); textures are uploaded from the texture cache.
 	uint8_t* data = nullptr;
 	bool load(const std::string& directory, const std::string& filename, int nof_components);
 };
@@ -45,7 +46,8 @@ struct Mesh
 {
 	std::string m_name;
 	uint32_t m_material_idx;
-	// Where this Mesh's vertices start
+	// Where this Mesh's vertices start. For indexed models (m_indices not
+	// empty) these are a range in the index buffer instead.
 	uint32_t m_start_index;
 	uint32_t m_number_of_vertices;
 };
@@ -66,16 +68,57 @@ public:
 	std::vector<glm::vec3> m_positions;
 	std::vector<glm::vec3> m_normals;
 	std::vector<glm::vec2> m_texture_coordinates;
-	// Buffers on GPU
-	uint32_t m_positions_bo;
-	uint32_t m_normals_bo;
-	uint32_t m_texture_coordinates_bo;
+	// Triangle list into the vertex buffers, empty for non-indexed models
+	std::vector<uint32_t> m_indices;
+	// Buffers on GPU, 0 for models that only live on the CPU
+	uint32_t m_positions_bo = 0;
+	uint32_t m_normals_bo = 0;
+	uint32_t m_texture_coordinates_bo = 0;
+	uint32_t m_indices_bo = 0;
 	// Vertex Array Object
-	uint32_t m_vaob;
+	uint32_t m_vaob = 0;
 };
 
+/**
+	* How saveModelToOBJ() writes the geometry.
+	*/
+struct ObjExportOptions
+{
+	// Write each distinct position, normal and texture coordinate once and
+	// let the faces index them, instead of one of each per triangle corner.
+	bool merge_vertices = true;
+	// Format blocks of lines on all threads.
+	bool multithreaded = true;
+	// Significant digits per number. 0 writes the shortest text that reads
+	// back as exactly the same float.
+	int precision = 6;
+};
+
+/**
+	* Loads an OBJ and its MTL files into an indexed model: identical
+	* position/normal/uv tuples are merged, and the triangles and vertices of
+	* each mesh are reordered for the post-transform cache and for fetching.
+	*
+	* The first load of a file writes a binary
+	* <name>.objcache next to it, which later loads map instead of parsing the
+	* text (as long as the OBJ and MTL files are unchanged).
+	*/
 Model* loadModelFromOBJ(std::string filename);
-void saveModelToOBJ(Model* model, std::string filename);
+/**
+	* Turns reading and writing .objcache files on or off (default on).
+	*/
+void setMeshCacheEnabled(bool enabled);
+/**
+	* Chooses between the multithreaded OBJ parser (parseObj(), the default)
+	* and tinyobj::LoadObj(). Both give the same model.
+	*/
+void setParallelObjParserEnabled(bool enabled);
+/**
+	* Writes a model made of triangle lists to an OBJ file, and its materials
+	* (if it has any) to an MTL file next to it. Models without normals or
+	* texture coordinates are written without them.
+	*/
+void saveModelToOBJ(const Model* model, std::string filename, const ObjExportOptions& options = ObjExportOptions());
 void freeModel(Model* model);
 void render(const Model* model, const bool submitMaterials = true);
 } // namespace labhelper
\ No newline at end of file
@@ -0,0 +1,154 @@
+#include "assetloader.h"
+
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <stb_image.h>
+
+namespace labhelper
+{
+namespace
+{
+// The HDR images are required, as with loadHdrTexture(). Called from the
+// uploads, since exit() on a pool worker would wait for that worker when the
+// global pool is destroyed. The decode has already printed what failed.
+void exitIfMissing(const void* data)
+{
+	if(data == nullptr)
+	{
+		exit(1);
+	}
+}
+} // namespace
+
+LDRImage::~LDRImage()
+{
+	if(data != nullptr)
+	{
+		stbi_image_free(data);
+	}
+}
+
+AssetLoader::AssetLoader(ThreadPool& pool) : pool(pool) {}
+
+AssetLoader::~AssetLoader()
+{
+	// Workers still reference this object until their decodes are done.
+	finish();
+}
+
+void AssetLoader::add(std::function<void()> decode, std::function<void()> upload)
+{
+	size_t index = uploads.size();
+	uploads.push_back(std::move(upload));
+	pool.submit([this, index, decode]() {
+		// Hand anything decode() throws to finish(), which would otherwise
+		// wait for this index forever.
+		std::exception_ptr error;
+		try
+		{
+			decode();
+		}
+		catch(...)
+		{
+			error = std::current_exception();
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			decoded.push_back({ index, error });
+		}
+		condition.notify_one();
+	});
+}
+
+void AssetLoader::loadImage(const std::string& filename, int components,
+                            std::function<void(const LDRImage&)> upload)
+{
+	// Relies on the flip flag being set once before main() and never toggled
+	// (stb_image keeps it in a global, see labhelper.cpp).
+	auto image = std::make_shared<LDRImage>();
+	add(
+	    [image, filename, components]() {
+		    image->data = stbi_load(filename.c_str(), &image->width, &image->height, &image->components,
+		                            components);
+		    if(image->data == nullptr)
+		    {
+			    std::cout << "Failed to load image: " << filename << "\n";
+		    }
+		    else if(components != 0)
+		    {
+			    image->components = components;
+		    }
+	    },
+	    [image, upload]() { upload(*image); });
+}
+
+void AssetLoader::loadHdrImage(const std::string& filename, std::function<void(const HDRImage&)> upload)
+{
+	auto image = std::make_shared<std::unique_ptr<HDRImage>>();
+	add([image, filename]() { image->reset(new HDRImage(filename)); },
+	    [image, upload]() {
+		    exitIfMissing((*image)->data);
+		    upload(**image);
+		    // Free the pixels as soon as they are on the GPU.
+		    image->reset();
+	    });
+}
+
+void AssetLoader::loadHdrImage(const std::string& filename, HdrFormat format,
+                               std::function<void(const PackedHdrImage&)> upload)
+{
+	auto image = std::make_shared<std::unique_ptr<PackedHdrImage>>();
+	add([image, filename, format]() { image->reset(new PackedHdrImage(filename, format)); },
+	    [image, upload]() {
+		    exitIfMissing((*image)->data);
+		    upload(**image);
+		    image->reset();
+	    });
+}
+
+void AssetLoader::loadCachedTexture(const std::string& filename, int components,
+                                    std::function<void(const CachedTexture&)> upload)
+{
+	auto texture = std::make_shared<std::unique_ptr<CachedTexture>>();
+	add(
+	    [texture, filename, components]() {
+		    texture->reset(new CachedTexture);
+		    if(!labhelper::loadCachedTexture(filename, components, **texture))
+		    {
+			    texture->reset();
+		    }
+	    },
+	    [texture, upload]() {
+		    if(*texture)
+		    {
+			    upload(**texture);
+		    }
+		    texture->reset();
+	    });
+}
+
+void AssetLoader::finish()
+{
+	while(numUploaded < uploads.size())
+	{
+		std::pair<size_t, std::exception_ptr> result;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [this] { return !decoded.empty(); });
+			result = decoded.front();
+			decoded.pop_front();
+		}
+		size_t index = result.first;
+		if(result.second)
+		{
+			uploads[index] = nullptr;
+			numUploaded++;
+			std::rethrow_exception(result.second);
+		}
+		uploads[index]();
+		uploads[index] = nullptr;
+		numUploaded++;
+	}
+}
+} // namespace labhelper
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "hdr.h"
+#include "texturecache.h"
+#include "threadpool.h"
+
+namespace labhelper
+{
+/**
+	* An 8-bit image decoded with stb_image. data is nullptr if the file could
+	* not be loaded.
+	*/
+struct LDRImage
+{
+	int width = 0, height = 0, components = 0;
+	unsigned char* data = nullptr;
+	~LDRImage();
+};
+
+/**
+	* Decodes assets on a thread pool while keeping everything that touches GL
+	* on the thread that owns the context.
+	*
+	* Each asset is a pair of functions: decode() runs on a worker, and
+	* upload() runs on the thread calling finish(), in the order the decodes
+	* complete. Everything upload() needs from decode() is passed through
+	* state the two functions share.
+	*
+	* Example:
+	*	AssetLoader loader;
+	*	loader.loadImage("rock.jpg", 3, [&](const LDRImage& image) { ...glTexImage2D... });
+	*	loader.loadHdrImage("sky.hdr", [&](const HDRImage& image) { ... });
+	*	doOtherWorkOnThisThread();
+	*	loader.finish();
+	*/
+class AssetLoader
+{
+public:
+	explicit AssetLoader(ThreadPool& pool = ThreadPool::global());
+	~AssetLoader();
+
+	void add(std::function<void()> decode, std::function<void()> upload);
+
+	void loadImage(const std::string& filename, int components, std::function<void(const LDRImage&)> upload);
+	void loadHdrImage(const std::string& filename, std::function<void(const HDRImage&)> upload);
+	/**
+		* Decodes and converts to format on the worker (or maps the converted
+		* texels from the cache, see PackedHdrImage).
+		*/
+	void loadHdrImage(const std::string& filename, HdrFormat format,
+	                  std::function<void(const PackedHdrImage&)> upload);
+	/**
+		* Loads through the texture cache (see loadCachedTexture()). The mapping
+		* is released right after upload() returns.
+		*/
+	void loadCachedTexture(const std::string& filename, int components,
+	                       std::function<void(const CachedTexture&)> upload);
+
+	/**
+		* Runs the uploads as their decodes complete, and returns once every asset
+		* added so far has been uploaded. Rethrows anything a decode threw, on
+		* this thread; calling finish() again continues with the rest.
+		*/
+	void finish();
+
+private:
+	AssetLoader(const AssetLoader&) = delete;
+	AssetLoader& operator=(const AssetLoader&) = delete;
+
+	ThreadPool& pool;
+	std::vector<std::function<void()>> uploads;
+	size_t numUploaded = 0;
+	std::deque<std::pair<size_t, std::exception_ptr>> decoded; // Index and what decode() threw
+	std::mutex mutex;
+	std::condition_variable condition;
+};
+} // namespace labhelper
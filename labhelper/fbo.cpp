@@ -3,9 +3,16 @@
 #include <labhelper.h>
 
 FboInfo::FboInfo(int numberOfColorBuffers)
-    : isComplete(false), framebufferId(UINT32_MAX), depthBuffer(UINT32_MAX), width(0), height(0)
+    : framebufferId(UINT32_MAX), colorTextureTargets(numberOfColorBuffers, UINT32_MAX)
+    , colorFormats(numberOfColorBuffers, GL_RGBA16F), depthBuffer(UINT32_MAX), width(0), height(0)
+    , isComplete(false)
+{
+};
+
+FboInfo::FboInfo(const std::vector<GLenum>& internalFormats)
+    : framebufferId(UINT32_MAX), colorTextureTargets(internalFormats.size(), UINT32_MAX)
+    , colorFormats(internalFormats), depthBuffer(UINT32_MAX), width(0), height(0), isComplete(false)
 {
-	colorTextureTargets.resize(numberOfColorBuffers, UINT32_MAX);
 };
 
 void FboInfo::resize(int w, int h)
@@ -40,10 +47,10 @@ void FboInfo::resize(int w, int h)
 	///////////////////////////////////////////////////////////////////////
 	// Allocate / Resize textures
 	///////////////////////////////////////////////////////////////////////
-	for(auto& colorTextureTarget : colorTextureTargets)
+	for(int i = 0; i < int(colorTextureTargets.size()); i++)
 	{
-		glBindTexture(GL_TEXTURE_2D, colorTextureTarget);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glBindTexture(GL_TEXTURE_2D, colorTextureTargets[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, colorFormats[i], width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 	}
 
 	glBindTexture(GL_TEXTURE_2D, depthBuffer);
@@ -97,3 +104,43 @@ bool FboInfo::checkFramebufferComplete(void)
 
 	return (status == GL_FRAMEBUFFER_COMPLETE);
 }
+
+size_t FboInfo::memoryUsage() const
+{
+	size_t bytes = bytesPerPixel(GL_DEPTH_COMPONENT32);
+	for(GLenum format : colorFormats)
+	{
+		bytes += bytesPerPixel(format);
+	}
+	return bytes * size_t(width) * size_t(height);
+}
+
+size_t FboInfo::bytesPerPixel(GLenum internalFormat)
+{
+	switch(internalFormat)
+	{
+	case GL_R8:
+		return 1;
+	case GL_RG8:
+	case GL_R16:
+	case GL_R16F:
+		return 2;
+	case GL_RGBA8:
+	case GL_RG16:
+	case GL_RG16F:
+	case GL_RGB10_A2:
+	case GL_R11F_G11F_B10F:
+	case GL_R32F:
+	case GL_DEPTH_COMPONENT32:
+	case GL_DEPTH_COMPONENT24:
+		return 4;
+	case GL_RGBA16:
+	case GL_RGBA16F:
+	case GL_RG32F:
+		return 8;
+	case GL_RGBA32F:
+		return 16;
+	default:
+		return 0;
+	}
+}
@@ -1,3 +1,4 @@
+#pragma once
 #include <GL/glew.h>
 #include <vector>
 
@@ -5,13 +6,19 @@ class FboInfo {
 public:
 	GLuint framebufferId;
 	std::vector<GLuint> colorTextureTargets; 
+	std::vector<GLenum> colorFormats;
 	GLuint depthBuffer;
 	int width;
 	int height;
 	bool isComplete;
 
 	FboInfo(int numberOfColorBuffers = 1);
+	// One color attachment per internal format, e.g. { GL_RGBA8, GL_RG16 }
+	FboInfo(const std::vector<GLenum>& internalFormats);
 		
 	void resize(int w, int h);
 	bool checkFramebufferComplete(void);
+	// GPU memory used by all attachments at the current size, in bytes
+	size_t memoryUsage() const;
+	static size_t bytesPerPixel(GLenum internalFormat);
 };
@@ -0,0 +1,57 @@
+#include "filecache.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+namespace labhelper
+{
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for(size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+bool getFileStamp(const std::string& filename, FileStamp& stamp)
+{
+	std::error_code ec;
+	stamp.size = std::filesystem::file_size(filename, ec);
+	if(ec)
+		return false;
+	stamp.time = int64_t(std::filesystem::last_write_time(filename, ec).time_since_epoch().count());
+	return !ec;
+}
+
+bool writeFileAtomic(const std::string& path, const void* data, size_t size)
+{
+	std::error_code ec;
+	std::filesystem::path parent = std::filesystem::path(path).parent_path();
+	if(!parent.empty())
+		std::filesystem::create_directories(parent, ec);
+	std::ostringstream tmpName;
+	tmpName << path << "." << std::this_thread::get_id() << ".tmp";
+	{
+		std::ofstream file(tmpName.str(), std::ios::binary);
+		if(!file.is_open() || !file.write(static_cast<const char*>(data), size))
+		{
+			std::cout << "Could not write cache file " << path << "\n";
+			return false;
+		}
+	}
+	std::filesystem::rename(tmpName.str(), path, ec);
+	if(ec)
+	{
+		std::cout << "Could not write cache file " << path << "\n";
+		std::filesystem::remove(tmpName.str(), ec);
+		return false;
+	}
+	return true;
+}
+} // namespace labhelper
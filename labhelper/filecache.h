@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace labhelper
+{
+/**
+	* Helpers shared by the on-disk caches (textures, HDR maps, meshes).
+	*/
+
+/**
+	* 64-bit FNV-1a. Good enough for cache keys and change detection, not
+	* cryptographic.
+	*/
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull);
+inline uint64_t hashString(const std::string& str, uint64_t hash = 0xcbf29ce484222325ull)
+{
+	return hashBytes(str.data(), str.size(), hash);
+}
+
+/**
+	* What a cache entry remembers about its source file to notice changes.
+	*/
+struct FileStamp
+{
+	uint64_t size;
+	int64_t time;
+};
+bool getFileStamp(const std::string& filename, FileStamp& stamp);
+
+/**
+	* Writes to a temporary name and renames it over path, so that a reader
+	* (or a concurrent writer) never sees a half-written file. Creates missing
+	* directories. Returns false, after printing why, if anything failed.
+	*/
+bool writeFileAtomic(const std::string& path, const void* data, size_t size);
+} // namespace labhelper
@@ -1,33 +1,336 @@
 #include "hdr.h"
+#include "filecache.h"
+#include "simd.h"
+#include "texturecache.h"
+#include <algorithm>
 #include <iostream>
+#include <cstring>
 #include <stb_image.h>
 
 namespace labhelper
 {
-struct HDRImage
+namespace
 {
-	int width, height, components;
-	float* data = nullptr;
-	// Constructor
-	HDRImage(const std::string& filename)
+// Bump whenever the layout of the cache files or the conversion changes.
+const uint32_t CACHE_MAGIC = 0x4348484c; // "LHHC"
+const uint32_t CACHE_VERSION = 1;
+
+struct CacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	uint32_t format;
+	int32_t width;
+	int32_t height;
+	float maxError;
+	float meanError;
+	uint32_t reserved;
+};
+
+struct GLFormat
+{
+	GLenum internalFormat, format, type;
+};
+
+GLFormat glFormat(HdrFormat format)
+{
+	switch(format)
+	{
+	case HdrFormat::RGB16F: return { GL_RGB16F, GL_RGB, GL_HALF_FLOAT };
+	case HdrFormat::RGB9E5: return { GL_RGB9_E5, GL_RGB, GL_UNSIGNED_INT_5_9_9_9_REV };
+	default: return { GL_RGB32F, GL_RGB, GL_FLOAT };
+	}
+}
+
+// Round to nearest even, with overflow to infinity and NaNs kept as NaNs
+// (after F. Giesen's float_to_half_fast3_rtne).
+simd::int4 floatToHalf(simd::float4 f)
+{
+	using namespace simd;
+	int4 justsign = asInt(f) & splat(int32_t(0x80000000));
+	int4 absf = asInt(f) ^ justsign;
+	int4 isregular = splat((127 + 16) << 23) > absf;
+	int4 infOrNan = (isnan(f) & splat(0x200)) | splat(0x7c00);
+	int4 issub = splat((127 - 14) << 23) > absf;
+
+	// Results that are subnormal halves: let the FPU do the rounding.
+	int4 subnormMagic = splat(((127 - 15) + (23 - 10) + 1) << 23);
+	int4 subnorm = asInt(asFloat(absf) + asFloat(subnormMagic)) - subnormMagic;
+	// Normal halves: rebias the exponent and round the mantissa.
+	int4 mantOdd = (absf << (31 - 13)) >> 31;
+	int4 normal = shiftRight(absf + splat(0xfff - ((127 - 15) << 23)) - mantOdd, 13);
+
+	int4 joined = select(isregular, select(issub, subnorm, normal), infOrNan);
+	return joined | (justsign >> 16);
+}
+
+float halfToFloat(uint16_t h)
+{
+	int exponent = (h >> 10) & 0x1f;
+	float mantissa = float(h & 0x3ff);
+	float value = exponent == 0 ? std::ldexp(mantissa, -24)
+	                            : exponent == 31 ? INFINITY : std::ldexp(mantissa + 1024.0f, exponent - 25);
+	return (h & 0x8000) ? -value : value;
+}
+
+// EXT_texture_shared_exponent: 9-bit mantissas, 5-bit exponent with bias 15.
+simd::int4 packRGB9E5(simd::float4 r, simd::float4 g, simd::float4 b)
+{
+	using namespace simd;
+	const float4 zero = splat(0.0f), maxValue = splat(65408.0f), half = splat(0.5f);
+	// max() with the constant second also maps NaN to zero.
+	r = min(max(r, zero), maxValue);
+	g = min(max(g, zero), maxValue);
+	b = min(max(b, zero), maxValue);
+	float4 maxc = max(max(r, g), b);
+
+	// floor(log2(maxc)) straight from the float exponent; zero and
+	// denormals give -127, which the clamp to -16 takes care of.
+	int4 exponent = max(shiftRight(asInt(maxc), 23) - splat(127), splat(-16)) + splat(16);
+	// 2^-(exponent - 15 - 9)
+	float4 scale = asFloat((splat(127 + 24) - exponent) << 23);
+	int4 overflow = toInt(maxc * scale + half) > splat(511);
+	exponent = exponent - overflow;
+	scale = select(overflow, scale * half, scale);
+
+	int4 rm = toInt(r * scale + half);
+	int4 gm = toInt(g * scale + half);
+	int4 bm = toInt(b * scale + half);
+	return rm | (gm << 9) | (bm << 18) | (exponent << 27);
+}
+
+void unpackRGB9E5(uint32_t texel, float* rgb)
+{
+	float scale = std::ldexp(1.0f, int(texel >> 27) - 24);
+	rgb[0] = float(texel & 0x1ff) * scale;
+	rgb[1] = float((texel >> 9) & 0x1ff) * scale;
+	rgb[2] = float((texel >> 18) & 0x1ff) * scale;
+}
+
+void packImageRGB16F(const float* src, size_t texels, uint16_t* dst)
+{
+	size_t n = texels * 3, i = 0;
+	for(; i + 4 <= n; i += 4)
+	{
+		simd::storeLow16(dst + i, floatToHalf(simd::load(src + i)));
+	}
+	if(i < n)
 	{
-		stbi_set_flip_vertically_on_load(false);
-		data = stbi_loadf(filename.c_str(), &width, &height, &components, 3);
-		stbi_set_flip_vertically_on_load(true);
-		if(data == nullptr)
+		float in[4] = {};
+		uint16_t out[4];
+		std::copy(src + i, src + n, in);
+		simd::storeLow16(out, floatToHalf(simd::load(in)));
+		std::copy(out, out + (n - i), dst + i);
+	}
+}
+
+void packImageRGB9E5(const float* src, size_t texels, uint32_t* dst)
+{
+	size_t i = 0;
+	for(; i + 4 <= texels; i += 4)
+	{
+		simd::float4 r, g, b;
+		simd::loadRGB(src + i * 3, r, g, b);
+		simd::store(reinterpret_cast<int32_t*>(dst + i), packRGB9E5(r, g, b));
+	}
+	if(i < texels)
+	{
+		float in[12] = {};
+		int32_t out[4];
+		std::copy(src + i * 3, src + texels * 3, in);
+		simd::float4 r, g, b;
+		simd::loadRGB(in, r, g, b);
+		simd::store(out, packRGB9E5(r, g, b));
+		std::copy(out, out + (texels - i), reinterpret_cast<int32_t*>(dst + i));
+	}
+}
+} // namespace
+
+const char* hdrFormatName(HdrFormat format)
+{
+	switch(format)
+	{
+	case HdrFormat::RGB16F: return "RGB16F";
+	case HdrFormat::RGB9E5: return "RGB9E5";
+	default: return "RGB32F";
+	}
+}
+
+int hdrFormatBytesPerTexel(HdrFormat format)
+{
+	switch(format)
+	{
+	case HdrFormat::RGB16F: return 6;
+	case HdrFormat::RGB9E5: return 4;
+	default: return 12;
+	}
+}
+HDRImage::HDRImage(const std::string& filename)
+{
+	// stbi_set_flip_vertically_on_load() is global and enabled before main()
+	// (see s_flip_images in labhelper.cpp), and toggling it here would race
+	// with loads on other threads. Undo the flip on our own copy instead.
+	data = stbi_loadf(filename.c_str(), &width, &height, &components, 3);
+	if(data == nullptr)
+	{
+		// Not exit(): this runs on pool workers, and exit() would join the
+		// calling worker when the global pool is destroyed.
+		std::cout << "Failed to load image: " << filename << ".\n";
+		width = height = components = 0;
+		return;
+	}
+	std::vector<float> row(width * 3);
+	for(int y = 0; y < height / 2; y++)
+	{
+		float* top = data + size_t(y) * width * 3;
+		float* bottom = data + size_t(height - 1 - y) * width * 3;
+		memcpy(row.data(), top, width * 3 * sizeof(float));
+		memcpy(top, bottom, width * 3 * sizeof(float));
+		memcpy(bottom, row.data(), width * 3 * sizeof(float));
+	}
+}
+
+HDRImage::~HDRImage()
+{
+	stbi_image_free(data);
+}
+
+PackedHdrImage::PackedHdrImage(const HDRImage& image, HdrFormat format) : format(format)
+{
+	pack(image);
+}
+
+PackedHdrImage::PackedHdrImage(const std::string& filename, HdrFormat format, bool useCache) : format(format)
+{
+	if(format == HdrFormat::RGB32F)
+	{
+		// Nothing to convert, and a copy of the floats is no faster to load.
+		pack(HDRImage(filename));
+		return;
+	}
+
+	CacheHeader expected = {};
+	expected.magic = CACHE_MAGIC;
+	expected.version = CACHE_VERSION;
+	expected.format = uint32_t(format);
+	std::string cacheFile;
+	FileStamp stamp;
+	if(useCache && getFileStamp(filename, stamp))
+	{
+		expected.sourceSize = stamp.size;
+		expected.sourceTime = stamp.time;
+		cacheFile = textureCachePath(filename, hdrFormatName(format), ".lhc");
+	}
+
+	CacheHeader header;
+	if(!cacheFile.empty() && m_file.open(cacheFile) && m_file.size() >= sizeof(header))
+	{
+		memcpy(&header, m_file.data(), sizeof(header));
+		if(header.magic == expected.magic && header.version == expected.version
+		   && header.sourceSize == expected.sourceSize && header.sourceTime == expected.sourceTime
+		   && header.format == expected.format && header.width > 0 && header.height > 0
+		   && m_file.size() - sizeof(header)
+		          == size_t(header.width) * header.height * hdrFormatBytesPerTexel(format))
 		{
-			std::cout << "Failed to load image: " << filename << ".\n";
-			exit(1);
+			width = header.width;
+			height = header.height;
+			data = m_file.data() + sizeof(header);
+			size = m_file.size() - sizeof(header);
+			maxError = header.maxError;
+			meanError = header.meanError;
+			fromCache = true;
+			return;
 		}
-	};
-	// Destructor
-	~HDRImage()
+	}
+	m_file.close();
+
+	pack(HDRImage(filename));
+	if(!cacheFile.empty() && data != nullptr)
 	{
-		stbi_image_free(data);
-	};
-};
+		header = expected;
+		header.width = width;
+		header.height = height;
+		header.maxError = maxError;
+		header.meanError = meanError;
+		std::vector<uint8_t> file(sizeof(header) + size);
+		memcpy(file.data(), &header, sizeof(header));
+		memcpy(file.data() + sizeof(header), data, size);
+		writeFileAtomic(cacheFile, file.data(), file.size());
+	}
+}
+
+void PackedHdrImage::pack(const HDRImage& image)
+{
+	if(image.data == nullptr)
+	{
+		width = height = 0;
+		data = nullptr;
+		size = 0;
+		return;
+	}
+	width = image.width;
+	height = image.height;
+	size_t texels = size_t(width) * height;
+	size = texels * hdrFormatBytesPerTexel(format);
+	fromCache = false;
+	if(format == HdrFormat::RGB32F)
+	{
+		m_floats.assign(image.data, image.data + texels * 3);
+		data = m_floats.data();
+		maxError = meanError = 0.0f;
+		return;
+	}
+
+	m_storage.resize(size);
+	data = m_storage.data();
+	if(format == HdrFormat::RGB16F)
+		packImageRGB16F(image.data, texels, reinterpret_cast<uint16_t*>(m_storage.data()));
+	else
+		packImageRGB9E5(image.data, texels, reinterpret_cast<uint32_t*>(m_storage.data()));
+
+	// Measure what the conversion cost, relative to the brightest channel.
+	double errorSum = 0.0;
+	size_t nofLit = 0;
+	maxError = 0.0f;
+	for(size_t i = 0; i < texels; i++)
+	{
+		const float* src = image.data + i * 3;
+		float maxc = std::max(src[0], std::max(src[1], src[2]));
+		if(!(maxc > 0.0f))
+			continue;
+		float decoded[3];
+		if(format == HdrFormat::RGB16F)
+		{
+			const uint16_t* h = reinterpret_cast<const uint16_t*>(m_storage.data()) + i * 3;
+			for(int c = 0; c < 3; c++)
+				decoded[c] = halfToFloat(h[c]);
+		}
+		else
+		{
+			unpackRGB9E5(reinterpret_cast<const uint32_t*>(m_storage.data())[i], decoded);
+		}
+		float error = 0.0f;
+		for(int c = 0; c < 3; c++)
+			error = std::max(error, std::abs(decoded[c] - std::max(src[c], 0.0f)) / maxc);
+		maxError = std::max(maxError, error);
+		errorSum += error;
+		nofLit++;
+	}
+	meanError = nofLit > 0 ? float(errorSum / nofLit) : 0.0f;
+}
+
+void printHdrImageStats(const std::string& name, const PackedHdrImage& image)
+{
+	size_t texels = size_t(image.width) * image.height;
+	size_t saved = texels * (hdrFormatBytesPerTexel(HdrFormat::RGB32F) - hdrFormatBytesPerTexel(image.format));
+	std::cout << name << ": " << hdrFormatName(image.format) << " " << image.width << "x" << image.height << ", "
+	          << saved / 1024 << " KB saved, max error " << image.maxError * 100.0f << "%, mean "
+	          << image.meanError * 100.0f << "%" << (image.fromCache ? " (cached)" : "") << "\n";
+}
 
-GLuint loadHdrTexture(const std::string& filename)
+GLuint createHdrTexture(const HDRImage& image)
 {
 	GLuint texId;
 	glGenTextures(1, &texId);
@@ -38,13 +341,28 @@ GLuint loadHdrTexture(const std::string& filename)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 
-	HDRImage image(filename);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, image.width, image.height, 0, GL_RGB, GL_FLOAT, image.data);
 
 	return texId;
 }
 
-GLuint loadHdrMipmapTexture(const std::vector<std::string>& filenames)
+GLuint createHdrTexture(const PackedHdrImage& image)
+{
+	GLuint texId;
+	glGenTextures(1, &texId);
+	glBindTexture(GL_TEXTURE_2D, texId);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+	uploadHdrMipmapLevel(texId, 0, image);
+
+	return texId;
+}
+
+GLuint createHdrMipmapTexture(int levels)
 {
 	GLuint texId;
 	glGenTextures(1, &texId);
@@ -53,15 +371,49 @@ GLuint loadHdrMipmapTexture(const std::vector<std::string>& filenames)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	// Only the levels we have files for; the shaders never sample further.
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
 
+	return texId;
+}
+
+void uploadHdrMipmapLevel(GLuint texture, int level, const HDRImage& image)
+{
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexImage2D(GL_TEXTURE_2D, level, GL_RGB32F, image.width, image.height, 0, GL_RGB, GL_FLOAT, image.data);
+}
+
+void uploadHdrMipmapLevel(GLuint texture, int level, const PackedHdrImage& image)
+{
+	GLFormat f = glFormat(image.format);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	// RGB16F rows are only 2-byte aligned for odd widths.
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, level, f.internalFormat, image.width, image.height, 0, f.format, f.type, image.data);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+GLuint loadHdrTexture(const std::string& filename, HdrFormat format)
+{
+	PackedHdrImage image(filename, format);
+	if(image.data == nullptr)
+	{
+		exit(1);
+	}
+	return createHdrTexture(image);
+}
+
+GLuint loadHdrMipmapTexture(const std::vector<std::string>& filenames, HdrFormat format)
+{
+	GLuint texId = createHdrMipmapTexture(int(filenames.size()));
 	for(int i = 0; i < filenames.size(); i++)
 	{
-		HDRImage image(filenames[i]);
-		glTexImage2D(GL_TEXTURE_2D, i, GL_RGB32F, image.width, image.height, 0, GL_RGB, GL_FLOAT, image.data);
-		if(i == 0)
+		PackedHdrImage image(filenames[i], format);
+		if(image.data == nullptr)
 		{
-			glGenerateMipmap(GL_TEXTURE_2D);
+			exit(1);
 		}
+		uploadHdrMipmapLevel(texId, i, image);
 	}
 
 	return texId;
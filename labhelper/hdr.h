@@ -1,8 +1,94 @@
+#pragma once
 #include <vector>
 #include <string>
 #include <GL/glew.h>
 
+#include "mappedfile.h"
+
 namespace labhelper {
-	GLuint loadHdrTexture(const std::string &filename);
-	GLuint loadHdrMipmapTexture(const std::vector<std::string> &filenames);
-}
\ No newline at end of file
+	/**
+	 * An RGB float image decoded from a Radiance .hdr file, top row first.
+	 * Decoding does not touch any global stb_image state, so images can be
+	 * loaded from several threads at once. If the file cannot be loaded, the
+	 * reason is printed and data is nullptr.
+	 */
+	struct HDRImage
+	{
+		int width = 0, height = 0, components = 0;
+		float* data = nullptr;
+		HDRImage(const std::string& filename);
+		~HDRImage();
+
+	private:
+		HDRImage(const HDRImage&) = delete;
+		HDRImage& operator=(const HDRImage&) = delete;
+	};
+
+	/**
+	 * GPU storage formats for HDR textures.
+	 *   RGB32F : 12 bytes per texel, lossless.
+	 *   RGB16F :  6 bytes per texel, ~3 significant digits per channel.
+	 *   RGB9E5 :  4 bytes per texel, 9-bit mantissas sharing one exponent, so
+	 *            the error is relative to the brightest channel of each texel.
+	 *            Fine for smooth, mostly desaturated maps such as irradiance.
+	 */
+	enum class HdrFormat
+	{
+		RGB32F,
+		RGB16F,
+		RGB9E5
+	};
+	const char* hdrFormatName(HdrFormat format);
+	int hdrFormatBytesPerTexel(HdrFormat format);
+
+	/**
+	 * An HDR image converted to one of the HdrFormats, ready for glTexImage2D.
+	 * The errors are relative to the largest channel of each texel, measured
+	 * against the 32-bit source when the image was converted.
+	 */
+	struct PackedHdrImage
+	{
+		HdrFormat format;
+		int width = 0, height = 0;
+		const void* data = nullptr;
+		size_t size = 0;
+		float maxError = 0.0f, meanError = 0.0f;
+		bool fromCache = false;
+
+		PackedHdrImage(const HDRImage &image, HdrFormat format);
+		/**
+		 * Loads filename and converts it. With useCache, the converted texels
+		 * are kept in the texture cache directory (see setTextureCacheDirectory())
+		 * and later loads just map them, skipping the .hdr decode entirely.
+		 * data is nullptr if the file cannot be loaded.
+		 */
+		PackedHdrImage(const std::string &filename, HdrFormat format, bool useCache = true);
+
+	private:
+		PackedHdrImage(const PackedHdrImage&) = delete;
+		PackedHdrImage& operator=(const PackedHdrImage&) = delete;
+		void pack(const HDRImage &image);
+
+		std::vector<uint8_t> m_storage;
+		std::vector<float> m_floats;
+		MappedFile m_file;
+	};
+
+	/**
+	 * Prints the format, the memory saved compared to RGB32F and the error.
+	 */
+	void printHdrImageStats(const std::string &name, const PackedHdrImage &image);
+
+	GLuint loadHdrTexture(const std::string &filename, HdrFormat format = HdrFormat::RGB32F);
+	GLuint loadHdrMipmapTexture(const std::vector<std::string> &filenames, HdrFormat format = HdrFormat::RGB32F);
+
+	/**
+	 * Split versions of the above, for when the images are decoded elsewhere
+	 * (see AssetLoader). Mip levels may be uploaded in any order.
+	 */
+	GLuint createHdrTexture(const HDRImage &image);
+	GLuint createHdrTexture(const PackedHdrImage &image);
+	GLuint createHdrMipmapTexture(int levels);
+	void uploadHdrMipmapLevel(GLuint texture, int level, const HDRImage &image);
+	void uploadHdrMipmapLevel(GLuint texture, int level, const PackedHdrImage &image);
+}
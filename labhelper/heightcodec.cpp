@@ -0,0 +1,569 @@
+#include "heightcodec.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <utility>
+
+namespace labhelper
+{
+namespace
+{
+const uint32_t CODEC_MAGIC = 0x4348484c; // "LHHC"
+const int BLOCK_SIZE = 128;
+
+enum Mode : uint32_t
+{
+	// Integers are the float bits, made order-preserving
+	FLOAT_BITS = 0,
+	// Integers are quantised steps: height = offset + step * value
+	QUANTISED = 1,
+	// The floats as they are, for fields that do not compress
+	STORED = 2,
+	// Integers are fixed point steps of a power of two: height is the float
+	// whose ordered bits are those of step * value plus a remainder, which
+	// is zero wherever the height is on the grid
+	FIXED_POINT = 3,
+};
+
+struct Header
+{
+	uint32_t magic;
+	uint32_t width;
+	uint32_t height;
+	uint32_t mode;
+	float offset;
+	float step;
+};
+static_assert(sizeof(Header) == 24, "the block widths start 24 bytes into the stream");
+
+size_t blockCount(size_t count)
+{
+	return (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Negative floats have their magnitude bits flipped, which makes integer
+// order match float order. The mapping is its own inverse.
+inline int32_t orderedBits(float value)
+{
+	int32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits ^ ((bits >> 31) & 0x7fffffff);
+}
+
+inline uint32_t zigzag(int32_t value)
+{
+	return (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+}
+
+inline simd::int4 unzigzag(simd::int4 value)
+{
+	using namespace simd;
+	return shiftRight(value, 1) ^ (splat(int32_t(0)) - (value & splat(int32_t(1))));
+}
+
+inline simd::int4 loadBytes(const uint8_t* p)
+{
+	int32_t words[4];
+	memcpy(words, p, sizeof(words));
+	return simd::load(words);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Bit packing. A block is 128 values in four lanes of 32, value i in lane
+// i % 4. Each lane packs its values into bits words of its own, and word w
+// of all four lanes is stored together, so that one 16 byte load feeds all
+// lanes.
+///////////////////////////////////////////////////////////////////////////////
+void packBlock(const uint32_t* values, int bits, uint8_t* out)
+{
+	if(bits == 0)
+		return;
+	uint32_t words[32 * 4] = {};
+	for(int lane = 0; lane < 4; lane++)
+	{
+		for(int k = 0; k < 32; k++)
+		{
+			uint32_t value = values[k * 4 + lane];
+			int bit = k * bits;
+			words[(bit / 32) * 4 + lane] |= value << (bit % 32);
+			if(bit % 32 + bits > 32)
+				words[(bit / 32 + 1) * 4 + lane] |= value >> (32 - bit % 32);
+		}
+	}
+	memcpy(out, words, size_t(bits) * 4 * sizeof(uint32_t));
+}
+
+template<int BITS>
+void unpackBlock(const uint8_t* in, int32_t* out)
+{
+	using namespace simd;
+	if(BITS == 0)
+	{
+		for(int k = 0; k < 32; k++)
+			store(out + k * 4, splat(int32_t(0)));
+		return;
+	}
+	const int4 mask = splat(int32_t(BITS == 32 ? 0xffffffffu : (1u << BITS) - 1));
+	int4 word = loadBytes(in);
+	int word_index = 0;
+	for(int k = 0; k < 32; k++)
+	{
+		int bit = k * BITS;
+		if(bit / 32 != word_index)
+		{
+			word_index = bit / 32;
+			word = loadBytes(in + word_index * 16);
+		}
+		int4 value = shiftRight(word, bit % 32);
+		if(bit % 32 + BITS > 32)
+		{
+			word_index++;
+			word = loadBytes(in + word_index * 16);
+			value = value | (word << (32 - bit % 32));
+		}
+		store(out + k * 4, value & mask);
+	}
+}
+
+typedef void (*Unpacker)(const uint8_t*, int32_t*);
+template<size_t... BITS>
+std::array<Unpacker, sizeof...(BITS)> makeUnpackers(std::index_sequence<BITS...>)
+{
+	return { { unpackBlock<int(BITS)>... } };
+}
+const std::array<Unpacker, 33> unpackers = makeUnpackers(std::make_index_sequence<33>());
+
+///////////////////////////////////////////////////////////////////////////////
+// Prediction. Each row picks whichever predictor suits it best, using zeros
+// outside the field. All arithmetic wraps around in 32 bits, so that every
+// residual fits.
+///////////////////////////////////////////////////////////////////////////////
+enum Predictor : uint8_t
+{
+	GRADIENT = 0, // left + upper - upper left
+	LEFT = 1,
+	UPPER = 2,
+};
+
+inline int bitLength(uint32_t value)
+{
+	int bits = 0;
+	for(int shift = 16; shift > 0; shift /= 2)
+	{
+		if(value >> shift)
+		{
+			value >>= shift;
+			bits += shift;
+		}
+	}
+	return bits + int(value);
+}
+
+/**
+	* Fills predictors with one per row, and residuals with the zigzag encoded
+	* residuals from them.
+	*/
+void computeResiduals(const int32_t* values, int width, int height, uint8_t* predictors, uint32_t* residuals)
+{
+	std::vector<uint32_t> candidates[3];
+	for(std::vector<uint32_t>& candidate : candidates)
+		candidate.resize(width);
+	for(int z = 0; z < height; z++)
+	{
+		const int32_t* row = values + size_t(z) * width;
+		const int32_t* up = z > 0 ? row - width : nullptr;
+		// Bits the residuals would take when packed in groups of 32, which
+		// is close to what the blocks of 128 take
+		int64_t cost[3] = { 0, 0, 0 };
+		uint32_t group[3] = { 0, 0, 0 };
+		for(int x = 0; x < width; x++)
+		{
+			uint32_t left = x > 0 ? uint32_t(row[x - 1]) : 0;
+			uint32_t upper = up != nullptr ? uint32_t(up[x]) : 0;
+			uint32_t upper_left = up != nullptr && x > 0 ? uint32_t(up[x - 1]) : 0;
+			uint32_t value = uint32_t(row[x]);
+			candidates[GRADIENT][x] = zigzag(int32_t(value - (left + upper - upper_left)));
+			candidates[LEFT][x] = zigzag(int32_t(value - left));
+			candidates[UPPER][x] = zigzag(int32_t(value - upper));
+			for(int p = 0; p < 3; p++)
+			{
+				group[p] |= candidates[p][x];
+				if(x % 32 == 31 || x == width - 1)
+				{
+					cost[p] += (x % 32 + 1) * bitLength(group[p]);
+					group[p] = 0;
+				}
+			}
+		}
+		int best = int(std::min_element(cost, cost + 3) - cost);
+		predictors[z] = uint8_t(best);
+		std::copy(candidates[best].begin(), candidates[best].end(), residuals + size_t(z) * width);
+	}
+}
+
+/**
+	* Rebuilds one row from its residuals. The row buffers start with a zero
+	* for the column left of the field, and have room for a vector past its
+	* end. For the predictors that use the left neighbour the row is a prefix
+	* sum, as with the gradient predictor
+	* value[x] - value[x - 1] = residual[x] + upper[x] - upper[x - 1].
+	*/
+template<Mode MODE, Predictor PREDICTOR>
+void rebuildRow(const int32_t* residuals, const int32_t* remainders, const int32_t* upper, int32_t* current, int width,
+                const Header& header, float* out)
+{
+	using namespace simd;
+	const int4 magnitude = splat(int32_t(0x7fffffff));
+	const float4 step = splat(header.step);
+	const float4 offset = splat(header.offset);
+	int4 carry = splat(int32_t(0));
+	for(int x = 0; x < width; x += 4)
+	{
+		int4 r = unzigzag(load(residuals + x));
+		int4 value;
+		if(PREDICTOR == UPPER)
+		{
+			value = r + load(upper + x + 1);
+		}
+		else
+		{
+			int4 delta = PREDICTOR == GRADIENT ? r + load(upper + x + 1) - load(upper + x) : r;
+			value = prefixSum(delta) + carry;
+			carry = splatLast(value);
+		}
+		store(current + x + 1, value);
+
+		float4 h;
+		if(MODE == QUANTISED)
+		{
+			h = toFloat(value) * step + offset;
+		}
+		else if(MODE == FIXED_POINT)
+		{
+			int4 bits = asInt(toFloat(value) * step);
+			bits = (bits ^ ((bits >> 31) & magnitude)) + unzigzag(load(remainders + x));
+			h = asFloat(bits ^ ((bits >> 31) & magnitude));
+		}
+		else
+		{
+			h = asFloat(value ^ ((value >> 31) & magnitude));
+		}
+		if(x + 4 <= width)
+		{
+			store(out + x, h);
+		}
+		else
+		{
+			float tail[4];
+			store(tail, h);
+			std::copy(tail, tail + (width - x), out + x);
+		}
+	}
+}
+
+template<Mode MODE>
+void rebuildRow(Predictor predictor, const int32_t* residuals, const int32_t* remainders, const int32_t* upper,
+                int32_t* current, int width, const Header& header, float* out)
+{
+	if(predictor == GRADIENT)
+		rebuildRow<MODE, GRADIENT>(residuals, remainders, upper, current, width, header, out);
+	else if(predictor == LEFT)
+		rebuildRow<MODE, LEFT>(residuals, remainders, upper, current, width, header, out);
+	else
+		rebuildRow<MODE, UPPER>(residuals, remainders, upper, current, width, header, out);
+}
+
+/**
+	* Appends the blocks of values to out, writing their bit widths from
+	* widths on (an offset into out).
+	*/
+void packBlocks(const std::vector<uint32_t>& values, size_t widths, std::vector<uint8_t>& out)
+{
+	size_t count = values.size();
+	uint32_t block[BLOCK_SIZE];
+	for(size_t b = 0; b < blockCount(count); b++)
+	{
+		size_t n = std::min(size_t(BLOCK_SIZE), count - b * BLOCK_SIZE);
+		memcpy(block, values.data() + b * BLOCK_SIZE, n * sizeof(uint32_t));
+		std::fill(block + n, block + BLOCK_SIZE, 0u);
+		uint32_t all = 0;
+		for(uint32_t value : block)
+			all |= value;
+		int bits = bitLength(all);
+		out[widths + b] = uint8_t(bits);
+		size_t start = out.size();
+		out.resize(start + size_t(bits) * 16);
+		packBlock(block, bits, out.data() + start);
+	}
+}
+
+/**
+	* The stream after the header: a predictor per row, a bit width per block
+	* of residuals and, in FIXED_POINT mode, per block of remainders, then the
+	* packed residuals and the packed remainders.
+	*/
+void encodeAs(const std::vector<int32_t>& values, const std::vector<uint32_t>* remainders, const Header& header,
+              std::vector<uint8_t>& out)
+{
+	size_t count = values.size();
+	size_t blocks = blockCount(count);
+	out.assign(sizeof(Header) + header.height + blocks * (remainders != nullptr ? 2 : 1), 0);
+	memcpy(out.data(), &header, sizeof(header));
+	uint8_t* predictors = out.data() + sizeof(Header);
+	std::vector<uint32_t> residuals(count);
+	computeResiduals(values.data(), int(header.width), int(header.height), predictors, residuals.data());
+
+	size_t widths = sizeof(Header) + header.height;
+	packBlocks(residuals, widths, out);
+	if(remainders != nullptr)
+		packBlocks(*remainders, widths + blocks, out);
+}
+
+/**
+	* Streams the blocks of a packed stream into a buffer holding a bit more
+	* than a row, so that each row can be rebuilt as soon as it is there.
+	*/
+struct BlockReader
+{
+	const uint8_t* widths;
+	const uint8_t* packed;
+	const uint8_t* end;
+	std::vector<int32_t> buffer;
+	size_t base = 0, count = 0, block = 0;
+
+	BlockReader(const uint8_t* widths, const uint8_t* packed, const uint8_t* end, int width)
+	    : widths(widths)
+	    , packed(packed)
+	    , end(end)
+	    , buffer(size_t(width) + BLOCK_SIZE + 4, 0)
+	{
+	}
+
+	/** Unpacks up to the end of the row at start. Returns false if the data is truncated or corrupt. */
+	bool fill(size_t start, int width)
+	{
+		size_t consumed = start - base;
+		memmove(buffer.data(), buffer.data() + consumed, (count - consumed) * sizeof(int32_t));
+		base = start;
+		count -= consumed;
+		while(count < size_t(width))
+		{
+			int bits = widths[block];
+			if(bits > 32 || size_t(end - packed) < size_t(bits) * 16)
+				return false;
+			unpackers[bits](packed, buffer.data() + count);
+			packed += bits * 16;
+			count += BLOCK_SIZE;
+			block++;
+		}
+		return true;
+	}
+};
+} // namespace
+
+void encodeHeights(const float* heights, int width, int height, float maxError, std::vector<uint8_t>& out)
+{
+	size_t count = size_t(width) * height;
+	std::vector<int32_t> values(count);
+	Header header = { CODEC_MAGIC, uint32_t(width), uint32_t(height), FLOAT_BITS, 0.0f, 0.0f };
+	std::vector<uint32_t> remainders;
+
+	if(maxError > 0.0f && count > 0)
+	{
+		float min_height = *std::min_element(heights, heights + count);
+		float max_height = *std::max_element(heights, heights + count);
+		// A bit under 2 * maxError, so that float rounding in the decoder
+		// does not push heights that land half way between steps over.
+		double step = 1.99 * maxError;
+		// The decoder converts steps to float, which is exact below 2^24
+		if((double(max_height) - min_height) / step < double(1 << 24))
+		{
+			header.mode = QUANTISED;
+			header.offset = min_height;
+			header.step = float(step);
+			for(size_t i = 0; i < count; i++)
+				values[i] = int32_t(std::floor((double(heights[i]) - header.offset) / header.step + 0.5));
+			encodeAs(values, nullptr, header, out);
+
+			std::vector<float> decoded(count);
+			decodeHeights(out.data(), out.size(), decoded.data());
+			bool within = true;
+			for(size_t i = 0; i < count && within; i++)
+				within = std::abs(decoded[i] - heights[i]) <= maxError;
+			if(within)
+				return;
+			header.mode = FLOAT_BITS;
+			header.offset = header.step = 0.0f;
+		}
+	}
+
+	// Lossless: fixed point on the grid of the float precision of the
+	// largest height, which is exact for heights within a factor of two of
+	// it. The remainders carry the extra precision of the smaller heights,
+	// as the distance from the grid point in float steps. It needs finite
+	// heights and a step that is not a denormal.
+	float largest = 0.0f;
+	bool finite = true;
+	for(size_t i = 0; i < count && finite; i++)
+	{
+		finite = std::isfinite(heights[i]);
+		largest = std::max(largest, std::abs(heights[i]));
+	}
+	int exponent;
+	std::frexp(largest, &exponent);
+	float step = std::ldexp(1.0f, exponent - 24);
+	if(finite && step >= std::numeric_limits<float>::min())
+	{
+		header.mode = FIXED_POINT;
+		header.step = step;
+		remainders.resize(count);
+		for(size_t i = 0; i < count; i++)
+		{
+			values[i] = int32_t(std::floor(double(heights[i]) / step + 0.5));
+			// Rounded the way the decoder does it
+			float on_grid = float(values[i]) * step;
+			remainders[i] = zigzag(int32_t(uint32_t(orderedBits(heights[i])) - uint32_t(orderedBits(on_grid))));
+		}
+		encodeAs(values, &remainders, header, out);
+	}
+	else
+	{
+		for(size_t i = 0; i < count; i++)
+			values[i] = orderedBits(heights[i]);
+		encodeAs(values, nullptr, header, out);
+	}
+	if(out.size() >= sizeof(Header) + count * sizeof(float))
+	{
+		header.mode = STORED;
+		out.resize(sizeof(Header) + count * sizeof(float));
+		memcpy(out.data(), &header, sizeof(header));
+		memcpy(out.data() + sizeof(Header), heights, count * sizeof(float));
+	}
+}
+
+bool encodedHeightsSize(const uint8_t* data, size_t size, int& width, int& height)
+{
+	Header header;
+	if(size < sizeof(Header))
+		return false;
+	memcpy(&header, data, sizeof(header));
+	if(header.magic != CODEC_MAGIC || header.mode > FIXED_POINT || header.width > 0x7fffffff
+	   || header.height > 0x7fffffff)
+		return false;
+	width = int(header.width);
+	height = int(header.height);
+	return true;
+}
+
+bool decodeHeights(const uint8_t* data, size_t size, float* heights)
+{
+	int width, height;
+	if(!encodedHeightsSize(data, size, width, height))
+		return false;
+	Header header;
+	memcpy(&header, data, sizeof(header));
+	size_t count = size_t(width) * height;
+	if(header.mode == STORED)
+	{
+		if(size - sizeof(Header) < count * sizeof(float))
+			return false;
+		memcpy(heights, data + sizeof(Header), count * sizeof(float));
+		return true;
+	}
+	size_t blocks = blockCount(count);
+	size_t width_bytes = header.mode == FIXED_POINT ? 2 * blocks : blocks;
+	if(size - sizeof(Header) < size_t(height) + width_bytes)
+		return false;
+	const uint8_t* predictors = data + sizeof(Header);
+	const uint8_t* widths = predictors + height;
+	const uint8_t* packed = widths + width_bytes;
+	const uint8_t* end = data + size;
+	if(count == 0)
+		return true;
+
+	BlockReader residuals(widths, packed, end, width);
+	// The remainders follow all of the residuals
+	size_t residual_bytes = 0;
+	for(size_t b = 0; b < blocks; b++)
+		residual_bytes += size_t(widths[b]) * 16;
+	if(header.mode == FIXED_POINT && size_t(end - packed) < residual_bytes)
+		return false;
+	BlockReader remainders(widths + blocks, packed + residual_bytes, end, header.mode == FIXED_POINT ? width : 0);
+	std::vector<int32_t> upper(size_t(width) + 8, 0), current(size_t(width) + 8, 0);
+
+	for(int z = 0; z < height; z++)
+	{
+		size_t row_start = size_t(z) * width;
+		if(!residuals.fill(row_start, width))
+			return false;
+
+		float* out = heights + row_start;
+		Predictor predictor = Predictor(predictors[z]);
+		if(predictor > UPPER)
+			return false;
+		if(header.mode == QUANTISED)
+		{
+			rebuildRow<QUANTISED>(predictor, residuals.buffer.data(), nullptr, upper.data(), current.data(), width,
+			                      header, out);
+		}
+		else if(header.mode == FIXED_POINT)
+		{
+			if(!remainders.fill(row_start, width))
+				return false;
+			rebuildRow<FIXED_POINT>(predictor, residuals.buffer.data(), remainders.buffer.data(), upper.data(),
+			                        current.data(), width, header, out);
+		}
+		else
+		{
+			rebuildRow<FLOAT_BITS>(predictor, residuals.buffer.data(), nullptr, upper.data(), current.data(), width,
+			                       header, out);
+		}
+		std::swap(upper, current);
+	}
+	return true;
+}
+
+void benchmarkHeightCodec(const float* heights, int width, int height)
+{
+	const float errors[] = { 0.0f, 0.0001f, 0.001f, 0.01f };
+	size_t count = size_t(width) * height;
+	double raw_megabytes = count * sizeof(float) / (1024.0 * 1024.0);
+	std::vector<uint8_t> encoded;
+	std::vector<float> decoded(count);
+	std::cout << "Encoding " << width << "x" << height << " heights (" << raw_megabytes << " MB):\n";
+	for(float max_error : errors)
+	{
+		// Best of a few runs, to keep the numbers steady
+		float encode_ms = 1e30f, decode_ms = 1e30f;
+		for(int run = 0; run < 5; run++)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+			encodeHeights(heights, width, height, max_error, encoded);
+			std::chrono::duration<float, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+			encode_ms = std::min(encode_ms, elapsed.count());
+
+			start = std::chrono::high_resolution_clock::now();
+			decodeHeights(encoded.data(), encoded.size(), decoded.data());
+			elapsed = std::chrono::high_resolution_clock::now() - start;
+			decode_ms = std::min(decode_ms, elapsed.count());
+		}
+		float worst = 0.0f;
+		for(size_t i = 0; i < count; i++)
+			worst = std::max(worst, std::abs(decoded[i] - heights[i]));
+
+		if(max_error == 0.0f)
+			std::cout << "  lossless";
+		else
+			std::cout << "  max error " << max_error;
+		std::cout << ": ratio " << double(count * sizeof(float)) / encoded.size() << ", encode "
+		          << raw_megabytes / (encode_ms / 1000.0) << " MB/s, decode "
+		          << raw_megabytes / (decode_ms / 1000.0) << " MB/s, worst error " << worst << "\n";
+	}
+}
+} // namespace labhelper
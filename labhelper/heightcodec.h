@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace labhelper
+{
+/**
+	* Compression for heightfields (whole fields or single tiles), which are
+	* smooth enough that each height is close to a prediction from its
+	* neighbours: the gradient left + upper - upper left, or just the left or
+	* upper one, whichever does best on each row.
+	*
+	* The heights are turned into integers first. With maxError > 0 they are
+	* quantised to steps of a little under 2 * maxError. Losslessly, they are
+	* rounded to fixed point with the float precision of the largest height,
+	* and heights nearer zero, which have more precision than that, keep the
+	* rest as a remainder: how many float steps they are from their fixed
+	* point value, which is zero for most heights. The residuals from the
+	* predictor and the remainders are zigzag encoded and bit packed in
+	* blocks of 128, each with its own bit width, laid out so that four lanes
+	* unpack at once with SSE2. Fields that would not get smaller are stored
+	* as they are.
+	*
+	* Decoding is single threaded; decode tiles on several threads to use
+	* more cores. The stream is little-endian.
+	*/
+
+/**
+	* Replaces out with the encoded heights. If maxError > 0, every decoded
+	* height is within maxError of the original; fields where quantising
+	* would not reach that (a huge range, or a maxError below the float
+	* precision of the heights) are encoded losslessly instead.
+	*/
+void encodeHeights(const float* heights, int width, int height, float maxError, std::vector<uint8_t>& out);
+
+/**
+	* Reads the size of encoded heights. Returns false if data does not start
+	* with encoded heights.
+	*/
+bool encodedHeightsSize(const uint8_t* data, size_t size, int& width, int& height);
+
+/**
+	* Decodes into heights, which must hold width * height floats. Returns
+	* false, leaving heights partly written, if data is truncated or
+	* corrupt.
+	*/
+bool decodeHeights(const uint8_t* data, size_t size, float* heights);
+
+/**
+	* Prints the compression ratio and encode/decode speed for a few error
+	* bounds, including lossless.
+	*/
+void benchmarkHeightCodec(const float* heights, int width, int height);
+} // namespace labhelper
@@ -0,0 +1,417 @@
+#include "heightfield.h"
+#include "stbextras.h"
+#include "threadpool.h"
+#include "tiledheightfield.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include <stb_image.h>
+
+namespace labhelper
+{
+namespace
+{
+const uint32_t RAW_MAGIC = 0x4648484c; // "LHHF"
+const uint32_t RAW_VERSION = 1;
+
+struct RawHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	float min_height;
+	float max_height;
+	uint32_t reserved[2];
+};
+static_assert(sizeof(RawHeader) == 32, "the heights start 32 bytes into the file");
+
+bool isLittleEndian()
+{
+	uint32_t one = 1;
+	uint8_t first;
+	memcpy(&first, &one, 1);
+	return first == 1;
+}
+
+bool hasExtension(const std::string& filename, const char* extension)
+{
+	size_t length = strlen(extension);
+	if(filename.size() < length)
+		return false;
+	for(size_t i = 0; i < length; i++)
+	{
+		if(tolower(filename[filename.size() - length + i]) != extension[i])
+			return false;
+	}
+	return true;
+}
+
+void heightRange(const float* heights, size_t count, float& min_height, float& max_height)
+{
+	min_height = count > 0 ? heights[0] : 0.0f;
+	max_height = min_height;
+	for(size_t i = 0; i < count; i++)
+	{
+		min_height = std::min(min_height, heights[i]);
+		max_height = std::max(max_height, heights[i]);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Raw float32
+///////////////////////////////////////////////////////////////////////////////
+bool saveRaw(const std::string& filename, const float* heights, int width, int height)
+{
+	size_t count = size_t(width) * height;
+	RawHeader header = {};
+	header.magic = RAW_MAGIC;
+	header.version = RAW_VERSION;
+	header.width = uint32_t(width);
+	header.height = uint32_t(height);
+	heightRange(heights, count, header.min_height, header.max_height);
+
+	std::vector<float> swapped;
+	if(!isLittleEndian())
+	{
+		// The header is swapped along with the heights, as they are all 32 bits.
+		swapped.resize(sizeof(RawHeader) / 4 + count);
+		memcpy(swapped.data(), &header, sizeof(header));
+		memcpy(swapped.data() + sizeof(RawHeader) / 4, heights, count * sizeof(float));
+		for(float& value : swapped)
+		{
+			uint8_t* bytes = reinterpret_cast<uint8_t*>(&value);
+			std::swap(bytes[0], bytes[3]);
+			std::swap(bytes[1], bytes[2]);
+		}
+	}
+
+	std::ofstream file(filename, std::ios::binary);
+	if(swapped.empty())
+	{
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(heights), count * sizeof(float));
+	}
+	else
+	{
+		file.write(reinterpret_cast<const char*>(swapped.data()), swapped.size() * sizeof(float));
+	}
+	file.close();
+	if(!file)
+	{
+		std::cout << "Failed to write heightfield " << filename << "\n";
+		return false;
+	}
+	return true;
+}
+
+bool loadRaw(const std::string& filename, Heightfield& field)
+{
+	if(!field.file.open(filename) || field.file.size() < sizeof(RawHeader))
+	{
+		std::cout << "Failed to load heightfield " << filename << "\n";
+		return false;
+	}
+	RawHeader header;
+	memcpy(&header, field.file.data(), sizeof(header));
+	bool little_endian = isLittleEndian();
+	if(!little_endian)
+	{
+		uint32_t* words = reinterpret_cast<uint32_t*>(&header);
+		for(size_t i = 0; i < sizeof(header) / 4; i++)
+			words[i] = (words[i] >> 24) | ((words[i] >> 8) & 0xff00) | ((words[i] << 8) & 0xff0000) | (words[i] << 24);
+	}
+	size_t count = size_t(header.width) * header.height;
+	if(header.magic != RAW_MAGIC || header.version != RAW_VERSION
+	   || field.file.size() - sizeof(RawHeader) < count * sizeof(float))
+	{
+		std::cout << "Not a heightfield, or truncated: " << filename << "\n";
+		field.file.close();
+		return false;
+	}
+	field.width = int(header.width);
+	field.height = int(header.height);
+	field.heights = reinterpret_cast<const float*>(field.file.data() + sizeof(RawHeader));
+	if(!little_endian)
+	{
+		field.storage.resize(count);
+		const uint8_t* bytes = field.file.data() + sizeof(RawHeader);
+		for(size_t i = 0; i < count; i++)
+		{
+			uint8_t value[4] = { bytes[i * 4 + 3], bytes[i * 4 + 2], bytes[i * 4 + 1], bytes[i * 4] };
+			memcpy(&field.storage[i], value, 4);
+		}
+		field.heights = field.storage.data();
+		field.file.close();
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// 16-bit PNG. stb_image_write only writes 8 bits per channel, so the chunks
+// are put together here and only the deflate step is borrowed from it.
+///////////////////////////////////////////////////////////////////////////////
+uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0)
+{
+	static uint32_t table[256];
+	static bool initialized = [] {
+		for(uint32_t n = 0; n < 256; n++)
+		{
+			uint32_t c = n;
+			for(int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+		return true;
+	}();
+	(void)initialized;
+	crc = ~crc;
+	for(size_t i = 0; i < size; i++)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+void appendBigEndian(std::vector<uint8_t>& out, uint32_t value)
+{
+	out.push_back(uint8_t(value >> 24));
+	out.push_back(uint8_t(value >> 16));
+	out.push_back(uint8_t(value >> 8));
+	out.push_back(uint8_t(value));
+}
+
+void appendChunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t size)
+{
+	appendBigEndian(out, uint32_t(size));
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data, data + size);
+	appendBigEndian(out, crc32(out.data() + start, size + 4));
+}
+
+int paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if(pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+// Filters one row of big-endian samples with each of the five PNG filters
+// and keeps the one with the smallest sum of absolute values, like libpng.
+void filterRow(const uint8_t* row, const uint8_t* previous, size_t size, uint8_t* out)
+{
+	const int bpp = 2;
+	std::vector<uint8_t> candidate(size);
+	int best_sum = -1;
+	for(int filter = 0; filter < 5; filter++)
+	{
+		int sum = 0;
+		for(size_t i = 0; i < size; i++)
+		{
+			int a = i >= bpp ? row[i - bpp] : 0;
+			int b = previous != nullptr ? previous[i] : 0;
+			int c = i >= bpp && previous != nullptr ? previous[i - bpp] : 0;
+			int predicted = 0;
+			switch(filter)
+			{
+			case 1: predicted = a; break;
+			case 2: predicted = b; break;
+			case 3: predicted = (a + b) / 2; break;
+			case 4: predicted = paeth(a, b, c); break;
+			}
+			candidate[i] = uint8_t(row[i] - predicted);
+			sum += abs(int(int8_t(candidate[i])));
+		}
+		if(best_sum < 0 || sum < best_sum)
+		{
+			best_sum = sum;
+			out[0] = uint8_t(filter);
+			memcpy(out + 1, candidate.data(), size);
+		}
+	}
+}
+
+bool savePng(const std::string& filename, const float* heights, int width, int height)
+{
+	size_t count = size_t(width) * height;
+	float min_height, max_height;
+	heightRange(heights, count, min_height, max_height);
+	float scale = max_height > min_height ? (max_height - min_height) / 65535.0f : 1.0f;
+
+	///////////////////////////////////////////////////////////////////////
+	// Quantise to big-endian 16-bit samples, then filter each row
+	///////////////////////////////////////////////////////////////////////
+	size_t row_size = size_t(width) * 2;
+	std::vector<uint8_t> samples(count * 2);
+	std::vector<uint8_t> filtered((row_size + 1) * height);
+	ThreadPool& pool = ThreadPool::global();
+	pool.parallelFor(0, height, [&](int begin, int end) {
+		for(int z = begin; z < end; z++)
+		{
+			for(int x = 0; x < width; x++)
+			{
+				float value = (heights[size_t(z) * width + x] - min_height) / scale;
+				uint16_t sample = uint16_t(std::min(std::max(value + 0.5f, 0.0f), 65535.0f));
+				samples[size_t(z) * row_size + x * 2] = uint8_t(sample >> 8);
+				samples[size_t(z) * row_size + x * 2 + 1] = uint8_t(sample);
+			}
+		}
+	}, 64);
+	pool.parallelFor(0, height, [&](int begin, int end) {
+		for(int z = begin; z < end; z++)
+		{
+			const uint8_t* previous = z > 0 ? &samples[size_t(z - 1) * row_size] : nullptr;
+			filterRow(&samples[size_t(z) * row_size], previous, row_size, &filtered[size_t(z) * (row_size + 1)]);
+		}
+	}, 64);
+
+	int compressed_size = 0;
+	uint8_t* compressed = zlibCompress(filtered.data(), int(filtered.size()), &compressed_size);
+	if(compressed == nullptr)
+	{
+		std::cout << "Failed to compress heightfield " << filename << "\n";
+		return false;
+	}
+
+	std::vector<uint8_t> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	std::vector<uint8_t> ihdr;
+	appendBigEndian(ihdr, uint32_t(width));
+	appendBigEndian(ihdr, uint32_t(height));
+	const uint8_t format[] = { 16, 0, 0, 0, 0 }; // 16 bits, greyscale, deflate, default filters, not interlaced
+	ihdr.insert(ihdr.end(), format, format + sizeof(format));
+	appendChunk(png, "IHDR", ihdr.data(), ihdr.size());
+	appendChunk(png, "IDAT", compressed, size_t(compressed_size));
+	appendChunk(png, "IEND", nullptr, 0);
+	free(compressed);
+
+	std::ofstream file(filename, std::ios::binary);
+	file.write(reinterpret_cast<const char*>(png.data()), png.size());
+	file.close();
+	FILE* sidecar = fopen((filename + ".txt").c_str(), "w");
+	if(!file || sidecar == nullptr)
+	{
+		if(sidecar != nullptr)
+			fclose(sidecar);
+		std::cout << "Failed to write heightfield " << filename << "\n";
+		return false;
+	}
+	// height = offset + scale * sample
+	fprintf(sidecar, "scale %.9g\noffset %.9g\n", scale, min_height);
+	fclose(sidecar);
+	return true;
+}
+
+bool loadPng(const std::string& filename, Heightfield& field)
+{
+	MappedFile file;
+	int width = 0, height = 0, components;
+	stbi_us* samples = nullptr;
+	if(file.open(filename) && file.size() > 0)
+		samples = stbi_load_16_from_memory(file.data(), int(file.size()), &width, &height, &components, 1);
+	if(samples == nullptr)
+	{
+		std::cout << "Failed to load heightfield " << filename << "\n";
+		return false;
+	}
+
+	float scale = 1.0f / 65535.0f, offset = 0.0f;
+	FILE* sidecar = fopen((filename + ".txt").c_str(), "r");
+	if(sidecar == nullptr || fscanf(sidecar, " scale %f offset %f", &scale, &offset) != 2)
+		std::cout << "No scale and offset in " << filename << ".txt, loading heights in [0, 1]\n";
+	if(sidecar != nullptr)
+		fclose(sidecar);
+
+	// stb_image flips every image it loads (see s_flip_images in
+	// labhelper.cpp, set before main()), so undo it while converting.
+	field.storage.resize(size_t(width) * height);
+	ThreadPool::global().parallelFor(0, height, [&](int begin, int end) {
+		for(int z = begin; z < end; z++)
+		{
+			const stbi_us* row = samples + size_t(height - 1 - z) * width;
+			for(int x = 0; x < width; x++)
+				field.storage[size_t(z) * width + x] = offset + scale * row[x];
+		}
+	}, 64);
+	stbi_image_free(samples);
+	field.file.close();
+	field.width = width;
+	field.height = height;
+	field.heights = field.storage.data();
+	return true;
+}
+///////////////////////////////////////////////////////////////////////////////
+// Tiled
+///////////////////////////////////////////////////////////////////////////////
+bool saveTiled(const std::string& filename, const float* heights, int width, int height)
+{
+	TiledHeightfieldWriter writer;
+	if(!writer.create(filename, width, height))
+		return false;
+	int tile_size = writer.tileSize();
+	int tiles_x = writer.tilesX();
+	ThreadPool::global().parallelFor(0, tiles_x * writer.tilesY(), [&](int begin, int end) {
+		std::vector<float> tile(size_t(tile_size) * tile_size);
+		for(int i = begin; i < end; i++)
+		{
+			int x0 = (i % tiles_x) * tile_size, z0 = (i / tiles_x) * tile_size;
+			int columns = std::min(tile_size, width - x0);
+			for(int z = z0; z < std::min(z0 + tile_size, height); z++)
+				memcpy(&tile[size_t(z - z0) * tile_size], heights + size_t(z) * width + x0, columns * sizeof(float));
+			writer.writeTile(i % tiles_x, i / tiles_x, tile.data());
+		}
+	});
+	return writer.finish();
+}
+
+bool loadTiled(const std::string& filename, Heightfield& field, int maxSize)
+{
+	TiledHeightfield tiled;
+	if(!tiled.open(filename))
+		return false;
+	int level = 0;
+	while(maxSize > 0 && level + 1 < tiled.levels()
+	      && std::max(tiled.width(level), tiled.height(level)) > maxSize)
+		level++;
+	field.width = tiled.width(level);
+	field.height = tiled.height(level);
+	field.storage.resize(size_t(field.width) * field.height);
+	int tile_size = tiled.tileSize();
+	// One band of tiles per task
+	ThreadPool::global().parallelFor(0, tiled.tilesY(level), [&](int begin, int end) {
+		int z0 = begin * tile_size, z1 = std::min(end * tile_size, field.height);
+		tiled.readRegion(level, 0, z0, field.width, z1 - z0, &field.storage[size_t(z0) * field.width]);
+	});
+	field.heights = field.storage.data();
+	return true;
+}
+} // namespace
+
+bool saveHeightfield(const std::string& filename, const float* heights, int width, int height)
+{
+	if(hasExtension(filename, ".png"))
+		return savePng(filename, heights, width, height);
+	if(hasExtension(filename, ".lht"))
+		return saveTiled(filename, heights, width, height);
+	return saveRaw(filename, heights, width, height);
+}
+
+bool loadHeightfield(const std::string& filename, Heightfield& field, int maxSize)
+{
+	field.storage.clear();
+	field.heights = nullptr;
+	field.width = field.height = 0;
+	if(hasExtension(filename, ".png"))
+		return loadPng(filename, field);
+	if(hasExtension(filename, ".lht"))
+		return loadTiled(filename, field, maxSize);
+	return loadRaw(filename, field);
+}
+} // namespace labhelper
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "mappedfile.h"
+
+namespace labhelper
+{
+/**
+	* A grid of heights, row by row (rows are consecutive z, columns x). The
+	* heights point either straight into a mapped raw file or into storage
+	* owned by the field itself.
+	*/
+struct Heightfield
+{
+	int width = 0, height = 0;
+	const float* heights = nullptr;
+
+	float at(int x, int z) const { return heights[size_t(z) * width + x]; }
+
+	MappedFile file;
+	std::vector<float> storage;
+};
+
+/**
+	* Three file formats, chosen by the extension of filename:
+	*
+	* ".png": 16-bit greyscale, for looking at and editing in other tools.
+	* The heights are quantised to 65536 steps between their minimum and
+	* maximum. The scale and offset that map the samples back to heights are
+	* in a small text file next to it, named filename + ".txt".
+	*
+	* ".lht": a TiledHeightfield with a mip pyramid, see tiledheightfield.h.
+	* Loading reads the finest level whose sides are at most maxSize (if
+	* it is not 0), touching only the tiles of that level.
+	*
+	* Anything else: raw little-endian float32, row by row, after a 32 byte
+	* header holding the size. Lossless, and loading it just maps the file.
+	*
+	* Both return false, after printing why, if the file could not be
+	* written or read.
+	*/
+bool saveHeightfield(const std::string& filename, const float* heights, int width, int height);
+bool loadHeightfield(const std::string& filename, Heightfield& field, int maxSize = 0);
+} // namespace labhelper
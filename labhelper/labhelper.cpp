@@ -16,8 +16,15 @@
 #include <stb_image.h>
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb_image_write.h>
+// Mip generation and block compression for the texture cache
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
+#include <stb_image_resize.h>
+#define STB_DXT_IMPLEMENTATION
+#define STBD_MEMSET memset // the default in v1.07 takes the wrong number of arguments
+#include <stb_dxt.h>
 
 #include "labhelper.h"
+#include "stbextras.h"
 
 #include <cmath>
 #include <cstring>
@@ -46,6 +53,18 @@ namespace labhelper
 
 static bool s_show_gui = true;
 
+// Flip images vertically so they don't end up upside-down: every loader
+// expects stb_image to return the bottom row first, as glTexImage2D wants,
+// and the few that need the top row first (HDRImage, loadPng()) undo it.
+// Set before main() rather than in init_window_SDL(), so that this holds
+// whatever loads first, including benchmarks that never open a window.
+static const bool s_flip_images = (stbi_set_flip_vertically_on_load(true), true);
+
+unsigned char* zlibCompress(const unsigned char* data, int size, int* compressedSize, int quality)
+{
+	return stbi_zlib_compress(const_cast<unsigned char*>(data), size, compressedSize, quality);
+}
+
 
 SDL_Window* init_window_SDL(std::string caption, int width, int height)
 {
@@ -106,9 +125,6 @@ SDL_Window* init_window_SDL(std::string caption, int width, int height)
 	labhelper::startupGLDiagnostics();
 	labhelper::setupGLDebugMessages();
 
-	// Flip textures vertically so they don't end up upside-down.
-	stbi_set_flip_vertically_on_load(true);
-
 	// 1 for v-sync
 	SDL_GL_SetSwapInterval(1);
 
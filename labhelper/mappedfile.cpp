@@ -0,0 +1,173 @@
+#include "mappedfile.h"
+
+#include <algorithm>
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define VC_EXTRALEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace labhelper
+{
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+{
+	*this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+	if(this != &other)
+	{
+		close();
+		std::swap(m_data, other.m_data);
+		std::swap(m_size, other.m_size);
+		std::swap(m_open, other.m_open);
+#ifdef _WIN32
+		std::swap(m_file, other.m_file);
+		std::swap(m_mapping, other.m_mapping);
+#endif
+	}
+	return *this;
+}
+
+#ifdef _WIN32
+bool MappedFile::open(const std::string& filename)
+{
+	close();
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+	                          FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if(file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(file, &size))
+	{
+		CloseHandle(file);
+		return false;
+	}
+	m_file = file;
+	m_size = size_t(size.QuadPart);
+	m_open = true;
+	if(m_size == 0)
+	{
+		// Zero-length files cannot be mapped.
+		return true;
+	}
+	m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if(m_mapping != nullptr)
+	{
+		m_data = static_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+	}
+	if(m_data == nullptr)
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::close()
+{
+	if(m_data != nullptr)
+	{
+		UnmapViewOfFile(m_data);
+	}
+	if(m_mapping != nullptr)
+	{
+		CloseHandle(m_mapping);
+	}
+	if(m_file != nullptr)
+	{
+		CloseHandle(m_file);
+	}
+	m_data = nullptr;
+	m_mapping = nullptr;
+	m_file = nullptr;
+	m_size = 0;
+	m_open = false;
+}
+
+void MappedFile::evict(size_t offset, size_t size) const
+{
+	if(m_data == nullptr || offset >= m_size)
+	{
+		return;
+	}
+	// Unlocking pages that are not locked takes them out of the working set.
+	VirtualUnlock(const_cast<uint8_t*>(m_data) + offset, std::min(size, m_size - offset));
+}
+#else
+bool MappedFile::open(const std::string& filename)
+{
+	close();
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if(fd < 0)
+	{
+		return false;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0)
+	{
+		::close(fd);
+		return false;
+	}
+	m_size = size_t(st.st_size);
+	if(m_size > 0)
+	{
+		void* mapped = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(mapped == MAP_FAILED)
+		{
+			::close(fd);
+			m_size = 0;
+			return false;
+		}
+		m_data = static_cast<const uint8_t*>(mapped);
+	}
+	// The mapping keeps its own reference to the file.
+	::close(fd);
+	m_open = true;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if(m_data != nullptr)
+	{
+		munmap(const_cast<uint8_t*>(m_data), m_size);
+	}
+	m_data = nullptr;
+	m_size = 0;
+	m_open = false;
+}
+
+void MappedFile::evict(size_t offset, size_t size) const
+{
+	if(m_data == nullptr || offset >= m_size)
+	{
+		return;
+	}
+	size_t page = size_t(sysconf(_SC_PAGESIZE));
+	size_t begin = (offset + page - 1) / page * page;
+	size_t end = std::min(offset + size, m_size) / page * page;
+	if(begin < end)
+	{
+		// The mapping is private and never written, so nothing is lost.
+		madvise(const_cast<uint8_t*>(m_data) + begin, end - begin, MADV_DONTNEED);
+	}
+}
+#endif
+} // namespace labhelper
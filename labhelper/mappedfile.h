@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace labhelper
+{
+/**
+	* A read-only memory mapping of a whole file. The mapping lives until
+	* close() or destruction; the object can be moved but not copied.
+	*
+	* Example:
+	*	MappedFile file;
+	*	if(file.open("terrain.bin"))
+	*		parse(file.data(), file.size());
+	*/
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	~MappedFile();
+	MappedFile(MappedFile&& other) noexcept;
+	MappedFile& operator=(MappedFile&& other) noexcept;
+
+	/**
+		* Maps filename, closing any previous mapping first. Returns false if the
+		* file does not exist or could not be mapped. An empty file opens fine
+		* with data() == nullptr.
+		*/
+	bool open(const std::string& filename);
+	void close();
+
+	/**
+		* Drops the pages of [offset, offset + size) from memory. They stay
+		* mapped, and are read back from the file the next time they are
+		* touched. Only whole pages inside the range are dropped.
+		*/
+	void evict(size_t offset, size_t size) const;
+
+	bool isOpen() const { return m_open; }
+	const uint8_t* data() const { return m_data; }
+	size_t size() const { return m_size; }
+
+private:
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const uint8_t* m_data = nullptr;
+	size_t m_size = 0;
+	bool m_open = false;
+#ifdef _WIN32
+	void* m_file = nullptr;
+	void* m_mapping = nullptr;
+#endif
+};
+} // namespace labhelper
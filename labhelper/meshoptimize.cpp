@@ -0,0 +1,191 @@
+#include "meshoptimize.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace labhelper
+{
+namespace
+{
+// Constants from the paper.
+const int CACHE_SIZE = 32;
+const float CACHE_DECAY_POWER = 1.5f;
+const float LAST_TRIANGLE_SCORE = 0.75f;
+const float VALENCE_BOOST_SCALE = 2.0f;
+const float VALENCE_BOOST_POWER = 0.5f;
+const int MAX_VALENCE = 32;
+
+struct ScoreTables
+{
+	float cache[CACHE_SIZE];
+	float valence[MAX_VALENCE];
+
+	ScoreTables()
+	{
+		for(int i = 0; i < CACHE_SIZE; i++)
+		{
+			// The three vertices of the last triangle get the same fixed score
+			// so that the next one is not biased by the order within it.
+			cache[i] = i < 3 ? LAST_TRIANGLE_SCORE
+			                 : std::pow(1.0f - float(i - 3) / float(CACHE_SIZE - 3), CACHE_DECAY_POWER);
+		}
+		valence[0] = 0.0f;
+		for(int i = 1; i < MAX_VALENCE; i++)
+		{
+			valence[i] = VALENCE_BOOST_SCALE * std::pow(float(i), -VALENCE_BOOST_POWER);
+		}
+	}
+};
+
+float vertexScore(const ScoreTables& tables, int cache_position, uint32_t remaining_triangles)
+{
+	if(remaining_triangles == 0)
+		return -1.0f;
+	float score = cache_position < 0 ? 0.0f : tables.cache[cache_position];
+	return score + tables.valence[std::min<uint32_t>(remaining_triangles, MAX_VALENCE - 1)];
+}
+} // namespace
+
+void optimizeVertexCache(uint32_t* indices, size_t nof_indices, size_t nof_vertices)
+{
+	size_t nof_triangles = nof_indices / 3;
+	if(nof_triangles == 0)
+		return;
+	static const ScoreTables tables;
+
+	///////////////////////////////////////////////////////////////////////
+	// Triangles using each vertex, as one flat array with offsets
+	///////////////////////////////////////////////////////////////////////
+	std::vector<uint32_t> remaining(nof_vertices, 0);
+	for(size_t i = 0; i < nof_triangles * 3; i++)
+		remaining[indices[i]]++;
+	std::vector<uint32_t> offsets(nof_vertices + 1, 0);
+	for(size_t v = 0; v < nof_vertices; v++)
+		offsets[v + 1] = offsets[v] + remaining[v];
+	std::vector<uint32_t> adjacency(offsets[nof_vertices]);
+	{
+		std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+		for(size_t t = 0; t < nof_triangles; t++)
+			for(int k = 0; k < 3; k++)
+				adjacency[fill[indices[t * 3 + k]]++] = uint32_t(t);
+	}
+
+	std::vector<float> vertex_score(nof_vertices);
+	for(size_t v = 0; v < nof_vertices; v++)
+		vertex_score[v] = vertexScore(tables, -1, remaining[v]);
+	std::vector<float> triangle_score(nof_triangles);
+	for(size_t t = 0; t < nof_triangles; t++)
+		triangle_score[t] = vertex_score[indices[t * 3]] + vertex_score[indices[t * 3 + 1]]
+		                    + vertex_score[indices[t * 3 + 2]];
+	std::vector<bool> emitted(nof_triangles, false);
+
+	std::vector<uint32_t> output;
+	output.reserve(nof_triangles * 3);
+	// Three extra slots hold the vertices pushed out by the newest triangle.
+	std::vector<uint32_t> cache, next_cache;
+	cache.reserve(CACHE_SIZE + 3);
+	next_cache.reserve(CACHE_SIZE + 3);
+
+	size_t scan_cursor = 0;
+	int64_t best = -1;
+	for(size_t emitted_count = 0; emitted_count < nof_triangles; emitted_count++)
+	{
+		if(best < 0)
+		{
+			// Nothing left around the cached vertices: continue with the first
+			// triangle not emitted yet. The cursor only moves forward, which
+			// keeps the whole thing linear.
+			while(emitted[scan_cursor])
+				scan_cursor++;
+			best = int64_t(scan_cursor);
+		}
+
+		///////////////////////////////////////////////////////////////////
+		// Emit the triangle and remove it from its vertices' lists
+		///////////////////////////////////////////////////////////////////
+		const uint32_t* tri = indices + best * 3;
+		emitted[best] = true;
+		output.insert(output.end(), tri, tri + 3);
+		next_cache.clear();
+		for(int k = 0; k < 3; k++)
+		{
+			uint32_t v = tri[k];
+			uint32_t* list = adjacency.data() + offsets[v];
+			uint32_t* end = list + remaining[v];
+			*std::find(list, end, uint32_t(best)) = *(end - 1);
+			remaining[v]--;
+			if(std::find(next_cache.begin(), next_cache.end(), v) == next_cache.end())
+				next_cache.push_back(v);
+		}
+		for(uint32_t v : cache)
+		{
+			if(v != tri[0] && v != tri[1] && v != tri[2])
+				next_cache.push_back(v);
+		}
+		std::swap(cache, next_cache);
+
+		///////////////////////////////////////////////////////////////////
+		// Rescore the cached vertices and pick the best of their triangles
+		///////////////////////////////////////////////////////////////////
+		for(size_t i = 0; i < cache.size(); i++)
+		{
+			uint32_t v = cache[i];
+			int position = i < CACHE_SIZE ? int(i) : -1;
+			float score = vertexScore(tables, position, remaining[v]);
+			float delta = score - vertex_score[v];
+			vertex_score[v] = score;
+			for(uint32_t j = 0; j < remaining[v]; j++)
+				triangle_score[adjacency[offsets[v] + j]] += delta;
+		}
+		if(cache.size() > CACHE_SIZE)
+			cache.resize(CACHE_SIZE);
+
+		best = -1;
+		float best_score = -1.0f;
+		for(uint32_t v : cache)
+		{
+			for(uint32_t j = 0; j < remaining[v]; j++)
+			{
+				uint32_t t = adjacency[offsets[v] + j];
+				if(triangle_score[t] > best_score)
+				{
+					best_score = triangle_score[t];
+					best = t;
+				}
+			}
+		}
+	}
+	std::copy(output.begin(), output.end(), indices);
+}
+
+std::vector<uint32_t> optimizeVertexFetch(uint32_t* indices, size_t nof_indices, size_t nof_vertices)
+{
+	std::vector<uint32_t> remap(nof_vertices, ~0u);
+	uint32_t next = 0;
+	for(size_t i = 0; i < nof_indices; i++)
+	{
+		uint32_t& target = remap[indices[i]];
+		if(target == ~0u)
+			target = next++;
+		indices[i] = target;
+	}
+	return remap;
+}
+
+size_t simulateVertexCache(const uint32_t* indices, size_t nof_indices, size_t nof_vertices, int cache_size)
+{
+	// A vertex is in the FIFO if it was shaded less than cache_size misses ago.
+	std::vector<size_t> shaded_at(nof_vertices, 0);
+	size_t misses = 0;
+	for(size_t i = 0; i < nof_indices; i++)
+	{
+		size_t& at = shaded_at[indices[i]];
+		if(at == 0 || misses - at >= size_t(cache_size))
+		{
+			misses++;
+			at = misses;
+		}
+	}
+	return misses;
+}
+} // namespace labhelper
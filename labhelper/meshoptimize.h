@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace labhelper
+{
+/**
+	* Index buffer optimisations for triangle lists.
+	*
+	* Typical use, after deduplicating the vertices:
+	*	optimizeVertexCache(indices.data(), indices.size(), nof_vertices);
+	*	std::vector<uint32_t> remap = optimizeVertexFetch(indices.data(), indices.size(), nof_vertices);
+	*	...move vertex i to remap[i] in every vertex stream...
+	*/
+
+/**
+	* Reorders the triangles for post-transform vertex cache locality, using
+	* Tom Forsyth's "Linear-Speed Vertex Cache Optimisation" (a 32 entry LRU
+	* model that also works well for the FIFO caches of real GPUs). The set
+	* of triangles and their winding is unchanged.
+	*/
+void optimizeVertexCache(uint32_t* indices, size_t nof_indices, size_t nof_vertices);
+
+/**
+	* Renumbers the vertices in the order the index buffer first uses them, so
+	* that vertex fetches walk through memory linearly. Rewrites the indices
+	* and returns the old -> new mapping (~0u for vertices that are unused).
+	*/
+std::vector<uint32_t> optimizeVertexFetch(uint32_t* indices, size_t nof_indices, size_t nof_vertices);
+
+/**
+	* Counts the vertex shader invocations for drawing indices with a FIFO
+	* post-transform cache of the given size.
+	*/
+size_t simulateVertexCache(const uint32_t* indices, size_t nof_indices, size_t nof_vertices, int cache_size = 16);
+} // namespace labhelper
@@ -0,0 +1,320 @@
+#include "multidraw.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <GL/glew.h>
+
+#include "Model.h"
+#include "simd.h"
+
+namespace labhelper
+{
+namespace
+{
+struct ModelRange
+{
+	int32_t baseVertex;
+	uint32_t firstIndex;
+	uint32_t firstMaterial;
+};
+
+struct Entry
+{
+	uint32_t colorTexture, emissionTexture;
+	glm::vec4 sphere;
+	uint32_t count, firstIndex;
+	int32_t baseVertex;
+	glm::mat4 modelMatrix;
+	uint32_t material;
+};
+
+int laneMask(size_t count)
+{
+	return count >= 4 ? 0xf : (1 << count) - 1;
+}
+
+template<typename T>
+uint32_t createBuffer(GLenum target, const std::vector<T>& data, GLenum usage)
+{
+	uint32_t buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(target, buffer);
+	glBufferData(target, data.size() * sizeof(T), data.empty() ? nullptr : data.data(), usage);
+	glBindBuffer(target, 0);
+	return buffer;
+}
+} // namespace
+
+MultiDrawBatch::~MultiDrawBatch()
+{
+	glDeleteVertexArrays(1, &vertexArray);
+	uint32_t buffers[] = { positionBuffer, normalBuffer, texCoordBuffer, indexBuffer,
+		                   drawIdBuffer,   recordBuffer, materialBuffer, commandBuffer };
+	glDeleteBuffers(8, buffers);
+}
+
+bool MultiDrawBatch::isSupported()
+{
+	return GLEW_VERSION_4_3 || (GLEW_ARB_shader_storage_buffer_object && GLEW_ARB_base_instance);
+}
+
+bool MultiDrawBatch::isMultiDrawSupported()
+{
+	return GLEW_VERSION_4_3 || GLEW_ARB_multi_draw_indirect;
+}
+
+bool MultiDrawBatch::add(const Model* model, const glm::mat4& modelMatrix)
+{
+	if(model->m_indices.empty())
+	{
+		return false;
+	}
+	copies.push_back({ model, modelMatrix });
+	return true;
+}
+
+void MultiDrawBatch::build()
+{
+	// Each distinct model once, in the order they were first added
+	std::map<const Model*, ModelRange> ranges;
+	std::vector<glm::vec3> positions, normals;
+	std::vector<glm::vec2> texCoords;
+	std::vector<uint32_t> indices;
+	std::vector<GpuMaterial> materials;
+	std::vector<Entry> entries;
+	for(const Copy& copy : copies)
+	{
+		const Model* model = copy.model;
+		auto found = ranges.find(model);
+		if(found == ranges.end())
+		{
+			ModelRange range = { int32_t(positions.size()), uint32_t(indices.size()),
+				                 uint32_t(materials.size()) };
+			found = ranges.emplace(model, range).first;
+			positions.insert(positions.end(), model->m_positions.begin(), model->m_positions.end());
+			normals.insert(normals.end(), model->m_normals.begin(), model->m_normals.end());
+			normals.resize(positions.size(), glm::vec3(0.0f, 1.0f, 0.0f));
+			texCoords.insert(texCoords.end(), model->m_texture_coordinates.begin(),
+			                 model->m_texture_coordinates.end());
+			texCoords.resize(positions.size(), glm::vec2(0.0f));
+			indices.insert(indices.end(), model->m_indices.begin(), model->m_indices.end());
+			for(const Material& m : model->m_materials)
+			{
+				GpuMaterial material = {};
+				material.colorMetalness = glm::vec4(m.m_color, m.m_metalness);
+				material.emissionFresnel = glm::vec4(m.m_color * m.m_emission, m.m_fresnel);
+				material.shininess = m.m_shininess;
+				material.hasColorTexture = m.m_color_texture.valid ? 1 : 0;
+				material.hasEmissionTexture = m.m_emission_texture.valid ? 1 : 0;
+				materials.push_back(material);
+			}
+		}
+		const ModelRange& range = found->second;
+
+		// A sphere around each mesh's bounding box, scaled by the longest
+		// axis of the matrix
+		float scale = std::max(glm::length(glm::vec3(copy.modelMatrix[0])),
+		                       std::max(glm::length(glm::vec3(copy.modelMatrix[1])),
+		                                glm::length(glm::vec3(copy.modelMatrix[2]))));
+		for(const Mesh& mesh : model->m_meshes)
+		{
+			if(mesh.m_number_of_vertices == 0)
+			{
+				continue;
+			}
+			glm::vec3 low(1e30f), high(-1e30f);
+			for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+			{
+				const glm::vec3& p = model->m_positions[model->m_indices[mesh.m_start_index + i]];
+				low = glm::min(low, p);
+				high = glm::max(high, p);
+			}
+			glm::vec3 centre = (low + high) * 0.5f;
+			const Material& m = model->m_materials[mesh.m_material_idx];
+			Entry entry;
+			entry.colorTexture = m.m_color_texture.valid ? m.m_color_texture.gl_id : 0;
+			entry.emissionTexture = m.m_emission_texture.valid ? m.m_emission_texture.gl_id : 0;
+			entry.sphere = glm::vec4(glm::vec3(copy.modelMatrix * glm::vec4(centre, 1.0f)),
+			                         glm::length(high - centre) * scale);
+			entry.count = mesh.m_number_of_vertices;
+			entry.firstIndex = range.firstIndex + mesh.m_start_index;
+			entry.baseVertex = range.baseVertex;
+			entry.modelMatrix = copy.modelMatrix;
+			entry.material = range.firstMaterial + mesh.m_material_idx;
+			entries.push_back(entry);
+		}
+	}
+	std::stable_sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+		return a.colorTexture != b.colorTexture ? a.colorTexture < b.colorTexture
+		                                        : a.emissionTexture < b.emissionTexture;
+	});
+
+	// The record index is the baseInstance of its command
+	std::vector<GpuRecord> gpuRecords(entries.size());
+	records.resize(entries.size());
+	size_t padded = entries.size() + 3;
+	centreX.assign(padded, 0.0f);
+	centreY.assign(padded, 0.0f);
+	centreZ.assign(padded, 0.0f);
+	radius.assign(padded, 0.0f);
+	groups.clear();
+	for(size_t i = 0; i < entries.size(); i++)
+	{
+		const Entry& e = entries[i];
+		if(groups.empty() || groups.back().colorTexture != e.colorTexture
+		   || groups.back().emissionTexture != e.emissionTexture)
+		{
+			groups.push_back({ e.colorTexture, e.emissionTexture, i, 0, 0 });
+		}
+		groups.back().count++;
+		records[i] = { e.count, 1, e.firstIndex, e.baseVertex, uint32_t(i) };
+		gpuRecords[i].modelMatrix = e.modelMatrix;
+		gpuRecords[i].normalMatrix = glm::transpose(glm::inverse(e.modelMatrix));
+		gpuRecords[i].material = e.material;
+		centreX[i] = e.sphere.x;
+		centreY[i] = e.sphere.y;
+		centreZ[i] = e.sphere.z;
+		radius[i] = e.sphere.w;
+	}
+	std::vector<uint32_t> drawIds(entries.size());
+	for(size_t i = 0; i < drawIds.size(); i++)
+	{
+		drawIds[i] = uint32_t(i);
+	}
+	commands = records;
+
+	positionBuffer = createBuffer(GL_ARRAY_BUFFER, positions, GL_STATIC_DRAW);
+	normalBuffer = createBuffer(GL_ARRAY_BUFFER, normals, GL_STATIC_DRAW);
+	texCoordBuffer = createBuffer(GL_ARRAY_BUFFER, texCoords, GL_STATIC_DRAW);
+	drawIdBuffer = createBuffer(GL_ARRAY_BUFFER, drawIds, GL_STATIC_DRAW);
+	indexBuffer = createBuffer(GL_ELEMENT_ARRAY_BUFFER, indices, GL_STATIC_DRAW);
+	recordBuffer = createBuffer(GL_SHADER_STORAGE_BUFFER, gpuRecords, GL_STATIC_DRAW);
+	materialBuffer = createBuffer(GL_SHADER_STORAGE_BUFFER, materials, GL_STATIC_DRAW);
+	commandBuffer = createBuffer(GL_DRAW_INDIRECT_BUFFER, commands, GL_STREAM_DRAW);
+
+	glGenVertexArrays(1, &vertexArray);
+	glBindVertexArray(vertexArray);
+	glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
+	glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0);
+	glEnableVertexAttribArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, normalBuffer);
+	glVertexAttribPointer(1, 3, GL_FLOAT, false, 0, 0);
+	glEnableVertexAttribArray(1);
+	glBindBuffer(GL_ARRAY_BUFFER, texCoordBuffer);
+	glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
+	glEnableVertexAttribArray(2);
+	glBindBuffer(GL_ARRAY_BUFFER, drawIdBuffer);
+	glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, 0, 0);
+	glVertexAttribDivisor(3, 1);
+	glEnableVertexAttribArray(3);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void MultiDrawBatch::cull(const glm::mat4& viewProjectionMatrix)
+{
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	// Planes with the normals pointing in, from the rows of the matrix
+	glm::mat4 m = glm::transpose(viewProjectionMatrix);
+	glm::vec4 planes[6] = { m[3] + m[0], m[3] - m[0], m[3] + m[1], m[3] - m[1], m[3] + m[2], m[3] - m[2] };
+	for(glm::vec4& plane : planes)
+	{
+		plane /= glm::length(glm::vec3(plane));
+	}
+
+	// The visible commands of each group are packed at its start
+	visible = 0;
+	for(Group& group : groups)
+	{
+		group.visible = 0;
+		size_t end = group.first + group.count;
+		for(size_t i = group.first; i < end; i += 4)
+		{
+			simd::float4 x = simd::load(&centreX[i]);
+			simd::float4 y = simd::load(&centreY[i]);
+			simd::float4 z = simd::load(&centreZ[i]);
+			simd::float4 r = simd::load(&radius[i]);
+			int inside = laneMask(end - i);
+			for(int p = 0; p < 6 && inside != 0; p++)
+			{
+				simd::float4 distance = x * simd::splat(planes[p].x) + y * simd::splat(planes[p].y)
+				                        + z * simd::splat(planes[p].z) + simd::splat(planes[p].w);
+				inside &= simd::movemask(distance > -r);
+			}
+			for(int lane = 0; lane < 4; lane++)
+			{
+				if(inside & (1 << lane))
+				{
+					commands[group.first + group.visible++] = records[i + lane];
+				}
+			}
+		}
+		visible += group.visible;
+	}
+
+	// Orphaned every frame, so that the driver need not wait for the last
+	// frame's draws
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(Command), commands.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+	std::chrono::duration<float, std::milli> elapsed = std::chrono::high_resolution_clock::now() - startTime;
+	cullMs = elapsed.count();
+}
+
+void MultiDrawBatch::draw(bool multiDraw)
+{
+	auto startTime = std::chrono::high_resolution_clock::now();
+	multiDraw = multiDraw && isMultiDrawSupported();
+
+	glBindVertexArray(vertexArray);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, recordBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, materialBuffer);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+	drawCalls = 0;
+	for(const Group& group : groups)
+	{
+		if(group.visible == 0)
+		{
+			continue;
+		}
+		// The same units as render()
+		if(group.colorTexture != 0)
+		{
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, group.colorTexture);
+		}
+		if(group.emissionTexture != 0)
+		{
+			glActiveTexture(GL_TEXTURE5);
+			glBindTexture(GL_TEXTURE_2D, group.emissionTexture);
+		}
+		glActiveTexture(GL_TEXTURE0);
+		if(multiDraw)
+		{
+			glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+			                            (const void*)(group.first * sizeof(Command)),
+			                            GLsizei(group.visible), 0);
+			drawCalls++;
+			continue;
+		}
+		for(size_t i = group.first; i < group.first + group.visible; i++)
+		{
+			const Command& c = commands[i];
+			glDrawElementsInstancedBaseVertexBaseInstance(
+			        GL_TRIANGLES, GLsizei(c.count), GL_UNSIGNED_INT,
+			        (const void*)(size_t(c.firstIndex) * sizeof(uint32_t)), 1, c.baseVertex,
+			        c.baseInstance);
+			drawCalls++;
+		}
+	}
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	glBindVertexArray(0);
+
+	std::chrono::duration<float, std::milli> elapsed = std::chrono::high_resolution_clock::now() - startTime;
+	drawMs = elapsed.count();
+}
+} // namespace labhelper
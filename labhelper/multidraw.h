@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+namespace labhelper
+{
+class Model;
+
+/**
+	* Static copies of models drawn with a few glMultiDrawElementsIndirect
+	* calls instead of one draw per mesh as in render().
+	*
+	* build() copies the geometry of every distinct model once into shared
+	* vertex and index buffers, and makes one draw record per mesh of each copy:
+	* its model matrix and the index of its material, kept in shader storage
+	* buffers along with the materials (see scene.vert/frag for the layout).
+	* Each frame cull() tests the bounding spheres of the records against the
+	* frustum on the CPU and writes the commands of the visible ones into the
+	* indirect buffer. Every command draws one instance starting at its record's
+	* index, and a per instance attribute holding 0, 1, 2... turns that
+	* baseInstance into the record index in the shaders (gl_DrawID needs
+	* GL 4.6).
+	*
+	* Textures cannot be switched within a multi-draw, so the records are
+	* grouped by their material's color and emission textures, and draw()
+	* makes one call per group that has anything visible.
+	*
+	* Example:
+	*	MultiDrawBatch batch;
+	*	batch.add(ship, translate(vec3(0, 10, 0)));
+	*	batch.build();
+	*	...
+	*	batch.cull(projectionMatrix * viewMatrix);
+	*	glUseProgram(sceneProgram); // scene.vert/frag
+	*	batch.draw(true);
+	*/
+class MultiDrawBatch
+{
+public:
+	MultiDrawBatch() = default;
+	~MultiDrawBatch();
+
+	/**
+		* Adds a copy of model, which must be indexed as loaded by
+		* loadModelFromOBJ() and outlive the batch, at modelMatrix. Returns
+		* false, and adds nothing, for models without indices. Only copies
+		* added before build() are drawn.
+		*/
+	bool add(const Model* model, const glm::mat4& modelMatrix);
+
+	/**
+		* Uploads the shared buffers, records and materials. Needs a GL context
+		* with isSupported().
+		*/
+	void build();
+
+	/**
+		* Picks the records whose bounding spheres touch the frustum and uploads
+		* their commands.
+		*/
+	void cull(const glm::mat4& viewProjectionMatrix);
+
+	/**
+		* Draws what the last cull() picked with the current program, with one
+		* glMultiDrawElementsIndirect per group of textures, or with one
+		* glDrawElementsInstancedBaseVertexBaseInstance per record if multiDraw
+		* is false (to compare with, or where indirect draws are missing).
+		*/
+	void draw(bool multiDraw);
+
+	/**
+		* Shader storage buffers and glDrawElementsInstancedBaseVertexBaseInstance
+		* (GL 4.3). Multi-draws also need isMultiDrawSupported().
+		*/
+	static bool isSupported();
+	static bool isMultiDrawSupported();
+
+	size_t getRecordCount() const { return records.size(); }
+	size_t getVisible() const { return visible; }
+	int getDrawCalls() const { return drawCalls; }
+	/**
+		* CPU time of the last cull() and draw(), including the upload of the
+		* commands.
+		*/
+	float getSubmitMs() const { return cullMs + drawMs; }
+
+private:
+	MultiDrawBatch(const MultiDrawBatch&) = delete;
+	MultiDrawBatch& operator=(const MultiDrawBatch&) = delete;
+
+	/**
+		* The layouts of scene.vert/frag's std430 buffers, and of the indirect
+		* commands GL reads.
+		*/
+	struct GpuRecord
+	{
+		glm::mat4 modelMatrix;
+		glm::mat4 normalMatrix;
+		uint32_t material;
+		uint32_t padding[3];
+	};
+	struct GpuMaterial
+	{
+		glm::vec4 colorMetalness;
+		glm::vec4 emissionFresnel; // Emission times the color, as in the labs
+		float shininess;
+		int32_t hasColorTexture;
+		int32_t hasEmissionTexture;
+		float padding;
+	};
+	struct Command
+	{
+		uint32_t count;
+		uint32_t instanceCount;
+		uint32_t firstIndex;
+		int32_t baseVertex;
+		uint32_t baseInstance;
+	};
+	struct Copy
+	{
+		const Model* model;
+		glm::mat4 modelMatrix;
+	};
+	struct Group
+	{
+		uint32_t colorTexture, emissionTexture;
+		size_t first, count; // Records, which are sorted by group
+		size_t visible;
+	};
+
+	std::vector<Copy> copies;
+	std::vector<Command> records;
+	std::vector<Group> groups;
+	// Bounding spheres of the records, with three entries of padding for the
+	// loops that take four at a time
+	std::vector<float> centreX, centreY, centreZ, radius;
+	std::vector<Command> commands;
+
+	uint32_t vertexArray = 0;
+	uint32_t positionBuffer = 0, normalBuffer = 0, texCoordBuffer = 0;
+	uint32_t indexBuffer = 0, drawIdBuffer = 0;
+	uint32_t recordBuffer = 0, materialBuffer = 0, commandBuffer = 0;
+
+	size_t visible = 0;
+	int drawCalls = 0;
+	float cullMs = 0.0f, drawMs = 0.0f;
+};
+} // namespace labhelper
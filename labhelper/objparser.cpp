@@ -0,0 +1,656 @@
+#include "objparser.h"
+#include "mappedfile.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+namespace labhelper
+{
+namespace
+{
+// Smaller files are not worth splitting.
+const size_t MIN_CHUNK_SIZE = 256 * 1024;
+
+///////////////////////////////////////////////////////////////////////////////
+// Line level parsing. A line is [token, end) without its terminator. The
+// character at end is always readable (the terminator itself, or the NUL of
+// a copied last line) and is never a space, digit, '/' or sign, so the
+// checks below may look at it but never past it.
+///////////////////////////////////////////////////////////////////////////////
+inline bool isSpace(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+inline bool isDigit(char c)
+{
+	return unsigned(c - '0') < 10u;
+}
+
+// Any whitespace, as in scanf("%s").
+inline bool isWhitespace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\v' || c == '\f' || c == '\r' || c == '\n';
+}
+
+inline const char* skipSpace(const char* token, const char* end)
+{
+	while(token < end && isSpace(*token))
+		token++;
+	return token;
+}
+
+inline const char* skipToSpace(const char* token, const char* end)
+{
+	while(token < end && !isSpace(*token))
+		token++;
+	return token;
+}
+
+inline const char* skipToSpaceOrSlash(const char* token, const char* end)
+{
+	while(token < end && !isSpace(*token) && *token != '/')
+		token++;
+	return token;
+}
+
+// The first whitespace delimited word after token, like scanf("%s").
+std::string parseWord(const char* token, const char* end)
+{
+	while(token < end && isWhitespace(*token))
+		token++;
+	const char* word = token;
+	while(token < end && !isWhitespace(*token))
+		token++;
+	return std::string(word, token);
+}
+
+// atoi() that stops at end.
+int parseInt(const char* token, const char* end)
+{
+	while(token < end && (isWhitespace(*token)))
+		token++;
+	bool negative = false;
+	if(token < end && (*token == '+' || *token == '-'))
+		negative = *token++ == '-';
+	int value = 0;
+	while(token < end && isDigit(*token))
+		value = value * 10 + (*token++ - '0');
+	return negative ? -value : value;
+}
+
+// tinyobj's tryParseDouble(). The digits are accumulated with exactly the
+// same double arithmetic so that both parsers produce the same floats.
+bool parseDouble(const char* s, const char* s_end, double& result)
+{
+	if(s >= s_end)
+		return false;
+
+	double mantissa = 0.0;
+	int exponent = 0;
+	char sign = '+';
+	char exp_sign = '+';
+	const char* curr = s;
+
+	if(*curr == '+' || *curr == '-')
+		sign = *curr++;
+	else if(!isDigit(*curr))
+		return false;
+
+	int read = 0;
+	while(curr != s_end && isDigit(*curr))
+	{
+		mantissa *= 10;
+		mantissa += int(*curr - '0');
+		curr++;
+		read++;
+	}
+	if(read == 0)
+		return false;
+
+	if(curr != s_end)
+	{
+		if(*curr == '.')
+		{
+			static const double pow_lut[] = { 1.0, 0.1, 0.01, 0.001, 0.0001, 0.00001, 0.000001, 0.0000001 };
+			const int lut_entries = sizeof(pow_lut) / sizeof(pow_lut[0]);
+			curr++;
+			read = 1;
+			while(curr != s_end && isDigit(*curr))
+			{
+				mantissa += int(*curr - '0') * (read < lut_entries ? pow_lut[read] : std::pow(10.0, -read));
+				read++;
+				curr++;
+			}
+		}
+		if(curr != s_end && (*curr == 'e' || *curr == 'E'))
+		{
+			curr++;
+			if(curr != s_end && (*curr == '+' || *curr == '-'))
+				exp_sign = *curr++;
+			else if(!isDigit(*curr))
+				return false;
+			read = 0;
+			while(curr != s_end && isDigit(*curr))
+			{
+				exponent *= 10;
+				exponent += int(*curr - '0');
+				curr++;
+				read++;
+			}
+			exponent *= exp_sign == '+' ? 1 : -1;
+			if(read == 0)
+				return false;
+		}
+	}
+
+	result = (sign == '+' ? 1 : -1)
+	         * (exponent ? std::ldexp(mantissa * std::pow(5.0, exponent), exponent) : mantissa);
+	return true;
+}
+
+inline float parseReal(const char*& token, const char* end)
+{
+	token = skipSpace(token, end);
+	const char* number_end = skipToSpace(token, end);
+	double value = 0.0;
+	parseDouble(token, number_end, value);
+	token = number_end;
+	return float(value);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// What one chunk of the file contains
+///////////////////////////////////////////////////////////////////////////////
+enum class StatementType
+{
+	UseMaterial,
+	MaterialLibrary,
+	Group,
+	Object
+};
+
+// A statement that affects how faces are grouped into shapes, and how many
+// triangles and faces of the chunk came before it.
+struct Statement
+{
+	StatementType type;
+	size_t triangle;
+	size_t face;
+	std::string argument;
+};
+
+struct Chunk
+{
+	const char* begin;
+	const char* end;
+	// The last line of the file, if it has no terminator.
+	const std::string* tail = nullptr;
+
+	std::vector<float> positions, normals, texcoords;
+	// Three per triangle.
+	std::vector<tinyobj::index_t> indices;
+	std::vector<Statement> statements;
+	// Faces with less than three vertices produce no triangles, but still
+	// count when deciding whether a group is empty.
+	size_t nof_faces = 0;
+	// Negative (relative) indices are resolved against the chunk's own vertex
+	// counts while parsing. These are the slots (index * 3 + component) that
+	// still need the vertex counts of the previous chunks added.
+	std::vector<size_t> relative;
+};
+
+// Index and the bits of the components that are relative.
+struct FaceVertex
+{
+	tinyobj::index_t index;
+	int relative;
+};
+
+int fixIndex(int index, int count, int component, FaceVertex& vertex)
+{
+	if(index > 0)
+		return index - 1;
+	if(index == 0)
+		return 0;
+	vertex.relative |= 1 << component;
+	return count + index;
+}
+
+// Parses i, i/j, i//k or i/j/k.
+FaceVertex parseFaceVertex(const char*& token, const char* end, const Chunk& chunk)
+{
+	FaceVertex vertex = { { -1, -1, -1 }, 0 };
+	int nof_positions = int(chunk.positions.size() / 3);
+	int nof_normals = int(chunk.normals.size() / 3);
+	int nof_texcoords = int(chunk.texcoords.size() / 2);
+
+	vertex.index.vertex_index = fixIndex(parseInt(token, end), nof_positions, 0, vertex);
+	token = skipToSpaceOrSlash(token, end);
+	if(token == end || *token != '/')
+		return vertex;
+	token++;
+	if(token < end && *token == '/')
+	{
+		token++;
+		vertex.index.normal_index = fixIndex(parseInt(token, end), nof_normals, 1, vertex);
+		token = skipToSpaceOrSlash(token, end);
+		return vertex;
+	}
+	vertex.index.texcoord_index = fixIndex(parseInt(token, end), nof_texcoords, 2, vertex);
+	token = skipToSpaceOrSlash(token, end);
+	if(token == end || *token != '/')
+		return vertex;
+	token++;
+	vertex.index.normal_index = fixIndex(parseInt(token, end), nof_normals, 1, vertex);
+	token = skipToSpaceOrSlash(token, end);
+	return vertex;
+}
+
+void addTriangleVertex(const FaceVertex& vertex, Chunk& chunk)
+{
+	if(vertex.relative != 0)
+	{
+		for(int component = 0; component < 3; component++)
+			if(vertex.relative & (1 << component))
+				chunk.relative.push_back(chunk.indices.size() * 3 + component);
+	}
+	chunk.indices.push_back(vertex.index);
+}
+
+void parseLine(const char* token, const char* end, Chunk& chunk, std::vector<FaceVertex>& face)
+{
+	token = skipSpace(token, end);
+	if(token == end || token[0] == '#')
+		return;
+
+	if(token[0] == 'v' && isSpace(token[1]))
+	{
+		token += 2;
+		for(int i = 0; i < 3; i++)
+			chunk.positions.push_back(parseReal(token, end));
+		return;
+	}
+	if(token[0] == 'v' && token[1] == 'n' && isSpace(token[2]))
+	{
+		token += 3;
+		for(int i = 0; i < 3; i++)
+			chunk.normals.push_back(parseReal(token, end));
+		return;
+	}
+	if(token[0] == 'v' && token[1] == 't' && isSpace(token[2]))
+	{
+		token += 3;
+		for(int i = 0; i < 2; i++)
+			chunk.texcoords.push_back(parseReal(token, end));
+		return;
+	}
+
+	if(token[0] == 'f' && isSpace(token[1]))
+	{
+		token = skipSpace(token + 2, end);
+		face.clear();
+		while(token < end)
+		{
+			face.push_back(parseFaceVertex(token, end, chunk));
+			token = skipSpace(token, end);
+		}
+		// Triangle fan, like tinyobj's triangulation
+		for(size_t k = 2; k < face.size(); k++)
+		{
+			addTriangleVertex(face[0], chunk);
+			addTriangleVertex(face[k - 1], chunk);
+			addTriangleVertex(face[k], chunk);
+		}
+		chunk.nof_faces++;
+		return;
+	}
+
+	Statement statement = { StatementType::UseMaterial, chunk.indices.size() / 3, chunk.nof_faces, std::string() };
+	if(strncmp(token, "usemtl", 6) == 0 && isSpace(token[6]))
+	{
+		statement.argument = parseWord(token + 7, end);
+	}
+	else if(strncmp(token, "mtllib", 6) == 0 && isSpace(token[6]))
+	{
+		statement.type = StatementType::MaterialLibrary;
+		statement.argument = std::string(token + 7, end);
+	}
+	else if(token[0] == 'g' && isSpace(token[1]))
+	{
+		statement.type = StatementType::Group;
+		const char* name = skipSpace(token + 1, end);
+		statement.argument = std::string(name, skipToSpace(name, end));
+	}
+	else if(token[0] == 'o' && isSpace(token[1]))
+	{
+		statement.type = StatementType::Object;
+		statement.argument = parseWord(token + 2, end);
+	}
+	else
+	{
+		// Tags and unknown statements are ignored.
+		return;
+	}
+	chunk.statements.push_back(std::move(statement));
+}
+
+void parseChunk(Chunk& chunk)
+{
+	std::vector<FaceVertex> face;
+	const char* line = chunk.begin;
+	while(line < chunk.end)
+	{
+		// Like tinyobj, a lone '\r' ends a line too. The '\n' after a '\r'
+		// gives an empty line that is skipped.
+		const char* line_end = line;
+		while(line_end < chunk.end && *line_end != '\n' && *line_end != '\r')
+			line_end++;
+		parseLine(line, line_end, chunk, face);
+		line = line_end + 1;
+	}
+	if(chunk.tail != nullptr)
+		parseLine(chunk.tail->c_str(), chunk.tail->c_str() + chunk.tail->size(), chunk, face);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Merging the chunks, following the grouping rules of tinyobj::LoadObj():
+// faces are collected until a statement ends the group. A usemtl that
+// changes the material moves them into the current shape; g and o move
+// them there and start a new shape, discarding the current one if no faces
+// were collected since the last statement.
+///////////////////////////////////////////////////////////////////////////////
+struct TriangleRange
+{
+	const Chunk* chunk;
+	size_t begin, end;
+};
+
+class ShapeBuilder
+{
+public:
+	ShapeBuilder(std::vector<tinyobj::shape_t>& shapes, std::vector<tinyobj::material_t>& materials,
+	             const std::string& mtlDirectory, std::string& err)
+	    : m_shapes(shapes), m_materials(materials), m_reader(mtlDirectory), m_err(err)
+	{
+	}
+
+	void addFaces(const Chunk& chunk, size_t triangle_begin, size_t triangle_end, size_t nof_faces)
+	{
+		if(triangle_end > triangle_begin)
+			m_pending.push_back({ &chunk, triangle_begin, triangle_end });
+		m_nof_pending_faces += nof_faces;
+	}
+
+	void addStatement(const Statement& statement)
+	{
+		switch(statement.type)
+		{
+		case StatementType::UseMaterial:
+		{
+			auto it = m_material_map.find(statement.argument);
+			int material = it != m_material_map.end() ? it->second : -1;
+			if(material != m_material)
+			{
+				exportPending();
+				m_material = material;
+			}
+			break;
+		}
+		case StatementType::MaterialLibrary:
+			loadMaterialLibrary(statement.argument);
+			break;
+		case StatementType::Group:
+		case StatementType::Object:
+			if(exportPending())
+				m_shapes.push_back(std::move(m_shape));
+			m_shape = tinyobj::shape_t();
+			m_name = statement.argument;
+			break;
+		}
+	}
+
+	void finish()
+	{
+		if(exportPending() || !m_shape.mesh.indices.empty())
+			m_shapes.push_back(std::move(m_shape));
+	}
+
+private:
+	bool exportPending()
+	{
+		if(m_nof_pending_faces == 0)
+			return false;
+		tinyobj::mesh_t& mesh = m_shape.mesh;
+		for(const TriangleRange& range : m_pending)
+		{
+			const tinyobj::index_t* indices = range.chunk->indices.data();
+			mesh.indices.insert(mesh.indices.end(), indices + range.begin * 3, indices + range.end * 3);
+			mesh.num_face_vertices.insert(mesh.num_face_vertices.end(), range.end - range.begin, 3);
+			mesh.material_ids.insert(mesh.material_ids.end(), range.end - range.begin, m_material);
+		}
+		m_shape.name = m_name;
+		m_pending.clear();
+		m_nof_pending_faces = 0;
+		return true;
+	}
+
+	void loadMaterialLibrary(const std::string& arguments)
+	{
+		std::vector<std::string> filenames;
+		std::stringstream ss(arguments);
+		std::string filename;
+		while(std::getline(ss, filename, ' '))
+			filenames.push_back(filename);
+		if(filenames.empty())
+		{
+			m_err += "WARN: Looks like empty filename for mtllib. Use default material. \n";
+			return;
+		}
+		for(const std::string& name : filenames)
+		{
+			std::string err_mtl;
+			bool ok = m_reader(name, &m_materials, &m_material_map, &err_mtl);
+			m_err += err_mtl;
+			if(ok)
+				return;
+		}
+		m_err += "WARN: Failed to load material file(s). Use default material.\n";
+	}
+
+	std::vector<tinyobj::shape_t>& m_shapes;
+	std::vector<tinyobj::material_t>& m_materials;
+	tinyobj::MaterialFileReader m_reader;
+	std::string& m_err;
+
+	std::map<std::string, int> m_material_map;
+	int m_material = -1;
+	std::string m_name;
+	tinyobj::shape_t m_shape;
+	std::vector<TriangleRange> m_pending;
+	size_t m_nof_pending_faces = 0;
+};
+
+bool sameAttributes(const tinyobj::attrib_t& a, const tinyobj::attrib_t& b)
+{
+	return a.vertices == b.vertices && a.normals == b.normals && a.texcoords == b.texcoords;
+}
+
+bool sameShapes(const std::vector<tinyobj::shape_t>& a, const std::vector<tinyobj::shape_t>& b)
+{
+	if(a.size() != b.size())
+		return false;
+	for(size_t i = 0; i < a.size(); i++)
+	{
+		const tinyobj::mesh_t& ma = a[i].mesh;
+		const tinyobj::mesh_t& mb = b[i].mesh;
+		if(a[i].name != b[i].name || ma.indices.size() != mb.indices.size()
+		   || ma.num_face_vertices != mb.num_face_vertices || ma.material_ids != mb.material_ids)
+			return false;
+		for(size_t j = 0; j < ma.indices.size(); j++)
+		{
+			if(ma.indices[j].vertex_index != mb.indices[j].vertex_index
+			   || ma.indices[j].normal_index != mb.indices[j].normal_index
+			   || ma.indices[j].texcoord_index != mb.indices[j].texcoord_index)
+				return false;
+		}
+	}
+	return true;
+}
+} // namespace
+
+bool parseObj(const std::string& filename, const std::string& mtlDirectory, tinyobj::attrib_t& attrib,
+              std::vector<tinyobj::shape_t>& shapes, std::vector<tinyobj::material_t>& materials,
+              std::string& err)
+{
+	attrib = tinyobj::attrib_t();
+	shapes.clear();
+
+	MappedFile file;
+	if(!file.open(filename))
+	{
+		err += "Cannot open file [" + filename + "]\n";
+		return false;
+	}
+	const char* data = reinterpret_cast<const char*>(file.data());
+	size_t size = file.size();
+
+	///////////////////////////////////////////////////////////////////////
+	// Cut the file into chunks that end with a line terminator, and copy
+	// an unterminated last line so that it gets one too.
+	///////////////////////////////////////////////////////////////////////
+	size_t body_size = size;
+	while(body_size > 0 && data[body_size - 1] != '\n' && data[body_size - 1] != '\r')
+		body_size--;
+	std::string tail(data + body_size, data + size);
+
+	ThreadPool& pool = ThreadPool::global();
+	size_t nof_chunks = std::max<size_t>(1, std::min<size_t>(body_size / MIN_CHUNK_SIZE, (pool.size() + 1) * 4));
+	std::vector<Chunk> chunks(nof_chunks);
+	size_t chunk_begin = 0;
+	for(size_t i = 0; i < nof_chunks; i++)
+	{
+		size_t chunk_end = body_size * (i + 1) / nof_chunks;
+		chunk_end = std::max(chunk_end, chunk_begin);
+		while(chunk_end < body_size && data[chunk_end - 1] != '\n' && data[chunk_end - 1] != '\r')
+			chunk_end++;
+		chunks[i].begin = data + chunk_begin;
+		chunks[i].end = data + chunk_end;
+		chunk_begin = chunk_end;
+	}
+	if(!tail.empty())
+		chunks.back().tail = &tail;
+
+	pool.parallelFor(0, int(nof_chunks), [&](int begin, int end) {
+		for(int i = begin; i < end; i++)
+			parseChunk(chunks[i]);
+	});
+
+	///////////////////////////////////////////////////////////////////////
+	// Concatenate the vertex data, and offset relative indices by the
+	// vertices of the chunks before them
+	///////////////////////////////////////////////////////////////////////
+	std::vector<size_t> position_offsets(nof_chunks + 1, 0);
+	std::vector<size_t> normal_offsets(nof_chunks + 1, 0);
+	std::vector<size_t> texcoord_offsets(nof_chunks + 1, 0);
+	for(size_t i = 0; i < nof_chunks; i++)
+	{
+		position_offsets[i + 1] = position_offsets[i] + chunks[i].positions.size();
+		normal_offsets[i + 1] = normal_offsets[i] + chunks[i].normals.size();
+		texcoord_offsets[i + 1] = texcoord_offsets[i] + chunks[i].texcoords.size();
+	}
+	attrib.vertices.resize(position_offsets.back());
+	attrib.normals.resize(normal_offsets.back());
+	attrib.texcoords.resize(texcoord_offsets.back());
+	pool.parallelFor(0, int(nof_chunks), [&](int begin, int end) {
+		for(int i = begin; i < end; i++)
+		{
+			Chunk& chunk = chunks[i];
+			std::copy(chunk.positions.begin(), chunk.positions.end(), attrib.vertices.begin() + position_offsets[i]);
+			std::copy(chunk.normals.begin(), chunk.normals.end(), attrib.normals.begin() + normal_offsets[i]);
+			std::copy(chunk.texcoords.begin(), chunk.texcoords.end(),
+			          attrib.texcoords.begin() + texcoord_offsets[i]);
+			for(size_t slot : chunk.relative)
+			{
+				tinyobj::index_t& index = chunk.indices[slot / 3];
+				switch(slot % 3)
+				{
+				case 0: index.vertex_index += int(position_offsets[i] / 3); break;
+				case 1: index.normal_index += int(normal_offsets[i] / 3); break;
+				case 2: index.texcoord_index += int(texcoord_offsets[i] / 2); break;
+				}
+			}
+		}
+	});
+
+	///////////////////////////////////////////////////////////////////////
+	// Group the triangles into shapes, in file order
+	///////////////////////////////////////////////////////////////////////
+	ShapeBuilder builder(shapes, materials, mtlDirectory, err);
+	for(const Chunk& chunk : chunks)
+	{
+		size_t triangle = 0, face = 0;
+		for(const Statement& statement : chunk.statements)
+		{
+			builder.addFaces(chunk, triangle, statement.triangle, statement.face - face);
+			builder.addStatement(statement);
+			triangle = statement.triangle;
+			face = statement.face;
+		}
+		builder.addFaces(chunk, triangle, chunk.indices.size() / 3, chunk.nof_faces - face);
+	}
+	builder.finish();
+	return true;
+}
+
+bool benchmarkObjParsers(const std::string& filename, int iterations)
+{
+	size_t separator = filename.find_last_of("\\/");
+	std::string directory = separator != std::string::npos ? filename.substr(0, separator + 1) : "./";
+	MappedFile file;
+	if(!file.open(filename))
+	{
+		std::cout << "Cannot open " << filename << "\n";
+		return false;
+	}
+	double megabytes = file.size() / (1024.0 * 1024.0);
+	file.close();
+
+	tinyobj::attrib_t reference_attrib, attrib;
+	std::vector<tinyobj::shape_t> reference_shapes, shapes;
+	std::vector<tinyobj::material_t> reference_materials, materials;
+	std::string err;
+
+	// Best of several runs, so that the first one can warm the file cache.
+	float tinyobj_ms = 1e30f, parallel_ms = 1e30f;
+	for(int i = 0; i < iterations; i++)
+	{
+		reference_materials.clear();
+		auto start = std::chrono::high_resolution_clock::now();
+		tinyobj::LoadObj(&reference_attrib, &reference_shapes, &reference_materials, &err, filename.c_str(),
+		                 directory.c_str(), true);
+		std::chrono::duration<float, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+		tinyobj_ms = std::min(tinyobj_ms, elapsed.count());
+
+		materials.clear();
+		start = std::chrono::high_resolution_clock::now();
+		parseObj(filename, directory, attrib, shapes, materials, err);
+		elapsed = std::chrono::high_resolution_clock::now() - start;
+		parallel_ms = std::min(parallel_ms, elapsed.count());
+	}
+
+	bool identical = sameAttributes(attrib, reference_attrib) && sameShapes(shapes, reference_shapes)
+	                 && materials.size() == reference_materials.size();
+	std::cout << filename << " (" << megabytes << " MB): tinyobj " << tinyobj_ms << " ms ("
+	          << megabytes / (tinyobj_ms / 1000.0f) << " MB/s), parseObj on " << ThreadPool::global().size() + 1
+	          << " threads " << parallel_ms << " ms (" << megabytes / (parallel_ms / 1000.0f) << " MB/s), "
+	          << (identical ? "identical" : "DIFFERENT") << "\n";
+	return identical;
+}
+} // namespace labhelper
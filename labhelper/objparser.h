@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <tiny_obj_loader.h>
+
+namespace labhelper
+{
+/**
+	* Multithreaded replacement for tinyobj::LoadObj(..., triangulate = true).
+	*
+	* The file is mapped in one go and cut into line-aligned chunks that are
+	* parsed on ThreadPool::global(). Each chunk records its vertex data,
+	* triangles and the g/o/usemtl/mtllib statements between them; the chunks
+	* are then stitched together in file order, applying the same grouping
+	* rules as tinyobj, so the result does not depend on the number of threads.
+	*
+	* Numbers are parsed with the same arithmetic as tinyobj (and so are
+	* independent of the C locale), which makes the output identical to
+	* tinyobj's, with one exception: subdivision tags ('t') are skipped.
+	* Material libraries are read with tinyobj::LoadMtl from mtlDirectory.
+	*
+	* Returns false if the file could not be read. err receives warnings,
+	* like missing material libraries.
+	*/
+bool parseObj(const std::string& filename, const std::string& mtlDirectory, tinyobj::attrib_t& attrib,
+              std::vector<tinyobj::shape_t>& shapes, std::vector<tinyobj::material_t>& materials,
+              std::string& err);
+
+/**
+	* Parses filename with tinyobj and with parseObj a few times each, prints
+	* the throughput of both in MB/s and whether their results are identical.
+	* Returns false if they differ.
+	*/
+bool benchmarkObjParsers(const std::string& filename, int iterations = 5);
+} // namespace labhelper
@@ -0,0 +1,508 @@
+#include "objwriter.h"
+#include "filecache.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+namespace labhelper
+{
+namespace
+{
+// Lines formatted per task. Large enough to amortise scheduling, small
+// enough that a batch of them for every thread stays a few MB.
+const size_t LINES_PER_BLOCK = 32 * 1024;
+
+// Enough for any line we write (a face with three 10 digit triples).
+const size_t MAX_LINE_LENGTH = 128;
+
+// A growable buffer that lines are formatted into in place.
+class TextBuffer
+{
+public:
+	// Returns room for at least n more characters, to be followed by commit().
+	char* reserve(size_t n)
+	{
+		if(m_size + n > m_data.size())
+			m_data.resize(std::max(m_data.size() * 2, m_size + n));
+		return m_data.data() + m_size;
+	}
+	void commit(char* end) { m_size = size_t(end - m_data.data()); }
+	void append(const std::string& text)
+	{
+		char* p = reserve(text.size());
+		memcpy(p, text.data(), text.size());
+		commit(p + text.size());
+	}
+	void clear() { m_size = 0; }
+	const char* data() const { return m_data.data(); }
+	size_t size() const { return m_size; }
+
+private:
+	std::vector<char> m_data;
+	size_t m_size = 0;
+};
+
+inline char* writeFloat(char* p, float value, int precision)
+{
+	if(precision > 0)
+		return std::to_chars(p, p + 32, value, std::chars_format::general, precision).ptr;
+	return std::to_chars(p, p + 32, value).ptr;
+}
+
+inline char* writeIndex(char* p, uint32_t index)
+{
+	return std::to_chars(p, p + 16, index).ptr;
+}
+
+// Gives every bitwise distinct value an index, in order of first
+// appearance, with an open addressing hash table like indexModel().
+template<typename T>
+std::vector<uint32_t> mergeEqual(const std::vector<T>& values, std::vector<T>& unique)
+{
+	size_t table_size = 1;
+	while(table_size < values.size() * 2)
+		table_size *= 2;
+	std::vector<uint32_t> table(table_size, ~0u);
+	std::vector<uint32_t> remap(values.size());
+	unique.clear();
+	for(size_t i = 0; i < values.size(); i++)
+	{
+		size_t slot = hashBytes(&values[i], sizeof(T)) & (table_size - 1);
+		while(table[slot] != ~0u && memcmp(&unique[table[slot]], &values[i], sizeof(T)) != 0)
+			slot = (slot + 1) & (table_size - 1);
+		if(table[slot] == ~0u)
+		{
+			table[slot] = uint32_t(unique.size());
+			unique.push_back(values[i]);
+		}
+		remap[i] = table[slot];
+	}
+	return remap;
+}
+
+// One vertex stream as written to the file: the values, and which of them
+// each model vertex uses (empty when they are the model's own array).
+template<typename T>
+struct Stream
+{
+	const std::vector<T>* values;
+	std::vector<T> merged;
+	std::vector<uint32_t> remap;
+
+	void init(const std::vector<T>& model_values, bool merge)
+	{
+		values = &model_values;
+		if(merge)
+		{
+			remap = mergeEqual(model_values, merged);
+			values = &merged;
+		}
+	}
+	uint32_t index(uint32_t vertex) const { return remap.empty() ? vertex : remap[vertex]; }
+	size_t size() const { return values->size(); }
+};
+
+enum class Section
+{
+	Positions,
+	Normals,
+	TextureCoordinates,
+	Faces
+};
+
+// A range of lines of one section, formatted as one task. The first block
+// of each mesh also writes its o/g/usemtl lines.
+struct Block
+{
+	Section section;
+	size_t begin, end;
+	size_t mesh;
+	bool mesh_header;
+};
+
+// What is written: the vertex streams, indices and meshes of a model and
+// the materials for the .mtl file, all borrowed. Lets the benchmark write
+// expanded streams without a second Model sharing the first one's textures.
+struct ObjSource
+{
+	const std::vector<glm::vec3>* positions;
+	const std::vector<glm::vec3>* normals;
+	const std::vector<glm::vec2>* texture_coordinates;
+	const std::vector<uint32_t>* indices;
+	const std::vector<Mesh>* meshes;
+	const std::vector<Material>* materials;
+};
+
+ObjSource sourceOf(const Model* model)
+{
+	return { &model->m_positions, &model->m_normals, &model->m_texture_coordinates,
+		     &model->m_indices, &model->m_meshes, &model->m_materials };
+}
+
+struct ObjContents
+{
+	const ObjSource* source;
+	int precision;
+	Stream<glm::vec3> positions;
+	Stream<glm::vec3> normals;
+	Stream<glm::vec2> texture_coordinates;
+};
+
+template<int N, typename T>
+void formatValues(const char* prefix, const std::vector<T>& values, size_t begin, size_t end, int precision,
+                  TextBuffer& out)
+{
+	size_t prefix_length = strlen(prefix);
+	for(size_t i = begin; i < end; i++)
+	{
+		char* p = out.reserve(MAX_LINE_LENGTH);
+		memcpy(p, prefix, prefix_length);
+		p += prefix_length;
+		for(int c = 0; c < N; c++)
+		{
+			if(c > 0)
+				*p++ = ' ';
+			p = writeFloat(p, values[i][c], precision);
+		}
+		*p++ = '\n';
+		out.commit(p);
+	}
+}
+
+void formatFaces(const ObjContents& obj, size_t begin, size_t end, TextBuffer& out)
+{
+	const std::vector<uint32_t>& indices = *obj.source->indices;
+	bool indexed = !indices.empty();
+	bool has_normals = obj.normals.size() > 0;
+	bool has_texture_coordinates = obj.texture_coordinates.size() > 0;
+	for(size_t corner = begin; corner < end; corner += 3)
+	{
+		char* p = out.reserve(MAX_LINE_LENGTH);
+		*p++ = 'f';
+		for(size_t j = 0; j < 3; j++)
+		{
+			uint32_t vertex = indexed ? indices[corner + j] : uint32_t(corner + j);
+			*p++ = ' ';
+			p = writeIndex(p, obj.positions.index(vertex) + 1);
+			if(has_texture_coordinates || has_normals)
+				*p++ = '/';
+			if(has_texture_coordinates)
+				p = writeIndex(p, obj.texture_coordinates.index(vertex) + 1);
+			if(has_normals)
+			{
+				*p++ = '/';
+				p = writeIndex(p, obj.normals.index(vertex) + 1);
+			}
+		}
+		*p++ = '\n';
+		out.commit(p);
+	}
+}
+
+void formatBlock(const ObjContents& obj, const Block& block, TextBuffer& out)
+{
+	switch(block.section)
+	{
+	case Section::Positions:
+		formatValues<3>("v ", *obj.positions.values, block.begin, block.end, obj.precision, out);
+		break;
+	case Section::Normals:
+		formatValues<3>("vn ", *obj.normals.values, block.begin, block.end, obj.precision, out);
+		break;
+	case Section::TextureCoordinates:
+		formatValues<2>("vt ", *obj.texture_coordinates.values, block.begin, block.end, obj.precision, out);
+		break;
+	case Section::Faces:
+		if(block.mesh_header)
+		{
+			const Mesh& mesh = (*obj.source->meshes)[block.mesh];
+			const std::vector<Material>& materials = *obj.source->materials;
+			out.append("o " + mesh.m_name + "\n");
+			out.append("g " + mesh.m_name + "\n");
+			if(mesh.m_material_idx < materials.size())
+				out.append("usemtl " + materials[mesh.m_material_idx].m_name + "\n");
+		}
+		formatFaces(obj, block.begin, block.end, out);
+		break;
+	}
+}
+
+void addBlocks(std::vector<Block>& blocks, Section section, size_t begin, size_t end, size_t mesh = 0)
+{
+	size_t step = LINES_PER_BLOCK * (section == Section::Faces ? 3 : 1);
+	size_t block_begin = begin;
+	do
+	{
+		size_t block_end = std::min(block_begin + step, end);
+		blocks.push_back({ section, block_begin, block_end, mesh, section == Section::Faces && block_begin == begin });
+		block_begin = block_end;
+	} while(block_begin < end);
+}
+
+bool writeMaterials(const std::vector<Material>& materials, const std::string& path)
+{
+	std::ofstream mat_file(path);
+	if(!mat_file.is_open())
+	{
+		std::cout << "Could not open file " << path << " for writing.\n";
+		return false;
+	}
+	mat_file << "# Exported by Chalmers Graphics Group\n";
+	for(const auto& mat : materials)
+	{
+		mat_file << "newmtl " << mat.m_name << "\n";
+		mat_file << "Kd " << mat.m_color.x << " " << mat.m_color.y << " " << mat.m_color.z << "\n";
+		mat_file << "Ks " << mat.m_reflectivity << " " << mat.m_reflectivity << " " << mat.m_reflectivity
+		         << "\n";
+		mat_file << "Pm " << mat.m_metalness << "\n";
+		mat_file << "Ps " << mat.m_fresnel << "\n";
+		mat_file << "Pr " << mat.m_shininess << "\n";
+		mat_file << "Ke " << mat.m_emission << " " << mat.m_emission << " " << mat.m_emission << "\n";
+		mat_file << "Tf " << mat.m_transparency << " " << mat.m_transparency << " " << mat.m_transparency
+		         << "\n";
+		if(mat.m_color_texture.valid)
+			mat_file << "map_Kd " << mat.m_color_texture.filename << "\n";
+		if(mat.m_reflectivity_texture.valid)
+			mat_file << "map_Ks " << mat.m_reflectivity_texture.filename << "\n";
+		if(mat.m_metalness_texture.valid)
+			mat_file << "map_Pm " << mat.m_metalness_texture.filename << "\n";
+		if(mat.m_fresnel_texture.valid)
+			mat_file << "map_Ps " << mat.m_fresnel_texture.filename << "\n";
+		if(mat.m_shininess_texture.valid)
+			mat_file << "map_Pr " << mat.m_shininess_texture.filename << "\n";
+		if(mat.m_emission_texture.valid)
+			mat_file << "map_Ke " << mat.m_emission_texture.filename << "\n";
+	}
+	return true;
+}
+
+// Writes the OBJ (and MTL) file and returns the size of the OBJ file, or 0
+// if it could not be written.
+size_t writeObj(const ObjSource& source, const std::string& path, const ObjExportOptions& options)
+{
+	///////////////////////////////////////////////////////////////////////
+	// Separate filename into directory, base filename and extension
+	///////////////////////////////////////////////////////////////////////
+	size_t separator = path.find_last_of("\\/");
+	std::string filename, directory;
+	if(separator != std::string::npos)
+	{
+		filename = path.substr(separator + 1, path.size() - separator - 1);
+		directory = path.substr(0, separator + 1);
+	}
+	else
+	{
+		filename = path;
+		directory = "./";
+	}
+	separator = filename.find_last_of(".");
+	if(separator == std::string::npos)
+	{
+		std::cout << "Fatal: saveModelToOBJ(): Expecting filename ending in '.obj'\n";
+		exit(1);
+	}
+	filename = filename.substr(0, separator);
+
+	bool has_materials = !source.materials->empty();
+	if(has_materials && !writeMaterials(*source.materials, directory + filename + ".mtl"))
+		return 0;
+	std::ofstream obj_file(directory + filename + ".obj", std::ios::binary);
+	if(!obj_file.is_open())
+	{
+		std::cout << "Could not open file " << directory + filename + ".obj" << " for writing.\n";
+		return 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Decide what to write. Every stream is written up front, so that the
+	// faces of all meshes can share vertices.
+	///////////////////////////////////////////////////////////////////////
+	ObjContents obj;
+	obj.source = &source;
+	obj.precision = std::min(std::max(options.precision, 0), 9);
+	obj.positions.init(*source.positions, options.merge_vertices);
+	obj.normals.init(*source.normals, options.merge_vertices);
+	obj.texture_coordinates.init(*source.texture_coordinates, options.merge_vertices);
+
+	std::vector<Block> blocks;
+	addBlocks(blocks, Section::Positions, 0, obj.positions.size());
+	if(obj.normals.size() > 0)
+		addBlocks(blocks, Section::Normals, 0, obj.normals.size());
+	if(obj.texture_coordinates.size() > 0)
+		addBlocks(blocks, Section::TextureCoordinates, 0, obj.texture_coordinates.size());
+	const std::vector<Mesh>& meshes = *source.meshes;
+	for(size_t m = 0; m < meshes.size(); m++)
+	{
+		const Mesh& mesh = meshes[m];
+		addBlocks(blocks, Section::Faces, mesh.m_start_index, mesh.m_start_index + mesh.m_number_of_vertices,
+		          m);
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Format a batch of blocks (in parallel), write them in order, repeat
+	///////////////////////////////////////////////////////////////////////
+	TextBuffer header;
+	header.append("# Exported by Chalmers Graphics Group\n");
+	if(has_materials)
+		header.append("mtllib " + filename + ".mtl\n");
+	obj_file.write(header.data(), header.size());
+	size_t written = header.size();
+
+	ThreadPool& pool = ThreadPool::global();
+	size_t batch_size = options.multithreaded ? (pool.size() + 1) * 2 : 1;
+	std::vector<TextBuffer> buffers(batch_size);
+	for(size_t first = 0; first < blocks.size(); first += batch_size)
+	{
+		int count = int(std::min(batch_size, blocks.size() - first));
+		auto format = [&](int begin, int end) {
+			for(int i = begin; i < end; i++)
+			{
+				buffers[i].clear();
+				formatBlock(obj, blocks[first + i], buffers[i]);
+			}
+		};
+		if(options.multithreaded)
+			pool.parallelFor(0, count, format);
+		else
+			format(0, count);
+		for(int i = 0; i < count; i++)
+		{
+			obj_file.write(buffers[i].data(), buffers[i].size());
+			written += buffers[i].size();
+		}
+	}
+	obj_file.close();
+	if(!obj_file)
+	{
+		std::cout << "Failed to write " << directory + filename + ".obj" << "\n";
+		return 0;
+	}
+	return written;
+}
+
+// What saveModelToOBJ() used to do: one v/vn/vt line per triangle corner,
+// every number through operator<<.
+size_t writeObjWithStreams(const Model* model, const std::string& path)
+{
+	std::ofstream obj_file(path);
+	obj_file << "# Exported by Chalmers Graphics Group\n";
+	bool indexed = !model->m_indices.empty();
+	bool has_normals = !model->m_normals.empty();
+	bool has_texture_coordinates = !model->m_texture_coordinates.empty();
+	int vertex_counter = 1;
+	for(const Mesh& mesh : model->m_meshes)
+	{
+		obj_file << "o " << mesh.m_name << "\n";
+		obj_file << "g " << mesh.m_name << "\n";
+		for(uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
+		{
+			uint32_t v = indexed ? model->m_indices[i] : i;
+			const glm::vec3& p = model->m_positions[v];
+			obj_file << "v " << p.x << " " << p.y << " " << p.z << "\n";
+			if(has_normals)
+			{
+				const glm::vec3& n = model->m_normals[v];
+				obj_file << "vn " << n.x << " " << n.y << " " << n.z << "\n";
+			}
+			if(has_texture_coordinates)
+			{
+				const glm::vec2& t = model->m_texture_coordinates[v];
+				obj_file << "vt " << t.x << " " << t.y << "\n";
+			}
+		}
+		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+		{
+			obj_file << (i % 3 == 0 ? "f " : " ") << vertex_counter << "/";
+			if(has_texture_coordinates)
+				obj_file << vertex_counter;
+			obj_file << "/" << vertex_counter << (i % 3 == 2 ? "\n" : "");
+			vertex_counter++;
+		}
+	}
+	return size_t(obj_file.tellp());
+}
+} // namespace
+
+void saveModelToOBJ(const Model* model, std::string path, const ObjExportOptions& options)
+{
+	std::cout << "Saving " << path << "..." << std::flush;
+	auto startTime = std::chrono::high_resolution_clock::now();
+	size_t size = writeObj(sourceOf(model), path, options);
+	std::chrono::duration<float, std::milli> elapsed = std::chrono::high_resolution_clock::now() - startTime;
+	if(size > 0)
+	{
+		double megabytes = size / (1024.0 * 1024.0);
+		std::cout << "done (" << megabytes << " MB in " << elapsed.count() << " ms, "
+		          << megabytes / (elapsed.count() / 1000.0) << " MB/s).\n";
+	}
+}
+
+void benchmarkObjWriter(const Model* model, const std::string& filename)
+{
+	struct Run
+	{
+		const char* name;
+		bool merge_vertices;
+		bool multithreaded;
+	};
+	const Run runs[] = {
+		{ "per corner, one thread", false, false },
+		{ "per corner, all threads", false, true },
+		{ "merged, one thread", true, false },
+		{ "merged, all threads", true, true },
+	};
+	auto report = [](const char* name, size_t size, float ms) {
+		double megabytes = size / (1024.0 * 1024.0);
+		std::cout << "  " << name << ": " << ms << " ms, " << megabytes << " MB, "
+		          << megabytes / (ms / 1000.0) << " MB/s\n";
+	};
+	std::cout << "Writing " << filename << " (" << model->m_positions.size() << " vertices, "
+	          << (model->m_indices.empty() ? model->m_positions.size() : model->m_indices.size()) / 3
+	          << " triangles):\n";
+
+	auto start = std::chrono::high_resolution_clock::now();
+	size_t size = writeObjWithStreams(model, filename);
+	std::chrono::duration<float, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+	report("std::ofstream <<, per corner", size, elapsed.count());
+
+	// Per corner means no merging of the model's own vertices either, so
+	// compare against non-indexed copies of the streams of indexed models.
+	ObjSource merged = sourceOf(model);
+	ObjSource per_corner = merged;
+	std::vector<glm::vec3> positions, normals;
+	std::vector<glm::vec2> texture_coordinates;
+	const std::vector<uint32_t> no_indices;
+	if(!model->m_indices.empty())
+	{
+		for(uint32_t index : model->m_indices)
+		{
+			positions.push_back(model->m_positions[index]);
+			if(!model->m_normals.empty())
+				normals.push_back(model->m_normals[index]);
+			if(!model->m_texture_coordinates.empty())
+				texture_coordinates.push_back(model->m_texture_coordinates[index]);
+		}
+		per_corner.positions = &positions;
+		per_corner.normals = &normals;
+		per_corner.texture_coordinates = &texture_coordinates;
+		per_corner.indices = &no_indices;
+	}
+
+	for(const Run& run : runs)
+	{
+		ObjExportOptions options;
+		options.merge_vertices = run.merge_vertices;
+		options.multithreaded = run.multithreaded;
+		start = std::chrono::high_resolution_clock::now();
+		size = writeObj(run.merge_vertices ? merged : per_corner, filename, options);
+		elapsed = std::chrono::high_resolution_clock::now() - start;
+		report(run.name, size, elapsed.count());
+	}
+}
+} // namespace labhelper
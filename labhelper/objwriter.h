@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+
+#include "Model.h"
+
+namespace labhelper
+{
+/**
+	* Writes model to filename a few times with different ObjExportOptions and
+	* with a plain std::ofstream << exporter for comparison, and prints the time,
+	* MB/s and file size of each. Leaves the last export in filename.
+	*/
+void benchmarkObjWriter(const Model* model, const std::string& filename);
+} // namespace labhelper
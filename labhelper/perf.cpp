@@ -68,6 +68,8 @@ std::vector<time_event_t> event_stack;
 std::unordered_map<std::string, time_event_durations_t> time_running_avg;
 std::unordered_map<std::string, time_event_durations_t> time_running_avg_tmp;
 
+std::unordered_map<std::string, time_event_durations_t> last_frame_durations;
+
 float seconds_to_record = 2;
 duration_t remaining_recording_seconds = {};
 std::unordered_map<std::string, std::vector<time_event_durations_t>>
@@ -75,6 +77,8 @@ std::unordered_map<std::string, std::vector<time_event_durations_t>>
 
 timestamp_t last_frame_time = {};
 
+std::vector<std::pair<std::string, float>> counters;
+
 timestamp_t getTimestamp() { return std::chrono::high_resolution_clock::now(); }
 
 } // namespace
@@ -260,6 +264,13 @@ std::string printf_events() {
 }
 #endif
 
+void collect_last_durations(const time_event_t &e, const std::string &path) {
+  last_frame_durations[path] = e.duration;
+  for (const auto &c : e.children) {
+    collect_last_durations(c, path + "~" + c.name);
+  }
+}
+
 void record_events() {
   const auto record_rec = [&](const time_event_t &e) {
     auto record_rec_impl = [&](const time_event_t &e,
@@ -300,6 +311,12 @@ void drawEventsWindow() {
               return a.start < b.start;
             });
 
+  // Before drawing, which replaces the durations with running averages.
+  last_frame_durations.clear();
+  for (const auto &e : events) {
+    collect_last_durations(e, e.name);
+  }
+
   ImGui::Begin("Performance Timings");
   {
 #if USE_FMT
@@ -396,6 +413,27 @@ void drawEventsWindow() {
       ImGui::EndTable();
     }
 
+    if (!counters.empty() &&
+        ImGui::BeginTable("counters", 2, ImGuiTableFlags_RowBg)) {
+      ImGuiTableColumnFlags flags =
+          ImGuiTableColumnFlags_NoHide | ImGuiTableColumnFlags_NoSort;
+      ImGui::TableSetupColumn("Counter",
+                              flags | ImGuiTableColumnFlags_WidthStretch);
+      ImGui::TableSetupColumn("   Value",
+                              flags | ImGuiTableColumnFlags_WidthFixed, 100);
+      ImGui::TableHeadersRow();
+
+      for (const auto &counter : counters) {
+        ImGui::TableNextRow();
+        ImGui::TableNextColumn();
+        ImGui::TextUnformatted(counter.first.c_str());
+        ImGui::TableNextColumn();
+        ImGui::Text("% 10.6g", counter.second);
+      }
+
+      ImGui::EndTable();
+    }
+
 #if USE_FMT
     if (copy_text) {
       SDL_SetClipboardText(printf_events().c_str());
@@ -455,6 +493,32 @@ void drawEventsWindow() {
   events.clear();
 }
 
+float getLastCPUTime(const std::string &path) {
+  auto it = last_frame_durations.find(path);
+  if (it == last_frame_durations.end()) {
+    return -1.f;
+  }
+  return it->second.cpu.count() / 1'000'000.f;
+}
+
+float getLastGLTime(const std::string &path) {
+  auto it = last_frame_durations.find(path);
+  if (it == last_frame_durations.end()) {
+    return -1.f;
+  }
+  return it->second.gl.count() / 1'000'000.f;
+}
+
+void setCounter(const std::string &name, float value) {
+  for (auto &counter : counters) {
+    if (counter.first == name) {
+      counter.second = value;
+      return;
+    }
+  }
+  counters.emplace_back(name, value);
+}
+
 } // namespace perf
 } // namespace labhelper
 
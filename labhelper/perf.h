@@ -15,6 +15,22 @@ void synchProfilers();
 
 void drawEventsWindow();
 
+/**
+	* Durations, in milliseconds, measured for an event during the last frame
+	* that drawEventsWindow() collected. Events are identified by their path
+	* of scope names joined with '~', e.g. "Frame~Display~Scene". Returns a
+	* negative value if no such event was recorded.
+	*/
+float getLastCPUTime( const std::string& path );
+float getLastGLTime( const std::string& path );
+
+/**
+	* A value shown under the timings in the events window, such as how many
+	* cells a simulation ran this frame. Counters are listed in the order they
+	* were first set, and keep their last value until set again.
+	*/
+void setCounter( const std::string& name, float value );
+
 struct Scope
 {
 public:
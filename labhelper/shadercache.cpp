@@ -0,0 +1,268 @@
+#include "shadercache.h"
+#include "labhelper.h"
+#include "filecache.h"
+#include "mappedfile.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <streambuf>
+
+namespace labhelper
+{
+namespace
+{
+std::string s_cache_directory = "shader_cache";
+
+// Bump whenever the layout of the cache files changes.
+const uint32_t CACHE_MAGIC = 0x4250484c; // "LHPB"
+const uint32_t CACHE_VERSION = 1;
+
+struct CacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint32_t format;
+	uint32_t length;
+};
+
+// Hashes a string followed by a separator, so that "ab"+"c" != "a"+"bc"
+uint64_t hashField(const std::string& data, uint64_t hash = 0xcbf29ce484222325ull)
+{
+	const unsigned char separator = 0xff;
+	return hashBytes(&separator, 1, hashString(data, hash));
+}
+
+std::string readFile(const std::string& filename)
+{
+	std::ifstream file(filename);
+	return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+std::string glString(GLenum name)
+{
+	const GLubyte* str = glGetString(name);
+	return str ? reinterpret_cast<const char*>(str) : "";
+}
+
+// Inserts the defines directly after the #version directive, which must stay
+// the first statement of the shader.
+std::string injectDefines(const std::string& source, const std::string& defines)
+{
+	if(defines.empty())
+		return source;
+	size_t version = source.find("#version");
+	if(version == std::string::npos)
+		return defines + source;
+	size_t eol = source.find('\n', version);
+	if(eol == std::string::npos)
+		return source + "\n" + defines;
+	return source.substr(0, eol + 1) + defines + source.substr(eol + 1);
+}
+
+bool binariesSupported()
+{
+	if(!(GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary))
+		return false;
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return formats > 0;
+}
+
+std::string cacheFilename(uint64_t key)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+	return s_cache_directory + "/" + name;
+}
+
+bool loadBinary(GLuint program, uint64_t key)
+{
+	MappedFile file;
+	if(!file.open(cacheFilename(key)) || file.size() < sizeof(CacheHeader))
+		return false;
+	CacheHeader header;
+	memcpy(&header, file.data(), sizeof(header));
+	// A truncated or corrupt file must not make us read past its end
+	if(header.magic != CACHE_MAGIC || header.version != CACHE_VERSION || header.key != key
+	   || header.length != file.size() - sizeof(header))
+		return false;
+
+	glProgramBinary(program, header.format, file.data() + sizeof(header), GLsizei(header.length));
+	// A driver that no longer knows the format raises an error rather than
+	// failing the link; either way the program is rebuilt from source.
+	bool accepted = true;
+	while(glGetError() != GL_NO_ERROR)
+		accepted = false;
+	GLint linkOk = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linkOk);
+	return accepted && linkOk != 0;
+}
+
+void storeBinary(GLuint program, uint64_t key)
+{
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if(length <= 0)
+		return;
+	std::vector<char> file(sizeof(CacheHeader) + length);
+	GLenum format = 0;
+	glGetProgramBinary(program, length, &length, &format, file.data() + sizeof(CacheHeader));
+	CacheHeader header = { CACHE_MAGIC, CACHE_VERSION, key, format, uint32_t(length) };
+	memcpy(file.data(), &header, sizeof(header));
+	writeFileAtomic(cacheFilename(key), file.data(), sizeof(header) + length);
+}
+
+void reportError(const std::string& err, const std::string& title, bool allow_errors)
+{
+	if(allow_errors)
+	{
+		non_fatal_error(err, title);
+	}
+	else
+	{
+		fatal_error(err, title);
+	}
+}
+
+struct PendingProgram
+{
+	GLuint program = 0;
+	GLuint vShader = 0;
+	GLuint fShader = 0;
+	uint64_t key = 0;
+	bool fromCache = false;
+};
+} // namespace
+
+void setShaderCacheDirectory(const std::string& directory)
+{
+	s_cache_directory = directory;
+}
+
+std::vector<GLuint> loadShaderPrograms(const std::vector<ShaderProgramSource>& sources, bool allow_errors)
+{
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	bool useCache = !s_cache_directory.empty() && binariesSupported();
+	std::string driver = glString(GL_VENDOR) + glString(GL_RENDERER) + glString(GL_VERSION);
+
+	// Let the driver use as many compiler threads as it likes. This is a hint
+	// only; compilation below is kicked off for every program before any
+	// result is queried either way.
+	if(GLEW_KHR_parallel_shader_compile)
+	{
+		glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Try the cache first, and submit everything that missed for
+	// compilation and linking without waiting on the results.
+	///////////////////////////////////////////////////////////////////////
+	std::vector<PendingProgram> pending(sources.size());
+	int nof_cached = 0, nof_rejected = 0;
+	for(size_t i = 0; i < sources.size(); i++)
+	{
+		PendingProgram& p = pending[i];
+		std::string vs_src = injectDefines(readFile(sources[i].vertexShader), sources[i].defines);
+		std::string fs_src = injectDefines(readFile(sources[i].fragmentShader), sources[i].defines);
+		p.key = hashField(driver, hashField(sources[i].defines, hashField(fs_src, hashField(vs_src))));
+
+		p.program = glCreateProgram();
+		if(useCache)
+		{
+			if(loadBinary(p.program, p.key))
+			{
+				p.fromCache = true;
+				nof_cached++;
+				continue;
+			}
+			// A stale or rejected binary leaves the program unusable; start over.
+			if(std::filesystem::exists(cacheFilename(p.key)))
+				nof_rejected++;
+			glDeleteProgram(p.program);
+			p.program = glCreateProgram();
+		}
+
+		const char* vs = vs_src.c_str();
+		const char* fs = fs_src.c_str();
+		p.vShader = glCreateShader(GL_VERTEX_SHADER);
+		p.fShader = glCreateShader(GL_FRAGMENT_SHADER);
+		glShaderSource(p.vShader, 1, &vs, nullptr);
+		glShaderSource(p.fShader, 1, &fs, nullptr);
+		glCompileShader(p.vShader);
+		glCompileShader(p.fShader);
+		glAttachShader(p.program, p.fShader);
+		glAttachShader(p.program, p.vShader);
+		if(useCache)
+		{
+			glProgramParameteri(p.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		}
+		glLinkProgram(p.program);
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Now collect the results, in order.
+	///////////////////////////////////////////////////////////////////////
+	std::vector<GLuint> programs(sources.size(), 0);
+	for(size_t i = 0; i < sources.size(); i++)
+	{
+		PendingProgram& p = pending[i];
+		if(p.fromCache)
+		{
+			programs[i] = p.program;
+			continue;
+		}
+
+		bool ok = true;
+		int status = 0;
+		glGetShaderiv(p.vShader, GL_COMPILE_STATUS, &status);
+		if(!status)
+		{
+			reportError(GetShaderInfoLog(p.vShader), "Vertex Shader", allow_errors);
+			ok = false;
+		}
+		glGetShaderiv(p.fShader, GL_COMPILE_STATUS, &status);
+		if(ok && !status)
+		{
+			reportError(GetShaderInfoLog(p.fShader), "Fragment Shader", allow_errors);
+			ok = false;
+		}
+		glGetProgramiv(p.program, GL_LINK_STATUS, &status);
+		if(ok && !status)
+		{
+			reportError(GetShaderProgramInfoLog(p.program), "Linking", allow_errors);
+			ok = false;
+		}
+		glDeleteShader(p.vShader);
+		glDeleteShader(p.fShader);
+
+		if(!ok)
+		{
+			glDeleteProgram(p.program);
+			continue;
+		}
+		if(useCache)
+		{
+			storeBinary(p.program, p.key);
+		}
+		programs[i] = p.program;
+	}
+	if(!allow_errors)
+		CHECK_GL_ERROR();
+
+	std::chrono::duration<float, std::milli> elapsed = std::chrono::high_resolution_clock::now() - startTime;
+	std::cout << "Shader programs: " << nof_cached << " from binary cache, "
+	          << sources.size() - nof_cached << " compiled";
+	if(nof_rejected > 0)
+		std::cout << " (" << nof_rejected << " cached binaries rejected)";
+	std::cout << ", " << elapsed.count() << " ms ("
+	          << (nof_cached == int(sources.size()) ? "warm" : "cold") << ")\n";
+	return programs;
+}
+} // namespace labhelper
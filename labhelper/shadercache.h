@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <GL/glew.h>
+
+namespace labhelper
+{
+/**
+	 * Describes one shader program to be built by loadShaderPrograms(). The
+	 * defines are inserted verbatim directly after the #version line of both
+	 * shaders, e.g. "#define SHADOWS 1\n".
+	 */
+struct ShaderProgramSource
+{
+	std::string vertexShader;
+	std::string fragmentShader;
+	std::string defines;
+
+	ShaderProgramSource(const std::string& vertexShader,
+	                    const std::string& fragmentShader,
+	                    const std::string& defines = std::string())
+	    : vertexShader(vertexShader), fragmentShader(fragmentShader), defines(defines)
+	{
+	}
+};
+
+/**
+	 * Sets the directory where linked program binaries are stored. The default
+	 * is "shader_cache" relative to the working directory. An empty string
+	 * disables the cache.
+	 */
+void setShaderCacheDirectory(const std::string& directory);
+
+/**
+	 * Loads, compiles and links a batch of shader programs. Each program is
+	 * first looked up in the on-disk binary cache, keyed by the shader source
+	 * text, the defines and the GL vendor/renderer/version strings. A binary the
+	 * driver rejects is silently rebuilt from source and re-cached.
+	 *
+	 * All programs that miss the cache are submitted for compilation before any
+	 * status is queried, so that drivers exposing KHR_parallel_shader_compile
+	 * (or compiling asynchronously anyway) build them concurrently.
+	 *
+	 * Returns one program per source, 0 for those that failed (only possible
+	 * with allow_errors).
+	 */
+std::vector<GLuint> loadShaderPrograms(const std::vector<ShaderProgramSource>& sources,
+                                       bool allow_errors = false);
+} // namespace labhelper
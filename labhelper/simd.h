@@ -0,0 +1,301 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#if(defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)) && !defined(LABHELPER_NO_SIMD)
+#define LABHELPER_SIMD_SSE2 1
+#include <emmintrin.h>
+#else
+#define LABHELPER_SIMD_SSE2 0
+#endif
+
+namespace labhelper
+{
+/**
+	* Four-wide float and int vectors for the CPU-heavy loops. Maps to SSE2
+	* where available (always on x86-64) and to plain arrays elsewhere, or when
+	* LABHELPER_NO_SIMD is defined, so the same code runs everywhere and the
+	* results only differ in the last bit of sqrt/division.
+	*
+	* Comparisons return int4 masks with all bits set in the lanes where they
+	* hold, to be used with select() and the bitwise operators.
+	*/
+namespace simd
+{
+#if LABHELPER_SIMD_SSE2
+struct float4
+{
+	__m128 v;
+};
+struct int4
+{
+	__m128i v;
+};
+
+inline float4 splat(float x) { return { _mm_set1_ps(x) }; }
+inline int4 splat(int32_t x) { return { _mm_set1_epi32(x) }; }
+inline float4 set(float a, float b, float c, float d) { return { _mm_setr_ps(a, b, c, d) }; }
+inline int4 set(int32_t a, int32_t b, int32_t c, int32_t d) { return { _mm_setr_epi32(a, b, c, d) }; }
+inline float4 load(const float* p) { return { _mm_loadu_ps(p) }; }
+inline int4 load(const int32_t* p) { return { _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)) }; }
+inline void store(float* p, float4 a) { _mm_storeu_ps(p, a.v); }
+inline void store(int32_t* p, int4 a) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), a.v); }
+inline float lane(float4 a, int i)
+{
+	alignas(16) float f[4];
+	_mm_store_ps(f, a.v);
+	return f[i];
+}
+inline int32_t lane(int4 a, int i)
+{
+	alignas(16) int32_t f[4];
+	_mm_store_si128(reinterpret_cast<__m128i*>(f), a.v);
+	return f[i];
+}
+
+inline float4 operator+(float4 a, float4 b) { return { _mm_add_ps(a.v, b.v) }; }
+inline float4 operator-(float4 a, float4 b) { return { _mm_sub_ps(a.v, b.v) }; }
+inline float4 operator*(float4 a, float4 b) { return { _mm_mul_ps(a.v, b.v) }; }
+inline float4 operator/(float4 a, float4 b) { return { _mm_div_ps(a.v, b.v) }; }
+inline float4 min(float4 a, float4 b) { return { _mm_min_ps(a.v, b.v) }; }
+inline float4 max(float4 a, float4 b) { return { _mm_max_ps(a.v, b.v) }; }
+inline float4 sqrt(float4 a) { return { _mm_sqrt_ps(a.v) }; }
+
+inline int4 asInt(float4 a) { return { _mm_castps_si128(a.v) }; }
+inline float4 asFloat(int4 a) { return { _mm_castsi128_ps(a.v) }; }
+/** Rounds towards zero, like a C cast. */
+inline int4 toInt(float4 a) { return { _mm_cvttps_epi32(a.v) }; }
+inline float4 toFloat(int4 a) { return { _mm_cvtepi32_ps(a.v) }; }
+
+inline int4 operator<(float4 a, float4 b) { return { _mm_castps_si128(_mm_cmplt_ps(a.v, b.v)) }; }
+inline int4 operator>(float4 a, float4 b) { return { _mm_castps_si128(_mm_cmpgt_ps(a.v, b.v)) }; }
+inline int4 operator<=(float4 a, float4 b) { return { _mm_castps_si128(_mm_cmple_ps(a.v, b.v)) }; }
+inline int4 operator>=(float4 a, float4 b) { return { _mm_castps_si128(_mm_cmpge_ps(a.v, b.v)) }; }
+inline int4 isnan(float4 a) { return { _mm_castps_si128(_mm_cmpunord_ps(a.v, a.v)) }; }
+
+inline int4 operator+(int4 a, int4 b) { return { _mm_add_epi32(a.v, b.v) }; }
+inline int4 operator-(int4 a, int4 b) { return { _mm_sub_epi32(a.v, b.v) }; }
+inline int4 operator&(int4 a, int4 b) { return { _mm_and_si128(a.v, b.v) }; }
+inline int4 operator|(int4 a, int4 b) { return { _mm_or_si128(a.v, b.v) }; }
+inline int4 operator^(int4 a, int4 b) { return { _mm_xor_si128(a.v, b.v) }; }
+/** a & ~mask */
+inline int4 andNot(int4 a, int4 mask) { return { _mm_andnot_si128(mask.v, a.v) }; }
+inline int4 operator<<(int4 a, int n) { return { _mm_sll_epi32(a.v, _mm_cvtsi32_si128(n)) }; }
+/** Logical (zero filling) shift, whatever the sign. */
+inline int4 shiftRight(int4 a, int n) { return { _mm_srl_epi32(a.v, _mm_cvtsi32_si128(n)) }; }
+/** Arithmetic (sign extending) shift. */
+inline int4 operator>>(int4 a, int n) { return { _mm_sra_epi32(a.v, _mm_cvtsi32_si128(n)) }; }
+inline int4 operator<(int4 a, int4 b) { return { _mm_cmplt_epi32(a.v, b.v) }; }
+inline int4 operator>(int4 a, int4 b) { return { _mm_cmpgt_epi32(a.v, b.v) }; }
+inline int4 operator==(int4 a, int4 b) { return { _mm_cmpeq_epi32(a.v, b.v) }; }
+/** Low 32 bits of the product (SSE2 has no pmulld). */
+inline int4 operator*(int4 a, int4 b)
+{
+	__m128i even = _mm_mul_epu32(a.v, b.v);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a.v, 32), _mm_srli_epi64(b.v, 32));
+	return { _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+		                        _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0))) };
+}
+inline int4 min(int4 a, int4 b)
+{
+	__m128i lt = _mm_cmplt_epi32(a.v, b.v);
+	return { _mm_or_si128(_mm_and_si128(lt, a.v), _mm_andnot_si128(lt, b.v)) };
+}
+inline int4 max(int4 a, int4 b)
+{
+	__m128i gt = _mm_cmpgt_epi32(a.v, b.v);
+	return { _mm_or_si128(_mm_and_si128(gt, a.v), _mm_andnot_si128(gt, b.v)) };
+}
+
+/** Lanes of a where mask is set, b elsewhere. */
+inline float4 select(int4 mask, float4 a, float4 b)
+{
+	__m128 m = _mm_castsi128_ps(mask.v);
+	return { _mm_or_ps(_mm_and_ps(m, a.v), _mm_andnot_ps(m, b.v)) };
+}
+inline int4 select(int4 mask, int4 a, int4 b)
+{
+	return { _mm_or_si128(_mm_and_si128(mask.v, a.v), _mm_andnot_si128(mask.v, b.v)) };
+}
+/** One bit per lane, lane 0 in bit 0. */
+inline int movemask(int4 mask) { return _mm_movemask_ps(_mm_castsi128_ps(mask.v)); }
+
+/** Splits four interleaved RGB triplets (12 floats) into one vector per channel. */
+inline void loadRGB(const float* p, float4& r, float4& g, float4& b)
+{
+	__m128 a = _mm_loadu_ps(p), m = _mm_loadu_ps(p + 4), c = _mm_loadu_ps(p + 8);
+	__m128 t = _mm_shuffle_ps(m, c, _MM_SHUFFLE(1, 1, 2, 2));
+	r.v = _mm_shuffle_ps(a, t, _MM_SHUFFLE(2, 0, 3, 0));
+	t = _mm_shuffle_ps(a, m, _MM_SHUFFLE(0, 0, 1, 1));
+	__m128 u = _mm_shuffle_ps(m, c, _MM_SHUFFLE(2, 2, 3, 3));
+	g.v = _mm_shuffle_ps(t, u, _MM_SHUFFLE(2, 0, 2, 0));
+	t = _mm_shuffle_ps(a, m, _MM_SHUFFLE(1, 1, 2, 2));
+	u = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0));
+	b.v = _mm_shuffle_ps(t, u, _MM_SHUFFLE(2, 0, 2, 0));
+}
+
+/** Running sum over the lanes: { a0, a0 + a1, a0 + a1 + a2, a0 + a1 + a2 + a3 } */
+inline int4 prefixSum(int4 a)
+{
+	a.v = _mm_add_epi32(a.v, _mm_slli_si128(a.v, 4));
+	return { _mm_add_epi32(a.v, _mm_slli_si128(a.v, 8)) };
+}
+/** Lane 3 in every lane. */
+inline int4 splatLast(int4 a) { return { _mm_shuffle_epi32(a.v, _MM_SHUFFLE(3, 3, 3, 3)) }; }
+
+/** Stores the low 16 bits of each lane. */
+inline void storeLow16(uint16_t* p, int4 a)
+{
+	// packs saturates, so sign extend the low halves first to keep them intact.
+	__m128i s = _mm_srai_epi32(_mm_slli_epi32(a.v, 16), 16);
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_packs_epi32(s, s));
+}
+#else
+struct float4
+{
+	float v[4];
+};
+struct int4
+{
+	int32_t v[4];
+};
+
+#define LABHELPER_SIMD_MAP(T, expr)                                                                                    \
+	T r;                                                                                                               \
+	for(int i = 0; i < 4; i++)                                                                                         \
+		r.v[i] = (expr);                                                                                               \
+	return r
+
+inline float4 splat(float x) { LABHELPER_SIMD_MAP(float4, x); }
+inline int4 splat(int32_t x) { LABHELPER_SIMD_MAP(int4, x); }
+inline float4 set(float a, float b, float c, float d) { return { { a, b, c, d } }; }
+inline int4 set(int32_t a, int32_t b, int32_t c, int32_t d) { return { { a, b, c, d } }; }
+inline float4 load(const float* p) { LABHELPER_SIMD_MAP(float4, p[i]); }
+inline int4 load(const int32_t* p) { LABHELPER_SIMD_MAP(int4, p[i]); }
+inline void store(float* p, float4 a) { memcpy(p, a.v, sizeof(a.v)); }
+inline void store(int32_t* p, int4 a) { memcpy(p, a.v, sizeof(a.v)); }
+inline float lane(float4 a, int i) { return a.v[i]; }
+inline int32_t lane(int4 a, int i) { return a.v[i]; }
+
+inline float4 operator+(float4 a, float4 b) { LABHELPER_SIMD_MAP(float4, a.v[i] + b.v[i]); }
+inline float4 operator-(float4 a, float4 b) { LABHELPER_SIMD_MAP(float4, a.v[i] - b.v[i]); }
+inline float4 operator*(float4 a, float4 b) { LABHELPER_SIMD_MAP(float4, a.v[i] * b.v[i]); }
+inline float4 operator/(float4 a, float4 b) { LABHELPER_SIMD_MAP(float4, a.v[i] / b.v[i]); }
+// Same NaN behaviour as minps/maxps: the second operand wins.
+inline float4 min(float4 a, float4 b) { LABHELPER_SIMD_MAP(float4, a.v[i] < b.v[i] ? a.v[i] : b.v[i]); }
+inline float4 max(float4 a, float4 b) { LABHELPER_SIMD_MAP(float4, a.v[i] > b.v[i] ? a.v[i] : b.v[i]); }
+inline float4 sqrt(float4 a) { LABHELPER_SIMD_MAP(float4, std::sqrt(a.v[i])); }
+
+inline int4 asInt(float4 a)
+{
+	int4 r;
+	memcpy(r.v, a.v, sizeof(r.v));
+	return r;
+}
+inline float4 asFloat(int4 a)
+{
+	float4 r;
+	memcpy(r.v, a.v, sizeof(r.v));
+	return r;
+}
+inline int4 toInt(float4 a) { LABHELPER_SIMD_MAP(int4, int32_t(a.v[i])); }
+inline float4 toFloat(int4 a) { LABHELPER_SIMD_MAP(float4, float(a.v[i])); }
+
+inline int4 operator<(float4 a, float4 b) { LABHELPER_SIMD_MAP(int4, a.v[i] < b.v[i] ? -1 : 0); }
+inline int4 operator>(float4 a, float4 b) { LABHELPER_SIMD_MAP(int4, a.v[i] > b.v[i] ? -1 : 0); }
+inline int4 operator<=(float4 a, float4 b) { LABHELPER_SIMD_MAP(int4, a.v[i] <= b.v[i] ? -1 : 0); }
+inline int4 operator>=(float4 a, float4 b) { LABHELPER_SIMD_MAP(int4, a.v[i] >= b.v[i] ? -1 : 0); }
+inline int4 isnan(float4 a) { LABHELPER_SIMD_MAP(int4, a.v[i] != a.v[i] ? -1 : 0); }
+
+inline int4 operator+(int4 a, int4 b) { LABHELPER_SIMD_MAP(int4, int32_t(uint32_t(a.v[i]) + uint32_t(b.v[i]))); }
+inline int4 operator-(int4 a, int4 b) { LABHELPER_SIMD_MAP(int4, int32_t(uint32_t(a.v[i]) - uint32_t(b.v[i]))); }
+inline int4 operator&(int4 a, int4 b) { LABHELPER_SIMD_MAP(int4, a.v[i] & b.v[i]); }
+inline int4 operator|(int4 a, int4 b) { LABHELPER_SIMD_MAP(int4, a.v[i] | b.v[i]); }
+inline int4 operator^(int4 a, int4 b) { LABHELPER_SIMD_MAP(int4, a.v[i] ^ b.v[i]); }
+inline int4 andNot(int4 a, int4 mask) { LABHELPER_SIMD_MAP(int4, a.v[i] & ~mask.v[i]); }
+inline int4 operator<<(int4 a, int n) { LABHELPER_SIMD_MAP(int4, int32_t(uint32_t(a.v[i]) << n)); }
+inline int4 shiftRight(int4 a, int n) { LABHELPER_SIMD_MAP(int4, int32_t(uint32_t(a.v[i]) >> n)); }
+inline int4 operator>>(int4 a, int n) { LABHELPER_SIMD_MAP(int4, a.v[i] >> n); }
+inline int4 operator<(int4 a, int4 b) { LABHELPER_SIMD_MAP(int4, a.v[i] < b.v[i] ? -1 : 0); }
+inline int4 operator>(int4 a, int4 b) { LABHELPER_SIMD_MAP(int4, a.v[i] > b.v[i] ? -1 : 0); }
+inline int4 operator==(int4 a, int4 b) { LABHELPER_SIMD_MAP(int4, a.v[i] == b.v[i] ? -1 : 0); }
+inline int4 operator*(int4 a, int4 b) { LABHELPER_SIMD_MAP(int4, int32_t(uint32_t(a.v[i]) * uint32_t(b.v[i]))); }
+inline int4 min(int4 a, int4 b) { LABHELPER_SIMD_MAP(int4, a.v[i] < b.v[i] ? a.v[i] : b.v[i]); }
+inline int4 max(int4 a, int4 b) { LABHELPER_SIMD_MAP(int4, a.v[i] > b.v[i] ? a.v[i] : b.v[i]); }
+
+inline int4 select(int4 mask, int4 a, int4 b) { LABHELPER_SIMD_MAP(int4, (mask.v[i] & a.v[i]) | (~mask.v[i] & b.v[i])); }
+inline float4 select(int4 mask, float4 a, float4 b) { return asFloat(select(mask, asInt(a), asInt(b))); }
+inline int movemask(int4 mask)
+{
+	int bits = 0;
+	for(int i = 0; i < 4; i++)
+		bits |= (mask.v[i] < 0 ? 1 : 0) << i;
+	return bits;
+}
+
+inline void loadRGB(const float* p, float4& r, float4& g, float4& b)
+{
+	for(int i = 0; i < 4; i++)
+	{
+		r.v[i] = p[3 * i + 0];
+		g.v[i] = p[3 * i + 1];
+		b.v[i] = p[3 * i + 2];
+	}
+}
+
+inline int4 prefixSum(int4 a)
+{
+	int4 r = a;
+	for(int i = 1; i < 4; i++)
+		r.v[i] = int32_t(uint32_t(r.v[i - 1]) + uint32_t(a.v[i]));
+	return r;
+}
+inline int4 splatLast(int4 a) { return splat(a.v[3]); }
+
+inline void storeLow16(uint16_t* p, int4 a)
+{
+	for(int i = 0; i < 4; i++)
+		p[i] = uint16_t(a.v[i]);
+}
+
+#undef LABHELPER_SIMD_MAP
+#endif
+
+inline float4 operator-(float4 a) { return splat(0.0f) - a; }
+inline float4 abs(float4 a) { return asFloat(andNot(asInt(a), splat(int32_t(0x80000000)))); }
+/** Rounds towards negative infinity. Valid for |a| < 2^31. */
+inline float4 floor(float4 a)
+{
+	float4 t = toFloat(toInt(a));
+	return t - select(t > a, splat(1.0f), splat(0.0f));
+}
+inline float4 clamp(float4 a, float4 lo, float4 hi) { return min(max(a, lo), hi); }
+inline bool any(int4 mask) { return movemask(mask) != 0; }
+inline bool all(int4 mask) { return movemask(mask) == 0xf; }
+
+/**
+	* Float and float4 under the same names, for stencils written once for
+	* V = float and V = float4, so that the last few cells of a row run the
+	* same code one at a time.
+	*/
+template<class V> V loadAs(const float* p);
+template<> inline float loadAs<float>(const float* p) { return *p; }
+template<> inline float4 loadAs<float4>(const float* p) { return load(p); }
+template<class V> V splatAs(float x);
+template<> inline float splatAs<float>(float x) { return x; }
+template<> inline float4 splatAs<float4>(float x) { return splat(x); }
+inline void storeTo(float* p, float a) { *p = a; }
+inline void storeTo(float* p, float4 a) { store(p, a); }
+inline float minOf(float a, float b) { return std::min(a, b); }
+inline float4 minOf(float4 a, float4 b) { return min(a, b); }
+inline float maxOf(float a, float b) { return std::max(a, b); }
+inline float4 maxOf(float4 a, float4 b) { return max(a, b); }
+inline float sqrtOf(float a) { return std::sqrt(a); }
+inline float4 sqrtOf(float4 a) { return sqrt(a); }
+inline float select(bool mask, float a, float b) { return mask ? a : b; }
+inline bool any(bool mask) { return mask; }
+} // namespace simd
+} // namespace labhelper
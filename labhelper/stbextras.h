@@ -0,0 +1,13 @@
+#pragma once
+
+namespace labhelper
+{
+/**
+	* The deflate compressor that stb_image_write uses for PNGs (compiled in
+	* labhelper.cpp along with the rest of stb), which the header of the
+	* bundled version does not declare. Returns a zlib stream in memory
+	* from malloc(), to be released with free(), or nullptr. Higher quality
+	* searches further back for matches (stb uses 8).
+	*/
+unsigned char* zlibCompress(const unsigned char* data, int size, int* compressedSize, int quality = 8);
+} // namespace labhelper
@@ -0,0 +1,294 @@
+#include "texturecache.h"
+#include "filecache.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <stb_dxt.h>
+#include <stb_image.h>
+#include <stb_image_resize.h>
+
+namespace labhelper
+{
+namespace
+{
+std::string s_cache_directory = "texture_cache";
+
+// Bump whenever the layout of the cache files or the encoder changes.
+const uint32_t CACHE_MAGIC = 0x4354484c; // "LHTC"
+const uint32_t CACHE_VERSION = 1;
+
+struct CacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	uint32_t internalFormat;
+	uint32_t components;
+	uint32_t levels;
+	uint32_t reserved;
+};
+
+struct CacheLevel
+{
+	uint32_t width;
+	uint32_t height;
+	uint64_t offset;
+	uint64_t size;
+};
+
+std::atomic<int> s_nof_hits{ 0 };
+std::atomic<int> s_nof_encoded{ 0 };
+std::atomic<uint64_t> s_gpu_bytes{ 0 };
+std::atomic<uint64_t> s_uncompressed_bytes{ 0 };
+
+GLenum chooseFormat(int components)
+{
+	if(components == 1 && (GLEW_VERSION_3_0 || GLEW_ARB_texture_compression_rgtc))
+		return GL_COMPRESSED_RED_RGTC1;
+	if(components == 3 && GLEW_EXT_texture_compression_s3tc)
+		return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	if(components == 4 && GLEW_EXT_texture_compression_s3tc)
+		return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+	return components == 1 ? GL_R8 : components == 3 ? GL_RGB8 : GL_RGBA8;
+}
+
+bool isCompressed(GLenum format)
+{
+	return format == GL_COMPRESSED_RED_RGTC1 || format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+	       || format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+}
+
+size_t levelSize(GLenum format, int components, int width, int height)
+{
+	if(!isCompressed(format))
+		return size_t(width) * height * components;
+	size_t blockBytes = format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT ? 16 : 8;
+	return size_t((width + 3) / 4) * ((height + 3) / 4) * blockBytes;
+}
+
+// Compresses one level in 4x4 blocks. Blocks hanging over the edge of
+// levels that are not a multiple of four repeat the last row/column.
+void compressLevel(const uint8_t* pixels, int width, int height, int components, GLenum format, uint8_t* out)
+{
+	int blocksX = (width + 3) / 4;
+	int blocksY = (height + 3) / 4;
+	size_t blockBytes = format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT ? 16 : 8;
+	ThreadPool::global().parallelFor(
+	    0, blocksY,
+	    [&](int rowBegin, int rowEnd) {
+		    uint8_t block[16 * 4];
+		    for(int by = rowBegin; by < rowEnd; by++)
+		    {
+			    for(int bx = 0; bx < blocksX; bx++)
+			    {
+				    for(int y = 0; y < 4; y++)
+				    {
+					    int sy = std::min(by * 4 + y, height - 1);
+					    for(int x = 0; x < 4; x++)
+					    {
+						    int sx = std::min(bx * 4 + x, width - 1);
+						    const uint8_t* src = pixels + (size_t(sy) * width + sx) * components;
+						    uint8_t* dst = block + (y * 4 + x) * (components == 1 ? 1 : 4);
+						    for(int c = 0; c < components; c++)
+							    dst[c] = src[c];
+						    if(components == 3)
+							    dst[3] = 255;
+					    }
+				    }
+				    uint8_t* dest = out + (size_t(by) * blocksX + bx) * blockBytes;
+				    if(format == GL_COMPRESSED_RED_RGTC1)
+					    stb_compress_bc4_block(dest, block);
+				    else
+					    stb_compress_dxt_block(dest, block, components == 4 ? 1 : 0, STB_DXT_HIGHQUAL);
+			    }
+		    }
+	    },
+	    8);
+}
+
+// Points the levels of texture into data (a complete cache file), after
+// checking that it matches what the caller expects.
+bool parseCache(const uint8_t* data, size_t size, const CacheHeader& expected, CachedTexture& texture)
+{
+	if(data == nullptr || size < sizeof(CacheHeader))
+		return false;
+	CacheHeader header;
+	memcpy(&header, data, sizeof(header));
+	if(header.magic != expected.magic || header.version != expected.version
+	   || header.sourceSize != expected.sourceSize || header.sourceTime != expected.sourceTime
+	   || header.internalFormat != expected.internalFormat || header.components != expected.components
+	   || header.levels == 0 || header.levels > 32
+	   || size < sizeof(CacheHeader) + header.levels * sizeof(CacheLevel))
+		return false;
+
+	texture.internalFormat = header.internalFormat;
+	texture.compressed = isCompressed(header.internalFormat);
+	texture.components = int(header.components);
+	texture.levels.resize(header.levels);
+	for(uint32_t i = 0; i < header.levels; i++)
+	{
+		CacheLevel level;
+		memcpy(&level, data + sizeof(CacheHeader) + i * sizeof(CacheLevel), sizeof(level));
+		if(level.offset > size || level.size > size - level.offset
+		   || level.size != levelSize(header.internalFormat, header.components, level.width, level.height))
+			return false;
+		texture.levels[i] = { int(level.width), int(level.height), data + level.offset, size_t(level.size) };
+	}
+	return true;
+}
+
+// Decodes the source image and builds the complete cache file in memory.
+bool encode(const std::string& filename, const CacheHeader& header, std::vector<uint8_t>& file)
+{
+	int width, height, components;
+	uint8_t* pixels = stbi_load(filename.c_str(), &width, &height, &components, int(header.components));
+	if(pixels == nullptr)
+		return false;
+	components = int(header.components);
+
+	// Box filter each level from the previous one, like glGenerateMipmap.
+	// Wrapping at the edges keeps tiling textures seamless.
+	std::vector<std::vector<uint8_t>> mips;
+	mips.emplace_back(pixels, pixels + size_t(width) * height * components);
+	stbi_image_free(pixels);
+	std::vector<std::pair<int, int>> sizes = { { width, height } };
+	while(sizes.back().first > 1 || sizes.back().second > 1)
+	{
+		int w = sizes.back().first, h = sizes.back().second;
+		int nw = std::max(1, w / 2), nh = std::max(1, h / 2);
+		std::vector<uint8_t> next(size_t(nw) * nh * components);
+		stbir_resize_uint8_generic(mips.back().data(), w, h, 0, next.data(), nw, nh, 0, components,
+		                           STBIR_ALPHA_CHANNEL_NONE, 0, STBIR_EDGE_WRAP, STBIR_FILTER_BOX,
+		                           STBIR_COLORSPACE_LINEAR, nullptr);
+		mips.push_back(std::move(next));
+		sizes.push_back({ nw, nh });
+	}
+
+	CacheHeader h = header;
+	h.levels = uint32_t(mips.size());
+	std::vector<CacheLevel> table(mips.size());
+	size_t offset = sizeof(CacheHeader) + table.size() * sizeof(CacheLevel);
+	for(size_t i = 0; i < mips.size(); i++)
+	{
+		offset = (offset + 15) & ~size_t(15);
+		table[i].width = uint32_t(sizes[i].first);
+		table[i].height = uint32_t(sizes[i].second);
+		table[i].offset = offset;
+		table[i].size = levelSize(h.internalFormat, components, sizes[i].first, sizes[i].second);
+		offset += table[i].size;
+	}
+
+	file.assign(offset, 0);
+	memcpy(file.data(), &h, sizeof(h));
+	memcpy(file.data() + sizeof(h), table.data(), table.size() * sizeof(CacheLevel));
+	for(size_t i = 0; i < mips.size(); i++)
+	{
+		uint8_t* dest = file.data() + table[i].offset;
+		if(isCompressed(h.internalFormat))
+			compressLevel(mips[i].data(), sizes[i].first, sizes[i].second, components, h.internalFormat, dest);
+		else
+			memcpy(dest, mips[i].data(), mips[i].size());
+	}
+	return true;
+}
+
+} // namespace
+
+size_t CachedTexture::sizeInBytes() const
+{
+	size_t size = 0;
+	for(const Level& level : levels)
+		size += level.size;
+	return size;
+}
+
+void setTextureCacheDirectory(const std::string& directory)
+{
+	s_cache_directory = directory;
+}
+
+std::string textureCachePath(const std::string& source, const std::string& variant, const std::string& extension)
+{
+	if(s_cache_directory.empty())
+		return std::string();
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long)hashString(source, hashString(variant)));
+	return s_cache_directory + "/" + name + extension;
+}
+
+bool loadCachedTexture(const std::string& filename, int components, CachedTexture& texture)
+{
+	CacheHeader expected = {};
+	expected.magic = CACHE_MAGIC;
+	expected.version = CACHE_VERSION;
+	expected.internalFormat = chooseFormat(components);
+	expected.components = uint32_t(components);
+	FileStamp stamp;
+	if(!getFileStamp(filename, stamp))
+	{
+		std::cout << "Failed to load texture: " << filename << "\n";
+		return false;
+	}
+	expected.sourceSize = stamp.size;
+	expected.sourceTime = stamp.time;
+
+	std::string cacheFile = textureCachePath(filename, std::to_string(expected.internalFormat), ".ltc");
+	if(!cacheFile.empty() && texture.file.open(cacheFile)
+	   && parseCache(texture.file.data(), texture.file.size(), expected, texture))
+	{
+		texture.fromCache = true;
+		s_nof_hits++;
+		return true;
+	}
+	texture.file.close();
+
+	if(!encode(filename, expected, texture.storage))
+	{
+		std::cout << "Failed to load texture: " << filename << "\n";
+		return false;
+	}
+	parseCache(texture.storage.data(), texture.storage.size(), expected, texture);
+	texture.fromCache = false;
+	s_nof_encoded++;
+	if(!cacheFile.empty())
+		writeFileAtomic(cacheFile, texture.storage.data(), texture.storage.size());
+	return true;
+}
+
+void uploadCachedTexture(const CachedTexture& texture)
+{
+	GLint alignment;
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	GLenum format = texture.components == 1 ? GL_RED : texture.components == 3 ? GL_RGB : GL_RGBA;
+	for(size_t i = 0; i < texture.levels.size(); i++)
+	{
+		const CachedTexture::Level& level = texture.levels[i];
+		if(texture.compressed)
+			glCompressedTexImage2D(GL_TEXTURE_2D, GLint(i), texture.internalFormat, level.width, level.height,
+			                       0, GLsizei(level.size), level.data);
+		else
+			glTexImage2D(GL_TEXTURE_2D, GLint(i), texture.internalFormat, level.width, level.height, 0, format,
+			             GL_UNSIGNED_BYTE, level.data);
+	}
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, GLint(texture.levels.size()) - 1);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+
+	s_gpu_bytes += texture.sizeInBytes();
+	for(const CachedTexture::Level& level : texture.levels)
+		s_uncompressed_bytes += levelSize(GL_RGBA8, texture.components, level.width, level.height);
+}
+
+void printTextureCacheStats()
+{
+	std::cout << "Textures: " << s_nof_hits << " from cache, " << s_nof_encoded << " encoded, "
+	          << s_gpu_bytes / (1024.0 * 1024.0) << " MB on the GPU ("
+	          << s_uncompressed_bytes / (1024.0 * 1024.0) << " MB uncompressed)\n";
+}
+} // namespace labhelper
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <GL/glew.h>
+
+#include "mappedfile.h"
+
+namespace labhelper
+{
+/**
+	* A texture with its complete mip chain, ready to be handed to GL as is.
+	* Levels point either into a mapped cache file or into storage owned by
+	* the image itself.
+	*/
+struct CachedTexture
+{
+	struct Level
+	{
+		int width, height;
+		const uint8_t* data;
+		size_t size;
+	};
+
+	/**
+		* GL_COMPRESSED_* for block compressed data, otherwise GL_R8, GL_RGB8 or
+		* GL_RGBA8 with tightly packed rows.
+		*/
+	GLenum internalFormat = 0;
+	bool compressed = false;
+	int components = 0;
+	std::vector<Level> levels;
+	bool fromCache = false;
+
+	int width() const { return levels.empty() ? 0 : levels[0].width; }
+	int height() const { return levels.empty() ? 0 : levels[0].height; }
+	size_t sizeInBytes() const;
+
+	MappedFile file;
+	std::vector<uint8_t> storage;
+};
+
+/**
+	* Sets the directory where encoded textures are stored. The default is
+	* "texture_cache" relative to the working directory. An empty string
+	* disables writing (and reading) the cache, so every load re-encodes.
+	*/
+void setTextureCacheDirectory(const std::string& directory);
+
+/**
+	* Names the entry for data derived from source (e.g. a converted HDR map,
+	* see PackedHdrImage) in the texture cache directory, or returns "" when
+	* the cache is disabled.
+	*/
+std::string textureCachePath(const std::string& source, const std::string& variant, const std::string& extension);
+
+/**
+	* Loads an 8-bit image with all its mip levels precomputed.
+	*
+	* The first load of a file decodes it, builds the mip chain on the CPU and,
+	* if the driver supports it, block compresses every level: BC4 (RGTC1) for
+	* one component, BC1 for three and BC3 for four (both S3TC). The result is
+	* written to the cache, keyed on the path and validated against the source
+	* file's size and modification time. Later loads just map the cache file.
+	*
+	* Does not touch GL state, so it can run on any thread once glewInit() has
+	* been called. Returns false if the source image could not be loaded.
+	*/
+bool loadCachedTexture(const std::string& filename, int components, CachedTexture& texture);
+
+/**
+	* Uploads every level of texture into the currently bound GL_TEXTURE_2D and
+	* sets GL_TEXTURE_MAX_LEVEL to match. Must be called on the GL thread.
+	*/
+void uploadCachedTexture(const CachedTexture& texture);
+
+/**
+	* Prints the cache hits, misses and the GPU memory used by textures loaded
+	* so far compared to uncompressed RGB(A)8 with full mip chains.
+	*/
+void printTextureCacheStats();
+} // namespace labhelper
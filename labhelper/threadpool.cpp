@@ -0,0 +1,155 @@
+#include "threadpool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+namespace labhelper
+{
+ThreadPool::ThreadPool(unsigned numThreads)
+{
+	if(numThreads == 0)
+	{
+		numThreads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	for(unsigned i = 0; i < numThreads; i++)
+	{
+		workers.emplace_back(&ThreadPool::workerLoop, this);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	condition.notify_all();
+	for(auto& worker : workers)
+	{
+		worker.join();
+	}
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> task)
+{
+	std::packaged_task<void()> packaged(std::move(task));
+	std::future<void> future = packaged.get_future();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks.push_back(std::move(packaged));
+	}
+	condition.notify_one();
+	return future;
+}
+
+void ThreadPool::workerLoop()
+{
+	for(;;)
+	{
+		std::packaged_task<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+			if(tasks.empty())
+			{
+				return;
+			}
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		task();
+	}
+}
+
+void ThreadPool::parallelFor(int begin, int end, const std::function<void(int, int)>& body, int grainSize)
+{
+	if(end <= begin)
+	{
+		return;
+	}
+	grainSize = std::max(1, grainSize);
+	int numChunks = (end - begin + grainSize - 1) / grainSize;
+	if(numChunks == 1)
+	{
+		body(begin, end);
+		return;
+	}
+
+	// Helpers may only get to run after this call has returned (if every
+	// worker is busy), so everything they touch is reference counted.
+	struct State
+	{
+		std::function<void(int, int)> body;
+		int begin, end, grainSize, numChunks;
+		std::atomic<int> nextChunk{ 0 };
+		std::atomic<int> chunksLeft{ 0 };
+		std::mutex mutex;
+		std::condition_variable done;
+		// The first exception a chunk threw; the chunks after it are skipped
+		std::exception_ptr error;
+		std::atomic<bool> failed{ false };
+	};
+	auto state = std::make_shared<State>();
+	state->body = body;
+	state->begin = begin;
+	state->end = end;
+	state->grainSize = grainSize;
+	state->numChunks = numChunks;
+	state->chunksLeft = numChunks;
+
+	auto work = [state]() {
+		for(;;)
+		{
+			int chunk = state->nextChunk.fetch_add(1);
+			if(chunk >= state->numChunks)
+			{
+				return;
+			}
+			int chunkBegin = state->begin + chunk * state->grainSize;
+			if(!state->failed.load())
+			{
+				// Every chunk must be counted below, or the caller waits forever.
+				try
+				{
+					state->body(chunkBegin, std::min(state->end, chunkBegin + state->grainSize));
+				}
+				catch(...)
+				{
+					std::lock_guard<std::mutex> lock(state->mutex);
+					if(!state->failed.exchange(true))
+					{
+						state->error = std::current_exception();
+					}
+				}
+			}
+			if(state->chunksLeft.fetch_sub(1) == 1)
+			{
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->done.notify_all();
+			}
+		}
+	};
+
+	int numHelpers = std::min(int(workers.size()), numChunks - 1);
+	for(int i = 0; i < numHelpers; i++)
+	{
+		submit(work);
+	}
+	work();
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->done.wait(lock, [&state] { return state->chunksLeft.load() == 0; });
+	if(state->error)
+	{
+		std::rethrow_exception(state->error);
+	}
+}
+
+ThreadPool& ThreadPool::global()
+{
+	static ThreadPool pool;
+	return pool;
+}
+} // namespace labhelper
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace labhelper
+{
+/**
+	* A fixed set of worker threads that run submitted tasks in FIFO order.
+	*/
+class ThreadPool
+{
+public:
+	/**
+		* numThreads == 0 means one worker per hardware thread.
+		*/
+	explicit ThreadPool(unsigned numThreads = 0);
+	~ThreadPool();
+
+	/**
+		* Queues a task. The future becomes ready when it has run, and rethrows
+		* anything the task threw.
+		*/
+	std::future<void> submit(std::function<void()> task);
+
+	/**
+		* Calls body(rangeBegin, rangeEnd) for consecutive chunks of at most
+		* grainSize indices covering [begin, end), and blocks until all are done.
+		* The calling thread works on chunks too, so this may be called from
+		* inside a task running on the same pool. Which thread gets which chunk
+		* is not specified; the chunk boundaries only depend on the arguments.
+		* If body throws, the chunks not yet started are skipped and the first
+		* exception is rethrown here once the running ones are done.
+		*/
+	void parallelFor(int begin, int end, const std::function<void(int, int)>& body, int grainSize = 1);
+
+	unsigned size() const { return unsigned(workers.size()); }
+
+	/**
+		* Pool shared by everything that does not need a specific thread count.
+		*/
+	static ThreadPool& global();
+
+private:
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	void workerLoop();
+
+	std::vector<std::thread> workers;
+	std::deque<std::packaged_task<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool stopping = false;
+};
+
+/**
+	* Calls body(rangeBegin, rangeEnd) over [0, count) in chunks of grainSize
+	* on pool, or once on the calling thread if pool is null or count fits in
+	* one chunk.
+	*/
+template<typename Body>
+void forRange(ThreadPool* pool, int count, int grainSize, const Body& body)
+{
+	if(pool != nullptr && count > grainSize)
+		pool->parallelFor(0, count, body, grainSize);
+	else
+		body(0, count);
+}
+
+/**
+	* Mixes two integers into a well spread hash, for random numbers keyed by
+	* seed and index that come out the same however the work is split between
+	* threads.
+	*/
+inline uint32_t hash(uint32_t a, uint32_t b)
+{
+	uint32_t h = a * 0x9e3779b9u ^ (b + 0x7f4a7c15u + (a << 6) + (a >> 2));
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	return h;
+}
+
+/**
+	* In [0, 1), from the top 24 bits of a hash.
+	*/
+inline float unitFloat(uint32_t h)
+{
+	return float(h >> 8) * (1.0f / 16777216.0f);
+}
+} // namespace labhelper
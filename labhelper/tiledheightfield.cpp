@@ -0,0 +1,564 @@
+#include "tiledheightfield.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define VC_EXTRALEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace labhelper
+{
+namespace
+{
+const uint32_t TILED_MAGIC = 0x46544c48; // "HLTF"
+const uint32_t TILED_VERSION = 1;
+
+// Tiles start on page boundaries so that they can be dropped from memory one
+// by one.
+const uint64_t TILE_ALIGNMENT = 4096;
+
+struct Header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t tile_size;
+	uint32_t levels;
+	uint32_t tile_count;
+	uint32_t reserved[9];
+};
+static_assert(sizeof(Header) == 64, "the tile index starts 64 bytes into the file");
+static_assert(sizeof(TiledHeightfieldTile) == 24, "tile index entries are 24 bytes");
+
+uint64_t alignUp(uint64_t value, uint64_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+uint64_t tileBytes(int tileSize, int level)
+{
+	return uint64_t(tileSize) * tileSize * sizeof(float) * (level == 0 ? 1 : 3);
+}
+
+/**
+	* Lays out the pyramid and the tile offsets. Returns the file size.
+	*/
+uint64_t layout(int width, int height, int tileSize, std::vector<TiledHeightfieldLevel>& levels,
+                std::vector<TiledHeightfieldTile>& tiles)
+{
+	levels.clear();
+	size_t tile_count = 0;
+	for(;;)
+	{
+		TiledHeightfieldLevel level;
+		level.width = width;
+		level.height = height;
+		level.tiles_x = (width + tileSize - 1) / tileSize;
+		level.tiles_y = (height + tileSize - 1) / tileSize;
+		level.first_tile = tile_count;
+		levels.push_back(level);
+		tile_count += size_t(level.tiles_x) * level.tiles_y;
+		if(level.tiles_x == 1 && level.tiles_y == 1)
+			break;
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+	}
+
+	tiles.assign(tile_count, TiledHeightfieldTile{});
+	uint64_t offset = alignUp(sizeof(Header) + tile_count * sizeof(TiledHeightfieldTile), TILE_ALIGNMENT);
+	for(size_t l = 0; l < levels.size(); l++)
+	{
+		size_t level_tiles = size_t(levels[l].tiles_x) * levels[l].tiles_y;
+		for(size_t i = 0; i < level_tiles; i++)
+		{
+			tiles[levels[l].first_tile + i].offset = offset;
+			offset += alignUp(tileBytes(tileSize, int(l)), TILE_ALIGNMENT);
+		}
+	}
+	return offset;
+}
+
+/**
+	* Repeats the last valid column and row of a tile over the rest of it.
+	*/
+void padTile(float* plane, int tileSize, int valid_width, int valid_height)
+{
+	for(int y = 0; y < tileSize; y++)
+	{
+		float* row = plane + size_t(y) * tileSize;
+		if(y >= valid_height)
+			memcpy(row, plane + size_t(valid_height - 1) * tileSize, tileSize * sizeof(float));
+		else
+			std::fill(row + valid_width, row + tileSize, row[valid_width - 1]);
+	}
+}
+
+#ifdef _WIN32
+bool writeAt(void* file, uint64_t offset, const void* data, size_t size)
+{
+	const char* bytes = static_cast<const char*>(data);
+	while(size > 0)
+	{
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = DWORD(offset);
+		overlapped.OffsetHigh = DWORD(offset >> 32);
+		DWORD chunk = DWORD(std::min<size_t>(size, 1 << 30)), written = 0;
+		if(!WriteFile(file, bytes, chunk, &written, &overlapped) || written == 0)
+			return false;
+		bytes += written;
+		offset += written;
+		size -= written;
+	}
+	return true;
+}
+
+bool readAt(void* file, uint64_t offset, void* data, size_t size)
+{
+	char* bytes = static_cast<char*>(data);
+	while(size > 0)
+	{
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = DWORD(offset);
+		overlapped.OffsetHigh = DWORD(offset >> 32);
+		DWORD chunk = DWORD(std::min<size_t>(size, 1 << 30)), read = 0;
+		if(!ReadFile(file, bytes, chunk, &read, &overlapped) || read == 0)
+			return false;
+		bytes += read;
+		offset += read;
+		size -= read;
+	}
+	return true;
+}
+#else
+bool writeAt(int file, uint64_t offset, const void* data, size_t size)
+{
+	const char* bytes = static_cast<const char*>(data);
+	while(size > 0)
+	{
+		ssize_t written = pwrite(file, bytes, size, off_t(offset));
+		if(written <= 0)
+			return false;
+		bytes += written;
+		offset += uint64_t(written);
+		size -= size_t(written);
+	}
+	return true;
+}
+
+bool readAt(int file, uint64_t offset, void* data, size_t size)
+{
+	char* bytes = static_cast<char*>(data);
+	while(size > 0)
+	{
+		ssize_t read = pread(file, bytes, size, off_t(offset));
+		if(read <= 0)
+			return false;
+		bytes += read;
+		offset += uint64_t(read);
+		size -= size_t(read);
+	}
+	return true;
+}
+#endif
+} // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+// Writer
+///////////////////////////////////////////////////////////////////////////////
+TiledHeightfieldWriter::~TiledHeightfieldWriter()
+{
+	close();
+}
+
+bool TiledHeightfieldWriter::create(const std::string& filename, int width, int height, int tileSize)
+{
+	close();
+	if(width <= 0 || height <= 0 || tileSize < 16 || tileSize > 4096 || (tileSize & (tileSize - 1)) != 0)
+	{
+		std::cout << "Invalid size for tiled heightfield " << filename << "\n";
+		return false;
+	}
+	m_filename = filename;
+	m_width = width;
+	m_height = height;
+	m_tile_size = tileSize;
+	m_failed = false;
+	uint64_t file_size = layout(width, height, tileSize, m_levels, m_tiles);
+	m_written.assign(size_t(m_levels[0].tiles_x) * m_levels[0].tiles_y, 0);
+
+	// The file is grown to its full size up front, so that tiles can be
+	// written in any order. It stays sparse until they are.
+	bool created;
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+	                          FILE_ATTRIBUTE_NORMAL, nullptr);
+	created = file != INVALID_HANDLE_VALUE;
+	if(created)
+	{
+		m_file = file;
+		LARGE_INTEGER size;
+		size.QuadPart = LONGLONG(file_size);
+		created = SetFilePointerEx(file, size, nullptr, FILE_BEGIN) && SetEndOfFile(file);
+	}
+#else
+	m_file = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	created = m_file >= 0 && ftruncate(m_file, off_t(file_size)) == 0;
+#endif
+	if(!created)
+	{
+		std::cout << "Could not create tiled heightfield " << filename << "\n";
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool TiledHeightfieldWriter::writeTile(int tx, int ty, const float* heights)
+{
+	const TiledHeightfieldLevel& level = m_levels[0];
+	if(tx < 0 || ty < 0 || tx >= level.tiles_x || ty >= level.tiles_y)
+	{
+		return false;
+	}
+	int valid_width = std::min(m_tile_size, m_width - tx * m_tile_size);
+	int valid_height = std::min(m_tile_size, m_height - ty * m_tile_size);
+
+	std::vector<float> padded(heights, heights + size_t(m_tile_size) * m_tile_size);
+	padTile(padded.data(), m_tile_size, valid_width, valid_height);
+
+	size_t index = level.first_tile + size_t(ty) * level.tiles_x + tx;
+	TiledHeightfieldTile& tile = m_tiles[index];
+	tile.min = tile.max = padded[0];
+	double sum = 0.0;
+	for(int y = 0; y < valid_height; y++)
+	{
+		for(int x = 0; x < valid_width; x++)
+		{
+			float h = padded[size_t(y) * m_tile_size + x];
+			tile.min = std::min(tile.min, h);
+			tile.max = std::max(tile.max, h);
+			sum += h;
+		}
+	}
+	tile.avg = float(sum / (double(valid_width) * valid_height));
+
+	if(!writeAt(m_file, tile.offset, padded.data(), padded.size() * sizeof(float)))
+	{
+		std::cout << "Could not write to tiled heightfield " << m_filename << "\n";
+		m_failed = true;
+		return false;
+	}
+	m_written[index - level.first_tile] = 1;
+	return true;
+}
+
+bool TiledHeightfieldWriter::buildTile(int l, int tx, int ty)
+{
+	const TiledHeightfieldLevel& level = m_levels[l];
+	const TiledHeightfieldLevel& below = m_levels[l - 1];
+	size_t plane_size = size_t(m_tile_size) * m_tile_size;
+	std::vector<float> planes(plane_size * 3);
+	std::vector<float> child(plane_size * 3);
+	int half = m_tile_size / 2;
+
+	// Each quadrant of the tile comes from one tile on the level below. The
+	// tiles below are padded with their edge texels, so texels past the edge
+	// of that level do not need to be treated specially.
+	for(int qy = 0; qy < 2; qy++)
+	{
+		for(int qx = 0; qx < 2; qx++)
+		{
+			int cx = tx * 2 + qx, cy = ty * 2 + qy;
+			if(cx >= below.tiles_x || cy >= below.tiles_y)
+				continue;
+			const TiledHeightfieldTile& source = m_tiles[below.first_tile + size_t(cy) * below.tiles_x + cx];
+			if(!readAt(m_file, source.offset, child.data(), size_t(tileBytes(m_tile_size, l - 1))))
+				return false;
+			const float* child_min = child.data();
+			const float* child_avg = l - 1 == 0 ? child_min : child_min + plane_size;
+			const float* child_max = l - 1 == 0 ? child_min : child_min + plane_size * 2;
+			for(int y = 0; y < half; y++)
+			{
+				for(int x = 0; x < half; x++)
+				{
+					size_t c = size_t(y * 2) * m_tile_size + x * 2;
+					size_t r = c + m_tile_size;
+					size_t out = size_t(qy * half + y) * m_tile_size + qx * half + x;
+					planes[out] = std::min(std::min(child_min[c], child_min[c + 1]),
+					                       std::min(child_min[r], child_min[r + 1]));
+					planes[plane_size + out] =
+					    0.25f * (child_avg[c] + child_avg[c + 1] + child_avg[r] + child_avg[r + 1]);
+					planes[plane_size * 2 + out] = std::max(std::max(child_max[c], child_max[c + 1]),
+					                                        std::max(child_max[r], child_max[r + 1]));
+				}
+			}
+		}
+	}
+
+	int valid_width = std::min(m_tile_size, level.width - tx * m_tile_size);
+	int valid_height = std::min(m_tile_size, level.height - ty * m_tile_size);
+	for(int p = 0; p < 3; p++)
+		padTile(planes.data() + plane_size * p, m_tile_size, valid_width, valid_height);
+
+	TiledHeightfieldTile& tile = m_tiles[level.first_tile + size_t(ty) * level.tiles_x + tx];
+	tile.min = planes[0];
+	tile.max = planes[plane_size * 2];
+	double sum = 0.0;
+	for(int y = 0; y < valid_height; y++)
+	{
+		for(int x = 0; x < valid_width; x++)
+		{
+			size_t i = size_t(y) * m_tile_size + x;
+			tile.min = std::min(tile.min, planes[i]);
+			sum += planes[plane_size + i];
+			tile.max = std::max(tile.max, planes[plane_size * 2 + i]);
+		}
+	}
+	tile.avg = float(sum / (double(valid_width) * valid_height));
+	return writeAt(m_file, tile.offset, planes.data(), planes.size() * sizeof(float));
+}
+
+bool TiledHeightfieldWriter::finish()
+{
+	if(m_levels.empty())
+	{
+		return false;
+	}
+	bool complete = std::find(m_written.begin(), m_written.end(), 0) == m_written.end();
+	if(!complete || m_failed)
+	{
+		std::cout << "Tiled heightfield " << m_filename << " is missing tiles\n";
+		close();
+		return false;
+	}
+
+	for(int l = 1; l < int(m_levels.size()) && !m_failed; l++)
+	{
+		const TiledHeightfieldLevel& level = m_levels[l];
+		ThreadPool::global().parallelFor(0, level.tiles_x * level.tiles_y, [&](int begin, int end) {
+			for(int i = begin; i < end; i++)
+			{
+				if(!buildTile(l, i % level.tiles_x, i / level.tiles_x))
+					m_failed = true;
+			}
+		});
+	}
+
+	// The header goes last, so that a file which was not finished is never
+	// mistaken for a complete one.
+	Header header = {};
+	header.width = uint32_t(m_width);
+	header.height = uint32_t(m_height);
+	header.tile_size = uint32_t(m_tile_size);
+	header.levels = uint32_t(m_levels.size());
+	header.tile_count = uint32_t(m_tiles.size());
+	header.magic = TILED_MAGIC;
+	header.version = TILED_VERSION;
+	bool ok = !m_failed
+	          && writeAt(m_file, sizeof(Header), m_tiles.data(), m_tiles.size() * sizeof(TiledHeightfieldTile))
+	          && writeAt(m_file, 0, &header, sizeof(header));
+	if(!ok)
+	{
+		std::cout << "Could not write to tiled heightfield " << m_filename << "\n";
+	}
+	close();
+	return ok;
+}
+
+void TiledHeightfieldWriter::close()
+{
+#ifdef _WIN32
+	if(m_file != nullptr)
+		CloseHandle(m_file);
+	m_file = nullptr;
+#else
+	if(m_file >= 0)
+		::close(m_file);
+	m_file = -1;
+#endif
+	m_levels.clear();
+	m_tiles.clear();
+	m_written.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reader
+///////////////////////////////////////////////////////////////////////////////
+bool TiledHeightfield::open(const std::string& filename, size_t pageBudget)
+{
+	close();
+	Header header;
+	bool valid = m_file.open(filename) && m_file.size() >= sizeof(Header);
+	if(valid)
+	{
+		memcpy(&header, m_file.data(), sizeof(header));
+		valid = header.magic == TILED_MAGIC && header.version == TILED_VERSION && header.width > 0
+		        && header.height > 0 && header.tile_size >= 16 && header.tile_size <= 4096
+		        && (header.tile_size & (header.tile_size - 1)) == 0 && header.width <= INT32_MAX
+		        && header.height <= INT32_MAX
+		        && sizeof(Header) + uint64_t(header.tile_count) * sizeof(TiledHeightfieldTile) <= m_file.size()
+		        // Bounds what layout() allocates, before it is checked below
+		        && uint64_t((header.width + header.tile_size - 1) / header.tile_size)
+		                   * ((header.height + header.tile_size - 1) / header.tile_size)
+		               <= header.tile_count;
+	}
+	if(valid)
+	{
+		uint64_t file_size = layout(int(header.width), int(header.height), int(header.tile_size), m_levels, m_tiles);
+		valid = m_levels.size() == header.levels && m_tiles.size() == header.tile_count
+		        && m_file.size() >= file_size;
+	}
+	if(valid)
+	{
+		// The offsets follow from the layout, which has been checked against
+		// the file size; the file's table only adds the statistics. A table
+		// that disagrees means a corrupt file, and trusting it could read
+		// past the mapping.
+		std::vector<TiledHeightfieldTile> stored(m_tiles.size());
+		memcpy(stored.data(), m_file.data() + sizeof(Header), stored.size() * sizeof(TiledHeightfieldTile));
+		for(size_t i = 0; i < stored.size() && valid; i++)
+		{
+			valid = stored[i].offset == m_tiles[i].offset;
+		}
+		m_tiles.swap(stored);
+	}
+	if(!valid)
+	{
+		std::cout << "Not a tiled heightfield, or not finished: " << filename << "\n";
+		close();
+		return false;
+	}
+	m_tile_size = int(header.tile_size);
+	m_page_budget = pageBudget;
+	return true;
+}
+
+void TiledHeightfield::close()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_file.close();
+	m_levels.clear();
+	m_tiles.clear();
+	m_lru.clear();
+	m_lru_entries.clear();
+	m_resident = 0;
+	m_tile_size = 0;
+}
+
+size_t TiledHeightfield::tileBytes(int level) const
+{
+	return size_t(labhelper::tileBytes(m_tile_size, level));
+}
+
+const TiledHeightfieldTile& TiledHeightfield::tileInfo(int level, int tx, int ty) const
+{
+	const TiledHeightfieldLevel& l = m_levels[level];
+	return m_tiles[l.first_tile + size_t(ty) * l.tiles_x + tx];
+}
+
+TiledHeightfield::TileData TiledHeightfield::tile(int level, int tx, int ty)
+{
+	const TiledHeightfieldLevel& l = m_levels[level];
+	size_t index = l.first_tile + size_t(ty) * l.tiles_x + tx;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto entry = m_lru_entries.find(index);
+		if(entry != m_lru_entries.end())
+		{
+			m_lru.splice(m_lru.begin(), m_lru, entry->second);
+		}
+		else
+		{
+			m_lru.push_front(index);
+			m_lru_entries[index] = m_lru.begin();
+			m_resident += tileBytes(level);
+		}
+		trim();
+	}
+
+	const float* heights = reinterpret_cast<const float*>(m_file.data() + m_tiles[index].offset);
+	size_t plane_size = size_t(m_tile_size) * m_tile_size;
+	TileData data;
+	data.min = heights;
+	data.avg = level == 0 ? heights : heights + plane_size;
+	data.max = level == 0 ? heights : heights + plane_size * 2;
+	return data;
+}
+
+void TiledHeightfield::readRegion(int level, int x, int y, int width, int height, float* out)
+{
+	const TiledHeightfieldLevel& l = m_levels[level];
+	if(width <= 0 || height <= 0)
+	{
+		return;
+	}
+	// Clamping keeps the source coordinates sorted, so every tile covers one
+	// block of out and is only looked up once.
+	auto clampX = [&](int i) { return std::min(std::max(x + i, 0), l.width - 1); };
+	auto clampY = [&](int i) { return std::min(std::max(y + i, 0), l.height - 1); };
+	for(int row = 0; row < height;)
+	{
+		int ty = clampY(row) / m_tile_size;
+		int row_end = row;
+		while(row_end < height && clampY(row_end) / m_tile_size == ty)
+			row_end++;
+		for(int column = 0; column < width;)
+		{
+			int tx = clampX(column) / m_tile_size;
+			int column_end = column;
+			while(column_end < width && clampX(column_end) / m_tile_size == tx)
+				column_end++;
+			const float* avg = tile(level, tx, ty).avg;
+			for(int r = row; r < row_end; r++)
+			{
+				const float* source = avg + size_t(clampY(r) - ty * m_tile_size) * m_tile_size;
+				for(int c = column; c < column_end; c++)
+					out[size_t(r) * width + c] = source[clampX(c) - tx * m_tile_size];
+			}
+			column = column_end;
+		}
+		row = row_end;
+	}
+}
+
+void TiledHeightfield::trim()
+{
+	// Never drops the most recently used tile, which may have just been
+	// handed out.
+	while(m_resident > m_page_budget && m_lru.size() > 1)
+	{
+		size_t victim = m_lru.back();
+		int level = 0;
+		while(level + 1 < int(m_levels.size()) && m_levels[level + 1].first_tile <= victim)
+			level++;
+		m_file.evict(size_t(m_tiles[victim].offset), tileBytes(level));
+		m_resident -= tileBytes(level);
+		m_lru_entries.erase(victim);
+		m_lru.pop_back();
+	}
+}
+
+void TiledHeightfield::setPageBudget(size_t pageBudget)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_page_budget = pageBudget;
+	trim();
+}
+
+size_t TiledHeightfield::residentBytes() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_resident;
+}
+} // namespace labhelper
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mappedfile.h"
+
+namespace labhelper
+{
+/**
+	* An on-disk heightfield split into fixed-size square tiles, for fields
+	* that do not fit in memory.
+	*
+	* The file holds a mip pyramid: level 0 is the field itself, and every
+	* level after it halves the width and height until one tile covers it
+	* all. A texel on level l > 0 stores the min, average and max of the 2x2
+	* texels below it, so each of its tiles is three planes of
+	* tileSize * tileSize floats (min, avg, max); a level 0 tile is one. Tiles
+	* on the right and bottom edge are padded by repeating the last texel.
+	*
+	* The header is followed by an index of every tile on every level, with
+	* the offset of its data and the min/avg/max of the whole tile, so a
+	* reader can cull or pick levels without touching any tile data.
+	*/
+struct TiledHeightfieldTile
+{
+	uint64_t offset;
+	float min, avg, max;
+	uint32_t reserved;
+};
+
+struct TiledHeightfieldLevel
+{
+	int width, height;
+	int tiles_x, tiles_y;
+	size_t first_tile; // Index of its first tile in the tile index
+};
+
+/**
+	* Writes a tiled heightfield. Level 0 tiles may be written in any order
+	* and from any number of threads; finish() then builds the rest of the
+	* pyramid from them, a few tiles at a time, and writes the index.
+	*
+	* Example:
+	*	TiledHeightfieldWriter writer;
+	*	writer.create("world.lht", 65536, 65536);
+	*	ThreadPool::global().parallelFor(0, writer.tilesX() * writer.tilesY(), [&](int begin, int end) {
+	*		std::vector<float> tile(writer.tileSize() * writer.tileSize());
+	*		for(int i = begin; i < end; i++)
+	*			writer.writeTile(i % writer.tilesX(), i / writer.tilesX(), generate(i, tile));
+	*	});
+	*	writer.finish();
+	*/
+class TiledHeightfieldWriter
+{
+public:
+	TiledHeightfieldWriter() = default;
+	~TiledHeightfieldWriter();
+
+	/**
+		* Creates (or truncates) filename for a width * height field. tileSize
+		* must be a power of two from 16 to 4096. Returns false, after printing
+		* why, if the file could not be created.
+		*/
+	bool create(const std::string& filename, int width, int height, int tileSize = 256);
+
+	/**
+		* Writes level 0 tile (tx, ty) from tileSize * tileSize heights, row by
+		* row. Heights outside the field (on edge tiles) are ignored. Safe to
+		* call concurrently for different tiles.
+		*/
+	bool writeTile(int tx, int ty, const float* heights);
+
+	/**
+		* Builds the coarser levels on the global thread pool, writes the index
+		* and closes the file. Returns false, after printing why, if a tile was
+		* never written or the file could not be written. The file is only
+		* recognised by readers once this has succeeded.
+		*/
+	bool finish();
+
+	int tileSize() const { return m_tile_size; }
+	int tilesX() const { return m_levels.empty() ? 0 : m_levels[0].tiles_x; }
+	int tilesY() const { return m_levels.empty() ? 0 : m_levels[0].tiles_y; }
+
+private:
+	TiledHeightfieldWriter(const TiledHeightfieldWriter&) = delete;
+	TiledHeightfieldWriter& operator=(const TiledHeightfieldWriter&) = delete;
+
+	bool buildTile(int level, int tx, int ty);
+	void close();
+
+	std::string m_filename;
+	int m_width = 0, m_height = 0, m_tile_size = 0;
+	std::vector<TiledHeightfieldLevel> m_levels;
+	std::vector<TiledHeightfieldTile> m_tiles;
+	std::vector<uint8_t> m_written;
+	std::atomic<bool> m_failed{ false };
+#ifdef _WIN32
+	void* m_file = nullptr;
+#else
+	int m_file = -1;
+#endif
+};
+
+/**
+	* Random access to a tiled heightfield through a memory mapping of the
+	* whole file. Only the tiles that are asked for are read, and the memory
+	* they take is kept under a page budget by dropping the least recently
+	* used ones from memory.
+	*
+	* Dropped tiles are still mapped: pointers from tile() stay valid until
+	* close(), and reading through them again just reads the pages back from
+	* disk without counting against the budget. Call tile() again when a tile
+	* is going to be used for a while. All functions are thread-safe.
+	*/
+class TiledHeightfield
+{
+public:
+	/**
+		* Every plane points to the same heights on level 0.
+		*/
+	struct TileData
+	{
+		const float* min = nullptr;
+		const float* avg = nullptr;
+		const float* max = nullptr;
+	};
+
+	/**
+		* Returns false, after printing why, if filename is not a complete
+		* tiled heightfield.
+		*/
+	bool open(const std::string& filename, size_t pageBudget = size_t(256) << 20);
+	void close();
+
+	int width(int level = 0) const { return m_levels[level].width; }
+	int height(int level = 0) const { return m_levels[level].height; }
+	int levels() const { return int(m_levels.size()); }
+	int tileSize() const { return m_tile_size; }
+	int tilesX(int level = 0) const { return m_levels[level].tiles_x; }
+	int tilesY(int level = 0) const { return m_levels[level].tiles_y; }
+
+	/**
+		* The min/avg/max of a whole tile, from the index.
+		*/
+	const TiledHeightfieldTile& tileInfo(int level, int tx, int ty) const;
+
+	/**
+		* The tileSize * tileSize texels of a tile, row by row.
+		*/
+	TileData tile(int level, int tx, int ty);
+
+	/**
+		* Copies the average heights of a rectangle of a level into out, row by
+		* row, clamping coordinates outside the level to its edge.
+		*/
+	void readRegion(int level, int x, int y, int width, int height, float* out);
+
+	void setPageBudget(size_t pageBudget);
+	size_t residentBytes() const;
+
+private:
+	size_t tileBytes(int level) const;
+	void trim(); // Drops tiles until the budget is met. Needs m_mutex.
+
+	MappedFile m_file;
+	int m_tile_size = 0;
+	std::vector<TiledHeightfieldLevel> m_levels;
+	std::vector<TiledHeightfieldTile> m_tiles;
+
+	mutable std::mutex m_mutex;
+	size_t m_page_budget = 0;
+	size_t m_resident = 0;
+	std::list<size_t> m_lru; // Most recently used first
+	std::unordered_map<size_t, std::list<size_t>::iterator> m_lru_entries;
+};
+} // namespace labhelper
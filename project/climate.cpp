@@ -0,0 +1,210 @@
+#include "climate.h"
+#include "drainage.h"
+#include <threadpool.h>
+#include <algorithm>
+#include <cmath>
+
+using labhelper::forRange;
+
+namespace
+{
+// Stands in for infinity, so that differences of it stay finite
+const float far = 1e20f;
+
+// Squared distance along a line to the nearest sample, where sample i is
+// squared[i] away from the line already (Felzenszwalb and Huttenlocher).
+// parabolas and bounds are scratch space for count and count + 1 entries.
+void distanceAlong(const float *squared, int count, float *result,
+                   int *parabolas, float *bounds)
+{
+  int k = 0;
+  parabolas[0] = 0;
+  bounds[0] = -far;
+  bounds[1] = far;
+  for (int q = 1; q < count; q++)
+  {
+    // Drops the parabolas the new one is lower than everywhere they were
+    // the lowest, which never includes the first bound
+    float s;
+    for (;;)
+    {
+      int v = parabolas[k];
+      s = ((squared[q] + float(q) * q) - (squared[v] + float(v) * v)) /
+          float(2 * (q - v));
+      if (s > bounds[k])
+      {
+        break;
+      }
+      k--;
+    }
+    k++;
+    parabolas[k] = q;
+    bounds[k] = s;
+    bounds[k + 1] = far;
+  }
+  k = 0;
+  for (int q = 0; q < count; q++)
+  {
+    while (bounds[k + 1] < q)
+    {
+      k++;
+    }
+    int v = parabolas[k];
+    result[q] = float(q - v) * (q - v) + squared[v];
+  }
+}
+
+float smoothstep(float edge0, float edge1, float x)
+{
+  float t = std::min(1.0f, std::max(0.0f, (x - edge0) / (edge1 - edge0)));
+  return t * t * (3.0f - 2.0f * t);
+}
+} // namespace
+
+void computeClimate(const std::vector<float> &heights, int size,
+                    float cellSize, const DrainageMap *drainage,
+                    const ClimateParams &params, ClimateMap &climate,
+                    labhelper::ThreadPool *pool)
+{
+  int block = std::max(1, params.downsample);
+  int n = (size + block - 1) / block;
+  size_t count = size_t(n) * n;
+  climate.size = n;
+  climate.temperature.resize(count);
+  climate.moisture.resize(count);
+  climate.weights.resize(count * 4);
+  if (drainage != nullptr && drainage->size != size)
+  {
+    drainage = nullptr;
+  }
+
+  // Mean height and steepness per climate sample, taken from the
+  // heightfield as the slopes of the coarser grid are much gentler, and the
+  // squared distance to water, which is 0 where any of its heightfield
+  // samples is water
+  std::vector<float> height(count), steepness(count), distance(count);
+  forRange(pool, n, 4, [&](int begin, int end) {
+    for (int cy = begin; cy < end; cy++)
+    {
+      for (int cx = 0; cx < n; cx++)
+      {
+        int yEnd = std::min(size, (cy + 1) * block);
+        int xEnd = std::min(size, (cx + 1) * block);
+        float sum = 0.0f, steepSum = 0.0f;
+        bool water = false;
+        for (int y = cy * block; y < yEnd; y++)
+        {
+          for (int x = cx * block; x < xEnd; x++)
+          {
+            size_t i = size_t(y) * size + x;
+            sum += heights[i];
+            int left = std::max(0, x - 1), right = std::min(size - 1, x + 1);
+            int up = std::max(0, y - 1), down = std::min(size - 1, y + 1);
+            float slopeX = (heights[size_t(y) * size + right] -
+                            heights[size_t(y) * size + left]) /
+                           (std::max(1, right - left) * cellSize);
+            float slopeZ = (heights[size_t(down) * size + x] -
+                            heights[size_t(up) * size + x]) /
+                           (std::max(1, down - up) * cellSize);
+            steepSum += 1.0f - 1.0f / std::sqrt(1.0f + slopeX * slopeX +
+                                                slopeZ * slopeZ);
+            water = water || heights[i] < params.seaLevel;
+            if (drainage != nullptr)
+            {
+              water = water ||
+                      drainage->filled[i] - heights[i] > params.lakeDepth ||
+                      drainage->accumulation[i] >= params.riverCells;
+            }
+          }
+        }
+        size_t c = size_t(cy) * n + cx;
+        float samples = float((yEnd - cy * block) * (xEnd - cx * block));
+        height[c] = sum / samples;
+        steepness[c] = steepSum / samples;
+        distance[c] = water ? 0.0f : far;
+      }
+    }
+  });
+
+  // Down each column, then along each row
+  forRange(pool, n, 16, [&](int begin, int end) {
+    std::vector<float> column(n), result(n), bounds(n + 1);
+    std::vector<int> parabolas(n);
+    for (int x = begin; x < end; x++)
+    {
+      for (int y = 0; y < n; y++)
+      {
+        column[y] = distance[size_t(y) * n + x];
+      }
+      distanceAlong(column.data(), n, result.data(), parabolas.data(),
+                    bounds.data());
+      for (int y = 0; y < n; y++)
+      {
+        distance[size_t(y) * n + x] = result[y];
+      }
+    }
+  });
+  forRange(pool, n, 16, [&](int begin, int end) {
+    std::vector<float> result(n), bounds(n + 1);
+    std::vector<int> parabolas(n);
+    for (int y = begin; y < end; y++)
+    {
+      float *row = distance.data() + size_t(y) * n;
+      distanceAlong(row, n, result.data(), parabolas.data(), bounds.data());
+      std::copy(result.begin(), result.end(), row);
+    }
+  });
+
+  float spacing = cellSize * block;
+  forRange(pool, n, 4, [&](int begin, int end) {
+    for (int y = begin; y < end; y++)
+    {
+      float latitude = params.latitudeCentre +
+                       params.latitudeSpan * (0.5f - (y + 0.5f) / n);
+      float seaTemperature =
+          params.equatorTemperature +
+          (params.poleTemperature - params.equatorTemperature) *
+              std::min(1.0f, std::abs(latitude) / 90.0f);
+      for (int x = 0; x < n; x++)
+      {
+        size_t c = size_t(y) * n + x;
+        float h = height[c];
+        float aboveSea = h - params.seaLevel;
+        float temperature =
+            seaTemperature - params.lapseRate * std::max(0.0f, aboveSea);
+        float moisture = std::exp2(-std::sqrt(distance[c]) * spacing /
+                                   params.moistureDistance);
+        climate.temperature[c] = temperature;
+        climate.moisture[c] = moisture;
+
+        // Layered like the height bands were: each layer covers what is
+        // below it by its own weight
+        enum { sand, grass, rock, snow };
+        float weights[4] = {0.0f, 1.0f, 0.0f, 0.0f};
+        auto cover = [&](int material, float weight) {
+          for (float &w : weights)
+          {
+            w *= 1.0f - weight;
+          }
+          weights[material] += weight;
+        };
+        float frozen = smoothstep(params.snowTemperature + 2.0f,
+                                  params.snowTemperature - 2.0f, temperature);
+        cover(sand, smoothstep(params.desertMoisture * 1.5f,
+                               params.desertMoisture * 0.5f, moisture) *
+                        (1.0f - frozen));
+        cover(snow, frozen);
+        cover(rock, smoothstep(params.rockSlope - 0.05f,
+                               params.rockSlope + 0.05f, steepness[c]));
+        cover(sand, 1.0f - smoothstep(params.beachHeight * 0.5f,
+                                      params.beachHeight, aboveSea));
+        float water = smoothstep(0.1f, -0.1f, aboveSea);
+        for (int m = 0; m < 4; m++)
+        {
+          climate.weights[c * 4 + m] =
+              uint8_t(weights[m] * (1.0f - water) * 255.0f + 0.5f);
+        }
+      }
+    }
+  });
+}
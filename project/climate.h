@@ -0,0 +1,60 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+namespace labhelper
+{
+class ThreadPool;
+}
+struct DrainageMap;
+
+// Temperature and moisture over the terrain, and the terrain materials they
+// give, at a lower resolution than the heightfield so that they are cheap to
+// regenerate and to sample.
+//
+// Temperature falls from the equator towards the poles, with the map
+// spanning a band of latitudes from north (row 0) to south, and falls with
+// height above the sea. Moisture falls with the distance to the nearest sea,
+// lake or river, which is an exact Euclidean distance transform, run over
+// columns and then rows in parallel.
+struct ClimateParams
+{
+    // Heightfield samples per climate sample, along each side
+    int downsample = 4;
+    float seaLevel = -2.0f;
+    float latitudeCentre = 35.0f; // In degrees, at the middle row
+    float latitudeSpan = 40.0f; // From the first row to the last
+    float equatorTemperature = 28.0f; // At sea level, in degrees Celsius
+    float poleTemperature = -10.0f;
+    float lapseRate = 2.5f; // Degrees colder per unit of height
+    // Moisture halves for every this many units away from water, which is
+    // the sea, lakes deeper than lakeDepth and cells draining riverCells
+    float moistureDistance = 6.0f;
+    float lakeDepth = 0.25f;
+    float riverCells = 5000.0f;
+    // Sand on the beaches up to this far above the sea, and in deserts, where
+    // the moisture is below desertMoisture and it does not freeze
+    float beachHeight = 0.5f;
+    float desertMoisture = 0.15f;
+    float snowTemperature = 0.0f;
+    // Rock where 1 minus the y of the normal is above this
+    float rockSlope = 0.2f;
+};
+
+struct ClimateMap
+{
+    int size = 0; // Climate samples per side
+    std::vector<float> temperature;
+    std::vector<float> moisture;
+    // Per sample, the weights of sand, grass, rock and snow, from 0 to 255,
+    // with water making up the rest
+    std::vector<uint8_t> weights;
+};
+
+// Computes the climate of a size * size heightmap with cellSize between
+// samples, on the threads of pool, or only on the calling thread if pool is
+// null. Lakes and rivers are taken from drainage, if not null.
+void computeClimate(const std::vector<float> &heights, int size,
+                    float cellSize, const DrainageMap *drainage,
+                    const ClimateParams &params, ClimateMap &climate,
+                    labhelper::ThreadPool *pool);
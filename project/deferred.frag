@@ -0,0 +1,148 @@
+#version 420
+
+// required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
+precision highp float;
+
+///////////////////////////////////////////////////////////////////////////////
+// G-buffer, written by terrain.frag built with DEFERRED
+//   albedo   (RGBA8) : rgb = base color, a = metalness
+//   normal   (RG16)  : octahedral view-space normal in [0, 1]
+//   material (RG8)   : r = fresnel, g = roughness
+//   depth    (D32)   : view-space position is reconstructed from this
+///////////////////////////////////////////////////////////////////////////////
+layout(binding = 0) uniform sampler2D gbufferAlbedo;
+layout(binding = 1) uniform sampler2D gbufferNormal;
+layout(binding = 2) uniform sampler2D gbufferMaterial;
+layout(binding = 3) uniform sampler2D gbufferDepth;
+
+///////////////////////////////////////////////////////////////////////////////
+// Environment
+///////////////////////////////////////////////////////////////////////////////
+layout(binding = 6) uniform sampler2D environmentMap;
+layout(binding = 7) uniform sampler2D irradianceMap;
+layout(binding = 8) uniform sampler2D reflectionMap;
+uniform float environment_multiplier;
+
+///////////////////////////////////////////////////////////////////////////////
+// Light source
+///////////////////////////////////////////////////////////////////////////////
+uniform vec3 point_light_color = vec3(1.0, 1.0, 1.0);
+uniform float point_light_intensity_multiplier = 50.0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Constants
+///////////////////////////////////////////////////////////////////////////////
+#define PI 3.14159265359
+
+///////////////////////////////////////////////////////////////////////////////
+// Input varyings from vertex shader
+///////////////////////////////////////////////////////////////////////////////
+in vec2 texCoord;
+
+///////////////////////////////////////////////////////////////////////////////
+// Input uniform variables
+///////////////////////////////////////////////////////////////////////////////
+uniform mat4 viewInverse;
+uniform mat4 projectionInverse;
+uniform vec3 viewSpaceLightPosition;
+
+///////////////////////////////////////////////////////////////////////////////
+// Output color
+///////////////////////////////////////////////////////////////////////////////
+layout(location = 0) out vec4 fragmentColor;
+
+vec3 decodeNormal(vec2 e)
+{
+    e = e * 2.0 - 1.0;
+    vec3 n = vec3(e.xy, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+
+vec3 calculateDirectIllumiunation(vec3 viewSpacePosition, vec3 wo, vec3 n, vec3 base_color,
+                                  float metalness, float fresnel, float shininess)
+{
+    float d = distance(viewSpacePosition, viewSpaceLightPosition);
+    vec3 wi = normalize(viewSpaceLightPosition - viewSpacePosition);
+    vec3 Li = point_light_intensity_multiplier * point_light_color * 1 / pow(d, 2);
+    if (dot(wi, n) <= 0.0) return vec3(0, 0, 0);
+
+    vec3 diffuse_term = base_color * (1.0 / PI) * dot(n, wi) * Li;
+
+    vec3 wh = normalize(wi + wo);
+    float F = fresnel + (1 - fresnel) * pow(1 - dot(wh, wi), 5);
+    float D = (shininess + 2) / (2 * PI) * pow(max(0.001, dot(n, wh)), shininess);
+    float G = min(1, min(2 * (dot(n, wh) * dot(n, wo) / max(0.001, dot(wo, wh))), 2 * (dot(n, wh) * dot(n, wi) / max(0.001, dot(wo, wh)))));
+    float brdf = F * D * G / max(0.001, (4 * dot(n, wo) * dot(n, wi)));
+
+    vec3 dielectic_term = brdf * dot(n, wi) * Li + (1.0 - F) * diffuse_term;
+    vec3 metal_term = brdf * base_color * dot(n, wi) * Li;
+
+    return metalness * metal_term + (1.0 - metalness) * dielectic_term;
+}
+
+vec3 calculateIndirectIllumination(vec3 wo, vec3 n, vec3 base_color,
+                                   float metalness, float fresnel, float roughness)
+{
+    vec3 nws = vec3(viewInverse * vec4(n, 0.0));
+
+    float theta = acos(max(-1.0f, min(1.0f, nws.y)));
+    float phi = atan(nws.z, nws.x);
+    if (phi < 0.0f)
+    {
+        phi = phi + 2.0f * PI;
+    }
+    vec2 lookup = vec2(phi / (2.0f * PI), 1.0f - theta / PI);
+    vec3 irradiance = environment_multiplier * texture(irradianceMap, lookup).rgb;
+
+    vec3 diffuse_term = base_color * (1.0f / PI) * irradiance;
+
+    vec3 wi = normalize(reflect(-wo, n));
+    vec3 wr = normalize(vec3(viewInverse * vec4(wi, 0.0f)));
+    theta = acos(max(-1.0f, min(1.0f, wr.y)));
+    phi = atan(wr.z, wr.x);
+    if (phi < 0.0f)
+    {
+        phi = phi + 2.0f * PI;
+    }
+    lookup = vec2(phi / (2.0f * PI), 1.0f - theta / PI);
+    vec3 Li = environment_multiplier * textureLod(reflectionMap, lookup, roughness * 7.0f).rgb;
+    vec3 wh = normalize(wi + wo);
+    float F = fresnel + (1.0f - fresnel) * pow(1 - dot(wh, wo), 5.0f);
+    vec3 dielectric_term = F * Li + (1.0f - F) * diffuse_term;
+    vec3 metal_term = F * base_color * Li;
+
+    return metalness * metal_term + (1.0f - metalness) * dielectric_term;
+}
+
+void main()
+{
+    float depth = texture(gbufferDepth, texCoord).r;
+    if (depth == 1.0)
+    {
+        // Nothing was rasterized here; keep the background.
+        discard;
+    }
+
+    vec4 clipSpacePosition = vec4(vec3(texCoord, depth) * 2.0 - 1.0, 1.0);
+    vec4 viewSpacePosition = projectionInverse * clipSpacePosition;
+    viewSpacePosition /= viewSpacePosition.w;
+
+    vec4 albedo = texture(gbufferAlbedo, texCoord);
+    vec2 material = texture(gbufferMaterial, texCoord).rg;
+    float metalness = albedo.a;
+    float fresnel = material.r;
+    float roughness = material.g;
+    float shininess = 2.0 / max(pow(roughness, 4.0), 1e-6) - 2.0;
+
+    vec3 wo = -normalize(viewSpacePosition.xyz);
+    vec3 n = decodeNormal(texture(gbufferNormal, texCoord).rg);
+
+    vec3 direct_illumination_term = calculateDirectIllumiunation(
+        viewSpacePosition.xyz, wo, n, albedo.rgb, metalness, fresnel, shininess);
+    vec3 indirect_illumination_term = calculateIndirectIllumination(
+        wo, n, albedo.rgb, metalness, fresnel, roughness);
+
+    fragmentColor = vec4(direct_illumination_term + indirect_illumination_term, 1.0);
+}
@@ -0,0 +1,526 @@
+#include "drainage.h"
+#include <threadpool.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <memory>
+
+using labhelper::forRange;
+
+namespace
+{
+// Neighbour offsets, starting at +x and going towards -y, so that the
+// opposite of direction d is (d + 4) & 7 and odd directions are diagonal
+const int offsetX[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+const int offsetY[8] = {0, -1, -1, -1, 0, 1, 1, 1};
+
+// Read from the exponent of value as a double, which is exact and avoids a
+// loop of unpredictable branches in the radix heap
+int bitLength(uint32_t value)
+{
+  double asDouble = value;
+  uint64_t bits;
+  memcpy(&bits, &asDouble, sizeof(bits));
+  int length = int(bits >> 52) - 1022;
+  return length < 0 ? 0 : length;
+}
+
+// Unsigned integers in the same order as the floats
+uint32_t orderedKey(float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+}
+
+// A priority queue for keys that are never smaller than the last one
+// popped. Entries are kept in buckets by the highest bit in which their key
+// differs from the last popped key, so a pop only ever has to look at, and
+// redistribute, the lowest non-empty bucket.
+class RadixHeap
+{
+public:
+  bool empty() const { return count == 0; }
+
+  void push(uint32_t key, uint32_t value)
+  {
+    Entry entry = {key, value};
+    buckets[bitLength(key ^ last)].push_back(entry);
+    count++;
+  }
+
+  uint32_t pop()
+  {
+    if (buckets[0].empty())
+    {
+      int i = 1;
+      while (buckets[i].empty())
+      {
+        i++;
+      }
+      // With the smallest key of bucket i as the last key, all its entries
+      // move to lower buckets
+      last = buckets[i][0].key;
+      for (const Entry &entry : buckets[i])
+      {
+        last = std::min(last, entry.key);
+      }
+      for (const Entry &entry : buckets[i])
+      {
+        buckets[bitLength(entry.key ^ last)].push_back(entry);
+      }
+      buckets[i].clear();
+    }
+    uint32_t value = buckets[0].back().value;
+    buckets[0].pop_back();
+    count--;
+    return value;
+  }
+
+private:
+  struct Entry
+  {
+    uint32_t key, value;
+  };
+  std::vector<Entry> buckets[33];
+  uint32_t last = 0;
+  size_t count = 0;
+};
+
+// The part of the flow from cell j that goes in direction towards
+float flowTowards(const DrainageMap &map, size_t j, int towards)
+{
+  uint8_t direction = map.direction[j];
+  if (direction == DrainageMap::noDirection)
+  {
+    return 0.0f;
+  }
+  float flow = 0.0f;
+  if (direction == towards)
+  {
+    flow += map.share[j];
+  }
+  if (((direction + 1) & 7) == towards)
+  {
+    flow += 1.0f - map.share[j];
+  }
+  return flow;
+}
+
+// The steepest neighbour on the filled heights, or noDirection if no
+// neighbour is lower
+uint8_t steepestNeighbour(const DrainageMap &map, int x, int y,
+                          float cellSize)
+{
+  int size = map.size;
+  float height = map.filled[size_t(y) * size + x];
+  float steepest = 0.0f;
+  uint8_t best = DrainageMap::noDirection;
+  for (int d = 0; d < 8; d++)
+  {
+    int nx = x + offsetX[d], ny = y + offsetY[d];
+    if (nx < 0 || ny < 0 || nx >= size || ny >= size)
+    {
+      continue;
+    }
+    float distance = (d & 1) ? cellSize * 1.41421356f : cellSize;
+    float slope = (height - map.filled[size_t(ny) * size + nx]) / distance;
+    if (slope > steepest)
+    {
+      steepest = slope;
+      best = uint8_t(d);
+    }
+  }
+  return best;
+}
+
+// Tarboton's D-infinity: the steepest downhill direction over the 8
+// triangular facets between the cell and two neighbours, with the flow
+// split between those two neighbours by how close the direction is to each
+void steepestFacet(DrainageMap &map, int x, int y, float cellSize)
+{
+  const float quarterPi = 0.785398163f;
+  int size = map.size;
+  size_t i = size_t(y) * size + x;
+  float height = map.filled[i];
+  float steepest = 0.0f;
+  uint8_t best = DrainageMap::noDirection;
+  float bestShare = 1.0f;
+  float around[8];
+  bool inside[8];
+  for (int d = 0; d < 8; d++)
+  {
+    int nx = x + offsetX[d], ny = y + offsetY[d];
+    inside[d] = nx >= 0 && ny >= 0 && nx < size && ny < size;
+    around[d] = inside[d] ? map.filled[size_t(ny) * size + nx] : 0.0f;
+  }
+  for (int d = 0; d < 8; d++)
+  {
+    int next = (d + 1) & 7;
+    if (!inside[d] || !inside[next])
+    {
+      continue;
+    }
+    // Every facet has one side and one diagonal neighbour
+    bool sideFirst = (d & 1) == 0;
+    float side = sideFirst ? around[d] : around[next];
+    float diagonal = sideFirst ? around[next] : around[d];
+    float s1 = (height - side) / cellSize;
+    float s2 = (side - diagonal) / cellSize;
+    // The direction is clamped to the facet, and only the angle of the
+    // steepest facet is needed
+    float slope;
+    if (s2 < 0.0f)
+    {
+      slope = s1;
+    }
+    else if (s2 > s1)
+    {
+      slope = (height - diagonal) / (cellSize * 1.41421356f);
+    }
+    else
+    {
+      slope = std::sqrt(s1 * s1 + s2 * s2);
+    }
+    if (slope > steepest)
+    {
+      steepest = slope;
+      best = uint8_t(d);
+      float toDiagonal = s2 < 0.0f   ? 0.0f
+                         : s2 > s1   ? 1.0f
+                                     : std::atan2(s2, s1) / quarterPi;
+      bestShare = sideFirst ? 1.0f - toDiagonal : toDiagonal;
+    }
+  }
+  if (best == DrainageMap::noDirection)
+  {
+    // Only at the edges, where some facets are missing
+    best = steepestNeighbour(map, x, y, cellSize);
+    bestShare = 1.0f;
+  }
+  map.direction[i] = best;
+  map.share[i] = bestShare;
+}
+} // namespace
+
+void fillDepressions(const std::vector<float> &heights, int size,
+                     DrainageMap &map)
+{
+  // Worked on with a ring of closed cells around the heightmap, so that
+  // neighbours need no bounds checks. Cells that are not closed yet still
+  // hold their original height.
+  int stride = size + 2;
+  std::vector<float> level(size_t(stride) * stride, 0.0f);
+  std::vector<uint8_t> closed(size_t(stride) * stride, 1);
+  for (int y = 0; y < size; y++)
+  {
+    size_t row = size_t(y + 1) * stride + 1;
+    std::copy(heights.begin() + size_t(y) * size,
+              heights.begin() + size_t(y + 1) * size, level.begin() + row);
+    std::fill(closed.begin() + row, closed.begin() + row + size, 0);
+  }
+  int step[8];
+  for (int d = 0; d < 8; d++)
+  {
+    step[d] = offsetY[d] * stride + offsetX[d];
+  }
+
+  RadixHeap open;
+  for (int i = 1; i <= size; i++)
+  {
+    uint32_t edges[4] = {uint32_t(stride + i), uint32_t(size * stride + i),
+                         uint32_t(i * stride + 1), uint32_t(i * stride + size)};
+    for (uint32_t cell : edges)
+    {
+      if (!closed[cell])
+      {
+        closed[cell] = 1;
+        open.push(orderedKey(level[cell]), cell);
+      }
+    }
+  }
+
+  // Cells below the level of the cell they are reached from are in a
+  // depression. They are raised to just above it and taken in the order
+  // they are found, which is already in increasing height.
+  std::vector<uint32_t> pit;
+  size_t pitNext = 0;
+  for (;;)
+  {
+    uint32_t cell;
+    if (pitNext < pit.size())
+    {
+      cell = pit[pitNext++];
+    }
+    else if (!open.empty())
+    {
+      pit.clear();
+      pitNext = 0;
+      cell = open.pop();
+    }
+    else
+    {
+      break;
+    }
+    float current = level[cell];
+    float raised = std::nextafter(current, INFINITY);
+    for (int d = 0; d < 8; d++)
+    {
+      uint32_t neighbour = cell + step[d];
+      if (closed[neighbour])
+      {
+        continue;
+      }
+      closed[neighbour] = 1;
+      if (level[neighbour] <= current)
+      {
+        level[neighbour] = raised;
+        pit.push_back(neighbour);
+      }
+      else
+      {
+        open.push(orderedKey(level[neighbour]), neighbour);
+      }
+    }
+  }
+
+  map.size = size;
+  map.filled.resize(size_t(size) * size);
+  for (int y = 0; y < size; y++)
+  {
+    size_t row = size_t(y + 1) * stride + 1;
+    std::copy(level.begin() + row, level.begin() + row + size,
+              map.filled.begin() + size_t(y) * size);
+  }
+}
+
+void computeFlowDirections(int size, float cellSize, FlowRouting routing,
+                           DrainageMap &map, labhelper::ThreadPool *pool)
+{
+  map.direction.resize(size_t(size) * size);
+  map.share.resize(size_t(size) * size);
+  forRange(pool, size, 16, [&](int begin, int end) {
+    for (int y = begin; y < end; y++)
+    {
+      for (int x = 0; x < size; x++)
+      {
+        if (routing == FlowRouting::DInfinity)
+        {
+          steepestFacet(map, x, y, cellSize);
+        }
+        else
+        {
+          size_t i = size_t(y) * size + x;
+          map.direction[i] = steepestNeighbour(map, x, y, cellSize);
+          map.share[i] = 1.0f;
+        }
+      }
+    }
+  });
+}
+
+void accumulateFlow(DrainageMap &map, labhelper::ThreadPool *pool)
+{
+  int size = map.size;
+  size_t count = size_t(size) * size;
+  map.accumulation.assign(count, 0.0f);
+
+  // Per cell, a bit for each neighbour it drains into, with a ring of cells
+  // that drain nowhere around the map so neighbours need no bounds checks
+  int stride = size + 2;
+  std::vector<uint8_t> drains(size_t(stride) * stride, 0);
+  forRange(pool, size, 16, [&](int begin, int end) {
+    for (int y = begin; y < end; y++)
+    {
+      for (int x = 0; x < size; x++)
+      {
+        size_t i = size_t(y) * size + x;
+        uint8_t direction = map.direction[i];
+        uint8_t mask = 0;
+        if (direction != DrainageMap::noDirection)
+        {
+          mask = uint8_t((map.share[i] > 0.0f ? 1 : 0) << direction);
+          if (map.share[i] < 1.0f)
+          {
+            mask |= uint8_t(1 << ((direction + 1) & 7));
+          }
+        }
+        drains[size_t(y + 1) * stride + x + 1] = mask;
+      }
+    }
+  });
+
+  // Per cell, a bit for each neighbour that drains into it, and the number
+  // of those that are not done yet
+  int step[8];
+  for (int d = 0; d < 8; d++)
+  {
+    step[d] = offsetY[d] * stride + offsetX[d];
+  }
+  std::vector<uint8_t> donors(count);
+  std::unique_ptr<std::atomic<uint8_t>[]> upstream(
+      new std::atomic<uint8_t>[count]);
+  const int rowsPerChunk = 16;
+  int rowChunks = (size + rowsPerChunk - 1) / rowsPerChunk;
+  std::vector<std::vector<uint32_t>> found(rowChunks);
+  forRange(pool, rowChunks, 1, [&](int begin, int end) {
+    for (int chunk = begin; chunk < end; chunk++)
+    {
+      int rowEnd = std::min(size, (chunk + 1) * rowsPerChunk);
+      for (int y = chunk * rowsPerChunk; y < rowEnd; y++)
+      {
+        const uint8_t *row = drains.data() + size_t(y + 1) * stride + 1;
+        for (int x = 0; x < size; x++)
+        {
+          int mask = 0, waiting = 0;
+          for (int d = 0; d < 8; d++)
+          {
+            int donor = (row[x + step[d]] >> ((d + 4) & 7)) & 1;
+            mask |= donor << d;
+            waiting += donor;
+          }
+          size_t i = size_t(y) * size + x;
+          donors[i] = uint8_t(mask);
+          upstream[i].store(uint8_t(waiting), std::memory_order_relaxed);
+          if (waiting == 0)
+          {
+            found[chunk].push_back(uint32_t(i));
+          }
+        }
+      }
+    }
+  });
+  std::vector<uint32_t> sources;
+  for (const std::vector<uint32_t> &cells : found)
+  {
+    sources.insert(sources.end(), cells.begin(), cells.end());
+  }
+
+  // Each thread follows the flow down from its sources, for as long as it
+  // is the one that finishes the last upstream cell of the next cell, so
+  // every cell is done exactly once, right after its upstream cells, and
+  // mostly by the thread that just touched its neighbours. Each cell sums
+  // the flow from its upstream cells in a fixed order.
+  const int sourcesPerChunk = 1024;
+  int chunks = int((sources.size() + sourcesPerChunk - 1) / sourcesPerChunk);
+  forRange(pool, chunks, 1, [&](int begin, int end) {
+    std::vector<uint32_t> ready;
+    size_t first = size_t(begin) * sourcesPerChunk;
+    size_t last = std::min(sources.size(), size_t(end) * sourcesPerChunk);
+    for (size_t k = first; k < last; k++)
+    {
+      ready.push_back(sources[k]);
+      while (!ready.empty())
+      {
+        uint32_t cell = ready.back();
+        ready.pop_back();
+        int x = int(cell % size), y = int(cell / size);
+        float flow = 1.0f;
+        for (int mask = donors[cell], d = 0; mask != 0; mask >>= 1, d++)
+        {
+          if (mask & 1)
+          {
+            size_t j = size_t(y + offsetY[d]) * size + x + offsetX[d];
+            flow += flowTowards(map, j, (d + 4) & 7) * map.accumulation[j];
+          }
+        }
+        map.accumulation[cell] = flow;
+
+        uint8_t direction = map.direction[cell];
+        if (direction == DrainageMap::noDirection)
+        {
+          continue;
+        }
+        int targets[2] = {direction, (direction + 1) & 7};
+        for (int d : targets)
+        {
+          if (flowTowards(map, cell, d) > 0.0f)
+          {
+            size_t j = size_t(y + offsetY[d]) * size + x + offsetX[d];
+            // Publishes the accumulation to whichever thread takes j
+            if (upstream[j].fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+              ready.push_back(uint32_t(j));
+            }
+          }
+        }
+      }
+    }
+  });
+}
+
+void computeDrainage(const std::vector<float> &heights, int size,
+                     float cellSize, FlowRouting routing, DrainageMap &map,
+                     labhelper::ThreadPool *pool)
+{
+  fillDepressions(heights, size, map);
+  computeFlowDirections(size, cellSize, routing, map, pool);
+  accumulateFlow(map, pool);
+}
+
+void drainageTexture(const DrainageMap &map, const std::vector<float> &heights,
+                     float maxLakeDepth, float riverCells,
+                     std::vector<uint8_t> &lakesAndRivers)
+{
+  size_t count = map.filled.size();
+  float largest = riverCells;
+  for (float flow : map.accumulation)
+  {
+    largest = std::max(largest, flow);
+  }
+  float riverScale = 1.0f / std::max(1e-6f, std::log(largest / riverCells));
+  lakesAndRivers.resize(count * 2);
+  for (size_t i = 0; i < count; i++)
+  {
+    float depth = (map.filled[i] - heights[i]) / maxLakeDepth;
+    float river = map.accumulation[i] > riverCells
+                      ? std::log(map.accumulation[i] / riverCells) * riverScale
+                      : 0.0f;
+    lakesAndRivers[2 * i] = uint8_t(std::min(1.0f, depth) * 255.0f + 0.5f);
+    lakesAndRivers[2 * i + 1] = uint8_t(std::min(1.0f, river) * 255.0f + 0.5f);
+  }
+}
+
+void benchmarkDrainage(const std::vector<float> &heights, int size,
+                       float cellSize)
+{
+  std::cout << "Drainage of " << size << "x" << size << ":\n";
+  const char *names[] = {"D8", "D-infinity"};
+  FlowRouting routings[] = {FlowRouting::D8, FlowRouting::DInfinity};
+  float cells = float(size) * size;
+  for (int r = 0; r < 2; r++)
+  {
+    DrainageMap map;
+    auto time = [](std::chrono::high_resolution_clock::time_point start) {
+      std::chrono::duration<float, std::milli> elapsed =
+          std::chrono::high_resolution_clock::now() - start;
+      return elapsed.count();
+    };
+    auto startTime = std::chrono::high_resolution_clock::now();
+    fillDepressions(heights, size, map);
+    float fillMs = time(startTime);
+    startTime = std::chrono::high_resolution_clock::now();
+    computeFlowDirections(size, cellSize, routings[r], map,
+                          &labhelper::ThreadPool::global());
+    float directionMs = time(startTime);
+    startTime = std::chrono::high_resolution_clock::now();
+    accumulateFlow(map, &labhelper::ThreadPool::global());
+    float accumulateMs = time(startTime);
+    double outflow = 0.0;
+    for (size_t i = 0; i < map.direction.size(); i++)
+    {
+      if (map.direction[i] == DrainageMap::noDirection)
+      {
+        outflow += map.accumulation[i];
+      }
+    }
+    std::cout << "  " << names[r] << ": fill " << fillMs << " ms ("
+              << cells / (fillMs * 1000.0f) << " million cells/s), directions "
+              << directionMs << " ms, accumulation " << accumulateMs
+              << " ms, " << outflow / cells * 100.0
+              << "% of the cells reach an outlet\n";
+  }
+}
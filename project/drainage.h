@@ -0,0 +1,72 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+namespace labhelper
+{
+class ThreadPool;
+}
+
+// Where water goes on a heightfield: every depression is filled up to the
+// height where it spills over (the lakes), each cell gets a direction water
+// flows in, and the flow is accumulated downstream, so that each cell knows
+// how many cells drain through it (the rivers).
+//
+// Depressions are filled with a priority-flood from the edges of the map,
+// using a radix heap keyed on the height bits, since the flood only ever
+// pops heights in increasing order. Cells inside a depression are raised a
+// little above the cell they were reached from, so that every cell has a
+// lower neighbour and flat lakes still drain towards their outlet.
+//
+// Flow is accumulated in topological order: threads start from the cells
+// that no other cell drains into and follow the flow downhill, taking each
+// cell once all of its upstream cells are done. Each cell sums its upstream
+// cells itself, so the result does not depend on the number of threads.
+enum class FlowRouting
+{
+    D8,       // All flow goes to the steepest of the 8 neighbours
+    DInfinity // Flow is split between the two neighbours of the steepest
+              // of the 8 triangular facets around the cell (Tarboton)
+};
+
+struct DrainageMap
+{
+    int size = 0;
+    // Heights with every depression filled up to its spill point
+    std::vector<float> filled;
+    // Per cell, the neighbour flow goes to (0 is +x, counting towards -y,
+    // so that odd directions are diagonal), or noDirection at the outlets
+    // on the edges of the map. With DInfinity, flow goes to this neighbour
+    // and the next one.
+    std::vector<uint8_t> direction;
+    // The fraction of the flow to direction, the rest goes to the next one
+    std::vector<float> share;
+    // The number of cells that drain through each cell, itself included
+    std::vector<float> accumulation;
+
+    static const uint8_t noDirection = 255;
+};
+
+// Analyses a size * size heightmap with cellSize between samples, on the
+// threads of pool, or only on the calling thread if pool is null.
+void computeDrainage(const std::vector<float> &heights, int size,
+                     float cellSize, FlowRouting routing, DrainageMap &map,
+                     labhelper::ThreadPool *pool);
+
+// The stages of computeDrainage(), each using the results of the one before
+void fillDepressions(const std::vector<float> &heights, int size,
+                     DrainageMap &map);
+void computeFlowDirections(int size, float cellSize, FlowRouting routing,
+                           DrainageMap &map, labhelper::ThreadPool *pool);
+void accumulateFlow(DrainageMap &map, labhelper::ThreadPool *pool);
+
+// Two channels per cell for a texture: lake depth up to maxLakeDepth, and
+// river strength, which is 0 below riverCells upstream cells and 1 for the
+// largest river, on a log scale.
+void drainageTexture(const DrainageMap &map, const std::vector<float> &heights,
+                     float maxLakeDepth, float riverCells,
+                     std::vector<uint8_t> &lakesAndRivers);
+
+// Prints the time each stage takes, for both kinds of flow routing.
+void benchmarkDrainage(const std::vector<float> &heights, int size,
+                       float cellSize);
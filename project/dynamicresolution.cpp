@@ -0,0 +1,50 @@
+#include "dynamicresolution.h"
+#include <algorithm>
+#include <cmath>
+
+void DynamicResolution::update(float gpuMs)
+{
+  if (gpuMs < 0.0f)
+  {
+    return;
+  }
+  lastGpuMs = gpuMs;
+  if (!enabled)
+  {
+    framesOverBudget = 0;
+    framesUnderBudget = 0;
+    return;
+  }
+
+  if (gpuMs > targetMs * downscaleThreshold)
+  {
+    framesOverBudget++;
+    framesUnderBudget = 0;
+  }
+  else if (gpuMs < targetMs * upscaleThreshold)
+  {
+    framesUnderBudget++;
+    framesOverBudget = 0;
+  }
+  else
+  {
+    framesOverBudget = 0;
+    framesUnderBudget = 0;
+  }
+
+  if (framesOverBudget >= framesBeforeDownscale)
+  {
+    // GPU time is roughly proportional to the pixel count, so jump straight
+    // to the scale that should fit, rounded down to a whole step.
+    float fit = scale * std::sqrt(targetMs / gpuMs);
+    float steps = std::floor(fit / step);
+    scale = std::min(scale - step, steps * step);
+    framesOverBudget = 0;
+  }
+  else if (framesUnderBudget >= framesBeforeUpscale)
+  {
+    scale += step;
+    framesUnderBudget = 0;
+  }
+  scale = std::max(minScale, std::min(maxScale, scale));
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+// Picks the fraction of the window resolution the 3D scene is rendered at,
+// so that the measured GPU time of the scene stays within a target budget.
+//
+// Scaling down reacts within a few frames, scaling up only after the GPU has
+// been comfortably under budget for a while, and the scale moves in fixed
+// steps. Together that keeps it from oscillating around the target (and from
+// reallocating render targets every frame).
+class DynamicResolution
+{
+public:
+    bool enabled = true;
+    float targetMs = 14.0f;
+    float minScale = 0.5f;
+    float maxScale = 1.0f;
+    float step = 0.05f;
+    // Fractions of targetMs outside of which the scale starts to move.
+    float upscaleThreshold = 0.8f;
+    float downscaleThreshold = 1.0f;
+    // Consecutive frames required before acting.
+    int framesBeforeUpscale = 30;
+    int framesBeforeDownscale = 3;
+
+    // Feed the GPU time of the last frame, in ms (negative if unknown).
+    void update(float gpuMs);
+    float getScale() const { return enabled ? scale : 1.0f; }
+    float getLastGpuMs() const { return lastGpuMs; }
+
+private:
+    float scale = 1.0f;
+    float lastGpuMs = 0.0f;
+    int framesOverBudget = 0;
+    int framesUnderBudget = 0;
+};
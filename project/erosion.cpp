@@ -0,0 +1,895 @@
+#include "erosion.h"
+#include <simd.h>
+#include <threadpool.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
+
+using labhelper::forRange;
+using labhelper::hash;
+
+namespace
+{
+struct BrushCell
+{
+  int dx, dy;
+  float weight;
+};
+
+// Cells within radius of the centre, weighted by closeness, summing to 1
+std::vector<BrushCell> makeBrush(int radius)
+{
+  std::vector<BrushCell> brush;
+  float total = 0.0f;
+  for (int dy = -radius; dy <= radius; dy++)
+  {
+    for (int dx = -radius; dx <= radius; dx++)
+    {
+      float distance = std::sqrt(float(dx * dx + dy * dy));
+      if (distance < radius)
+      {
+        BrushCell cell = {dx, dy, radius - distance};
+        brush.push_back(cell);
+        total += cell.weight;
+      }
+    }
+  }
+  for (BrushCell &cell : brush)
+  {
+    cell.weight /= total;
+  }
+  return brush;
+}
+
+struct Tile
+{
+  int x0, y0, x1, y1; // Clipped to the map
+  int droplets;
+  uint32_t seed;
+};
+
+class Eroder
+{
+public:
+  Eroder(std::vector<float> &heightMap, int size,
+         const DropletErosionParams &params)
+      : h(heightMap), size(size), params(params),
+        brush(makeBrush(params.erosionRadius)),
+        margin(params.tileSize / 2 - params.erosionRadius - 1)
+  {
+  }
+
+  void erodeTile(const Tile &tile)
+  {
+    // Nodes a droplet may visit. Everything it reads or writes is within
+    // the brush radius of them, so stays clear of other tiles of the colour.
+    int minNode = 0, maxNode = size - 2;
+    int lowX = std::max(minNode, tile.x0 - margin);
+    int highX = std::min(maxNode, tile.x1 - 1 + margin);
+    int lowY = std::max(minNode, tile.y0 - margin);
+    int highY = std::min(maxNode, tile.y1 - 1 + margin);
+
+    std::mt19937 rng(tile.seed);
+    std::uniform_real_distribution<float> startX(float(tile.x0), float(tile.x1));
+    std::uniform_real_distribution<float> startY(float(tile.y0), float(tile.y1));
+    for (int i = 0; i < tile.droplets; i++)
+    {
+      float x = std::min(startX(rng), size - 1.001f);
+      float y = std::min(startY(rng), size - 1.001f);
+      runDroplet(x, y, lowX, highX, lowY, highY);
+    }
+  }
+
+private:
+  void heightAndGradient(float x, float y, float &height, float &gradX,
+                         float &gradY) const
+  {
+    int cx = int(x), cy = int(y);
+    float u = x - cx, v = y - cy;
+    int i = cy * size + cx;
+    float nw = h[i], ne = h[i + 1], sw = h[i + size], se = h[i + size + 1];
+    gradX = (ne - nw) * (1 - v) + (se - sw) * v;
+    gradY = (sw - nw) * (1 - u) + (se - ne) * u;
+    height = nw * (1 - u) * (1 - v) + ne * u * (1 - v) + sw * (1 - u) * v +
+             se * u * v;
+  }
+
+  void runDroplet(float x, float y, int lowX, int highX, int lowY, int highY)
+  {
+    float dirX = 0.0f, dirY = 0.0f;
+    float speed = 1.0f, water = 1.0f, sediment = 0.0f;
+    for (int step = 0; step < params.maxLifetime; step++)
+    {
+      int nodeX = int(x), nodeY = int(y);
+      float u = x - nodeX, v = y - nodeY;
+      float height, gradX, gradY;
+      heightAndGradient(x, y, height, gradX, gradY);
+
+      dirX = dirX * params.inertia - gradX * (1 - params.inertia);
+      dirY = dirY * params.inertia - gradY * (1 - params.inertia);
+      float length = std::sqrt(dirX * dirX + dirY * dirY);
+      if (length == 0.0f)
+      {
+        break;
+      }
+      dirX /= length;
+      dirY /= length;
+      x += dirX;
+      y += dirY;
+      if (x < lowX || x >= highX + 1 || y < lowY || y >= highY + 1)
+      {
+        break;
+      }
+
+      float newHeight, unusedX, unusedY;
+      heightAndGradient(x, y, newHeight, unusedX, unusedY);
+      float deltaHeight = newHeight - height;
+
+      float capacity =
+          std::max(-deltaHeight * speed * water * params.sedimentCapacityFactor,
+                   params.minSedimentCapacity);
+      if (sediment > capacity || deltaHeight > 0.0f)
+      {
+        // Fill the pit it climbed out of, or drop what it can not carry,
+        // over the four nodes around where it was
+        float amount = deltaHeight > 0.0f
+                           ? std::min(deltaHeight, sediment)
+                           : (sediment - capacity) * params.depositSpeed;
+        sediment -= amount;
+        int i = nodeY * size + nodeX;
+        h[i] += amount * (1 - u) * (1 - v);
+        h[i + 1] += amount * u * (1 - v);
+        h[i + size] += amount * (1 - u) * v;
+        h[i + size + 1] += amount * u * v;
+      }
+      else
+      {
+        // Never dig deeper than the drop, so it does not dig pits
+        float amount =
+            std::min((capacity - sediment) * params.erodeSpeed, -deltaHeight);
+        for (const BrushCell &cell : brush)
+        {
+          int bx = nodeX + cell.dx, by = nodeY + cell.dy;
+          if (bx < 0 || by < 0 || bx >= size || by >= size)
+          {
+            continue;
+          }
+          float eroded = amount * cell.weight;
+          h[by * size + bx] -= eroded;
+          sediment += eroded;
+        }
+      }
+
+      speed = std::sqrt(std::max(0.0f, speed * speed + deltaHeight * params.gravity));
+      water *= 1 - params.evaporateSpeed;
+    }
+  }
+
+  std::vector<float> &h;
+  int size;
+  const DropletErosionParams &params;
+  std::vector<BrushCell> brush;
+  int margin;
+};
+} // namespace
+
+void erodeDroplets(std::vector<float> &heightMap, int size,
+                   const DropletErosionParams &params,
+                   labhelper::ThreadPool *pool)
+{
+  if (params.droplets <= 0 || size < 2)
+  {
+    return;
+  }
+  Eroder eroder(heightMap, size, params);
+  int tileSize = std::max(params.tileSize, 2 * params.erosionRadius + 8);
+  int passes = std::max(1, params.passes);
+  int64_t area = int64_t(size) * size;
+  for (int pass = 0; pass < passes; pass++)
+  {
+    int offset = pass % 2 == 1 ? tileSize / 2 : 0;
+    int tilesPerSide = (size + offset + tileSize - 1) / tileSize;
+    int64_t passDroplets = int64_t(params.droplets) * (pass + 1) / passes -
+                           int64_t(params.droplets) * pass / passes;
+
+    // Droplets are shared out in proportion to the area of each tile
+    std::vector<Tile> tiles[4];
+    int64_t areaBefore = 0;
+    for (int ty = 0; ty < tilesPerSide; ty++)
+    {
+      for (int tx = 0; tx < tilesPerSide; tx++)
+      {
+        Tile tile;
+        tile.x0 = std::max(0, tx * tileSize - offset);
+        tile.y0 = std::max(0, ty * tileSize - offset);
+        tile.x1 = std::min(size, (tx + 1) * tileSize - offset);
+        tile.y1 = std::min(size, (ty + 1) * tileSize - offset);
+        int64_t areaAfter =
+            areaBefore + int64_t(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+        tile.droplets = int(passDroplets * areaAfter / area -
+                            passDroplets * areaBefore / area);
+        areaBefore = areaAfter;
+        tile.seed = hash(hash(params.seed, uint32_t(pass)),
+                         uint32_t(ty * tilesPerSide + tx));
+        tiles[(tx & 1) + 2 * (ty & 1)].push_back(tile);
+      }
+    }
+
+    for (const std::vector<Tile> &colour : tiles)
+    {
+      auto body = [&](int begin, int end) {
+        for (int i = begin; i < end; i++)
+        {
+          eroder.erodeTile(colour[i]);
+        }
+      };
+      if (pool != nullptr)
+      {
+        pool->parallelFor(0, int(colour.size()), body);
+      }
+      else
+      {
+        body(0, int(colour.size()));
+      }
+    }
+  }
+}
+
+void benchmarkDropletErosion(const std::vector<float> &heightMap, int size,
+                             const DropletErosionParams &params)
+{
+  int maxThreads = std::max(4, int(std::thread::hardware_concurrency()));
+  std::cout << "Eroding " << size << "x" << size << " with " << params.droplets
+            << " droplets:\n";
+  std::vector<float> reference;
+  float singleThreadMs = 0.0f;
+  for (int threads = 1; threads <= maxThreads; threads *= 2)
+  {
+    // The calling thread works too, so the pool needs one worker less
+    std::unique_ptr<labhelper::ThreadPool> pool;
+    if (threads > 1)
+    {
+      pool.reset(new labhelper::ThreadPool(threads - 1));
+    }
+    std::vector<float> heights = heightMap;
+    auto startTime = std::chrono::high_resolution_clock::now();
+    erodeDroplets(heights, size, params, pool.get());
+    std::chrono::duration<float, std::milli> elapsed =
+        std::chrono::high_resolution_clock::now() - startTime;
+    if (threads == 1)
+    {
+      reference = heights;
+      singleThreadMs = elapsed.count();
+    }
+    std::cout << "  " << threads << " threads: " << elapsed.count() << " ms, "
+              << params.droplets / (elapsed.count() / 1000.0f)
+              << " droplets/s, speedup " << singleThreadMs / elapsed.count()
+              << (heights == reference ? "" : ", DIFFERENT RESULT") << "\n";
+  }
+}
+
+namespace
+{
+namespace simd = labhelper::simd;
+
+// The grid stencils are written once for V = float and V = simd::float4
+// with the helpers from simd.h, so the last few cells of each row run the
+// same code one at a time
+using simd::loadAs;
+using simd::splatAs;
+using simd::storeTo;
+using simd::minOf;
+using simd::maxOf;
+using simd::sqrtOf;
+using simd::select;
+using simd::any;
+
+template <class V> V columns(int x);
+template <> float columns<float>(int x) { return float(x); }
+template <> simd::float4 columns<simd::float4>(int x)
+{
+  return simd::set(float(x), float(x + 1), float(x + 2), float(x + 3));
+}
+int toIndex(float a) { return int(a); }
+simd::int4 toIndex(simd::float4 a) { return simd::toInt(a); }
+float toFloat(int a) { return float(a); }
+using simd::toFloat;
+int splatIndex(float, int a) { return a; }
+simd::int4 splatIndex(simd::float4, int a) { return simd::splat(int32_t(a)); }
+float gather(const float *p, int i) { return p[i]; }
+simd::float4 gather(const float *p, simd::int4 i)
+{
+  return simd::set(p[simd::lane(i, 0)], p[simd::lane(i, 1)],
+                   p[simd::lane(i, 2)], p[simd::lane(i, 3)]);
+}
+
+struct Grids
+{
+  float *terrain, *water, *sediment, *nextSediment;
+  float *fluxLeft, *fluxRight, *fluxUp, *fluxDown;
+  float *velocityX, *velocityY, *tilt;
+  const float *uploaded;
+  char *changedRows;
+  int size, stride;
+  float cellSize;
+};
+
+// Runs kernel on the cells of rows [rowBegin, rowEnd) of the heightmap and
+// returns whether it returned true for any
+template <class Kernel>
+bool forCells(const Kernel &kernel, const Grids &grids, int rowBegin,
+              int rowEnd)
+{
+  bool result = false;
+  for (int y = rowBegin; y < rowEnd; y++)
+  {
+    int row = (y + 1) * grids.stride + 1;
+    int x = 0;
+    for (; x + 4 <= grids.size; x += 4)
+    {
+      result |= kernel.template run<simd::float4>(row + x, x, y);
+    }
+    for (; x < grids.size; x++)
+    {
+      result |= kernel.template run<float>(row + x, x, y);
+    }
+  }
+  return result;
+}
+
+// Outflow towards each neighbour, accelerated by the difference in water
+// surface and scaled down where it would take more water than there is.
+// Also the sine of the terrain slope, for the sediment capacity.
+struct FluxKernel
+{
+  Grids g;
+  float flowFactor, rainStep, cellArea, timeStep, halfInverseCellSize;
+
+  template <class V> bool run(int i, int, int) const
+  {
+    int s = g.stride;
+    V zero = splatAs<V>(0.0f);
+    V k = splatAs<V>(flowFactor);
+    V water = loadAs<V>(g.water + i);
+    V surface = loadAs<V>(g.terrain + i) + water;
+    V left = maxOf(zero, loadAs<V>(g.fluxLeft + i) +
+                             k * (surface - loadAs<V>(g.terrain + i - 1) -
+                                  loadAs<V>(g.water + i - 1)));
+    V right = maxOf(zero, loadAs<V>(g.fluxRight + i) +
+                              k * (surface - loadAs<V>(g.terrain + i + 1) -
+                                   loadAs<V>(g.water + i + 1)));
+    V up = maxOf(zero, loadAs<V>(g.fluxUp + i) +
+                           k * (surface - loadAs<V>(g.terrain + i - s) -
+                                loadAs<V>(g.water + i - s)));
+    V down = maxOf(zero, loadAs<V>(g.fluxDown + i) +
+                             k * (surface - loadAs<V>(g.terrain + i + s) -
+                                  loadAs<V>(g.water + i + s)));
+    V available = (water + splatAs<V>(rainStep)) * splatAs<V>(cellArea);
+    V outflow = (left + right + up + down) * splatAs<V>(timeStep);
+    V scale = select(outflow > available,
+                     available / maxOf(outflow, splatAs<V>(1e-20f)),
+                     splatAs<V>(1.0f));
+    storeTo(g.fluxLeft + i, left * scale);
+    storeTo(g.fluxRight + i, right * scale);
+    storeTo(g.fluxUp + i, up * scale);
+    storeTo(g.fluxDown + i, down * scale);
+
+    V h = splatAs<V>(halfInverseCellSize);
+    V slopeX = (loadAs<V>(g.terrain + i + 1) - loadAs<V>(g.terrain + i - 1)) * h;
+    V slopeY = (loadAs<V>(g.terrain + i + s) - loadAs<V>(g.terrain + i - s)) * h;
+    V slope2 = slopeX * slopeX + slopeY * slopeY;
+    storeTo(g.tilt + i, sqrtOf(slope2 / (splatAs<V>(1.0f) + slope2)));
+    return false;
+  }
+};
+
+// New water height and velocity from the flow, then dissolves terrain into
+// sediment where the water can carry more than it does, and deposits it
+// where it can carry less. Returns whether a height moved by more than
+// threshold since it was last uploaded.
+struct WaterKernel
+{
+  Grids g;
+  float rainStep, timeStep, cellArea, cellSize, minDepth;
+  float capacity, minTilt, dissolveStep, depositStep, threshold;
+
+  template <class V> bool run(int i, int, int) const
+  {
+    int s = g.stride;
+    V left = loadAs<V>(g.fluxLeft + i), right = loadAs<V>(g.fluxRight + i);
+    V up = loadAs<V>(g.fluxUp + i), down = loadAs<V>(g.fluxDown + i);
+    V fromLeft = loadAs<V>(g.fluxRight + i - 1);
+    V fromRight = loadAs<V>(g.fluxLeft + i + 1);
+    V fromUp = loadAs<V>(g.fluxDown + i - s);
+    V fromDown = loadAs<V>(g.fluxUp + i + s);
+    V before = loadAs<V>(g.water + i) + splatAs<V>(rainStep);
+    V netFlow = fromLeft + fromRight + fromUp + fromDown - left - right - up - down;
+    V after = maxOf(splatAs<V>(0.0f),
+                    before + netFlow * splatAs<V>(timeStep / cellArea));
+    storeTo(g.water + i, after);
+
+    V half = splatAs<V>(0.5f);
+    V depth = (before + after) * half;
+    V flowX = (fromLeft - left + right - fromRight) * half;
+    V flowY = (fromUp - up + down - fromDown) * half;
+    V shallow = splatAs<V>(minDepth);
+    V crossSection = maxOf(depth, shallow) * splatAs<V>(cellSize);
+    V zero = splatAs<V>(0.0f);
+    V velocityX = select(depth > shallow, flowX / crossSection, zero);
+    V velocityY = select(depth > shallow, flowY / crossSection, zero);
+    storeTo(g.velocityX + i, velocityX);
+    storeTo(g.velocityY + i, velocityY);
+
+    // Scaled by depth as well, or the thin film of fresh rain, which moves
+    // fast, would carry off as much as a river
+    V speed = sqrtOf(velocityX * velocityX + velocityY * velocityY);
+    V carried = splatAs<V>(capacity) *
+                maxOf(loadAs<V>(g.tilt + i), splatAs<V>(minTilt)) * speed *
+                depth;
+    V sediment = loadAs<V>(g.sediment + i);
+    V excess = carried - sediment;
+    V dissolved = excess * select(excess > zero, splatAs<V>(dissolveStep),
+                                  splatAs<V>(depositStep));
+    V terrain = loadAs<V>(g.terrain + i) - dissolved;
+    storeTo(g.terrain + i, terrain);
+    storeTo(g.sediment + i, sediment + dissolved);
+
+    V moved = terrain - loadAs<V>(g.uploaded + i);
+    return any(maxOf(moved, zero - moved) > splatAs<V>(threshold));
+  }
+};
+
+// Carries the sediment along with the water, by sampling it where the water
+// came from, and evaporates some of the water
+struct TransportKernel
+{
+  Grids g;
+  float cellsPerStep, evaporation;
+
+  template <class V> bool run(int i, int x, int y) const
+  {
+    // At most a cell per step, which also keeps the sampling stable
+    V k = splatAs<V>(cellsPerStep);
+    V one = splatAs<V>(1.0f), minusOne = splatAs<V>(-1.0f);
+    V moveX = minOf(one, maxOf(minusOne, loadAs<V>(g.velocityX + i) * k));
+    V moveY = minOf(one, maxOf(minusOne, loadAs<V>(g.velocityY + i) * k));
+    V zero = splatAs<V>(0.0f);
+    V last = splatAs<V>(float(g.size - 1));
+    V fromX = minOf(last, maxOf(zero, columns<V>(x) - moveX));
+    V fromY = minOf(last, maxOf(zero, splatAs<V>(float(y)) - moveY));
+    // Clamped so that the far edge samples between the last two cells
+    auto cellX = toIndex(minOf(fromX, splatAs<V>(float(g.size - 2))));
+    auto cellY = toIndex(minOf(fromY, splatAs<V>(float(g.size - 2))));
+    V u = fromX - toFloat(cellX);
+    V v = fromY - toFloat(cellY);
+    auto corner = (cellY + splatIndex(zero, 1)) * splatIndex(zero, g.stride) +
+                  cellX + splatIndex(zero, 1);
+    auto below = corner + splatIndex(zero, g.stride);
+    auto right = splatIndex(zero, 1);
+    V top = gather(g.sediment, corner) +
+            (gather(g.sediment, corner + right) - gather(g.sediment, corner)) * u;
+    V bottom = gather(g.sediment, below) +
+               (gather(g.sediment, below + right) - gather(g.sediment, below)) * u;
+    storeTo(g.nextSediment + i, top + (bottom - top) * v);
+    storeTo(g.water + i, loadAs<V>(g.water + i) * splatAs<V>(evaporation));
+    return false;
+  }
+};
+
+void updateFlux(const Grids &grids, const PipeErosionParams &params,
+                int rowBegin, int rowEnd)
+{
+  FluxKernel kernel;
+  kernel.g = grids;
+  kernel.flowFactor =
+      params.timeStep * params.pipeArea * params.gravity / grids.cellSize;
+  kernel.rainStep = params.rain * params.timeStep;
+  kernel.cellArea = grids.cellSize * grids.cellSize;
+  kernel.timeStep = params.timeStep;
+  kernel.halfInverseCellSize = 0.5f / grids.cellSize;
+  forCells(kernel, kernel.g, rowBegin, rowEnd);
+}
+
+void updateWater(const Grids &grids, const PipeErosionParams &params,
+                 int rowBegin, int rowEnd)
+{
+  WaterKernel kernel;
+  kernel.g = grids;
+  kernel.rainStep = params.rain * params.timeStep;
+  kernel.timeStep = params.timeStep;
+  kernel.cellArea = grids.cellSize * grids.cellSize;
+  kernel.cellSize = grids.cellSize;
+  kernel.minDepth = 1e-4f;
+  kernel.capacity = params.sedimentCapacity;
+  kernel.minTilt = params.minTilt;
+  kernel.dissolveStep = params.dissolveSpeed * params.timeStep;
+  kernel.depositStep = params.depositSpeed * params.timeStep;
+  kernel.threshold = params.changeThreshold;
+  // Rows are only ever flagged here, by the thread that runs them
+  for (int y = rowBegin; y < rowEnd; y++)
+  {
+    if (forCells(kernel, kernel.g, y, y + 1))
+    {
+      grids.changedRows[y] = 1;
+    }
+  }
+}
+
+void moveSediment(const Grids &grids, const PipeErosionParams &params,
+                  int rowBegin, int rowEnd)
+{
+  TransportKernel kernel;
+  kernel.g = grids;
+  kernel.cellsPerStep = params.timeStep / grids.cellSize;
+  kernel.evaporation =
+      std::max(0.0f, 1.0f - params.evaporationSpeed * params.timeStep);
+  forCells(kernel, kernel.g, rowBegin, rowEnd);
+}
+
+const float noFlow = 1e30f;
+} // namespace
+
+PipeErosion::PipeErosion(const std::vector<float> &heights, int size,
+                         float cellSize, const PipeErosionParams &params)
+    : params(params), size(size), stride(size + 2), cellSize(cellSize)
+{
+  size_t cells = size_t(stride) * (size + 2);
+  terrain.resize(cells, 0.0f);
+  water.resize(cells, 0.0f);
+  sediment.resize(cells, 0.0f);
+  nextSediment.resize(cells, 0.0f);
+  fluxLeft.resize(cells, 0.0f);
+  fluxRight.resize(cells, 0.0f);
+  fluxUp.resize(cells, 0.0f);
+  fluxDown.resize(cells, 0.0f);
+  velocityX.resize(cells, 0.0f);
+  velocityY.resize(cells, 0.0f);
+  tilt.resize(cells, 0.0f);
+  changedRows.resize(size, 0);
+  for (int y = 0; y < size; y++)
+  {
+    std::copy(heights.begin() + size_t(y) * size,
+              heights.begin() + size_t(y + 1) * size,
+              terrain.begin() + size_t(y + 1) * stride + 1);
+  }
+  uploaded = terrain;
+  // Water never flows into the ring around the heightmap, as its surface
+  // is always higher
+  for (int x = 0; x < stride; x++)
+  {
+    water[x] = noFlow;
+    water[size_t(size + 1) * stride + x] = noFlow;
+  }
+  for (int y = 0; y < size + 2; y++)
+  {
+    water[size_t(y) * stride] = noFlow;
+    water[size_t(y) * stride + size + 1] = noFlow;
+  }
+  copyEdges();
+}
+
+void PipeErosion::step(int iterations, labhelper::ThreadPool *pool)
+{
+  auto startTime = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < iterations; i++)
+  {
+    Grids grids = {terrain.data(),   water.data(),     sediment.data(),
+                   nextSediment.data(), fluxLeft.data(), fluxRight.data(),
+                   fluxUp.data(),    fluxDown.data(),  velocityX.data(),
+                   velocityY.data(), tilt.data(),      uploaded.data(),
+                   changedRows.data(), size,           stride,
+                   cellSize};
+    // Each stage reads neighbours the stage before wrote, so every stage
+    // finishes on all rows before the next one starts
+    forRange(pool, size, 8, [&](int begin, int end) {
+      updateFlux(grids, params, begin, end);
+    });
+    forRange(pool, size, 8, [&](int begin, int end) {
+      updateWater(grids, params, begin, end);
+    });
+    copyEdges();
+    forRange(pool, size, 8, [&](int begin, int end) {
+      moveSediment(grids, params, begin, end);
+    });
+    sediment.swap(nextSediment);
+  }
+  std::chrono::duration<float, std::milli> elapsed =
+      std::chrono::high_resolution_clock::now() - startTime;
+  if (iterations > 0)
+  {
+    lastStepMs = elapsed.count() / iterations;
+  }
+}
+
+int PipeErosion::stepFor(float budgetMs, labhelper::ThreadPool *pool)
+{
+  auto startTime = std::chrono::high_resolution_clock::now();
+  int steps = 0;
+  float elapsedMs = 0.0f;
+  do
+  {
+    step(1, pool);
+    steps++;
+    std::chrono::duration<float, std::milli> elapsed =
+        std::chrono::high_resolution_clock::now() - startTime;
+    elapsedMs = elapsed.count();
+  } while (elapsedMs + lastStepMs <= budgetMs);
+  return steps;
+}
+
+void PipeErosion::getHeights(std::vector<float> &heights) const
+{
+  heights.resize(size_t(size) * size);
+  for (int y = 0; y < size; y++)
+  {
+    const float *row = terrain.data() + size_t(y + 1) * stride + 1;
+    std::copy(row, row + size, heights.begin() + size_t(y) * size);
+  }
+}
+
+bool PipeErosion::takeChangedRows(std::vector<float> &heights, int &rowBegin,
+                                  int &rowEnd)
+{
+  rowBegin = size;
+  rowEnd = 0;
+  for (int y = 0; y < size; y++)
+  {
+    if (!changedRows[y])
+    {
+      continue;
+    }
+    changedRows[y] = 0;
+    rowBegin = std::min(rowBegin, y);
+    rowEnd = y + 1;
+    size_t row = size_t(y + 1) * stride + 1;
+    std::copy(terrain.begin() + row, terrain.begin() + row + size,
+              heights.begin() + size_t(y) * size);
+    std::copy(terrain.begin() + row, terrain.begin() + row + size,
+              uploaded.begin() + row);
+  }
+  return rowBegin < rowEnd;
+}
+
+void PipeErosion::copyEdges()
+{
+  // The slope at the edges is taken as if the heightmap continued flat
+  for (int y = 1; y <= size; y++)
+  {
+    terrain[size_t(y) * stride] = terrain[size_t(y) * stride + 1];
+    terrain[size_t(y) * stride + size + 1] = terrain[size_t(y) * stride + size];
+  }
+  std::copy(terrain.begin() + stride, terrain.begin() + 2 * stride,
+            terrain.begin());
+  std::copy(terrain.begin() + size_t(size) * stride,
+            terrain.begin() + size_t(size + 1) * stride,
+            terrain.begin() + size_t(size + 1) * stride);
+}
+
+void benchmarkPipeErosion(const std::vector<float> &heightMap, int size,
+                          float cellSize, const PipeErosionParams &params,
+                          int iterations)
+{
+  int maxThreads = std::max(4, int(std::thread::hardware_concurrency()));
+  std::cout << "Eroding " << size << "x" << size << " for " << iterations
+            << " water steps:\n";
+  std::vector<float> reference;
+  float singleThreadMs = 0.0f;
+  for (int threads = 1; threads <= maxThreads; threads *= 2)
+  {
+    std::unique_ptr<labhelper::ThreadPool> pool;
+    if (threads > 1)
+    {
+      pool.reset(new labhelper::ThreadPool(threads - 1));
+    }
+    PipeErosion erosion(heightMap, size, cellSize, params);
+    auto startTime = std::chrono::high_resolution_clock::now();
+    erosion.step(iterations, pool.get());
+    std::chrono::duration<float, std::milli> elapsed =
+        std::chrono::high_resolution_clock::now() - startTime;
+    std::vector<float> heights;
+    erosion.getHeights(heights);
+    if (threads == 1)
+    {
+      reference = heights;
+      singleThreadMs = elapsed.count();
+    }
+    std::cout << "  " << threads << " threads: " << elapsed.count() << " ms, "
+              << float(size) * size * iterations / (elapsed.count() * 1000.0f)
+              << " million cells/s, speedup "
+              << singleThreadMs / elapsed.count()
+              << (heights == reference ? "" : ", DIFFERENT RESULT") << "\n";
+  }
+}
+
+namespace
+{
+// Heights split by colour, with a ring of cells around the heightmap. Cell
+// (x, y) of the padded grid is in cells[(x + y) & 1], row y, index x / 2.
+struct Checkerboard
+{
+  int size, width;
+  std::vector<float> cells[2];
+
+  float &at(int x, int y)
+  {
+    return cells[(x + y) & 1][size_t(y) * width + (x >> 1)];
+  }
+
+  // Copies the cells along the edges into the ring around them, so that no
+  // material slides off the heightmap
+  void copyEdges()
+  {
+    for (int i = 1; i <= size; i++)
+    {
+      at(0, i) = at(1, i);
+      at(size + 1, i) = at(size, i);
+      at(i, 0) = at(i, 1);
+      at(i, size + 1) = at(i, size);
+    }
+  }
+};
+
+// The part of a height difference beyond the talus height, either way
+template <class V> V beyondTalus(V difference, V talus, V zero)
+{
+  return maxOf(difference - talus, zero) + minOf(difference + talus, zero);
+}
+
+// Moves rate times the excess slope to or from each neighbour into the
+// cells at k of one colour, where sides[k] and sides[k + 1] are on either
+// side of cells[k]
+template <class V>
+void relaxCells(float *cells, const float *sides, const float *up,
+                const float *down, int k, float talus, float rate,
+                V &maxChange)
+{
+  V zero = splatAs<V>(0.0f);
+  V t = splatAs<V>(talus);
+  V h = loadAs<V>(cells + k);
+  V excess = beyondTalus(loadAs<V>(sides + k) - h, t, zero) +
+             beyondTalus(loadAs<V>(sides + k + 1) - h, t, zero) +
+             beyondTalus(loadAs<V>(up + k) - h, t, zero) +
+             beyondTalus(loadAs<V>(down + k) - h, t, zero);
+  V change = excess * splatAs<V>(rate);
+  storeTo(cells + k, h + change);
+  maxChange = maxOf(maxChange, maxOf(change, zero - change));
+}
+
+// Updates the cells of one colour in row y of the padded grid from other,
+// the grid of the other colour, and returns the largest change
+float relaxRow(const Checkerboard &board, float *cells, const float *other,
+               int colour, int y, float talus, float rate)
+{
+  // The first cell of the colour in the row is at x = parity, and its left
+  // neighbour at index parity - 1 of the other colour
+  int parity = (colour + y) & 1;
+  cells += size_t(y) * board.width;
+  const float *sides = other + size_t(y) * board.width + parity - 1;
+  const float *up = other + size_t(y - 1) * board.width;
+  const float *down = other + size_t(y + 1) * board.width;
+  int k = parity == 1 ? 0 : 1;
+  int end = (board.size - parity) / 2 + 1;
+
+  simd::float4 maxChange4 = simd::splat(0.0f);
+  for (; k + 4 <= end; k += 4)
+  {
+    relaxCells(cells, sides, up, down, k, talus, rate, maxChange4);
+  }
+  float maxChange = std::max(
+      std::max(simd::lane(maxChange4, 0), simd::lane(maxChange4, 1)),
+      std::max(simd::lane(maxChange4, 2), simd::lane(maxChange4, 3)));
+  for (; k < end; k++)
+  {
+    relaxCells(cells, sides, up, down, k, talus, rate, maxChange);
+  }
+  return maxChange;
+}
+} // namespace
+
+int erodeThermal(std::vector<float> &heightMap, int size, float cellSize,
+                 const ThermalErosionParams &params,
+                 labhelper::ThreadPool *pool)
+{
+  if (params.iterations <= 0 || size < 2)
+  {
+    return 0;
+  }
+  Checkerboard board;
+  board.size = size;
+  board.width = (size + 3) / 2;
+  board.cells[0].resize(size_t(size + 2) * board.width, 0.0f);
+  board.cells[1].resize(size_t(size + 2) * board.width, 0.0f);
+  for (int y = 0; y < size; y++)
+  {
+    for (int x = 0; x < size; x++)
+    {
+      board.at(x + 1, y + 1) = heightMap[size_t(y) * size + x];
+    }
+  }
+
+  float talus = std::tan(params.talusAngle * 3.14159265f / 180.0f) * cellSize;
+  float rate = std::max(0.0f, std::min(0.25f, params.rate));
+  std::vector<float> rowChange(size), previous;
+  int iteration = 0;
+  while (iteration < params.iterations)
+  {
+    iteration++;
+    float maxChange = 0.0f;
+    for (int colour = 0; colour < 2; colour++)
+    {
+      // The cells of the colour take what they gain from their neighbours,
+      // and then the neighbours give up the same amounts, worked out from
+      // the heights the cells had before
+      board.copyEdges();
+      previous = board.cells[colour];
+      float *cells = board.cells[colour].data();
+      float *others = board.cells[1 - colour].data();
+      forRange(pool, size, 8, [&](int begin, int end) {
+        for (int y = begin; y < end; y++)
+        {
+          rowChange[y] = relaxRow(board, cells, others, colour, y + 1, talus,
+                                  rate);
+        }
+      });
+      forRange(pool, size, 8, [&](int begin, int end) {
+        for (int y = begin; y < end; y++)
+        {
+          rowChange[y] = std::max(
+              rowChange[y], relaxRow(board, others, previous.data(),
+                                     1 - colour, y + 1, talus, rate));
+        }
+      });
+      maxChange = std::max(maxChange,
+                           *std::max_element(rowChange.begin(), rowChange.end()));
+    }
+    if (maxChange < params.minChange)
+    {
+      break;
+    }
+  }
+
+  for (int y = 0; y < size; y++)
+  {
+    for (int x = 0; x < size; x++)
+    {
+      heightMap[size_t(y) * size + x] = board.at(x + 1, y + 1);
+    }
+  }
+  return iteration;
+}
+
+void benchmarkThermalErosion(const std::vector<float> &heightMap, int size,
+                             float cellSize,
+                             const ThermalErosionParams &params)
+{
+  int maxThreads = std::max(4, int(std::thread::hardware_concurrency()));
+  std::cout << "Thermal erosion of " << size << "x" << size << ":\n";
+  std::vector<float> reference;
+  for (int threads = 1; threads <= maxThreads; threads *= 2)
+  {
+    std::unique_ptr<labhelper::ThreadPool> pool;
+    if (threads > 1)
+    {
+      pool.reset(new labhelper::ThreadPool(threads - 1));
+    }
+    std::vector<float> heights = heightMap;
+    auto startTime = std::chrono::high_resolution_clock::now();
+    int iterations = erodeThermal(heights, size, cellSize, params, pool.get());
+    std::chrono::duration<float, std::milli> elapsed =
+        std::chrono::high_resolution_clock::now() - startTime;
+    if (threads == 1)
+    {
+      reference = heights;
+    }
+    std::cout << "  " << threads << " threads: " << iterations
+              << " iterations in " << elapsed.count() << " ms, "
+              << elapsed.count() / std::max(1, iterations)
+              << " ms per iteration"
+              << (heights == reference ? "" : ", DIFFERENT RESULT") << "\n";
+  }
+}
@@ -0,0 +1,162 @@
+#pragma once
+#include <vector>
+
+namespace labhelper
+{
+class ThreadPool;
+}
+
+// Droplet (particle) hydraulic erosion: each droplet runs downhill, picking
+// up sediment where it speeds up and dropping it where it slows down or
+// fills a pit.
+//
+// The map is split into square tiles coloured in a 2x2 pattern. Droplets
+// start in a tile and never leave a margin around it, and tiles of the
+// same colour are a whole tile apart, so all tiles of one colour run in
+// parallel without touching the same heights. Each tile has its own random
+// sequence and the colours run in a fixed order, so the result only
+// depends on the parameters, not on the number of threads.
+struct DropletErosionParams
+{
+    int droplets = 0; // 0 turns the pass off
+    unsigned int seed = 0;
+    int maxLifetime = 30;
+    float inertia = 0.05f;
+    float sedimentCapacityFactor = 4.0f;
+    float minSedimentCapacity = 0.01f;
+    float erodeSpeed = 0.3f;
+    float depositSpeed = 0.3f;
+    float evaporateSpeed = 0.01f;
+    float gravity = 4.0f;
+    int erosionRadius = 3;
+    // Droplets are spread over this many passes over all four colours, with
+    // the tile grid shifted by half a tile every other pass, so that tile
+    // edges do not show.
+    int passes = 4;
+    int tileSize = 64;
+};
+
+// Erodes a size * size heightMap (row by row, one unit between samples) on
+// the threads of pool, or only on the calling thread if pool is null.
+void erodeDroplets(std::vector<float> &heightMap, int size,
+                   const DropletErosionParams &params,
+                   labhelper::ThreadPool *pool);
+
+// Erodes copies of a heightmap with 1, 2, 4... threads up to the hardware
+// thread count (at least 4), and prints droplets per second and whether
+// every thread count gave the same heights.
+void benchmarkDropletErosion(const std::vector<float> &heightMap, int size,
+                             const DropletErosionParams &params);
+
+// Grid (virtual pipe) hydraulic erosion: every cell holds terrain height,
+// water height, suspended sediment and the outflow through a virtual pipe
+// to each of its four neighbours. Each step rains on the whole grid, lets
+// water flow along the pipes by the difference in water surface, dissolves
+// or deposits sediment depending on how fast the water runs down the
+// slope, carries the sediment along with the water and evaporates some
+// water.
+//
+// Each stage only writes the cells it is run on, so rows run in parallel
+// on the thread pool, four cells at a time, and the result does not depend
+// on the number of threads.
+struct PipeErosionParams
+{
+    int iterations = 0; // Run when the terrain is generated, 0 turns it off
+    float timeStep = 0.02f;
+    float rain = 0.01f; // Water height per unit of time
+    float gravity = 9.81f;
+    float pipeArea = 1.0f;
+    float sedimentCapacity = 1.0f;
+    // Flat ground still carries some sediment along
+    float minTilt = 0.05f;
+    float dissolveSpeed = 0.5f;
+    float depositSpeed = 1.0f;
+    float evaporationSpeed = 0.5f;
+    // takeChangedRows() skips heights that moved less than this
+    float changeThreshold = 0.001f;
+};
+
+class PipeErosion
+{
+public:
+    // Starts dry from a size * size heightmap, with cellSize between samples
+    PipeErosion(const std::vector<float> &heights, int size, float cellSize,
+                const PipeErosionParams &params);
+
+    PipeErosionParams params;
+
+    // Runs iterations steps on the threads of pool, or only on the calling
+    // thread if pool is null.
+    void step(int iterations, labhelper::ThreadPool *pool);
+    // Steps for as long as another step is expected to fit in budgetMs, but
+    // at least once, and returns the number of steps.
+    int stepFor(float budgetMs, labhelper::ThreadPool *pool);
+
+    void getHeights(std::vector<float> &heights) const;
+    // Copies the rows whose heights moved by more than
+    // params.changeThreshold since the last call into heights, which holds
+    // the whole heightmap. Returns false if no row did, and otherwise the
+    // rows in [rowBegin, rowEnd) that may have changed.
+    bool takeChangedRows(std::vector<float> &heights, int &rowBegin,
+                         int &rowEnd);
+
+    int getSize() const { return size; }
+    float getLastStepMs() const { return lastStepMs; }
+
+private:
+    // The grids have a ring of cells around the heightmap that water can
+    // not flow into, so the stencils need no special cases at the edges
+    int size;
+    int stride;
+    float cellSize;
+    float lastStepMs = 0.0f;
+    std::vector<float> terrain, water, sediment, nextSediment;
+    std::vector<float> fluxLeft, fluxRight, fluxUp, fluxDown;
+    std::vector<float> velocityX, velocityY, tilt;
+    std::vector<float> uploaded; // Heights as of the last takeChangedRows()
+    std::vector<char> changedRows;
+
+    void copyEdges();
+};
+
+// Runs iterations steps on a heightmap with 1, 2, 4... threads up to the
+// hardware thread count (at least 4), and prints cells per second and
+// whether every thread count gave the same heights.
+void benchmarkPipeErosion(const std::vector<float> &heightMap, int size,
+                          float cellSize, const PipeErosionParams &params,
+                          int iterations);
+
+// Thermal erosion: wherever the height difference to a neighbour is steeper
+// than the talus angle, part of the excess slides down to it, until slopes
+// settle at the talus angle. What one cell gains its neighbour loses, so
+// the total height stays the same, and nothing slides off the edges.
+//
+// Cells are updated in place in red-black order: first every cell whose
+// x + y is even takes its share from its four neighbours, which are all
+// odd, and then the odd cells give up the same amounts; then the same with
+// the colours swapped. No cell of a colour reads another of the same
+// colour, so each step runs in parallel on the thread pool, and with the
+// colours stored in separate grids four cells are updated at a time.
+struct ThermalErosionParams
+{
+    int iterations = 0; // 0 turns it off
+    float talusAngle = 35.0f; // In degrees
+    // Fraction of the excess slope moved per iteration, at most 0.25
+    float rate = 0.2f;
+    // Stops early once no height moves by more than this in an iteration
+    float minChange = 1e-4f;
+};
+
+// Relaxes a size * size heightMap with cellSize between samples on the
+// threads of pool, or only on the calling thread if pool is null, and
+// returns the number of iterations run.
+int erodeThermal(std::vector<float> &heightMap, int size, float cellSize,
+                 const ThermalErosionParams &params,
+                 labhelper::ThreadPool *pool);
+
+// Runs thermal erosion on a heightmap with 1, 2, 4... threads up to the
+// hardware thread count (at least 4), and prints the time per iteration and
+// whether every thread count gave the same heights.
+void benchmarkThermalErosion(const std::vector<float> &heightMap, int size,
+                             float cellSize,
+                             const ThermalErosionParams &params);
@@ -0,0 +1,375 @@
+#include "impostor.h"
+#include <GL/glew.h>
+#include <Model.h>
+#include <filecache.h>
+#include <labhelper.h>
+#include <mappedfile.h>
+#include <texturecache.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+const uint32_t cacheMagic = 0x4d49484c; // "LHIM"
+// Bump when the bake (bake(), dilate() or impostor_bake.vert/frag) changes
+const uint32_t cacheVersion = 2;
+
+struct CacheHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t sourceSize;
+  int64_t sourceTime;
+  uint64_t materialHash;
+  int32_t frames;
+  int32_t frameSize;
+  int32_t hemisphere;
+  float radius;
+  float centre[3];
+  uint32_t reserved;
+};
+
+float signNotZero(float a)
+{
+  return a >= 0.0f ? 1.0f : -1.0f;
+}
+
+// The view direction of the frame at uv in [-1, 1]^2, as in impostor.vert
+glm::vec3 frameDirection(glm::vec2 uv, bool hemisphere)
+{
+  glm::vec3 d;
+  if (hemisphere)
+  {
+    // The octahedron's upper half, turned 45 degrees to fill the square
+    float x = (uv.x + uv.y) * 0.5f, z = (uv.x - uv.y) * 0.5f;
+    d = glm::vec3(x, 1.0f - std::abs(x) - std::abs(z), z);
+  }
+  else
+  {
+    d = glm::vec3(uv.x, 1.0f - std::abs(uv.x) - std::abs(uv.y), uv.y);
+    if (d.y < 0.0f)
+    {
+      float x = d.x;
+      d.x = (1.0f - std::abs(d.z)) * signNotZero(x);
+      d.z = (1.0f - std::abs(x)) * signNotZero(d.z);
+    }
+  }
+  return glm::normalize(d);
+}
+
+// Maps the bounding sphere as seen from direction to [-1, 1]^3, nearest
+// points to -1 in z
+glm::mat4 frameMatrix(glm::vec3 direction, glm::vec3 centre, float radius)
+{
+  glm::vec3 right = glm::cross(glm::vec3(0.0f, 1.0f, 0.0f), direction);
+  right = glm::length(right) < 1e-4f ? glm::vec3(1.0f, 0.0f, 0.0f)
+                                     : glm::normalize(right);
+  glm::vec3 up = glm::cross(direction, right);
+  glm::mat4 m(1.0f);
+  for (int i = 0; i < 3; i++)
+  {
+    m[i][0] = right[i] / radius;
+    m[i][1] = up[i] / radius;
+    m[i][2] = -direction[i] / radius;
+  }
+  m[3][0] = -glm::dot(right, centre) / radius;
+  m[3][1] = -glm::dot(up, centre) / radius;
+  m[3][2] = glm::dot(direction, centre) / radius;
+  return m;
+}
+
+// What the bake reads besides the geometry: the colour of each material
+// and the path and stamp of its colour texture, so that editing the MTL
+// file or a texture bakes the impostor again
+uint64_t materialHash(const labhelper::Model *model)
+{
+  uint64_t hash = labhelper::hashBytes(nullptr, 0);
+  for (const labhelper::Material &material : model->m_materials)
+  {
+    hash = labhelper::hashBytes(&material.m_color, sizeof(material.m_color),
+                                hash);
+    const labhelper::Texture &texture = material.m_color_texture;
+    if (texture.valid)
+    {
+      std::string path = texture.directory + texture.filename;
+      labhelper::FileStamp stamp = {};
+      labhelper::getFileStamp(path, stamp);
+      hash = labhelper::hashString(path, hash);
+      hash = labhelper::hashBytes(&stamp, sizeof(stamp), hash);
+    }
+  }
+  return hash;
+}
+
+// Spreads the colours of covered texels (alpha above 0 in albedo) into the
+// empty ones next to them, a texel per pass and never across frames, so
+// that filtering and mipmaps at the silhouette do not blend in black. Alpha
+// is left as is.
+void dilate(std::vector<uint8_t> &albedo, std::vector<uint8_t> &normalDepth,
+            int frameSize, int size, int passes)
+{
+  std::vector<uint8_t> filled(size_t(size) * size);
+  for (size_t i = 0; i < filled.size(); i++)
+  {
+    filled[i] = albedo[i * 4 + 3] > 0 ? 1 : 0;
+  }
+  std::vector<uint8_t> next = filled;
+  const int dx[4] = {-1, 1, 0, 0};
+  const int dy[4] = {0, 0, -1, 1};
+  for (int pass = 0; pass < passes; pass++)
+  {
+    bool changed = false;
+    for (int y = 0; y < size; y++)
+    {
+      for (int x = 0; x < size; x++)
+      {
+        size_t i = size_t(y) * size + x;
+        if (filled[i])
+        {
+          continue;
+        }
+        int sum[8] = {};
+        int count = 0;
+        for (int k = 0; k < 4; k++)
+        {
+          int nx = x + dx[k], ny = y + dy[k];
+          if (nx < 0 || ny < 0 || nx >= size || ny >= size ||
+              nx / frameSize != x / frameSize ||
+              ny / frameSize != y / frameSize)
+          {
+            continue;
+          }
+          size_t j = size_t(ny) * size + nx;
+          if (!filled[j])
+          {
+            continue;
+          }
+          for (int c = 0; c < 3; c++)
+          {
+            sum[c] += albedo[j * 4 + c];
+            sum[4 + c] += normalDepth[j * 4 + c];
+          }
+          sum[7] += normalDepth[j * 4 + 3];
+          count++;
+        }
+        if (count == 0)
+        {
+          continue;
+        }
+        for (int c = 0; c < 3; c++)
+        {
+          albedo[i * 4 + c] = uint8_t(sum[c] / count);
+          normalDepth[i * 4 + c] = uint8_t(sum[4 + c] / count);
+        }
+        normalDepth[i * 4 + 3] = uint8_t(sum[7] / count);
+        next[i] = 1;
+        changed = true;
+      }
+    }
+    if (!changed)
+    {
+      break;
+    }
+    filled = next;
+  }
+}
+
+// Averages each 2x2 block of a size * size RGBA8 image into the next
+// mipmap. With an even frame size no block straddles two frames.
+std::vector<uint8_t> halve(const uint8_t *image, int size)
+{
+  int half = size / 2;
+  std::vector<uint8_t> result(size_t(half) * half * 4);
+  for (int y = 0; y < half; y++)
+  {
+    for (int x = 0; x < half; x++)
+    {
+      const uint8_t *top = image + (size_t(2 * y) * size + 2 * x) * 4;
+      const uint8_t *bottom = top + size_t(size) * 4;
+      for (int c = 0; c < 4; c++)
+      {
+        int sum = top[c] + top[4 + c] + bottom[c] + bottom[4 + c];
+        result[(size_t(y) * half + x) * 4 + c] = uint8_t((sum + 2) / 4);
+      }
+    }
+  }
+  return result;
+}
+
+void bake(const labhelper::Model *model, const Impostor &impostor,
+          unsigned int bakeProgram)
+{
+  const ImpostorParams &params = impostor.params;
+  GLint previousFramebuffer, viewport[4];
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousFramebuffer);
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+  GLboolean cullFace = glIsEnabled(GL_CULL_FACE);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, impostor.atlas.framebufferId);
+  glViewport(0, 0, impostor.atlas.width, impostor.atlas.height);
+  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+  glClearDepth(1.0f);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glEnable(GL_DEPTH_TEST);
+  glDepthFunc(GL_LESS);
+  glDisable(GL_CULL_FACE);
+  glUseProgram(bakeProgram);
+  int n = params.frames;
+  for (int j = 0; j < n; j++)
+  {
+    for (int i = 0; i < n; i++)
+    {
+      glm::vec2 uv = glm::vec2(i, j) / float(n - 1) * 2.0f - 1.0f;
+      glm::vec3 direction = frameDirection(uv, params.hemisphere);
+      glViewport(i * params.frameSize, j * params.frameSize, params.frameSize,
+                 params.frameSize);
+      labhelper::setUniformSlow(
+          bakeProgram, "viewProjectionMatrix",
+          frameMatrix(direction, impostor.centre, impostor.radius));
+      labhelper::render(model, true);
+    }
+  }
+
+  glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+  glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+  if (!depthTest)
+  {
+    glDisable(GL_DEPTH_TEST);
+  }
+  if (cullFace)
+  {
+    glEnable(GL_CULL_FACE);
+  }
+}
+} // namespace
+
+bool loadImpostor(const labhelper::Model *model, const ImpostorParams &params,
+                  unsigned int bakeProgram, Impostor &impostor)
+{
+  if (model->m_positions.empty() || params.frames < 2 || params.frameSize < 1)
+  {
+    return false;
+  }
+  impostor.params = params;
+
+  // The centre of the bounding box, and the furthest vertex from it
+  glm::vec3 low = model->m_positions[0], high = model->m_positions[0];
+  for (const glm::vec3 &p : model->m_positions)
+  {
+    low = glm::min(low, p);
+    high = glm::max(high, p);
+  }
+  impostor.centre = (low + high) * 0.5f;
+  impostor.radius = 0.0f;
+  for (const glm::vec3 &p : model->m_positions)
+  {
+    impostor.radius =
+        std::max(impostor.radius, glm::length(p - impostor.centre));
+  }
+  impostor.radius = std::max(impostor.radius, 1e-4f);
+
+  int size = params.frames * params.frameSize;
+  size_t bytes = size_t(size) * size * 4;
+  impostor.atlas.resize(size, size);
+
+  CacheHeader expected = {};
+  expected.magic = cacheMagic;
+  expected.version = cacheVersion;
+  expected.frames = params.frames;
+  expected.frameSize = params.frameSize;
+  expected.hemisphere = params.hemisphere ? 1 : 0;
+  expected.radius = impostor.radius;
+  memcpy(expected.centre, &impostor.centre, sizeof(expected.centre));
+  std::string cacheFile;
+  labhelper::FileStamp stamp;
+  if (labhelper::getFileStamp(model->m_filename, stamp))
+  {
+    expected.sourceSize = stamp.size;
+    expected.sourceTime = stamp.time;
+    expected.materialHash = materialHash(model);
+    cacheFile = labhelper::textureCachePath(
+        model->m_filename,
+        "impostor " + std::to_string(params.frames) + " " +
+            std::to_string(params.frameSize) + " " +
+            std::to_string(expected.hemisphere),
+        ".lim");
+  }
+
+  const uint8_t *images[2] = {nullptr, nullptr};
+  std::vector<uint8_t> albedo, normalDepth;
+  labhelper::MappedFile file;
+  CacheHeader header;
+  impostor.fromCache = false;
+  if (!cacheFile.empty() && file.open(cacheFile) &&
+      file.size() == sizeof(header) + 2 * bytes)
+  {
+    memcpy(&header, file.data(), sizeof(header));
+    impostor.fromCache = memcmp(&header, &expected, sizeof(header)) == 0;
+  }
+  if (impostor.fromCache)
+  {
+    images[0] = file.data() + sizeof(header);
+    images[1] = images[0] + bytes;
+  }
+  else
+  {
+    bake(model, impostor, bakeProgram);
+    albedo.resize(bytes);
+    normalDepth.resize(bytes);
+    glBindTexture(GL_TEXTURE_2D, impostor.atlas.colorTextureTargets[0]);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, albedo.data());
+    glBindTexture(GL_TEXTURE_2D, impostor.atlas.colorTextureTargets[1]);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                  normalDepth.data());
+    dilate(albedo, normalDepth, params.frameSize, size,
+           std::max(2, params.frameSize / 8));
+    images[0] = albedo.data();
+    images[1] = normalDepth.data();
+    if (!cacheFile.empty())
+    {
+      std::vector<uint8_t> out(sizeof(expected) + 2 * bytes);
+      memcpy(out.data(), &expected, sizeof(expected));
+      memcpy(out.data() + sizeof(expected), albedo.data(), bytes);
+      memcpy(out.data() + sizeof(expected) + bytes, normalDepth.data(), bytes);
+      labhelper::writeFileAtomic(cacheFile, out.data(), out.size());
+    }
+  }
+
+  // The mipmaps are built here rather than with glGenerateMipmap, and stop
+  // while frames still have an even number of texels down to 4, so that no
+  // texel of a coarse level mixes two views (impostor.frag keeps the
+  // filter inside a frame at the level it samples)
+  int levels = 0;
+  while ((params.frameSize >> levels) % 2 == 0 &&
+         (params.frameSize >> levels) > 4)
+  {
+    levels++;
+  }
+  for (int k = 0; k < 2; k++)
+  {
+    glBindTexture(GL_TEXTURE_2D, impostor.atlas.colorTextureTargets[k]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size, size, GL_RGBA,
+                    GL_UNSIGNED_BYTE, images[k]);
+    std::vector<uint8_t> mip;
+    for (int level = 1; level <= levels; level++)
+    {
+      int levelSize = size >> level;
+      mip = halve(level == 1 ? images[k] : mip.data(), levelSize * 2);
+      glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, levelSize, levelSize, 0,
+                   GL_RGBA, GL_UNSIGNED_BYTE, mip.data());
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                    GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  }
+  glBindTexture(GL_TEXTURE_2D, 0);
+  return true;
+}
@@ -0,0 +1,189 @@
+#version 420
+
+// required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
+precision highp float;
+
+///////////////////////////////////////////////////////////////////////////////
+// The impostor atlas, see Impostor in impostor.h
+///////////////////////////////////////////////////////////////////////////////
+layout(binding = 0) uniform sampler2D impostorAlbedo;
+layout(binding = 1) uniform sampler2D impostorNormalDepth;
+uniform int impostorFrames;
+
+///////////////////////////////////////////////////////////////////////////////
+// Material, the same for the whole impostor
+///////////////////////////////////////////////////////////////////////////////
+uniform float material_metalness = 0;
+uniform float material_fresnel = 0.04;
+uniform float material_shininess = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Environment
+///////////////////////////////////////////////////////////////////////////////
+layout(binding = 6) uniform sampler2D environmentMap;
+layout(binding = 7) uniform sampler2D irradianceMap;
+layout(binding = 8) uniform sampler2D reflectionMap;
+uniform float environment_multiplier;
+
+///////////////////////////////////////////////////////////////////////////////
+// Light source
+///////////////////////////////////////////////////////////////////////////////
+uniform vec3 point_light_color = vec3(1.0, 1.0, 1.0);
+uniform float point_light_intensity_multiplier = 50.0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Constants
+///////////////////////////////////////////////////////////////////////////////
+#define PI 3.14159265359
+
+///////////////////////////////////////////////////////////////////////////////
+// Input varyings from vertex shader
+///////////////////////////////////////////////////////////////////////////////
+flat in vec2 frame[3];
+flat in vec3 frameWeights;
+in vec2 frameTexCoord[3];
+flat in vec2 instanceCosSin;
+in vec3 viewSpacePosition;
+
+///////////////////////////////////////////////////////////////////////////////
+// Input uniform variables
+///////////////////////////////////////////////////////////////////////////////
+uniform mat4 viewMatrix;
+uniform mat4 viewInverse;
+uniform vec3 viewSpaceLightPosition;
+
+///////////////////////////////////////////////////////////////////////////////
+// Output color, or the G-buffer when built with DEFERRED (see deferred.frag
+// for the layout)
+///////////////////////////////////////////////////////////////////////////////
+#ifdef DEFERRED
+layout(location = 0) out vec4 gbufferAlbedo;
+layout(location = 1) out vec2 gbufferNormal;
+layout(location = 2) out vec2 gbufferMaterial;
+#else
+layout(location = 0) out vec4 fragmentColor;
+#endif
+
+vec3 calculateDirectIllumiunation(vec3 wo, vec3 n, vec3 base_color)
+{
+    vec3 direct_illum = base_color;
+    float d = distance(viewSpacePosition, viewSpaceLightPosition);
+    vec3 wi = normalize(viewSpaceLightPosition - viewSpacePosition);
+    vec3 Li = point_light_intensity_multiplier * point_light_color * 1 / pow(d, 2);
+    if (dot(wi, n) <= 0.0) return vec3(0, 0, 0);
+
+    vec3 diffuse_term = base_color * (1.0 / PI) * dot(n, wi) * Li;
+
+    vec3 wh = normalize(wi + wo);
+    float F = material_fresnel + (1 - material_fresnel) * pow(1 - dot(wh, wi), 5);
+    float D = (material_shininess + 2) / (2 * PI) * pow(max(0.001, dot(n, wh)), material_shininess);
+    float G = min(1, min(2 * (dot(n, wh) * dot(n, wo) / max(0.001, dot(wo, wh))), 2 * (dot(n, wh) * dot(n, wi) / max(0.001, dot(wo, wh)))));
+    float brdf = F * D * G / max(0.001, (4 * dot(n, wo) * dot(n, wi)));
+
+    vec3 dielectic_term = brdf * dot(n, wi) * Li + (1.0 - F) * diffuse_term;
+    vec3 metal_term = brdf * base_color * dot(n, wi) * Li;
+    direct_illum = material_metalness * metal_term + (1.0 - material_metalness) * dielectic_term;
+
+    return material_metalness * metal_term + (1.0 - material_metalness) * dielectic_term;
+}
+
+vec3 calculateIndirectIllumination(vec3 wo, vec3 n, vec3 base_color)
+{
+    vec3 indirect_illum = vec3(0.f);
+
+    vec3 nws = vec3(viewInverse * vec4(n, 0.0));
+
+    float theta = acos(max(-1.0f, min(1.0f, nws.y)));
+    float phi = atan(nws.z, nws.x);
+    if (phi < 0.0f)
+    {
+        phi = phi + 2.0f * PI;
+    }
+    vec2 lookup = vec2(phi / (2.0f * PI), 1.0f - theta / PI);
+    vec3 irradiance = environment_multiplier * texture(irradianceMap, lookup).rgb;
+
+    vec3 diffuse_term = base_color * (1.0f / PI) * irradiance;
+
+    float roughness = sqrt(sqrt(2.0f / (material_shininess + 2.0f)));
+    vec3 wi = normalize(reflect(-wo, n));
+    vec3 wr = normalize(vec3(viewInverse * vec4(wi, 0.0f)));
+    theta = acos(max(-1.0f, min(1.0f, wr.y)));
+    phi = atan(wr.z, wr.x);
+    if (phi < 0.0f)
+    {
+        phi = phi + 2.0f * PI;
+    }
+    lookup = vec2(phi / (2.0f * PI), 1.0f - theta / PI);
+    vec3 Li = environment_multiplier * textureLod(reflectionMap, lookup, roughness * 7.0f).rgb;
+    vec3 wh = normalize(wi + wo);
+    float F = material_fresnel + (1.0f - material_fresnel) * pow(1 - dot(wh, wo), 5.0f);
+    vec3 dielectric_term = F * Li + (1.0f - F) * diffuse_term;
+    vec3 metal_term = F * base_color * Li;
+    indirect_illum = material_metalness * metal_term + (1.0f - material_metalness) * dielectric_term;
+
+    return indirect_illum;
+}
+
+// Octahedral normal encoding, mapped to [0, 1] for a UNORM target
+vec2 octWrap(vec2 v)
+{
+    return (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec2 encodeNormal(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    n.xy = n.z >= 0.0 ? n.xy : octWrap(n.xy);
+    return n.xy * 0.5 + 0.5;
+}
+
+vec3 rotateY(vec3 v, float c, float s)
+{
+    return vec3(c * v.x + s * v.z, v.y, c * v.z - s * v.x);
+}
+
+void main()
+{
+    // The three nearest views, weighted by how near they are and by their
+    // coverage, each kept inside its own frame of the atlas. The mipmap
+    // level is picked before clamping, and the clamp keeps the filter half
+    // a texel of the coarser level it blends from away from the frame edge
+    vec3 baseColor = vec3(0.0);
+    vec3 modelSpaceNormal = vec3(0.0);
+    float coverage = 0.0;
+    float frameTexels = float(textureSize(impostorAlbedo, 0).x / impostorFrames);
+    for (int k = 0; k < 3; k++)
+    {
+        float lod = textureQueryLod(impostorAlbedo,
+                                    (frame[k] + frameTexCoord[k]) / float(impostorFrames)).x;
+        float inset = 0.5 * exp2(ceil(lod)) / frameTexels;
+        vec2 uv = (frame[k] + clamp(frameTexCoord[k], inset, 1.0 - inset)) / float(impostorFrames);
+        vec4 albedo = textureLod(impostorAlbedo, uv, lod);
+        vec3 normal = textureLod(impostorNormalDepth, uv, lod).xyz * 2.0 - 1.0;
+        float w = frameWeights[k] * albedo.a;
+        baseColor += w * albedo.rgb;
+        modelSpaceNormal += w * normal;
+        coverage += w;
+    }
+    if (coverage < 0.5)
+    {
+        discard;
+    }
+    baseColor /= coverage;
+
+    vec3 worldNormal = rotateY(modelSpaceNormal, instanceCosSin.x, instanceCosSin.y);
+    vec3 n = normalize((viewMatrix * vec4(worldNormal, 0.0)).xyz);
+    vec3 wo = -normalize(viewSpacePosition);
+
+#ifdef DEFERRED
+    // Lighting is done once per pixel in deferred.frag
+    float roughness = sqrt(sqrt(2.0 / (material_shininess + 2.0)));
+    gbufferAlbedo = vec4(baseColor, material_metalness);
+    gbufferNormal = encodeNormal(n);
+    gbufferMaterial = vec2(material_fresnel, roughness);
+#else
+    vec3 shading = calculateDirectIllumiunation(wo, n, baseColor) +
+                   calculateIndirectIllumination(wo, n, baseColor);
+    fragmentColor = vec4(shading, 1.0);
+#endif
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <fbo.h>
+#include <glm/glm.hpp>
+
+namespace labhelper
+{
+class Model;
+}
+
+// A model baked from many directions into one atlas, so that a distant
+// copy can be drawn as a single quad showing the views nearest to the
+// camera's direction (see impostor.vert).
+//
+// The views sit on an octahedral grid of frames * frames directions, over
+// the upper hemisphere by default, as props on the ground are not seen from
+// below. Each view is an orthographic image of the model's bounding sphere.
+// The atlas has albedo with coverage in alpha in its first attachment, and
+// the model space normal with the depth into the sphere in its second.
+//
+// Bakes are cached in the texture cache directory, keyed on the OBJ file,
+// its materials and colour textures, and the settings, so only the first
+// run renders them.
+struct ImpostorParams
+{
+    int frames = 12; // Views per side of the atlas
+    int frameSize = 128; // Pixels per side of a view
+    bool hemisphere = true;
+};
+
+struct Impostor
+{
+    ImpostorParams params;
+    FboInfo atlas = FboInfo({GL_RGBA8, GL_RGBA8});
+    // The bounding sphere of the model, in model space
+    glm::vec3 centre;
+    float radius = 0.0f;
+    bool fromCache = false;
+};
+
+// Loads the impostor of model from the cache, or bakes it with
+// bakeProgram (impostor_bake.vert/frag) and caches it. Must be called on the
+// GL thread. Returns false if the model has no vertices.
+bool loadImpostor(const labhelper::Model *model, const ImpostorParams &params,
+                  unsigned int bakeProgram, Impostor &impostor);
@@ -0,0 +1,133 @@
+#version 420
+///////////////////////////////////////////////////////////////////////////////
+// Input vertex attributes
+///////////////////////////////////////////////////////////////////////////////
+// Corner of the quad, in [-1, 1]^2
+layout(location = 0) in vec2 corner;
+
+// Per instance, from InstancedRenderer: world position and scale, and the
+// rotation about the y axis in radians
+layout(location = 3) in vec4 instancePositionScale;
+layout(location = 4) in float instanceRotation;
+
+///////////////////////////////////////////////////////////////////////////////
+// Input uniform variables
+///////////////////////////////////////////////////////////////////////////////
+uniform mat4 viewMatrix;
+uniform mat4 viewInverse;
+uniform mat4 viewProjectionMatrix;
+
+// The impostor, see Impostor in impostor.h
+uniform int impostorFrames;
+uniform int impostorHemisphere;
+uniform vec3 impostorCentre;
+uniform float impostorRadius;
+
+///////////////////////////////////////////////////////////////////////////////
+// Output to fragment shader
+///////////////////////////////////////////////////////////////////////////////
+// The three frames nearest to the view direction, with their weights, and
+// where the corner falls in each of them
+flat out vec2 frame[3];
+flat out vec3 frameWeights;
+out vec2 frameTexCoord[3];
+flat out vec2 instanceCosSin;
+out vec3 viewSpacePosition;
+
+vec3 rotateY(vec3 v, float c, float s)
+{
+	return vec3(c * v.x + s * v.z, v.y, c * v.z - s * v.x);
+}
+
+vec2 signNotZero(vec2 v)
+{
+	return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+// The inverse of frameDirection()
+vec2 encodeDirection(vec3 d)
+{
+	if (impostorHemisphere == 1)
+	{
+		d.y = max(d.y, 0.0);
+		d /= abs(d.x) + d.y + abs(d.z);
+		return vec2(d.x + d.z, d.x - d.z);
+	}
+	d /= abs(d.x) + abs(d.y) + abs(d.z);
+	return d.y >= 0.0 ? d.xz : (1.0 - abs(d.zx)) * signNotZero(d.xz);
+}
+
+// The view direction of the frame at uv in [-1, 1]^2, as in impostor.cpp
+vec3 frameDirection(vec2 uv)
+{
+	vec3 d;
+	if (impostorHemisphere == 1)
+	{
+		float x = (uv.x + uv.y) * 0.5;
+		float z = (uv.x - uv.y) * 0.5;
+		d = vec3(x, 1.0 - abs(x) - abs(z), z);
+	}
+	else
+	{
+		d = vec3(uv.x, 1.0 - abs(uv.x) - abs(uv.y), uv.y);
+		if (d.y < 0.0)
+		{
+			d.xz = (1.0 - abs(d.zx)) * signNotZero(d.xz);
+		}
+	}
+	return normalize(d);
+}
+
+// Where the model space offset p from the centre falls in the frame, in
+// [0, 1]^2 inside it
+vec2 frameCoordinate(vec2 frame, vec3 p)
+{
+	vec3 direction = frameDirection(frame / float(impostorFrames - 1) * 2.0 - 1.0);
+	vec3 right = cross(vec3(0.0, 1.0, 0.0), direction);
+	right = length(right) < 1e-4 ? vec3(1.0, 0.0, 0.0) : normalize(right);
+	vec3 up = cross(direction, right);
+	return vec2(dot(p, right), dot(p, up)) / impostorRadius * 0.5 + 0.5;
+}
+
+void main()
+{
+	float c = cos(instanceRotation);
+	float s = sin(instanceRotation);
+	float scale = instancePositionScale.w;
+	vec3 worldCentre = rotateY(impostorCentre * scale, c, s) + instancePositionScale.xyz;
+
+	// The camera in model space picks the frames, on the triangle of the
+	// grid that holds it
+	vec3 cameraPosition = viewInverse[3].xyz;
+	vec3 toCamera = rotateY(normalize(cameraPosition - worldCentre), c, -s);
+	vec2 grid = (encodeDirection(toCamera) * 0.5 + 0.5) * float(impostorFrames - 1);
+	vec2 base = clamp(floor(grid), vec2(0.0), vec2(float(impostorFrames - 2)));
+	vec2 f = grid - base;
+	if (f.x + f.y < 1.0)
+	{
+		frame[0] = base;
+		frame[1] = base + vec2(1.0, 0.0);
+		frame[2] = base + vec2(0.0, 1.0);
+		frameWeights = vec3(1.0 - f.x - f.y, f.x, f.y);
+	}
+	else
+	{
+		frame[0] = base + vec2(1.0, 1.0);
+		frame[1] = base + vec2(0.0, 1.0);
+		frame[2] = base + vec2(1.0, 0.0);
+		frameWeights = vec3(f.x + f.y - 1.0, 1.0 - f.x, 1.0 - f.y);
+	}
+
+	// A quad facing the camera, covering the bounding sphere
+	vec3 offset = (corner.x * viewInverse[0].xyz + corner.y * viewInverse[1].xyz) *
+	              impostorRadius * scale;
+	vec3 worldPos = worldCentre + offset;
+	vec3 p = rotateY(offset, c, -s) / scale;
+	for (int k = 0; k < 3; k++)
+	{
+		frameTexCoord[k] = frameCoordinate(frame[k], p);
+	}
+	instanceCosSin = vec2(c, s);
+	viewSpacePosition = (viewMatrix * vec4(worldPos, 1.0)).xyz;
+	gl_Position = viewProjectionMatrix * vec4(worldPos, 1.0);
+}
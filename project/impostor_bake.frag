@@ -0,0 +1,38 @@
+#version 420
+
+// required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
+precision highp float;
+
+///////////////////////////////////////////////////////////////////////////////
+// Material, set per mesh by labhelper::render()
+///////////////////////////////////////////////////////////////////////////////
+uniform vec3 material_color = vec3(1, 1, 1);
+uniform int has_color_texture = 0;
+layout(binding = 0) uniform sampler2D colorMap;
+
+///////////////////////////////////////////////////////////////////////////////
+// Input varyings from vertex shader
+///////////////////////////////////////////////////////////////////////////////
+in vec2 texCoord;
+in vec3 modelSpaceNormal;
+
+///////////////////////////////////////////////////////////////////////////////
+// Output to the impostor atlas: albedo and coverage, and the model space
+// normal mapped to [0, 1] with the depth into the bounding sphere
+///////////////////////////////////////////////////////////////////////////////
+layout(location = 0) out vec4 albedo;
+layout(location = 1) out vec4 normalDepth;
+
+void main()
+{
+	vec3 baseColor = material_color;
+	if (has_color_texture == 1)
+	{
+		baseColor *= texture(colorMap, texCoord).rgb;
+	}
+	// Both sides of the faces are baked, so face the normal to the view
+	vec3 n = normalize(modelSpaceNormal);
+	n = gl_FrontFacing ? n : -n;
+	albedo = vec4(baseColor, 1.0);
+	normalDepth = vec4(n * 0.5 + 0.5, gl_FragCoord.z);
+}
@@ -0,0 +1,26 @@
+#version 420
+///////////////////////////////////////////////////////////////////////////////
+// Input vertex attributes
+///////////////////////////////////////////////////////////////////////////////
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 normalIn;
+layout(location = 2) in vec2 texCoordIn;
+
+///////////////////////////////////////////////////////////////////////////////
+// Input uniform variables
+///////////////////////////////////////////////////////////////////////////////
+// One view of the bounding sphere, see loadImpostor()
+uniform mat4 viewProjectionMatrix;
+
+///////////////////////////////////////////////////////////////////////////////
+// Output to fragment shader
+///////////////////////////////////////////////////////////////////////////////
+out vec2 texCoord;
+out vec3 modelSpaceNormal;
+
+void main()
+{
+	gl_Position = viewProjectionMatrix * vec4(position, 1.0);
+	texCoord = texCoordIn;
+	modelSpaceNormal = normalIn;
+}
@@ -0,0 +1,41 @@
+#version 420
+///////////////////////////////////////////////////////////////////////////////
+// Input vertex attributes
+///////////////////////////////////////////////////////////////////////////////
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 normalIn;
+layout(location = 2) in vec2 texCoordIn;
+
+// Per instance, from InstancedRenderer: world position and scale, and the
+// rotation about the y axis in radians
+layout(location = 3) in vec4 instancePositionScale;
+layout(location = 4) in float instanceRotation;
+
+///////////////////////////////////////////////////////////////////////////////
+// Input uniform variables
+///////////////////////////////////////////////////////////////////////////////
+uniform mat4 viewMatrix;
+uniform mat4 viewProjectionMatrix;
+
+///////////////////////////////////////////////////////////////////////////////
+// Output to fragment shader
+///////////////////////////////////////////////////////////////////////////////
+out vec2 texCoord;
+out vec3 viewSpaceNormal;
+out vec3 viewSpacePosition;
+
+vec3 rotateY(vec3 v, float c, float s)
+{
+	return vec3(c * v.x + s * v.z, v.y, c * v.z - s * v.x);
+}
+
+void main()
+{
+	float c = cos(instanceRotation);
+	float s = sin(instanceRotation);
+	vec3 worldPos = rotateY(position * instancePositionScale.w, c, s) + instancePositionScale.xyz;
+	gl_Position = viewProjectionMatrix * vec4(worldPos, 1.0);
+	texCoord = texCoordIn;
+	viewSpaceNormal = (viewMatrix * vec4(rotateY(normalIn, c, s), 0.0)).xyz;
+	viewSpacePosition = (viewMatrix * vec4(worldPos, 1.0)).xyz;
+}
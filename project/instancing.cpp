@@ -0,0 +1,545 @@
+#include "instancing.h"
+#include "impostor.h"
+#include "vegetation.h"
+#include <GL/glew.h>
+#include <Model.h>
+#include <simd.h>
+#include <threadpool.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+using labhelper::simd::float4;
+using labhelper::simd::int4;
+namespace simd = labhelper::simd;
+
+namespace
+{
+// Chunks of cells culled by one thread each, so that the order of the
+// instances in each bucket does not depend on the number of threads
+const int cullChunks = 64;
+
+// Lanes [0, count) of four
+int laneMask(int count)
+{
+  return count >= 4 ? 0xf : (1 << count) - 1;
+}
+
+// Smallest amount of a beyond [low, high], 0 inside
+float4 outsideBy(float4 a, float4 low, float4 high)
+{
+  return simd::max(simd::max(low - a, a - high), simd::splat(0.0f));
+}
+} // namespace
+
+InstancedRenderer::InstancedRenderer(float cellSize) : cellSize(cellSize)
+{
+  glGenBuffers(1, &instanceBuffer);
+
+  const float corners[] = {-1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f};
+  glGenBuffers(1, &quadBuffer);
+  glBindBuffer(GL_ARRAY_BUFFER, quadBuffer);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+  glGenVertexArrays(1, &quadVertexArray);
+  glBindVertexArray(quadVertexArray);
+  glVertexAttribPointer(0, 2, GL_FLOAT, false, 0, 0);
+  glEnableVertexAttribArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+  glEnableVertexAttribArray(3);
+  glVertexAttribDivisor(3, 1);
+  glEnableVertexAttribArray(4);
+  glVertexAttribDivisor(4, 1);
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+InstancedRenderer::~InstancedRenderer()
+{
+  for (Type &t : types)
+  {
+    for (Lod &lod : t.lods)
+    {
+      glDeleteVertexArrays(1, &lod.vertexArray);
+    }
+  }
+  glDeleteVertexArrays(1, &quadVertexArray);
+  glDeleteBuffers(1, &quadBuffer);
+  glDeleteBuffers(1, &instanceBuffer);
+}
+
+int InstancedRenderer::addType(const std::vector<InstanceLod> &lods,
+                               const Impostor *impostor,
+                               float impostorDistance)
+{
+  Type t;
+  t.firstBucket = bucketCount;
+  bucketCount += int(lods.size()) + (impostor != nullptr ? 1 : 0);
+
+  // A sphere around the bounding boxes of all levels of detail
+  glm::vec3 low(0.0f), high(0.0f);
+  bool empty = true;
+  for (const InstanceLod &lod : lods)
+  {
+    for (const glm::vec3 &p : lod.model->m_positions)
+    {
+      low = empty ? p : glm::min(low, p);
+      high = empty ? p : glm::max(high, p);
+      empty = false;
+    }
+  }
+  t.centreHeight = (low.y + high.y) / 2.0f;
+  t.radius = 0.0f;
+  for (const InstanceLod &lod : lods)
+  {
+    for (const glm::vec3 &p : lod.model->m_positions)
+    {
+      t.radius = std::max(
+          t.radius, glm::length(p - glm::vec3(0.0f, t.centreHeight, 0.0f)));
+    }
+  }
+
+  // Each model gets a vertex array of its own buffers and the instance
+  // buffer, which draw() points at the bucket
+  for (const InstanceLod &lod : lods)
+  {
+    labhelper::Model *model = lod.model;
+    Lod l = {model, nullptr, lod.maxDistance, 0};
+    glGenVertexArrays(1, &l.vertexArray);
+    glBindVertexArray(l.vertexArray);
+    glBindBuffer(GL_ARRAY_BUFFER, model->m_positions_bo);
+    glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0);
+    glEnableVertexAttribArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, model->m_normals_bo);
+    glVertexAttribPointer(1, 3, GL_FLOAT, false, 0, 0);
+    glEnableVertexAttribArray(1);
+    glBindBuffer(GL_ARRAY_BUFFER, model->m_texture_coordinates_bo);
+    glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
+    glEnableVertexAttribArray(2);
+    if (model->m_indices_bo != 0)
+    {
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model->m_indices_bo);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+    glEnableVertexAttribArray(3);
+    glVertexAttribDivisor(3, 1);
+    glEnableVertexAttribArray(4);
+    glVertexAttribDivisor(4, 1);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    t.lods.push_back(l);
+    maxDistance = std::max(maxDistance, lod.maxDistance);
+  }
+  // Impostors share the quad's vertex array
+  if (impostor != nullptr)
+  {
+    Lod l = {nullptr, impostor, impostorDistance, 0};
+    t.lods.push_back(l);
+    maxDistance = std::max(maxDistance, impostorDistance);
+  }
+  types.push_back(t);
+  return int(types.size()) - 1;
+}
+
+void InstancedRenderer::setInstances(const VegetationInstances &instances)
+{
+  // The grid covers the instances of known types
+  float lowX = 0.0f, lowZ = 0.0f, highX = 0.0f, highZ = 0.0f;
+  bool empty = true;
+  for (size_t i = 0; i < instances.size(); i++)
+  {
+    if (instances.type[i] < types.size())
+    {
+      lowX = empty ? instances.x[i] : std::min(lowX, instances.x[i]);
+      lowZ = empty ? instances.z[i] : std::min(lowZ, instances.z[i]);
+      highX = empty ? instances.x[i] : std::max(highX, instances.x[i]);
+      highZ = empty ? instances.z[i] : std::max(highZ, instances.z[i]);
+      empty = false;
+    }
+  }
+  int cellsX = std::max(1, int(std::ceil((highX - lowX) / cellSize)));
+  int cellsZ = std::max(1, int(std::ceil((highZ - lowZ) / cellSize)));
+  cellCount = empty ? 0 : cellsX * cellsZ;
+  auto cellOf = [&](size_t i) {
+    int cx = std::min(cellsX - 1, int((instances.x[i] - lowX) / cellSize));
+    int cz = std::min(cellsZ - 1, int((instances.z[i] - lowZ) / cellSize));
+    return cz * cellsX + cx;
+  };
+
+  // Counting sort by cell, keeping the order within each cell
+  cellStart.assign(cellCount + 1, 0);
+  for (size_t i = 0; i < instances.size() && cellCount > 0; i++)
+  {
+    if (instances.type[i] < types.size())
+    {
+      cellStart[cellOf(i) + 1]++;
+    }
+  }
+  for (int c = 0; c < cellCount; c++)
+  {
+    cellStart[c + 1] += cellStart[c];
+  }
+  instanceCount = cellCount > 0 ? size_t(cellStart[cellCount]) : 0;
+  for (std::vector<float> *a :
+       {&centreX, &centreY, &centreZ, &radius, &scale, &rotation})
+  {
+    a->assign(instanceCount + 3, 0.0f);
+  }
+  type.assign(instanceCount + 3, 0);
+  std::vector<int> next(cellStart.begin(), cellStart.end() - 1);
+  for (size_t i = 0; i < instances.size() && cellCount > 0; i++)
+  {
+    if (instances.type[i] >= types.size())
+    {
+      continue;
+    }
+    const Type &t = types[instances.type[i]];
+    int j = next[cellOf(i)]++;
+    centreX[j] = instances.x[i];
+    centreY[j] = instances.y[i] + t.centreHeight * instances.scale[i];
+    centreZ[j] = instances.z[i];
+    radius[j] = t.radius * instances.scale[i];
+    scale[j] = instances.scale[i];
+    rotation[j] = instances.rotation[i];
+    type[j] = instances.type[i];
+  }
+
+  // Empty cells get bounds that fail every test
+  size_t paddedCells = size_t(cellCount) + 3;
+  cellMinX.assign(paddedCells, 1e30f);
+  cellMinY.assign(paddedCells, 1e30f);
+  cellMinZ.assign(paddedCells, 1e30f);
+  cellMaxX.assign(paddedCells, -1e30f);
+  cellMaxY.assign(paddedCells, -1e30f);
+  cellMaxZ.assign(paddedCells, -1e30f);
+  for (int c = 0; c < cellCount; c++)
+  {
+    for (int j = cellStart[c]; j < cellStart[c + 1]; j++)
+    {
+      cellMinX[c] = std::min(cellMinX[c], centreX[j] - radius[j]);
+      cellMinY[c] = std::min(cellMinY[c], centreY[j] - radius[j]);
+      cellMinZ[c] = std::min(cellMinZ[c], centreZ[j] - radius[j]);
+      cellMaxX[c] = std::max(cellMaxX[c], centreX[j] + radius[j]);
+      cellMaxY[c] = std::max(cellMaxY[c], centreY[j] + radius[j]);
+      cellMaxZ[c] = std::max(cellMaxZ[c], centreZ[j] + radius[j]);
+    }
+  }
+}
+
+void InstancedRenderer::cullCell(
+    int cell, bool inside, const glm::vec4 *planes,
+    const glm::vec3 &cameraPosition,
+    std::vector<std::vector<InstanceData>> &buckets) const
+{
+  float4 eyeX = simd::splat(cameraPosition.x);
+  float4 eyeY = simd::splat(cameraPosition.y);
+  float4 eyeZ = simd::splat(cameraPosition.z);
+  int end = cellStart[cell + 1];
+  for (int i = cellStart[cell]; i < end; i += 4)
+  {
+    float4 x = simd::load(&centreX[i]);
+    float4 y = simd::load(&centreY[i]);
+    float4 z = simd::load(&centreZ[i]);
+    float4 r = simd::load(&radius[i]);
+    int visible = laneMask(end - i);
+    if (!inside)
+    {
+      for (int p = 0; p < 6 && visible != 0; p++)
+      {
+        float4 distance = x * simd::splat(planes[p].x) +
+                          y * simd::splat(planes[p].y) +
+                          z * simd::splat(planes[p].z) +
+                          simd::splat(planes[p].w);
+        visible &= simd::movemask(distance > -r);
+      }
+    }
+    if (visible == 0)
+    {
+      continue;
+    }
+    float4 dx = x - eyeX, dy = y - eyeY, dz = z - eyeZ;
+    float4 distance2 = dx * dx + dy * dy + dz * dz;
+    for (int lane = 0; lane < 4; lane++)
+    {
+      if ((visible & (1 << lane)) == 0)
+      {
+        continue;
+      }
+      int j = i + lane;
+      const Type &t = types[type[j]];
+      float d2 = simd::lane(distance2, lane);
+      for (size_t l = 0; l < t.lods.size(); l++)
+      {
+        if (d2 < t.lods[l].maxDistance * t.lods[l].maxDistance)
+        {
+          InstanceData data = {centreX[j],
+                               centreY[j] - t.centreHeight * scale[j],
+                               centreZ[j], scale[j], rotation[j]};
+          bool keep = t.lods[l].model != nullptr || useImpostors || l == 0;
+          buckets[t.firstBucket + (keep ? l : l - 1)].push_back(data);
+          break;
+        }
+      }
+    }
+  }
+}
+
+void InstancedRenderer::cull(const glm::mat4 &viewProjectionMatrix,
+                             const glm::vec3 &cameraPosition,
+                             labhelper::ThreadPool *pool)
+{
+  auto startTime = std::chrono::high_resolution_clock::now();
+
+  // Planes with the normals pointing in, from the rows of the matrix
+  glm::mat4 m = glm::transpose(viewProjectionMatrix);
+  glm::vec4 planes[6] = {m[3] + m[0], m[3] - m[0], m[3] + m[1],
+                         m[3] - m[1], m[3] + m[2], m[3] - m[2]};
+  for (glm::vec4 &plane : planes)
+  {
+    plane /= glm::length(glm::vec3(plane));
+  }
+
+  chunkBuckets.resize(cullChunks);
+  auto body = [&](int begin, int end) {
+    for (int chunk = begin; chunk < end; chunk++)
+    {
+      std::vector<std::vector<InstanceData>> &buckets = chunkBuckets[chunk];
+      buckets.resize(bucketCount);
+      for (std::vector<InstanceData> &bucket : buckets)
+      {
+        bucket.clear();
+      }
+      int first = int(int64_t(cellCount) * chunk / cullChunks);
+      int last = int(int64_t(cellCount) * (chunk + 1) / cullChunks);
+      for (int c = first; c < last; c += 4)
+      {
+        float4 minX = simd::load(&cellMinX[c]);
+        float4 minY = simd::load(&cellMinY[c]);
+        float4 minZ = simd::load(&cellMinZ[c]);
+        float4 maxX = simd::load(&cellMaxX[c]);
+        float4 maxY = simd::load(&cellMaxY[c]);
+        float4 maxZ = simd::load(&cellMaxZ[c]);
+        // A cell is out if its corner furthest along the normal of a plane
+        // is behind it, and wholly in if its nearest corner is in front of
+        // every plane
+        int visible = laneMask(last - c), inside = 0xf;
+        for (const glm::vec4 &plane : planes)
+        {
+          float4 furthest =
+              (plane.x >= 0.0f ? maxX : minX) * simd::splat(plane.x) +
+              (plane.y >= 0.0f ? maxY : minY) * simd::splat(plane.y) +
+              (plane.z >= 0.0f ? maxZ : minZ) * simd::splat(plane.z) +
+              simd::splat(plane.w);
+          float4 nearest =
+              (plane.x >= 0.0f ? minX : maxX) * simd::splat(plane.x) +
+              (plane.y >= 0.0f ? minY : maxY) * simd::splat(plane.y) +
+              (plane.z >= 0.0f ? minZ : maxZ) * simd::splat(plane.z) +
+              simd::splat(plane.w);
+          visible &= simd::movemask(furthest >= simd::splat(0.0f));
+          inside &= simd::movemask(nearest >= simd::splat(0.0f));
+        }
+        float4 dx = outsideBy(simd::splat(cameraPosition.x), minX, maxX);
+        float4 dy = outsideBy(simd::splat(cameraPosition.y), minY, maxY);
+        float4 dz = outsideBy(simd::splat(cameraPosition.z), minZ, maxZ);
+        visible &= simd::movemask(dx * dx + dy * dy + dz * dz <
+                                  simd::splat(maxDistance * maxDistance));
+        for (int lane = 0; lane < 4; lane++)
+        {
+          if (visible & (1 << lane))
+          {
+            cullCell(c + lane, (inside & (1 << lane)) != 0, planes,
+                     cameraPosition, buckets);
+          }
+        }
+      }
+    }
+  };
+  if (pool != nullptr)
+  {
+    pool->parallelFor(0, cullChunks, body, 1);
+  }
+  else
+  {
+    body(0, cullChunks);
+  }
+
+  // Buckets one after the other, each in the order of the chunks
+  bucketStart.assign(bucketCount, 0);
+  bucketSize.assign(bucketCount, 0);
+  submitted = 0;
+  for (int b = 0; b < bucketCount; b++)
+  {
+    bucketStart[b] = submitted;
+    for (const auto &buckets : chunkBuckets)
+    {
+      bucketSize[b] += buckets[b].size();
+    }
+    submitted += bucketSize[b];
+  }
+  staging.resize(submitted);
+  for (int b = 0; b < bucketCount; b++)
+  {
+    size_t out = bucketStart[b];
+    for (const auto &buckets : chunkBuckets)
+    {
+      std::copy(buckets[b].begin(), buckets[b].end(), staging.begin() + out);
+      out += buckets[b].size();
+    }
+  }
+  drawCalls = 0;
+  impostors = 0;
+  triangles = 0;
+  for (const Type &t : types)
+  {
+    for (size_t l = 0; l < t.lods.size(); l++)
+    {
+      size_t count = bucketSize[t.firstBucket + l];
+      if (count == 0)
+      {
+        continue;
+      }
+      const labhelper::Model *model = t.lods[l].model;
+      if (model == nullptr)
+      {
+        drawCalls++;
+        impostors += count;
+        triangles += 2 * count;
+        continue;
+      }
+      drawCalls += int(model->m_meshes.size());
+      for (const labhelper::Mesh &mesh : model->m_meshes)
+      {
+        triangles += count * (mesh.m_number_of_vertices / 3);
+      }
+    }
+  }
+  std::chrono::duration<float, std::milli> elapsed =
+      std::chrono::high_resolution_clock::now() - startTime;
+  cullMs = elapsed.count();
+
+  // Orphaned every frame, so that the driver need not wait for the last
+  // frame's draws
+  glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+  if (submitted > bufferCapacity)
+  {
+    bufferCapacity = submitted + submitted / 2;
+  }
+  glBufferData(GL_ARRAY_BUFFER, bufferCapacity * sizeof(InstanceData), nullptr,
+               GL_STREAM_DRAW);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, submitted * sizeof(InstanceData),
+                  staging.data());
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void InstancedRenderer::invalidateUniforms()
+{
+  materialUniforms.program = 0;
+  impostorUniforms.program = 0;
+}
+
+void InstancedRenderer::draw(uint32_t program) const
+{
+  MaterialUniforms &u = materialUniforms;
+  if (u.program != program)
+  {
+    u.program = program;
+    u.hasColorTexture = glGetUniformLocation(program, "has_color_texture");
+    u.color = glGetUniformLocation(program, "material_color");
+    u.metalness = glGetUniformLocation(program, "material_metalness");
+    u.fresnel = glGetUniformLocation(program, "material_fresnel");
+    u.shininess = glGetUniformLocation(program, "material_shininess");
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+  for (const Type &t : types)
+  {
+    for (size_t l = 0; l < t.lods.size(); l++)
+    {
+      size_t count = bucketSize[t.firstBucket + l];
+      const labhelper::Model *model = t.lods[l].model;
+      if (count == 0 || model == nullptr)
+      {
+        continue;
+      }
+      glBindVertexArray(t.lods[l].vertexArray);
+      size_t offset = bucketStart[t.firstBucket + l] * sizeof(InstanceData);
+      glVertexAttribPointer(3, 4, GL_FLOAT, false, sizeof(InstanceData),
+                            (const void *)offset);
+      glVertexAttribPointer(4, 1, GL_FLOAT, false, sizeof(InstanceData),
+                            (const void *)(offset + 4 * sizeof(float)));
+      for (const labhelper::Mesh &mesh : model->m_meshes)
+      {
+        const labhelper::Material &material =
+            model->m_materials[mesh.m_material_idx];
+        if (material.m_color_texture.valid)
+        {
+          glActiveTexture(GL_TEXTURE0);
+          glBindTexture(GL_TEXTURE_2D, material.m_color_texture.gl_id);
+        }
+        glUniform1i(u.hasColorTexture, material.m_color_texture.valid ? 1 : 0);
+        glUniform3fv(u.color, 1, &material.m_color.x);
+        glUniform1f(u.metalness, material.m_metalness);
+        glUniform1f(u.fresnel, material.m_fresnel);
+        glUniform1f(u.shininess, material.m_shininess);
+        if (model->m_indices.empty())
+        {
+          glDrawArraysInstanced(GL_TRIANGLES, mesh.m_start_index,
+                                GLsizei(mesh.m_number_of_vertices),
+                                GLsizei(count));
+        }
+        else
+        {
+          glDrawElementsInstanced(
+              GL_TRIANGLES, GLsizei(mesh.m_number_of_vertices),
+              GL_UNSIGNED_INT,
+              (const void *)(mesh.m_start_index * sizeof(uint32_t)),
+              GLsizei(count));
+        }
+      }
+    }
+  }
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void InstancedRenderer::drawImpostors(uint32_t program) const
+{
+  ImpostorUniforms &u = impostorUniforms;
+  if (u.program != program)
+  {
+    u.program = program;
+    u.frames = glGetUniformLocation(program, "impostorFrames");
+    u.hemisphere = glGetUniformLocation(program, "impostorHemisphere");
+    u.centre = glGetUniformLocation(program, "impostorCentre");
+    u.radius = glGetUniformLocation(program, "impostorRadius");
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+  glBindVertexArray(quadVertexArray);
+  for (const Type &t : types)
+  {
+    for (size_t l = 0; l < t.lods.size(); l++)
+    {
+      size_t count = bucketSize[t.firstBucket + l];
+      const Impostor *impostor = t.lods[l].impostor;
+      if (count == 0 || impostor == nullptr)
+      {
+        continue;
+      }
+      size_t offset = bucketStart[t.firstBucket + l] * sizeof(InstanceData);
+      glVertexAttribPointer(3, 4, GL_FLOAT, false, sizeof(InstanceData),
+                            (const void *)offset);
+      glVertexAttribPointer(4, 1, GL_FLOAT, false, sizeof(InstanceData),
+                            (const void *)(offset + 4 * sizeof(float)));
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, impostor->atlas.colorTextureTargets[0]);
+      glActiveTexture(GL_TEXTURE1);
+      glBindTexture(GL_TEXTURE_2D, impostor->atlas.colorTextureTargets[1]);
+      glActiveTexture(GL_TEXTURE0);
+      glUniform1i(u.frames, impostor->params.frames);
+      glUniform1i(u.hemisphere, impostor->params.hemisphere ? 1 : 0);
+      glUniform3fv(u.centre, 1, &impostor->centre.x);
+      glUniform1f(u.radius, impostor->radius);
+      glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, GLsizei(count));
+    }
+  }
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
@@ -0,0 +1,160 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace labhelper
+{
+class Model;
+class ThreadPool;
+}
+struct Impostor;
+struct VegetationInstances;
+
+// Draws many copies of a few models, such as the vegetation, with one
+// instanced draw per mesh per level of detail instead of one draw per copy.
+//
+// The instances are sorted into square cells on the ground. Each frame the
+// cells are tested against the frustum and the draw distance four at a
+// time, then the instances of the cells that are only partly inside are
+// tested the same way, and the visible ones are bucketed by type and level
+// of detail. The buckets go into one buffer of positions, scales and
+// rotations, which the vertex shader (instance.vert) reads per instance.
+//
+// A type can end with an impostor (see impostor.h), drawn as one quad per
+// instance by drawImpostors() beyond its last model.
+struct InstanceLod
+{
+    // Drawn up to maxDistance from the camera, for models loaded with
+    // labhelper::loadModelFromOBJ() (not owned)
+    labhelper::Model *model;
+    float maxDistance;
+};
+
+class InstancedRenderer
+{
+public:
+    // Needs a GL context
+    explicit InstancedRenderer(float cellSize = 32.0f);
+    ~InstancedRenderer();
+
+    // Adds a type of instance, drawn with the models of lods, nearest first,
+    // then with impostor up to impostorDistance if it is not null (not
+    // owned), and not at all beyond that. Returns the index of the type.
+    int addType(const std::vector<InstanceLod> &lods,
+                const Impostor *impostor = nullptr,
+                float impostorDistance = 0.0f);
+    // Replaces the instances. Those of types that were not added are left
+    // out.
+    void setInstances(const VegetationInstances &instances);
+
+    // Picks the instances to draw from the camera, on the threads of pool,
+    // or only on the calling thread if pool is null, and uploads them.
+    void cull(const glm::mat4 &viewProjectionMatrix,
+              const glm::vec3 &cameraPosition, labhelper::ThreadPool *pool);
+    // Draws what the last cull() picked with program, which takes the same
+    // material uniforms as for labhelper::render()
+    void draw(uint32_t program) const;
+    // Draws the impostors the last cull() picked with program
+    // (impostor.vert/frag)
+    void drawImpostors(uint32_t program) const;
+    // Forgets the uniform locations looked up for the programs. Call after
+    // reloading shaders, as a new program may reuse a deleted one's name.
+    void invalidateUniforms();
+
+    // Without impostors, the last model of each type is drawn in their
+    // place, to compare the two
+    void setUseImpostors(bool use) { useImpostors = use; }
+    bool getUseImpostors() const { return useImpostors; }
+
+    size_t getInstanceCount() const { return instanceCount; }
+    size_t getSubmitted() const { return submitted; }
+    size_t getCulled() const { return instanceCount - submitted; }
+    int getDrawCalls() const { return drawCalls; }
+    size_t getImpostors() const { return impostors; }
+    // Of the models and impostor quads drawn
+    size_t getTriangles() const { return triangles; }
+    // CPU time of the last cull(), not counting the upload
+    float getCullMs() const { return cullMs; }
+
+private:
+    InstancedRenderer(const InstancedRenderer &) = delete;
+    InstancedRenderer &operator=(const InstancedRenderer &) = delete;
+
+    // What the vertex shader reads per instance
+    struct InstanceData
+    {
+        float x, y, z, scale;
+        float rotation;
+    };
+    // Uniform locations, looked up when draw() or drawImpostors() is given
+    // a different program than the last time, or after invalidateUniforms()
+    struct MaterialUniforms
+    {
+        uint32_t program = 0;
+        int hasColorTexture, color, metalness, fresnel, shininess;
+    };
+    struct ImpostorUniforms
+    {
+        uint32_t program = 0;
+        int frames, hemisphere, centre, radius;
+    };
+    // Either a model or an impostor
+    struct Lod
+    {
+        labhelper::Model *model;
+        const Impostor *impostor;
+        float maxDistance;
+        uint32_t vertexArray;
+    };
+    struct Type
+    {
+        std::vector<Lod> lods;
+        // Bounding sphere of the models at scale 1, centred centreHeight
+        // above the instance position
+        float centreHeight;
+        float radius;
+        int firstBucket; // Buckets are by type, then by level of detail
+    };
+
+    void cullCell(int cell, bool inside, const glm::vec4 *planes,
+                  const glm::vec3 &cameraPosition,
+                  std::vector<std::vector<InstanceData>> &buckets) const;
+
+    float cellSize;
+    std::vector<Type> types;
+    int bucketCount = 0;
+    float maxDistance = 0.0f; // Of all types
+    bool useImpostors = true;
+
+    // Instances sorted by cell, with the sphere centres, and three entries
+    // of padding for the loops that take four at a time
+    size_t instanceCount = 0;
+    std::vector<float> centreX, centreY, centreZ, radius;
+    std::vector<float> scale, rotation;
+    std::vector<uint8_t> type;
+    std::vector<int> cellStart; // cellCount + 1 entries
+    // Bounds of the spheres in each cell, padded like the instances
+    int cellCount = 0;
+    std::vector<float> cellMinX, cellMinY, cellMinZ;
+    std::vector<float> cellMaxX, cellMaxY, cellMaxZ;
+
+    // Per chunk of cells culled together, the instances of each bucket
+    std::vector<std::vector<std::vector<InstanceData>>> chunkBuckets;
+    std::vector<InstanceData> staging;
+    std::vector<size_t> bucketStart, bucketSize;
+    uint32_t instanceBuffer = 0;
+    size_t bufferCapacity = 0; // In instances
+    // A quad of two triangles for the impostors
+    uint32_t quadBuffer = 0;
+    uint32_t quadVertexArray = 0;
+    mutable MaterialUniforms materialUniforms;
+    mutable ImpostorUniforms impostorUniforms;
+
+    size_t submitted = 0;
+    size_t impostors = 0;
+    size_t triangles = 0;
+    int drawCalls = 0;
+    float cullMs = 0.0f;
+};
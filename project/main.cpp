@@ -4,20 +4,35 @@ extern "C" _declspec(dllexport) unsigned int NvOptimusEnablement = 0x00000001;
 
 #include <GL/glew.h>
 #include <chrono>
+#include <iostream>
 
 #include <imgui.h>
 #include <labhelper.h>
 
 #include <perf.h>
+#include <shadercache.h>
+#include <assetloader.h>
+#include <objparser.h>
+#include <objwriter.h>
+#include <heightfield.h>
+#include <heightcodec.h>
+#include <threadpool.h>
 
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 using namespace glm;
 
-#include "stb_image.h"
-
 #include "hdr.h"
+#include "fbo.h"
 #include "terrain.h"
+#include "drainage.h"
+#include "climate.h"
+#include "water.h"
+#include "vegetation.h"
+#include "instancing.h"
+#include "impostor.h"
+#include "dynamicresolution.h"
+#include "multidraw.h"
 #include <Model.h>
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -38,6 +53,40 @@ bool g_isMouseDragging = false;
 ///////////////////////////////////////////////////////////////////////////////
 GLuint shaderProgram;
 GLuint backgroundProgram;
+GLuint depthPrepassProgram;
+GLuint gbufferProgram;
+GLuint deferredLightingProgram;
+GLuint instanceProgram;
+GLuint instanceGbufferProgram;
+GLuint impostorBakeProgram;
+GLuint impostorProgram;
+GLuint impostorGbufferProgram;
+GLuint sceneObjectProgram;
+GLuint sceneObjectGbufferProgram;
+
+///////////////////////////////////////////////////////////////////////////////
+// Rendering options
+///////////////////////////////////////////////////////////////////////////////
+// Lay down terrain depth with a position-only shader first, so that the
+// expensive terrain shading runs at most once per pixel.
+bool useDepthPrepass = true;
+
+enum RenderMode
+{
+  Forward = 0,
+  Deferred = 1,
+};
+int renderMode = Forward;
+
+// Albedo + metalness, octahedral normal, fresnel + roughness. Keep in sync
+// with the layout documented in deferred.frag.
+FboInfo gBuffer({GL_RGBA8, GL_RG16, GL_RG8});
+
+// The 3D scene is rendered at a fraction of the window resolution chosen by
+// the controller, then upscaled. The GUI is always drawn at full resolution.
+DynamicResolution dynamicResolution;
+FboInfo sceneFbo(1);
+int renderWidth, renderHeight;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Environment
@@ -45,6 +94,12 @@ GLuint backgroundProgram;
 float environment_multiplier = 1.5f;
 GLuint environmentMap, irradianceMap, reflectionMap;
 const std::string envmap_base_name = "001";
+// GPU storage per map. The background shows the environment map directly,
+// so it keeps per-channel exponents; the prefiltered maps are smooth enough
+// for a shared exponent.
+labhelper::HdrFormat environmentMapFormat = labhelper::HdrFormat::RGB16F;
+labhelper::HdrFormat irradianceMapFormat = labhelper::HdrFormat::RGB9E5;
+labhelper::HdrFormat reflectionMapFormat = labhelper::HdrFormat::RGB9E5;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Camera parameters.
@@ -64,28 +119,352 @@ TerrainParams terrainParams;
 mat4 terrainModelMatrix;
 
 float waterLevel = -2.0f;
-float sandLevel = -1.5f;
-float grassLevel = 1.2f;
-float rockLevel = 3.0f;
-float slopeThreshold = 0.8f;
 
 GLuint heightmapTexture;
+// Lakes and rivers of the current terrain, for the terrain shader
+DrainageMap drainage;
+GLuint drainageMapTexture;
+bool showDrainage = true;
+// Which terrain material goes where, from temperature and moisture
+ClimateParams climateParams;
+ClimateMap climate;
+GLuint climateTexture;
+float climateMs = 0.0f;
+// Where the trees, bushes and boulders stand
+VegetationParams vegetationParams;
+VegetationInstances vegetation;
+float vegetationMs = 0.0f;
+InstancedRenderer *vegetationRenderer = nullptr;
+std::vector<labhelper::Model *> vegetationModels;
+std::vector<Impostor *> vegetationImpostors;
+bool showVegetation = true;
+// Landing pads with ships on the terrain, drawn with multi-draw indirect
+labhelper::MultiDrawBatch *sceneObjects = nullptr;
+labhelper::Model *shipModel = nullptr;
+labhelper::Model *landingPadModel = nullptr;
+bool showSceneObjects = true;
+bool useMultiDraw = true;
 GLuint waterTexture, sandTexture, grassTexture, rockTexture, snowTexture;
 
-void loadShaders(bool is_reload)
+// Grid erosion of the current terrain, run a few steps per frame within a
+// CPU budget, re-uploading only the rows of the terrain that changed
+PipeErosion *interactiveErosion = nullptr;
+bool runInteractiveErosion = false;
+float erosionBudgetMs = 4.0f;
+std::vector<float> erodedHeights;
+int erosionSteps = 0;
+int erosionRowsUploaded = 0;
+
+// Shallow water flowing over the terrain, starting from a sea at waterLevel
+// and stepped each frame within a CPU budget. Depth and velocity go to a
+// texture the terrain shader blends water on with.
+ShallowWater *waterSimulation = nullptr;
+ShallowWaterParams waterParams;
+bool simulateWater = true;
+float waterBudgetMs = 3.0f;
+GLuint waterSimulationTexture;
+std::vector<float> waterDepthAndVelocity;
+
+// A .png (16-bit), .lht (tiled) or raw float heightmap to build the terrain
+// from instead of generating it, set with --heightmap on the command line or
+// in the GUI
+char heightmapPath[256] = "";
+// Tiled heightmaps can be far larger than a terrain mesh can be, and are
+// loaded from the mip level that fits
+const int maxTerrainSize = 4096;
+
+///////////////////////////////////////////////////////////////////////////////
+/// Replaces terrain with one built from the heightmap in filename, keeping
+/// the current terrain if the file can not be loaded
+///////////////////////////////////////////////////////////////////////////////
+bool loadTerrain(const char *filename)
+{
+  auto startTime = std::chrono::high_resolution_clock::now();
+  labhelper::Heightfield field;
+  if (!labhelper::loadHeightfield(filename, field, maxTerrainSize))
+  {
+    return false;
+  }
+  if (field.width != field.height || field.width < 2)
+  {
+    std::cout << "Heightmap " << filename << " is " << field.width << "x"
+              << field.height << ", the terrain needs it to be square\n";
+    return false;
+  }
+  std::chrono::duration<float, std::milli> elapsed =
+      std::chrono::high_resolution_clock::now() - startTime;
+  std::cout << "Loaded heightmap " << filename << " in " << elapsed.count()
+            << " ms\n";
+
+  terrainParams.size = field.width;
+  terrain = new Terrain(terrainParams, field.heights);
+  return true;
+}
+
+/// Shows the current terrain heights, normalized to [0, 1], in the GUI
+void uploadHeightmapTexture()
+{
+  const std::vector<float> &heightMap = terrain->getHeightMap();
+  float minHeight = FLT_MAX;
+  float maxHeight = -FLT_MAX;
+  for (float height : heightMap)
+  {
+    minHeight = std::min(minHeight, height);
+    maxHeight = std::max(maxHeight, height);
+  }
+
+  std::vector<float> normalizedHeightmap;
+  normalizedHeightmap.reserve(heightMap.size() * 3); // * 3 for RGB
+  for (float height : heightMap)
+  {
+    float normalizedHeight = (height - minHeight) / (maxHeight - minHeight);
+    normalizedHeightmap.push_back(normalizedHeight);
+    normalizedHeightmap.push_back(normalizedHeight);
+    normalizedHeightmap.push_back(normalizedHeight);
+  }
+
+  glBindTexture(GL_TEXTURE_2D, heightmapTexture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, terrainParams.size, terrainParams.size, 0, GL_RGB, GL_FLOAT, normalizedHeightmap.data());
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/// Finds where water collects and flows on the current terrain
+void updateDrainageTexture()
+{
+  auto startTime = std::chrono::high_resolution_clock::now();
+  const std::vector<float> &heightMap = terrain->getHeightMap();
+  computeDrainage(heightMap, terrain->getSize(), terrainParams.scale,
+                  FlowRouting::DInfinity, drainage,
+                  &labhelper::ThreadPool::global());
+  std::vector<uint8_t> lakesAndRivers;
+  drainageTexture(drainage, heightMap, 0.5f, 200.0f, lakesAndRivers);
+  std::chrono::duration<float, std::milli> elapsed =
+      std::chrono::high_resolution_clock::now() - startTime;
+  std::cout << "Computed drainage in " << elapsed.count() << " ms\n";
+
+  glBindTexture(GL_TEXTURE_2D, drainageMapTexture);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RG8, drainage.size, drainage.size, 0,
+               GL_RG, GL_UNSIGNED_BYTE, lakesAndRivers.data());
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/// Classifies the terrain from its climate, after updateDrainageTexture()
+void updateClimateTexture()
+{
+  auto startTime = std::chrono::high_resolution_clock::now();
+  climateParams.seaLevel = waterLevel;
+  computeClimate(terrain->getHeightMap(), terrain->getSize(),
+                 terrainParams.scale, &drainage, climateParams, climate,
+                 &labhelper::ThreadPool::global());
+  std::chrono::duration<float, std::milli> elapsed =
+      std::chrono::high_resolution_clock::now() - startTime;
+  climateMs = elapsed.count();
+  labhelper::perf::setCounter("Climate ms", climateMs);
+
+  glBindTexture(GL_TEXTURE_2D, climateTexture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, climate.size, climate.size, 0,
+               GL_RGBA, GL_UNSIGNED_BYTE, climate.weights.data());
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/// Scatters the vegetation over the terrain, after updateClimateTexture()
+void updateVegetation()
+{
+  auto startTime = std::chrono::high_resolution_clock::now();
+  int64_t candidates = placeVegetation(
+      terrain->getHeightMap(), terrain->getSize(), terrainParams.scale,
+      &climate, vegetationParams, terrainParams.seed, vegetation,
+      &labhelper::ThreadPool::global());
+  std::chrono::duration<float, std::milli> elapsed =
+      std::chrono::high_resolution_clock::now() - startTime;
+  vegetationMs = elapsed.count();
+  labhelper::perf::setCounter("Vegetation ms", vegetationMs);
+  labhelper::perf::setCounter("Vegetation candidates", float(candidates));
+  labhelper::perf::setCounter("Vegetation instances", float(vegetation.size()));
+  if (vegetationRenderer != nullptr)
+  {
+    vegetationRenderer->setInstances(vegetation);
+  }
+}
+
+/// Puts a grid of landing pads, each with a ship above it, on the terrain
+void placeSceneObjects()
+{
+  if (shipModel == nullptr || landingPadModel == nullptr)
+  {
+    return;
+  }
+  delete sceneObjects;
+  sceneObjects = new labhelper::MultiDrawBatch();
+  TerrainQuery query = terrain->getQuery();
+  const int padsPerSide = 4;
+  const float padSpacing = 100.0f, padScale = 0.2f;
+  for (int j = 0; j < padsPerSide; j++)
+  {
+    for (int i = 0; i < padsPerSide; i++)
+    {
+      float x = (i - (padsPerSide - 1) / 2.0f) * padSpacing;
+      float z = (j - (padsPerSide - 1) / 2.0f) * padSpacing;
+      float y = query.height(x, z, TerrainFilter::Bicubic);
+      mat4 pad = translate(vec3(x, y, z)) * scale(vec3(padScale));
+      sceneObjects->add(landingPadModel, pad);
+      sceneObjects->add(shipModel, pad * translate(vec3(0.0f, 40.0f, 0.0f)) *
+                                       rotate(float(i + j), vec3(0.0f, 1.0f, 0.0f)));
+    }
+  }
+  sceneObjects->build();
+}
+
+/// Starts the interactive erosion over from the current terrain
+void resetInteractiveErosion()
+{
+  delete interactiveErosion;
+  interactiveErosion = nullptr;
+  erosionSteps = 0;
+  erosionRowsUploaded = 0;
+}
+
+/// Starts the water over from a sea at waterLevel on the current terrain
+void resetWaterSimulation()
+{
+  delete waterSimulation;
+  waterSimulation =
+      new ShallowWater(terrain->getHeightMap(), terrain->getSize(),
+                       terrainParams.scale, waterLevel, waterParams);
+  int size = terrain->getSize();
+  glBindTexture(GL_TEXTURE_2D, waterSimulationTexture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, size, size, 0, GL_RGB, GL_FLOAT,
+               nullptr);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void updateWaterSimulation()
 {
-  GLuint shader = labhelper::loadShaderProgram(
-      "../project/background.vert", "../project/background.frag", is_reload);
-  if (shader != 0)
+  if (!simulateWater)
   {
-    backgroundProgram = shader;
+    return;
+  }
+  int64_t cellsBefore = waterSimulation->getCellsStepped();
+  waterSimulation->params = waterParams;
+  waterSimulation->stepFor(waterBudgetMs, &labhelper::ThreadPool::global());
+  labhelper::perf::setCounter(
+      "Water cells per frame",
+      float(waterSimulation->getCellsStepped() - cellsBefore));
+  labhelper::perf::setCounter("Water ms per step",
+                              waterSimulation->getLastStepMs());
+  labhelper::perf::setCounter("Water tiles awake",
+                              float(waterSimulation->getAwakeTiles()));
+
+  int rowBegin, rowEnd;
+  if (waterSimulation->takeChangedRows(waterDepthAndVelocity, rowBegin, rowEnd))
+  {
+    int size = waterSimulation->getSize();
+    glBindTexture(GL_TEXTURE_2D, waterSimulationTexture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, rowBegin, size, rowEnd - rowBegin,
+                    GL_RGB, GL_FLOAT,
+                    waterDepthAndVelocity.data() + size_t(rowBegin) * size * 3);
+    glBindTexture(GL_TEXTURE_2D, 0);
   }
+}
 
-  shader = labhelper::loadShaderProgram("../project/terrain.vert",
-                                        "../project/terrain.frag", is_reload);
-  if (shader != 0)
+void updateInteractiveErosion()
+{
+  if (!runInteractiveErosion)
+  {
+    return;
+  }
+  if (interactiveErosion == nullptr)
+  {
+    erodedHeights = terrain->getHeightMap();
+    interactiveErosion =
+        new PipeErosion(erodedHeights, terrain->getSize(), terrainParams.scale,
+                        terrainParams.pipeErosion);
+  }
+  interactiveErosion->params = terrainParams.pipeErosion;
+  erosionSteps += interactiveErosion->stepFor(erosionBudgetMs,
+                                              &labhelper::ThreadPool::global());
+  int rowBegin, rowEnd;
+  erosionRowsUploaded = 0;
+  if (interactiveErosion->takeChangedRows(erodedHeights, rowBegin, rowEnd))
   {
-    shaderProgram = shader;
+    terrain->updateHeights(erodedHeights.data(), rowBegin, rowEnd);
+    erosionRowsUploaded = rowEnd - rowBegin;
+  }
+}
+
+void loadShaders(bool is_reload)
+{
+  // Built as one batch so that programs missing the binary cache are
+  // compiled concurrently by drivers that support it.
+  std::vector<labhelper::ShaderProgramSource> sources = {
+      {"../project/background.vert", "../project/background.frag"},
+      {"../project/terrain.vert", "../project/terrain.frag"},
+      {"../project/terrain_depth.vert", "../project/terrain_depth.frag"},
+      {"../project/terrain.vert", "../project/terrain.frag", "#define DEFERRED\n"},
+      {"../project/background.vert", "../project/deferred.frag"},
+      {"../project/instance.vert", "../project/instance.frag"},
+      {"../project/instance.vert", "../project/instance.frag", "#define DEFERRED\n"},
+      {"../project/impostor_bake.vert", "../project/impostor_bake.frag"},
+      {"../project/impostor.vert", "../project/impostor.frag"},
+      {"../project/impostor.vert", "../project/impostor.frag", "#define DEFERRED\n"},
+      {"../project/scene.vert", "../project/scene.frag"},
+      {"../project/scene.vert", "../project/scene.frag", "#define DEFERRED\n"},
+  };
+  std::vector<GLuint> programs = labhelper::loadShaderPrograms(sources, is_reload);
+
+  if (programs[0] != 0)
+  {
+    backgroundProgram = programs[0];
+  }
+  if (programs[1] != 0)
+  {
+    shaderProgram = programs[1];
+  }
+  if (programs[2] != 0)
+  {
+    depthPrepassProgram = programs[2];
+  }
+  if (programs[3] != 0)
+  {
+    gbufferProgram = programs[3];
+  }
+  if (programs[4] != 0)
+  {
+    deferredLightingProgram = programs[4];
+  }
+  if (programs[5] != 0)
+  {
+    instanceProgram = programs[5];
+  }
+  if (programs[6] != 0)
+  {
+    instanceGbufferProgram = programs[6];
+  }
+  if (programs[7] != 0)
+  {
+    impostorBakeProgram = programs[7];
+  }
+  if (programs[8] != 0)
+  {
+    impostorProgram = programs[8];
+  }
+  if (programs[9] != 0)
+  {
+    impostorGbufferProgram = programs[9];
+  }
+  if (programs[10] != 0)
+  {
+    sceneObjectProgram = programs[10];
+  }
+  if (programs[11] != 0)
+  {
+    sceneObjectGbufferProgram = programs[11];
+  }
+  if (vegetationRenderer != nullptr)
+  {
+    vegetationRenderer->invalidateUniforms();
   }
 }
 
@@ -96,124 +475,171 @@ void initialize()
 {
   ENSURE_INITIALIZE_ONLY_ONCE();
 
-  ///////////////////////////////////////////////////////////////////////
-  //		Load Shaders
-  ///////////////////////////////////////////////////////////////////////
-  loadShaders(false);
+  auto startTime = std::chrono::high_resolution_clock::now();
 
   ///////////////////////////////////////////////////////////////////////
-  //		Load Terrain Textures
+  // Start decoding all images on worker threads. The GL uploads happen
+  // on this thread in loader.finish(), once the terrain is generated.
+  // Terrain textures come block compressed with precomputed mips from the
+  // texture cache (encoded on the first run).
   ///////////////////////////////////////////////////////////////////////
-  // Load and setup terrain textures
+  labhelper::AssetLoader loader;
+
   glGenTextures(1, &waterTexture);
   glGenTextures(1, &sandTexture);
   glGenTextures(1, &grassTexture);
   glGenTextures(1, &rockTexture);
   glGenTextures(1, &snowTexture);
 
-  // Load water texture
-  int width, height, channels;
-  unsigned char *data = stbi_load("../scenes/textures/water.png", &width, &height, &channels, 0);
-  if (data)
+  struct TerrainTextureFile
   {
-    glBindTexture(GL_TEXTURE_2D, waterTexture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-    glGenerateMipmap(GL_TEXTURE_2D);
-    stbi_image_free(data);
-  }
-
-  // Load sand texture
-  data = stbi_load("../scenes/textures/sand.jpg", &width, &height, &channels, 0);
-  if (data)
+    GLuint texture;
+    const char *filename;
+  };
+  const TerrainTextureFile terrainTextureFiles[] = {
+      {waterTexture, "../scenes/textures/water.png"},
+      {sandTexture, "../scenes/textures/sand.jpg"},
+      {grassTexture, "../scenes/textures/grass.jpg"},
+      {rockTexture, "../scenes/textures/rock.jpg"},
+      {snowTexture, "../scenes/textures/snow.jpg"},
+  };
+  for (const TerrainTextureFile &file : terrainTextureFiles)
   {
-    glBindTexture(GL_TEXTURE_2D, sandTexture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-    glGenerateMipmap(GL_TEXTURE_2D);
-    stbi_image_free(data);
+    GLuint texture = file.texture;
+    loader.loadCachedTexture(file.filename, 3, [texture](const labhelper::CachedTexture &image)
+    {
+      glBindTexture(GL_TEXTURE_2D, texture);
+      labhelper::uploadCachedTexture(image);
+    });
   }
 
-  // Load grass texture
-  data = stbi_load("../scenes/textures/grass.jpg", &width, &height, &channels, 0);
-  if (data)
+  const int roughnesses = 8;
+  loader.loadHdrImage("../scenes/envmaps/" + envmap_base_name + ".hdr", environmentMapFormat,
+                      [](const labhelper::PackedHdrImage &image)
   {
-    glBindTexture(GL_TEXTURE_2D, grassTexture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-    glGenerateMipmap(GL_TEXTURE_2D);
-    stbi_image_free(data);
-  }
-
-  // Load rock texture
-  data = stbi_load("../scenes/textures/rock.jpg", &width, &height, &channels, 0);
-  if (data)
+    environmentMap = labhelper::createHdrTexture(image);
+    labhelper::printHdrImageStats("Environment map", image);
+  });
+  loader.loadHdrImage("../scenes/envmaps/" + envmap_base_name + "_irradiance.hdr", irradianceMapFormat,
+                      [](const labhelper::PackedHdrImage &image)
   {
-    glBindTexture(GL_TEXTURE_2D, rockTexture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-    glGenerateMipmap(GL_TEXTURE_2D);
-    stbi_image_free(data);
-  }
-
-  // Load snow texture
-  data = stbi_load("../scenes/textures/snow.jpg", &width, &height, &channels, 0);
-  if (data)
+    irradianceMap = labhelper::createHdrTexture(image);
+    labhelper::printHdrImageStats("Irradiance map", image);
+  });
+  reflectionMap = labhelper::createHdrMipmapTexture(roughnesses);
+  for (int i = 0; i < roughnesses; i++)
   {
-    glBindTexture(GL_TEXTURE_2D, snowTexture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-    glGenerateMipmap(GL_TEXTURE_2D);
-    stbi_image_free(data);
+    loader.loadHdrImage("../scenes/envmaps/" + envmap_base_name + "_dl_" +
+                            std::to_string(i) + ".hdr", reflectionMapFormat,
+                        [i](const labhelper::PackedHdrImage &image)
+    {
+      labhelper::uploadHdrMipmapLevel(reflectionMap, i, image);
+      labhelper::printHdrImageStats("Reflection map level " + std::to_string(i), image);
+    });
   }
 
-  // Set texture parameters for all terrain textures
-  GLuint textures[] = {waterTexture, sandTexture, grassTexture, rockTexture, snowTexture};
-  for (GLuint tex : textures)
-  {
-    glBindTexture(GL_TEXTURE_2D, tex);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  }
-  glBindTexture(GL_TEXTURE_2D, 0);
+  ///////////////////////////////////////////////////////////////////////
+  //		Load Shaders
+  ///////////////////////////////////////////////////////////////////////
+  loadShaders(false);
 
   terrainParams.size = 500;
   terrainParams.scale = 1.0f;
   terrainParams.heightScale = 5.0f;
   terrainParams.noiseOctaves = 8;
   terrainParams.seed = rand();
-  terrain = new Terrain(terrainParams);
+  terrainParams.dropletErosion.droplets = 100000;
+  terrainParams.dropletErosion.seed = terrainParams.seed;
+  terrainParams.thermalErosion.iterations = 200;
+  if (heightmapPath[0] == '\0' || !loadTerrain(heightmapPath))
+  {
+    terrain = new Terrain(terrainParams);
+  }
 
   terrainModelMatrix = translate(
       vec3(0.0f, 0.0f, 0.0f));
 
-  glGenTextures(1, &heightmapTexture);
-  glBindTexture(GL_TEXTURE_2D, heightmapTexture);
-
-  std::vector<float> normalizedHeightmap;
-  normalizedHeightmap.reserve(terrainParams.size * terrainParams.size * 3); // * 3 for RGB
-  float minHeight = FLT_MAX;
-  float maxHeight = -FLT_MAX;
-
-  auto heightMap = terrain->getHeightMap();
-  for (const auto &row : heightMap)
+  // One type per vegetation type, in the same order, nearest model first,
+  // then an impostor of the nearest model
+  struct VegetationModelFiles
+  {
+    const char *near;
+    float nearDistance;
+    const char *far;
+    float farDistance;
+    float impostorDistance;
+  };
+  const VegetationModelFiles vegetationModelFiles[] = {
+      {"../scenes/tree.obj", 80.0f, "../scenes/tree_lod1.obj", 300.0f, 1500.0f},
+      {"../scenes/bush.obj", 40.0f, "../scenes/bush_lod1.obj", 120.0f, 400.0f},
+      {"../scenes/bush_lod1.obj", 80.0f, nullptr, 0.0f, 250.0f},
+      {"../scenes/boulder.obj", 60.0f, "../scenes/boulder_lod1.obj", 200.0f, 600.0f},
+  };
+  vegetationRenderer = new InstancedRenderer();
+  for (const VegetationModelFiles &files : vegetationModelFiles)
   {
-    for (float height : row)
+    std::vector<InstanceLod> lods;
+    lods.push_back({labhelper::loadModelFromOBJ(files.near), files.nearDistance});
+    if (files.far != nullptr)
     {
-      minHeight = std::min(minHeight, height);
-      maxHeight = std::max(maxHeight, height);
+      lods.push_back({labhelper::loadModelFromOBJ(files.far), files.farDistance});
+    }
+    for (const InstanceLod &lod : lods)
+    {
+      vegetationModels.push_back(lod.model);
+    }
+    Impostor *impostor = new Impostor();
+    if (loadImpostor(lods[0].model, ImpostorParams(), impostorBakeProgram,
+                     *impostor))
+    {
+      vegetationImpostors.push_back(impostor);
+      vegetationRenderer->addType(lods, impostor, files.impostorDistance);
+    }
+    else
+    {
+      delete impostor;
+      vegetationRenderer->addType(lods);
     }
   }
 
-  for (const auto &row : heightMap)
+  glGenTextures(1, &heightmapTexture);
+  uploadHeightmapTexture();
+  glBindTexture(GL_TEXTURE_2D, heightmapTexture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glGenTextures(1, &drainageMapTexture);
+  updateDrainageTexture();
+  glBindTexture(GL_TEXTURE_2D, drainageMapTexture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glGenTextures(1, &climateTexture);
+  updateClimateTexture();
+  glBindTexture(GL_TEXTURE_2D, climateTexture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  updateVegetation();
+
+  if (labhelper::MultiDrawBatch::isSupported())
   {
-    for (float height : row)
-    {
-      float normalizedHeight = (height - minHeight) / (maxHeight - minHeight);
-      normalizedHeightmap.push_back(normalizedHeight);
-      normalizedHeightmap.push_back(normalizedHeight);
-      normalizedHeightmap.push_back(normalizedHeight);
-    }
+    shipModel = labhelper::loadModelFromOBJ("../scenes/NewShip.obj");
+    landingPadModel = labhelper::loadModelFromOBJ("../scenes/landingpad.obj");
+    placeSceneObjects();
   }
 
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, terrainParams.size, terrainParams.size, 0, GL_RGB, GL_FLOAT, normalizedHeightmap.data());
+  glGenTextures(1, &waterSimulationTexture);
+  resetWaterSimulation();
+  glBindTexture(GL_TEXTURE_2D, waterSimulationTexture);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -221,19 +647,26 @@ void initialize()
   glBindTexture(GL_TEXTURE_2D, 0);
 
   ///////////////////////////////////////////////////////////////////////
-  // Load environment map
+  // Upload the images as they finish decoding
   ///////////////////////////////////////////////////////////////////////
-  const int roughnesses = 8;
-  std::vector<std::string> filenames;
-  for (int i = 0; i < roughnesses; i++)
-    filenames.push_back("../scenes/envmaps/" + envmap_base_name + "_dl_" +
-                        std::to_string(i) + ".hdr");
+  loader.finish();
 
-  environmentMap = labhelper::loadHdrTexture("../scenes/envmaps/" +
-                                             envmap_base_name + ".hdr");
-  irradianceMap = labhelper::loadHdrTexture(
-      "../scenes/envmaps/" + envmap_base_name + "_irradiance.hdr");
-  reflectionMap = labhelper::loadHdrMipmapTexture(filenames);
+  // Set texture parameters for all terrain textures
+  GLuint textures[] = {waterTexture, sandTexture, grassTexture, rockTexture, snowTexture};
+  for (GLuint tex : textures)
+  {
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  }
+  glBindTexture(GL_TEXTURE_2D, 0);
+  labhelper::printTextureCacheStats();
+
+  std::chrono::duration<float, std::milli> elapsed =
+      std::chrono::high_resolution_clock::now() - startTime;
+  std::cout << "Initialized in " << elapsed.count() << " ms\n";
 
   glEnable(GL_DEPTH_TEST); // enable Z-buffering
   glEnable(GL_CULL_FACE);  // enables backface culling
@@ -250,6 +683,30 @@ void drawBackground(const mat4 &viewMatrix, const mat4 &projectionMatrix)
   labhelper::drawFullScreenQuad();
 }
 
+void drawTerrainGeometry()
+{
+  glBindVertexArray(terrain->getModel()->m_vaob);
+  for (auto &mesh : terrain->getModel()->m_meshes)
+  {
+    glDrawArrays(GL_TRIANGLE_STRIP, mesh.m_start_index,
+                 (GLsizei)mesh.m_number_of_vertices);
+  }
+  glBindVertexArray(0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Writes only the terrain depth, leaving the color buffer untouched
+///////////////////////////////////////////////////////////////////////////////
+void drawTerrainDepth(const mat4 &viewMatrix, const mat4 &projectionMatrix)
+{
+  glUseProgram(depthPrepassProgram);
+  labhelper::setUniformSlow(depthPrepassProgram, "modelViewProjectionMatrix",
+                            projectionMatrix * viewMatrix * terrainModelMatrix);
+  glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+  drawTerrainGeometry();
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 /// This function is used to draw the main objects on the scene
 ///////////////////////////////////////////////////////////////////////////////
@@ -282,6 +739,20 @@ void drawScene(GLuint currentShaderProgram, const mat4 &viewMatrix,
   glBindTexture(GL_TEXTURE_2D, snowTexture);
   glUniform1i(glGetUniformLocation(currentShaderProgram, "snowTexture"), 14);
 
+  glActiveTexture(GL_TEXTURE15);
+  glBindTexture(GL_TEXTURE_2D, drainageMapTexture);
+  labhelper::setUniformSlow(currentShaderProgram, "terrainSize",
+                            float(terrain->getSize()));
+  labhelper::setUniformSlow(currentShaderProgram, "terrainScale",
+                            terrainParams.scale);
+  labhelper::setUniformSlow(currentShaderProgram, "showDrainage",
+                            showDrainage ? 1.0f : 0.0f);
+
+  glActiveTexture(GL_TEXTURE4);
+  glBindTexture(GL_TEXTURE_2D, waterSimulationTexture);
+  labhelper::setUniformSlow(currentShaderProgram, "showWater",
+                            simulateWater ? 1.0f : 0.0f);
+
   // Set texture scale
   labhelper::setUniformSlow(currentShaderProgram, "textureScale", 10.0f);
 
@@ -289,12 +760,9 @@ void drawScene(GLuint currentShaderProgram, const mat4 &viewMatrix,
   labhelper::setUniformSlow(currentShaderProgram, "viewInverse",
                             inverse(viewMatrix));
 
-  // Set terrain height thresholds
-  labhelper::setUniformSlow(currentShaderProgram, "waterLevel", waterLevel);
-  labhelper::setUniformSlow(currentShaderProgram, "sandLevel", sandLevel);
-  labhelper::setUniformSlow(currentShaderProgram, "grassLevel", grassLevel);
-  labhelper::setUniformSlow(currentShaderProgram, "rockLevel", rockLevel);
-  labhelper::setUniformSlow(currentShaderProgram, "slopeThreshold", slopeThreshold);
+  // Terrain materials
+  glActiveTexture(GL_TEXTURE5);
+  glBindTexture(GL_TEXTURE_2D, climateTexture);
 
   // Render terrain
   labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix",
@@ -307,13 +775,98 @@ void drawScene(GLuint currentShaderProgram, const mat4 &viewMatrix,
   labhelper::setUniformSlow(currentShaderProgram, "modelMatrix",
                             terrainModelMatrix);
 
-  glBindVertexArray(terrain->getModel()->m_vaob);
-  for (auto &mesh : terrain->getModel()->m_meshes)
+  drawTerrainGeometry();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Culls the vegetation and draws what is left with instancing
+///////////////////////////////////////////////////////////////////////////////
+void drawVegetation(GLuint currentShaderProgram, GLuint currentImpostorProgram,
+                    const mat4 &viewMatrix, const mat4 &projectionMatrix)
+{
+  vegetationRenderer->cull(projectionMatrix * viewMatrix, cameraPosition,
+                           &labhelper::ThreadPool::global());
+  labhelper::perf::setCounter("Instances submitted",
+                              float(vegetationRenderer->getSubmitted()));
+  labhelper::perf::setCounter("Instances culled",
+                              float(vegetationRenderer->getCulled()));
+  labhelper::perf::setCounter("Instance draw calls",
+                              float(vegetationRenderer->getDrawCalls()));
+  labhelper::perf::setCounter("Instance culling ms",
+                              vegetationRenderer->getCullMs());
+  labhelper::perf::setCounter("Impostors drawn",
+                              float(vegetationRenderer->getImpostors()));
+  labhelper::perf::setCounter("Instance triangles",
+                              float(vegetationRenderer->getTriangles()));
+
+  glUseProgram(currentShaderProgram);
+  labhelper::setUniformSlow(currentShaderProgram, "environment_multiplier",
+                            environment_multiplier);
+  labhelper::setUniformSlow(currentShaderProgram, "viewInverse",
+                            inverse(viewMatrix));
+  labhelper::setUniformSlow(currentShaderProgram, "viewMatrix", viewMatrix);
+  labhelper::setUniformSlow(currentShaderProgram, "viewProjectionMatrix",
+                            projectionMatrix * viewMatrix);
+  vegetationRenderer->draw(currentShaderProgram);
+
+  glUseProgram(currentImpostorProgram);
+  labhelper::setUniformSlow(currentImpostorProgram, "environment_multiplier",
+                            environment_multiplier);
+  labhelper::setUniformSlow(currentImpostorProgram, "viewInverse",
+                            inverse(viewMatrix));
+  labhelper::setUniformSlow(currentImpostorProgram, "viewMatrix", viewMatrix);
+  labhelper::setUniformSlow(currentImpostorProgram, "viewProjectionMatrix",
+                            projectionMatrix * viewMatrix);
+  vegetationRenderer->drawImpostors(currentImpostorProgram);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Culls the scene objects and draws what is left, with one multi-draw per
+/// group of textures or one draw per mesh
+///////////////////////////////////////////////////////////////////////////////
+void drawSceneObjects(GLuint currentShaderProgram, const mat4 &viewMatrix,
+                      const mat4 &projectionMatrix)
+{
+  glUseProgram(currentShaderProgram);
+  labhelper::setUniformSlow(currentShaderProgram, "environment_multiplier",
+                            environment_multiplier);
+  labhelper::setUniformSlow(currentShaderProgram, "viewInverse",
+                            inverse(viewMatrix));
+  labhelper::setUniformSlow(currentShaderProgram, "viewMatrix", viewMatrix);
+  labhelper::setUniformSlow(currentShaderProgram, "viewProjectionMatrix",
+                            projectionMatrix * viewMatrix);
+  sceneObjects->cull(projectionMatrix * viewMatrix);
+  sceneObjects->draw(useMultiDraw);
+  labhelper::perf::setCounter("Scene draws visible",
+                              float(sceneObjects->getVisible()));
+  labhelper::perf::setCounter("Scene draw calls",
+                              float(sceneObjects->getDrawCalls()));
+  labhelper::perf::setCounter("Scene submit ms", sceneObjects->getSubmitMs());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Full-screen lighting pass reading the G-buffer
+///////////////////////////////////////////////////////////////////////////////
+void drawDeferredLighting(const mat4 &viewMatrix, const mat4 &projectionMatrix)
+{
+  glUseProgram(deferredLightingProgram);
+  labhelper::setUniformSlow(deferredLightingProgram, "environment_multiplier",
+                            environment_multiplier);
+  labhelper::setUniformSlow(deferredLightingProgram, "viewInverse",
+                            inverse(viewMatrix));
+  labhelper::setUniformSlow(deferredLightingProgram, "projectionInverse",
+                            inverse(projectionMatrix));
+
+  for (int i = 0; i < int(gBuffer.colorTextureTargets.size()); i++)
   {
-    glDrawArrays(GL_TRIANGLE_STRIP, mesh.m_start_index,
-                 (GLsizei)mesh.m_number_of_vertices);
+    glActiveTexture(GL_TEXTURE0 + i);
+    glBindTexture(GL_TEXTURE_2D, gBuffer.colorTextureTargets[i]);
   }
-  glBindVertexArray(0);
+  glActiveTexture(GL_TEXTURE3);
+  glBindTexture(GL_TEXTURE_2D, gBuffer.depthBuffer);
+  glActiveTexture(GL_TEXTURE0);
+
+  labhelper::drawFullScreenQuad();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -325,15 +878,21 @@ void display()
   labhelper::perf::Scope s("Display");
 
   ///////////////////////////////////////////////////////////////////////////
-  // Check if window size has changed and resize buffers as needed
+  // Check if window size or render scale has changed and resize buffers as
+  // needed
   ///////////////////////////////////////////////////////////////////////////
+  SDL_GetWindowSize(g_window, &windowWidth, &windowHeight);
+  dynamicResolution.update(labhelper::perf::getLastGLTime("Frame~Display"));
   {
-    int w, h;
-    SDL_GetWindowSize(g_window, &w, &h);
-    if (w != windowWidth || h != windowHeight)
+    float scale = dynamicResolution.getScale();
+    int w = std::max(1, int(windowWidth * scale + 0.5f));
+    int h = std::max(1, int(windowHeight * scale + 0.5f));
+    if (w != renderWidth || h != renderHeight)
     {
-      windowWidth = w;
-      windowHeight = h;
+      renderWidth = w;
+      renderHeight = h;
+      gBuffer.resize(renderWidth, renderHeight);
+      sceneFbo.resize(renderWidth, renderHeight);
     }
   }
 
@@ -361,18 +920,79 @@ void display()
   ///////////////////////////////////////////////////////////////////////////
   // Draw from camera
   ///////////////////////////////////////////////////////////////////////////
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
-  glViewport(0, 0, windowWidth, windowHeight);
-  glClearColor(0.2f, .2f, .8f, 1.f);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
+  bool deferred = renderMode == Deferred;
+  bool upscale = dynamicResolution.enabled;
+  GLuint sceneFramebuffer = upscale ? sceneFbo.framebufferId : 0;
+  if (deferred)
   {
+    glBindFramebuffer(GL_FRAMEBUFFER, gBuffer.framebufferId);
+    glViewport(0, 0, renderWidth, renderHeight);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  }
+  else
+  {
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+    glViewport(0, 0, renderWidth, renderHeight);
+    glClearColor(0.2f, .2f, .8f, 1.f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
     labhelper::perf::Scope s("Background");
     drawBackground(viewMatrix, projMatrix);
   }
+
+  if (useDepthPrepass)
+  {
+    labhelper::perf::Scope s("Terrain Depth Pre-pass");
+    drawTerrainDepth(viewMatrix, projMatrix);
+    // Only the front-most fragment passes; depth is already final.
+    glDepthFunc(GL_EQUAL);
+    glDepthMask(GL_FALSE);
+  }
   {
-    labhelper::perf::Scope s("Scene");
-    drawScene(shaderProgram, viewMatrix, projMatrix);
+    labhelper::perf::Scope s(deferred ? "G-buffer" : "Scene");
+    drawScene(deferred ? gbufferProgram : shaderProgram, viewMatrix, projMatrix);
+  }
+  glDepthFunc(GL_LESS);
+  glDepthMask(GL_TRUE);
+  if (showVegetation)
+  {
+    labhelper::perf::Scope s("Vegetation");
+    drawVegetation(deferred ? instanceGbufferProgram : instanceProgram,
+                   deferred ? impostorGbufferProgram : impostorProgram,
+                   viewMatrix, projMatrix);
+  }
+  if (showSceneObjects && sceneObjects != nullptr)
+  {
+    labhelper::perf::Scope s("Scene objects");
+    drawSceneObjects(deferred ? sceneObjectGbufferProgram : sceneObjectProgram,
+                     viewMatrix, projMatrix);
+  }
+
+  if (deferred)
+  {
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+    glViewport(0, 0, renderWidth, renderHeight);
+    glClearColor(0.2f, .2f, .8f, 1.f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    {
+      labhelper::perf::Scope s("Background");
+      drawBackground(viewMatrix, projMatrix);
+    }
+    {
+      labhelper::perf::Scope s("Deferred Lighting");
+      drawDeferredLighting(viewMatrix, projMatrix);
+    }
+  }
+
+  if (upscale)
+  {
+    labhelper::perf::Scope s("Upscale");
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, sceneFbo.framebufferId);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, renderWidth, renderHeight, 0, 0, windowWidth,
+                      windowHeight, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
   }
 }
 
@@ -467,6 +1087,47 @@ bool handleEvents()
   return quitEvent;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+/// G-buffer memory and the minimum traffic of one frame (every texel written
+/// once by the G-buffer pass and read once by the lighting pass)
+///////////////////////////////////////////////////////////////////////////////
+void gbufferReport()
+{
+  size_t bytesPerPixel = gBuffer.memoryUsage() /
+                         std::max<size_t>(1, size_t(gBuffer.width) * gBuffer.height);
+  ImGui::Text("G-buffer: %d bytes/pixel (RGBA8 + RG16 + RG8 + D32)",
+              int(bytesPerPixel));
+
+  struct Resolution
+  {
+    const char *name;
+    int width, height;
+  };
+  const Resolution resolutions[] = {{"Current", gBuffer.width, gBuffer.height},
+                                    {"720p", 1280, 720},
+                                    {"1080p", 1920, 1080},
+                                    {"1440p", 2560, 1440},
+                                    {"2160p", 3840, 2160}};
+  if (ImGui::BeginTable("G-buffer", 3, ImGuiTableFlags_RowBg))
+  {
+    ImGui::TableSetupColumn("Resolution");
+    ImGui::TableSetupColumn("Memory");
+    ImGui::TableSetupColumn("Traffic @ 60 Hz");
+    ImGui::TableHeadersRow();
+    for (const Resolution &r : resolutions)
+    {
+      double bytes = double(bytesPerPixel) * r.width * r.height;
+      ImGui::TableNextColumn();
+      ImGui::Text("%s (%dx%d)", r.name, r.width, r.height);
+      ImGui::TableNextColumn();
+      ImGui::Text("%.1f MB", bytes / (1024.0 * 1024.0));
+      ImGui::TableNextColumn();
+      ImGui::Text("%.2f GB/s", 2.0 * bytes * 60.0 / 1e9);
+    }
+    ImGui::EndTable();
+  }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 /// This function is to hold the general GUI logic
 ///////////////////////////////////////////////////////////////////////////////
@@ -478,15 +1139,125 @@ void gui()
               1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
   ImGui::SliderFloat("Environment Multiplier", &environment_multiplier, 0.0f,
                      10.0f);
+  ImGui::Checkbox("Terrain Depth Pre-pass", &useDepthPrepass);
+  ImGui::Checkbox("Dynamic Resolution", &dynamicResolution.enabled);
+  if (dynamicResolution.enabled)
+  {
+    ImGui::SliderFloat("Target GPU Time (ms)", &dynamicResolution.targetMs,
+                       1.0f, 33.3f);
+    ImGui::SliderFloat("Minimum Scale", &dynamicResolution.minScale, 0.25f,
+                       1.0f);
+  }
+  ImGui::Text("Render Scale %.2f (%dx%d), GPU %.2f ms",
+              dynamicResolution.getScale(), renderWidth, renderHeight,
+              dynamicResolution.getLastGpuMs());
+  ImGui::RadioButton("Forward", &renderMode, Forward);
+  ImGui::SameLine();
+  ImGui::RadioButton("Deferred", &renderMode, Deferred);
+  if (renderMode == Deferred)
+  {
+    gbufferReport();
+  }
+
+  ImGui::Separator();
+
+  ImGui::Text("Climate");
+  bool climateChanged = false;
+  if (ImGui::SliderFloat("Water Level", &waterLevel, -10.0f, 0.0f))
+  {
+    // The simulated sea starts at the water level
+    resetWaterSimulation();
+    climateChanged = true;
+  }
+  climateChanged |= ImGui::SliderFloat("Latitude", &climateParams.latitudeCentre,
+                                       -90.0f, 90.0f);
+  climateChanged |= ImGui::SliderFloat("Latitude Span",
+                                       &climateParams.latitudeSpan, 0.0f, 90.0f);
+  climateChanged |= ImGui::SliderFloat(
+      "Equator Temperature", &climateParams.equatorTemperature, 0.0f, 40.0f);
+  climateChanged |= ImGui::SliderFloat("Lapse Rate", &climateParams.lapseRate,
+                                       0.0f, 10.0f);
+  climateChanged |= ImGui::SliderFloat(
+      "Moisture Distance", &climateParams.moistureDistance, 1.0f, 50.0f);
+  climateChanged |= ImGui::SliderFloat(
+      "Desert Moisture", &climateParams.desertMoisture, 0.0f, 1.0f);
+  climateChanged |= ImGui::SliderFloat("Rock Slope", &climateParams.rockSlope,
+                                       0.0f, 1.0f);
+  if (climateChanged)
+  {
+    updateClimateTexture();
+    updateVegetation();
+  }
+  ImGui::Text("Climate fields in %.2f ms", climateMs);
+  ImGui::Checkbox("Show Lakes and Rivers", &showDrainage);
+
+  ImGui::Separator();
+
+  ImGui::Text("Vegetation");
+  bool vegetationChanged = false;
+  vegetationChanged |= ImGui::SliderFloat(
+      "Spacing", &vegetationParams.spacing, 0.5f, 10.0f);
+  for (VegetationType &type : vegetationParams.types)
+  {
+    vegetationChanged |= ImGui::SliderFloat(
+        (std::string(type.name) + " Density").c_str(), &type.density, 0.0f,
+        1.0f);
+  }
+  if (vegetationChanged)
+  {
+    updateVegetation();
+  }
+  ImGui::Text("%d instances in %.2f ms", int(vegetation.size()), vegetationMs);
+  ImGui::Checkbox("Show Vegetation", &showVegetation);
+  ImGui::Text("%d drawn, %d culled in %.2f ms, %d draw calls",
+              int(vegetationRenderer->getSubmitted()),
+              int(vegetationRenderer->getCulled()),
+              vegetationRenderer->getCullMs(),
+              vegetationRenderer->getDrawCalls());
+  bool useImpostors = vegetationRenderer->getUseImpostors();
+  if (ImGui::Checkbox("Impostors", &useImpostors))
+  {
+    vegetationRenderer->setUseImpostors(useImpostors);
+  }
+  ImGui::Text("%d impostors, %d triangles",
+              int(vegetationRenderer->getImpostors()),
+              int(vegetationRenderer->getTriangles()));
+
+  if (sceneObjects != nullptr)
+  {
+    ImGui::Separator();
+
+    ImGui::Text("Scene Objects");
+    ImGui::Checkbox("Show Scene Objects", &showSceneObjects);
+    if (labhelper::MultiDrawBatch::isMultiDrawSupported())
+    {
+      ImGui::Checkbox("Multi-Draw Indirect", &useMultiDraw);
+    }
+    ImGui::Text("%d of %d meshes in %d draw calls, %.3f ms submit",
+                int(sceneObjects->getVisible()),
+                int(sceneObjects->getRecordCount()),
+                sceneObjects->getDrawCalls(), sceneObjects->getSubmitMs());
+  }
 
   ImGui::Separator();
 
-  ImGui::Text("Terrain Thresholds");
-  ImGui::SliderFloat("Water Level", &waterLevel, -10.0f, 0.0f);
-  ImGui::SliderFloat("Sand Level", &sandLevel, waterLevel, 5.0f);
-  ImGui::SliderFloat("Grass Level", &grassLevel, sandLevel, 10.0f);
-  ImGui::SliderFloat("Rock Level", &rockLevel, grassLevel, 20.0f);
-  ImGui::SliderFloat("Slope Threshold", &slopeThreshold, 0.0f, 1.0f);
+  ImGui::Text("Water Simulation");
+  ImGui::Checkbox("Simulate Water", &simulateWater);
+  ImGui::SliderFloat("Water Budget (ms)", &waterBudgetMs, 0.5f, 20.0f);
+  ImGui::SliderFloat("Water Rain", &waterParams.rain, 0.0f, 0.1f);
+  ImGui::SliderFloat("Water Friction", &waterParams.friction, 0.0f, 5.0f);
+  if (ImGui::Button("Pour Water"))
+  {
+    // On a random spot of the terrain, which wakes the tiles around it
+    int size = waterSimulation->getSize();
+    waterSimulation->addWater(float(rand() % size), float(rand() % size),
+                              size / 50.0f, 2.0f);
+  }
+  ImGui::SameLine();
+  if (ImGui::Button("Reset Water"))
+  {
+    resetWaterSimulation();
+  }
 
   ImGui::Separator();
 
@@ -504,53 +1275,223 @@ void gui()
   {
     terrainParams.seed = rand();
   }
+  ImGui::SliderInt("Erosion Droplets", &terrainParams.dropletErosion.droplets,
+                   0, 1000000);
+  ImGui::SliderInt("Grid Erosion Steps", &terrainParams.pipeErosion.iterations,
+                   0, 5000);
+  ImGui::SliderInt("Thermal Erosion Iterations",
+                   &terrainParams.thermalErosion.iterations, 0, 1000);
+  ImGui::SliderFloat("Talus Angle", &terrainParams.thermalErosion.talusAngle,
+                     10.0f, 60.0f);
 
   if (ImGui::Button("Generate New Terrain"))
   {
     delete terrain;
+    terrainParams.dropletErosion.seed = terrainParams.seed;
     terrain = new Terrain(terrainParams);
+    resetInteractiveErosion();
+    uploadHeightmapTexture();
+    updateDrainageTexture();
+    updateClimateTexture();
+    updateVegetation();
+    placeSceneObjects();
+    resetWaterSimulation();
+  }
 
-    std::vector<float> normalizedHeightmap;
-    normalizedHeightmap.reserve(terrainParams.size * terrainParams.size * 3);
-    float minHeight = FLT_MAX;
-    float maxHeight = -FLT_MAX;
-
-    auto heightMap = terrain->getHeightMap();
-    for (const auto &row : heightMap)
-    {
-      for (float height : row)
-      {
-        minHeight = std::min(minHeight, height);
-        maxHeight = std::max(maxHeight, height);
-      }
-    }
+  if (ImGui::Checkbox("Erode Interactively", &runInteractiveErosion) &&
+      !runInteractiveErosion)
+  {
+    uploadHeightmapTexture();
+    updateDrainageTexture();
+    updateClimateTexture();
+    updateVegetation();
+    placeSceneObjects();
+    resetWaterSimulation();
+  }
+  ImGui::SliderFloat("Erosion Budget (ms)", &erosionBudgetMs, 1.0f, 30.0f);
+  ImGui::SliderFloat("Rain", &terrainParams.pipeErosion.rain, 0.0f, 0.1f);
+  if (interactiveErosion != nullptr)
+  {
+    ImGui::Text("%d steps, %.2f ms per step, %d rows uploaded", erosionSteps,
+                interactiveErosion->getLastStepMs(), erosionRowsUploaded);
+  }
 
-    for (const auto &row : heightMap)
+  ImGui::InputText("Heightmap File", heightmapPath, sizeof(heightmapPath));
+  if (ImGui::Button("Save Heightmap"))
+  {
+    terrain->saveHeightmap(heightmapPath);
+  }
+  ImGui::SameLine();
+  if (ImGui::Button("Load Heightmap"))
+  {
+    Terrain *previous = terrain;
+    if (loadTerrain(heightmapPath))
     {
-      for (float height : row)
-      {
-        float normalizedHeight = (height - minHeight) / (maxHeight - minHeight);
-        normalizedHeightmap.push_back(normalizedHeight);
-        normalizedHeightmap.push_back(normalizedHeight);
-        normalizedHeightmap.push_back(normalizedHeight);
-      }
+      delete previous;
+      resetInteractiveErosion();
+      uploadHeightmapTexture();
+      updateDrainageTexture();
+      updateClimateTexture();
+      updateVegetation();
+      placeSceneObjects();
+      resetWaterSimulation();
     }
+  }
 
-    glBindTexture(GL_TEXTURE_2D, heightmapTexture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, terrainParams.size, terrainParams.size, 0, GL_RGB, GL_FLOAT, normalizedHeightmap.data());
-    glBindTexture(GL_TEXTURE_2D, 0);
+  if (ImGui::Button("Export Terrain OBJ"))
+  {
+    terrain->saveToOBJ("terrain.obj");
+  }
+  ImGui::SameLine();
+  if (ImGui::Button("Benchmark OBJ Export"))
+  {
+    labhelper::Model *model = terrain->createExportModel();
+    labhelper::benchmarkObjWriter(model, "terrain_benchmark.obj");
+    delete model;
   }
 
   ImGui::End();
+
+  labhelper::perf::drawEventsWindow();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// The terrain the --bench-* modes run on, so that their numbers compare
+///////////////////////////////////////////////////////////////////////////////
+TerrainParams benchmarkTerrainParams(int size = 1024)
+{
+  TerrainParams params;
+  params.size = size;
+  params.heightScale = 5.0f;
+  params.noiseOctaves = 8;
+  params.seed = 1;
+  return params;
 }
 
 int main(int argc, char *argv[])
 {
+  auto launchTime = std::chrono::high_resolution_clock::now();
+
+  // Compare the OBJ parsers on the bundled scenes, without opening a window
+  if (argc > 1 && std::string(argv[1]) == "--bench-obj")
+  {
+    const char *scenes[] = {"../scenes/NewShip.obj", "../scenes/landingpad.obj",
+                            "../scenes/sphere.obj"};
+    bool identical = true;
+    for (const char *scene : scenes)
+      identical = labhelper::benchmarkObjParsers(scene) && identical;
+    return identical ? 0 : 1;
+  }
+
+  for (int i = 1; i + 1 < argc; i++)
+  {
+    if (std::string(argv[i]) == "--heightmap")
+    {
+      strncpy(heightmapPath, argv[i + 1], sizeof(heightmapPath) - 1);
+    }
+  }
+
+  // Compression ratio and speed of the heightmap codec on a few seeds
+  if (argc > 1 && std::string(argv[1]) == "--bench-codec")
+  {
+    TerrainParams params = benchmarkTerrainParams();
+    for (unsigned int seed = 1; seed <= 4; seed++)
+    {
+      params.seed = seed;
+      std::vector<float> heights = Terrain::generateHeightMap(params);
+      std::cout << "Seed " << seed << ": ";
+      labhelper::benchmarkHeightCodec(heights.data(), params.size, params.size);
+    }
+    return 0;
+  }
+
+  // Droplet erosion speed and scaling over thread counts
+  if (argc > 1 && std::string(argv[1]) == "--bench-erosion")
+  {
+    TerrainParams params = benchmarkTerrainParams();
+    std::vector<float> heights = Terrain::generateHeightMap(params);
+    params.dropletErosion.droplets = 400000;
+    params.dropletErosion.seed = params.seed;
+    benchmarkDropletErosion(heights, params.size, params.dropletErosion);
+    return 0;
+  }
+
+  // Single and batched terrain height and normal queries
+  if (argc > 1 && std::string(argv[1]) == "--bench-queries")
+  {
+    TerrainParams params = benchmarkTerrainParams();
+    std::vector<float> heights = Terrain::generateHeightMap(params);
+    benchmarkTerrainQueries(heights, params.size, params.scale);
+    return 0;
+  }
+
+  // Grid erosion speed and scaling over thread counts
+  if (argc > 1 && std::string(argv[1]) == "--bench-pipe-erosion")
+  {
+    TerrainParams params = benchmarkTerrainParams();
+    std::vector<float> heights = Terrain::generateHeightMap(params);
+    benchmarkPipeErosion(heights, params.size, params.scale,
+                         params.pipeErosion, 200);
+    return 0;
+  }
+
+  // Thermal erosion time per iteration at 1k^2 and 4k^2
+  if (argc > 1 && std::string(argv[1]) == "--bench-thermal")
+  {
+    ThermalErosionParams thermal;
+    thermal.iterations = 1000;
+    for (int size : {1024, 4096})
+    {
+      TerrainParams params = benchmarkTerrainParams(size);
+      std::vector<float> heights = Terrain::generateHeightMap(params);
+      benchmarkThermalErosion(heights, size, params.scale, thermal);
+    }
+    return 0;
+  }
+
+  // Drainage analysis time per stage at 1k^2, 4k^2 and 8k^2
+  if (argc > 1 && std::string(argv[1]) == "--bench-drainage")
+  {
+    for (int size : {1024, 4096, 8192})
+    {
+      TerrainParams params = benchmarkTerrainParams(size);
+      std::vector<float> heights = Terrain::generateHeightMap(params);
+      benchmarkDrainage(heights, size, params.scale);
+    }
+    return 0;
+  }
+
+  // Shallow water speed with water poured on a calm sea
+  if (argc > 1 && std::string(argv[1]) == "--bench-water")
+  {
+    TerrainParams params = benchmarkTerrainParams();
+    std::vector<float> heights = Terrain::generateHeightMap(params);
+    benchmarkShallowWater(heights, params.size, params.scale, waterLevel,
+                          ShallowWaterParams(), 500);
+    return 0;
+  }
+
+  // Vegetation placement speed at 4k^2
+  if (argc > 1 && std::string(argv[1]) == "--bench-vegetation")
+  {
+    TerrainParams params = benchmarkTerrainParams(4096);
+    std::vector<float> heights = Terrain::generateHeightMap(params);
+    ClimateParams seaClimate;
+    seaClimate.seaLevel = waterLevel;
+    ClimateMap biomes;
+    computeClimate(heights, params.size, params.scale, nullptr, seaClimate,
+                   biomes, nullptr);
+    benchmarkVegetation(heights, params.size, params.scale, &biomes,
+                        VegetationParams(), params.seed);
+    return 0;
+  }
+
   g_window = labhelper::init_window_SDL("OpenGL Project");
 
   initialize();
 
   bool stopRendering = false;
+  bool firstFrame = true;
   auto startTime = std::chrono::system_clock::now();
 
   while (!stopRendering)
@@ -568,6 +1509,9 @@ int main(int argc, char *argv[])
     // Inform imgui of new frame
     labhelper::newFrame(g_window);
 
+    updateInteractiveErosion();
+    updateWaterSimulation();
+
     // render to window
     display();
 
@@ -579,8 +1523,33 @@ int main(int argc, char *argv[])
 
     // Swap front and back buffer. This frame will now been displayed.
     SDL_GL_SwapWindow(g_window);
+
+    if (firstFrame)
+    {
+      std::chrono::duration<float, std::milli> elapsed =
+          std::chrono::high_resolution_clock::now() - launchTime;
+      std::cout << "Time to first frame: " << elapsed.count() << " ms\n";
+      firstFrame = false;
+    }
   }
   // Free Models
+  delete vegetationRenderer;
+  for (labhelper::Model *model : vegetationModels)
+  {
+    labhelper::freeModel(model);
+  }
+  for (Impostor *impostor : vegetationImpostors)
+  {
+    delete impostor;
+  }
+  delete sceneObjects;
+  if (shipModel != nullptr)
+  {
+    labhelper::freeModel(shipModel);
+    labhelper::freeModel(landingPadModel);
+  }
+  delete waterSimulation;
+  delete interactiveErosion;
   delete terrain;
 
   // Shut down everything. This includes the window and all other subsystems.
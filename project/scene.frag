@@ -0,0 +1,181 @@
+#version 430
+
+// required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
+precision highp float;
+
+///////////////////////////////////////////////////////////////////////////////
+// Materials, see MultiDrawBatch::GpuMaterial, and the textures of the group
+// being drawn, bound to the same units as by labhelper::render()
+///////////////////////////////////////////////////////////////////////////////
+struct Material
+{
+    vec4 colorMetalness;
+    vec4 emissionFresnel;
+    float shininess;
+    int hasColorTexture;
+    int hasEmissionTexture;
+};
+layout(std430, binding = 1) readonly buffer Materials
+{
+    Material materials[];
+};
+layout(binding = 0) uniform sampler2D colorMap;
+layout(binding = 5) uniform sampler2D emissiveMap;
+
+// Set from the material at the start of main(), for the functions below
+float material_metalness;
+float material_fresnel;
+float material_shininess;
+
+///////////////////////////////////////////////////////////////////////////////
+// Environment
+///////////////////////////////////////////////////////////////////////////////
+layout(binding = 6) uniform sampler2D environmentMap;
+layout(binding = 7) uniform sampler2D irradianceMap;
+layout(binding = 8) uniform sampler2D reflectionMap;
+uniform float environment_multiplier;
+
+///////////////////////////////////////////////////////////////////////////////
+// Light source
+///////////////////////////////////////////////////////////////////////////////
+uniform vec3 point_light_color = vec3(1.0, 1.0, 1.0);
+uniform float point_light_intensity_multiplier = 50.0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Constants
+///////////////////////////////////////////////////////////////////////////////
+#define PI 3.14159265359
+
+///////////////////////////////////////////////////////////////////////////////
+// Input varyings from vertex shader
+///////////////////////////////////////////////////////////////////////////////
+in vec2 texCoord;
+in vec3 viewSpaceNormal;
+in vec3 viewSpacePosition;
+flat in uint material;
+
+///////////////////////////////////////////////////////////////////////////////
+// Input uniform variables
+///////////////////////////////////////////////////////////////////////////////
+uniform mat4 viewInverse;
+uniform vec3 viewSpaceLightPosition;
+
+///////////////////////////////////////////////////////////////////////////////
+// Output color, or the G-buffer when built with DEFERRED (see deferred.frag
+// for the layout)
+///////////////////////////////////////////////////////////////////////////////
+#ifdef DEFERRED
+layout(location = 0) out vec4 gbufferAlbedo;
+layout(location = 1) out vec2 gbufferNormal;
+layout(location = 2) out vec2 gbufferMaterial;
+#else
+layout(location = 0) out vec4 fragmentColor;
+#endif
+
+vec3 calculateDirectIllumiunation(vec3 wo, vec3 n, vec3 base_color)
+{
+    vec3 direct_illum = base_color;
+    float d = distance(viewSpacePosition, viewSpaceLightPosition);
+    vec3 wi = normalize(viewSpaceLightPosition - viewSpacePosition);
+    vec3 Li = point_light_intensity_multiplier * point_light_color * 1 / pow(d, 2);
+    if (dot(wi, n) <= 0.0) return vec3(0, 0, 0);
+
+    vec3 diffuse_term = base_color * (1.0 / PI) * dot(n, wi) * Li;
+
+    vec3 wh = normalize(wi + wo);
+    float F = material_fresnel + (1 - material_fresnel) * pow(1 - dot(wh, wi), 5);
+    float D = (material_shininess + 2) / (2 * PI) * pow(max(0.001, dot(n, wh)), material_shininess);
+    float G = min(1, min(2 * (dot(n, wh) * dot(n, wo) / max(0.001, dot(wo, wh))), 2 * (dot(n, wh) * dot(n, wi) / max(0.001, dot(wo, wh)))));
+    float brdf = F * D * G / max(0.001, (4 * dot(n, wo) * dot(n, wi)));
+
+    vec3 dielectic_term = brdf * dot(n, wi) * Li + (1.0 - F) * diffuse_term;
+    vec3 metal_term = brdf * base_color * dot(n, wi) * Li;
+    direct_illum = material_metalness * metal_term + (1.0 - material_metalness) * dielectic_term;
+
+    return material_metalness * metal_term + (1.0 - material_metalness) * dielectic_term;
+}
+
+vec3 calculateIndirectIllumination(vec3 wo, vec3 n, vec3 base_color)
+{
+    vec3 indirect_illum = vec3(0.f);
+
+    vec3 nws = vec3(viewInverse * vec4(n, 0.0));
+
+    float theta = acos(max(-1.0f, min(1.0f, nws.y)));
+    float phi = atan(nws.z, nws.x);
+    if (phi < 0.0f)
+    {
+        phi = phi + 2.0f * PI;
+    }
+    vec2 lookup = vec2(phi / (2.0f * PI), 1.0f - theta / PI);
+    vec3 irradiance = environment_multiplier * texture(irradianceMap, lookup).rgb;
+
+    vec3 diffuse_term = base_color * (1.0f / PI) * irradiance;
+
+    float roughness = sqrt(sqrt(2.0f / (material_shininess + 2.0f)));
+    vec3 wi = normalize(reflect(-wo, n));
+    vec3 wr = normalize(vec3(viewInverse * vec4(wi, 0.0f)));
+    theta = acos(max(-1.0f, min(1.0f, wr.y)));
+    phi = atan(wr.z, wr.x);
+    if (phi < 0.0f)
+    {
+        phi = phi + 2.0f * PI;
+    }
+    lookup = vec2(phi / (2.0f * PI), 1.0f - theta / PI);
+    vec3 Li = environment_multiplier * textureLod(reflectionMap, lookup, roughness * 7.0f).rgb;
+    vec3 wh = normalize(wi + wo);
+    float F = material_fresnel + (1.0f - material_fresnel) * pow(1 - dot(wh, wo), 5.0f);
+    vec3 dielectric_term = F * Li + (1.0f - F) * diffuse_term;
+    vec3 metal_term = F * base_color * Li;
+    indirect_illum = material_metalness * metal_term + (1.0f - material_metalness) * dielectric_term;
+
+    return indirect_illum;
+}
+
+// Octahedral normal encoding, mapped to [0, 1] for a UNORM target
+vec2 octWrap(vec2 v)
+{
+    return (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec2 encodeNormal(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    n.xy = n.z >= 0.0 ? n.xy : octWrap(n.xy);
+    return n.xy * 0.5 + 0.5;
+}
+
+void main()
+{
+    Material m = materials[material];
+    material_metalness = m.colorMetalness.a;
+    material_fresnel = m.emissionFresnel.a;
+    material_shininess = m.shininess;
+
+    vec3 wo = -normalize(viewSpacePosition);
+    vec3 n = normalize(viewSpaceNormal);
+
+    vec3 baseColor = m.colorMetalness.rgb;
+    if (m.hasColorTexture == 1)
+    {
+        baseColor *= texture(colorMap, texCoord).rgb;
+    }
+    vec3 emission = m.emissionFresnel.rgb;
+    if (m.hasEmissionTexture == 1)
+    {
+        emission = texture(emissiveMap, texCoord).rgb;
+    }
+
+#ifdef DEFERRED
+    // Lighting is done once per pixel in deferred.frag, which has no
+    // emission term yet
+    float roughness = sqrt(sqrt(2.0 / (material_shininess + 2.0)));
+    gbufferAlbedo = vec4(baseColor, material_metalness);
+    gbufferNormal = encodeNormal(n);
+    gbufferMaterial = vec2(material_fresnel, roughness);
+#else
+    vec3 shading = calculateDirectIllumiunation(wo, n, baseColor) +
+                   calculateIndirectIllumination(wo, n, baseColor) + emission;
+    fragmentColor = vec4(shading, 1.0);
+#endif
+}
@@ -0,0 +1,50 @@
+#version 430
+///////////////////////////////////////////////////////////////////////////////
+// Input vertex attributes
+///////////////////////////////////////////////////////////////////////////////
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 normalIn;
+layout(location = 2) in vec2 texCoordIn;
+
+// Per instance, 0, 1, 2... offset by each command's baseInstance, which
+// labhelper::MultiDrawBatch sets to the index of its draw record
+layout(location = 3) in uint drawId;
+
+///////////////////////////////////////////////////////////////////////////////
+// Draw records, see MultiDrawBatch::GpuRecord
+///////////////////////////////////////////////////////////////////////////////
+struct DrawRecord
+{
+	mat4 modelMatrix;
+	mat4 normalMatrix;
+	uint material;
+};
+layout(std430, binding = 0) readonly buffer DrawRecords
+{
+	DrawRecord records[];
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Input uniform variables
+///////////////////////////////////////////////////////////////////////////////
+uniform mat4 viewMatrix;
+uniform mat4 viewProjectionMatrix;
+
+///////////////////////////////////////////////////////////////////////////////
+// Output to fragment shader
+///////////////////////////////////////////////////////////////////////////////
+out vec2 texCoord;
+out vec3 viewSpaceNormal;
+out vec3 viewSpacePosition;
+flat out uint material;
+
+void main()
+{
+	DrawRecord record = records[drawId];
+	vec4 worldPos = record.modelMatrix * vec4(position, 1.0);
+	gl_Position = viewProjectionMatrix * worldPos;
+	texCoord = texCoordIn;
+	viewSpaceNormal = (viewMatrix * vec4((record.normalMatrix * vec4(normalIn, 0.0)).xyz, 0.0)).xyz;
+	viewSpacePosition = (viewMatrix * worldPos).xyz;
+	material = record.material;
+}
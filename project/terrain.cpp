@@ -1,5 +1,8 @@
 #include "terrain.h"
 #include "labhelper.h"
+#include <heightfield.h>
+#include <threadpool.h>
+#include <chrono>
 #include <cmath>
 #include <random>
 #include <vector>
@@ -11,47 +14,106 @@ Terrain::Terrain(const TerrainParams &params)
   std::cout << "Generating terrain with size: " << params.size
             << ", scale: " << params.scale
             << ", heightScale: " << params.heightScale << std::endl;
-  generateTerrain();
+  auto startTime = std::chrono::high_resolution_clock::now();
+  generateHeights();
+  std::chrono::duration<float, std::milli> elapsed =
+      std::chrono::high_resolution_clock::now() - startTime;
+  std::cout << "Generated heights in " << elapsed.count() << " ms\n";
+  erodeHeights();
+  buildModel();
 }
 
-void Terrain::generateTerrain()
+Terrain::Terrain(const TerrainParams &params, const float *heights)
+    : params(params), terrainModel(nullptr),
+      heightMap(heights, heights + params.size * params.size)
 {
-  terrainModel = new labhelper::Model();
-  terrainModel->m_name = "Terrain";
-  terrainModel->m_filename = "generated_terrain";
-
-  std::vector<std::vector<glm::vec3>> normalMap(
-      params.size, std::vector<glm::vec3>(params.size));
+  buildModel();
+}
 
-  heightMap.resize(params.size, std::vector<float>(params.size));
+std::vector<float> Terrain::generateHeightMap(const TerrainParams &params)
+{
+  Terrain generator;
+  generator.params = params;
+  generator.generateHeights();
+  generator.erodeHeights();
+  return std::move(generator.heightMap);
+}
 
+void Terrain::generateHeights()
+{
+  heightMap.resize(params.size * params.size);
   for (int z = 0; z < params.size; z++)
   {
     for (int x = 0; x < params.size; x++)
     {
       float xPos = (x - params.size / 2.0f) * params.scale;
       float zPos = (z - params.size / 2.0f) * params.scale;
-      heightMap[z][x] = perlinOctaves(xPos, zPos, 0.5f) * params.heightScale;
+      heightMap[z * params.size + x] =
+          perlinOctaves(xPos, zPos, 0.5f) * params.heightScale;
     }
   }
+}
 
-  for (int z = 0; z < params.size; z++)
+void Terrain::erodeHeights()
+{
+  const DropletErosionParams &droplets = params.dropletErosion;
+  if (droplets.droplets > 0)
   {
-    for (int x = 0; x < params.size; x++)
+    auto startTime = std::chrono::high_resolution_clock::now();
+    // The droplets work in grid units, one unit between samples
+    for (float &h : heightMap)
+    {
+      h /= params.scale;
+    }
+    erodeDroplets(heightMap, params.size, droplets,
+                  &labhelper::ThreadPool::global());
+    for (float &h : heightMap)
     {
-      glm::vec3 normal(0.0f, 1.0f, 0.0f);
-      if (x > 0 && x < params.size - 1 && z > 0 && z < params.size - 1)
-      {
-        float slopeX = heightMap[z][x + 1] - heightMap[z][x - 1];
-        float slopeY = heightMap[z + 1][x] - heightMap[z - 1][x];
-        glm::vec3 tangentX(2.0f * params.scale, slopeX, 0.0f);
-        glm::vec3 tangentZ(0.0f, slopeY, 2.0f * params.scale);
-        normal = glm::normalize(glm::cross(tangentX, tangentZ));
-      }
-      normalMap[z][x] = normal;
+      h *= params.scale;
     }
+    std::chrono::duration<float, std::milli> elapsed =
+        std::chrono::high_resolution_clock::now() - startTime;
+    std::cout << "Eroded with " << droplets.droplets << " droplets in "
+              << elapsed.count() << " ms ("
+              << droplets.droplets / (elapsed.count() / 1000.0f)
+              << " droplets/s)\n";
   }
 
+  const PipeErosionParams &pipes = params.pipeErosion;
+  if (pipes.iterations > 0)
+  {
+    auto startTime = std::chrono::high_resolution_clock::now();
+    PipeErosion erosion(heightMap, params.size, params.scale, pipes);
+    erosion.step(pipes.iterations, &labhelper::ThreadPool::global());
+    erosion.getHeights(heightMap);
+    std::chrono::duration<float, std::milli> elapsed =
+        std::chrono::high_resolution_clock::now() - startTime;
+    std::cout << "Eroded with " << pipes.iterations << " water steps in "
+              << elapsed.count() << " ms ("
+              << float(params.size) * params.size * pipes.iterations /
+                     (elapsed.count() * 1000.0f)
+              << " million cells/s)\n";
+  }
+
+  const ThermalErosionParams &thermal = params.thermalErosion;
+  if (thermal.iterations > 0)
+  {
+    auto startTime = std::chrono::high_resolution_clock::now();
+    int iterations = erodeThermal(heightMap, params.size, params.scale,
+                                  thermal, &labhelper::ThreadPool::global());
+    std::chrono::duration<float, std::milli> elapsed =
+        std::chrono::high_resolution_clock::now() - startTime;
+    std::cout << "Relaxed slopes in " << iterations << " iterations, "
+              << elapsed.count() << " ms\n";
+  }
+}
+
+void Terrain::buildModel()
+{
+  terrainModel = new labhelper::Model();
+  terrainModel->m_name = "Terrain";
+  terrainModel->m_filename = "generated_terrain";
+
   int verticesPerRow = params.size * 2;
   int numRows = params.size - 1;
   int borderVertices = (numRows - 1) * 2;
@@ -59,43 +121,7 @@ void Terrain::generateTerrain()
 
   terrainModel->m_positions.resize(numVertices);
   terrainModel->m_normals.resize(numVertices);
-
-  int vertexIndex = 0;
-  for (int z = 0; z < params.size - 1; z++)
-  {
-    if (z > 0)
-    {
-      terrainModel->m_positions[vertexIndex] =
-          terrainModel->m_positions[vertexIndex - 1];
-      terrainModel->m_normals[vertexIndex] =
-          terrainModel->m_normals[vertexIndex - 1];
-      vertexIndex++;
-
-      float xPos = (-params.size / 2.0f) * params.scale;
-      float zPos = (z - params.size / 2.0f) * params.scale;
-      terrainModel->m_positions[vertexIndex] =
-          glm::vec3(xPos, heightMap[z][0], zPos);
-      terrainModel->m_normals[vertexIndex] = normalMap[z][0];
-      vertexIndex++;
-    }
-
-    for (int x = 0; x < params.size; x++)
-    {
-      float xPos = (x - params.size / 2.0f) * params.scale;
-      float zPos = (z - params.size / 2.0f) * params.scale;
-      terrainModel->m_positions[vertexIndex] =
-          glm::vec3(xPos, heightMap[z][x], zPos);
-      terrainModel->m_normals[vertexIndex] = normalMap[z][x];
-      vertexIndex++;
-
-      xPos = (x - params.size / 2.0f) * params.scale;
-      zPos = ((z + 1) - params.size / 2.0f) * params.scale;
-      terrainModel->m_positions[vertexIndex] =
-          glm::vec3(xPos, heightMap[z + 1][x], zPos);
-      terrainModel->m_normals[vertexIndex] = normalMap[z + 1][x];
-      vertexIndex++;
-    }
-  }
+  fillStrips(0, numRows);
 
   labhelper::Mesh mesh;
   mesh.m_name = "TerrainMesh";
@@ -125,8 +151,149 @@ void Terrain::generateTerrain()
   terrainModel->m_meshes.push_back(mesh);
 }
 
+int Terrain::stripStart(int z) const
+{
+  // Every strip but the first starts with two degenerate vertices
+  return z * (params.size * 2 + 2) - (z > 0 ? 2 : 0);
+}
+
+void Terrain::fillStrips(int zBegin, int zEnd)
+{
+  // Strip z runs between rows z and z + 1
+  std::vector<glm::vec3> normalMap((zEnd - zBegin + 1) * params.size);
+  for (int z = zBegin; z <= zEnd; z++)
+  {
+    for (int x = 0; x < params.size; x++)
+    {
+      normalMap[(z - zBegin) * params.size + x] = vertexNormal(x, z);
+    }
+  }
+
+  for (int z = zBegin; z < zEnd; z++)
+  {
+    int vertexIndex = stripStart(z);
+    const glm::vec3 *normals = &normalMap[(z - zBegin) * params.size];
+    if (z > 0)
+    {
+      terrainModel->m_positions[vertexIndex] =
+          vertexPosition(params.size - 1, z);
+      terrainModel->m_normals[vertexIndex] = normals[params.size - 1];
+      vertexIndex++;
+
+      terrainModel->m_positions[vertexIndex] = vertexPosition(0, z);
+      terrainModel->m_normals[vertexIndex] = normals[0];
+      vertexIndex++;
+    }
+
+    for (int x = 0; x < params.size; x++)
+    {
+      terrainModel->m_positions[vertexIndex] = vertexPosition(x, z);
+      terrainModel->m_normals[vertexIndex] = normals[x];
+      vertexIndex++;
+
+      terrainModel->m_positions[vertexIndex] = vertexPosition(x, z + 1);
+      terrainModel->m_normals[vertexIndex] = normals[params.size + x];
+      vertexIndex++;
+    }
+  }
+}
+
+void Terrain::updateHeights(const float *heights, int rowBegin, int rowEnd)
+{
+  std::copy(heights + rowBegin * params.size, heights + rowEnd * params.size,
+            heightMap.begin() + rowBegin * params.size);
+  // Normals use the rows on either side, and each row is in two strips
+  int zBegin = std::max(0, rowBegin - 2);
+  int zEnd = std::min(params.size - 1, rowEnd + 1);
+  fillStrips(zBegin, zEnd);
+
+  int first = stripStart(zBegin);
+  int count = stripStart(zEnd) - first;
+  glBindBuffer(GL_ARRAY_BUFFER, terrainModel->m_positions_bo);
+  glBufferSubData(GL_ARRAY_BUFFER, first * sizeof(glm::vec3),
+                  count * sizeof(glm::vec3), &terrainModel->m_positions[first]);
+  glBindBuffer(GL_ARRAY_BUFFER, terrainModel->m_normals_bo);
+  glBufferSubData(GL_ARRAY_BUFFER, first * sizeof(glm::vec3),
+                  count * sizeof(glm::vec3), &terrainModel->m_normals[first]);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
 labhelper::Model *Terrain::getModel() const { return terrainModel; }
-std::vector<std::vector<float>> Terrain::getHeightMap() const { return heightMap; }
+const std::vector<float> &Terrain::getHeightMap() const { return heightMap; }
+
+bool Terrain::saveHeightmap(const std::string &filename) const
+{
+  return labhelper::saveHeightfield(filename, heightMap.data(), params.size,
+                                    params.size);
+}
+
+glm::vec3 Terrain::vertexPosition(int x, int z) const
+{
+  return glm::vec3((x - params.size / 2.0f) * params.scale, height(x, z),
+                   (z - params.size / 2.0f) * params.scale);
+}
+
+glm::vec3 Terrain::vertexNormal(int x, int z) const
+{
+  if (x > 0 && x < params.size - 1 && z > 0 && z < params.size - 1)
+  {
+    float slopeX = height(x + 1, z) - height(x - 1, z);
+    float slopeY = height(x, z + 1) - height(x, z - 1);
+    glm::vec3 tangentX(2.0f * params.scale, slopeX, 0.0f);
+    glm::vec3 tangentZ(0.0f, slopeY, 2.0f * params.scale);
+    return glm::normalize(glm::cross(tangentX, tangentZ));
+  }
+  return glm::vec3(0.0f, 1.0f, 0.0f);
+}
+
+labhelper::Model *Terrain::createExportModel() const
+{
+  labhelper::Model *model = new labhelper::Model();
+  model->m_name = terrainModel->m_name;
+  model->m_filename = terrainModel->m_filename;
+
+  int size = params.size;
+  model->m_positions.reserve(size * size);
+  model->m_normals.reserve(size * size);
+  for (int z = 0; z < size; z++)
+  {
+    for (int x = 0; x < size; x++)
+    {
+      model->m_positions.push_back(vertexPosition(x, z));
+      model->m_normals.push_back(vertexNormal(x, z));
+    }
+  }
+
+  // Two triangles per grid cell, with the same winding as the strip
+  model->m_indices.reserve((size - 1) * (size - 1) * 6);
+  for (int z = 0; z < size - 1; z++)
+  {
+    for (int x = 0; x < size - 1; x++)
+    {
+      uint32_t i00 = z * size + x;
+      uint32_t i01 = (z + 1) * size + x;
+      uint32_t i10 = i00 + 1;
+      uint32_t i11 = i01 + 1;
+      uint32_t cell[] = {i00, i01, i10, i10, i01, i11};
+      model->m_indices.insert(model->m_indices.end(), cell, cell + 6);
+    }
+  }
+
+  labhelper::Mesh mesh;
+  mesh.m_name = "TerrainMesh";
+  mesh.m_material_idx = 0;
+  mesh.m_start_index = 0;
+  mesh.m_number_of_vertices = (uint32_t)model->m_indices.size();
+  model->m_meshes.push_back(mesh);
+  return model;
+}
+
+void Terrain::saveToOBJ(const std::string &filename) const
+{
+  labhelper::Model *model = createExportModel();
+  labhelper::saveModelToOBJ(model, filename);
+  delete model;
+}
 
 float Terrain::perlinOctaves(float x, float z, float persistance)
 {
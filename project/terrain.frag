@@ -50,17 +50,22 @@ uniform vec3 viewSpaceLightPosition;
 uniform vec2 texSize;
 
 ///////////////////////////////////////////////////////////////////////////////
-// Output color
+// Output color, or the G-buffer when built with DEFERRED (see deferred.frag
+// for the layout)
 ///////////////////////////////////////////////////////////////////////////////
+#ifdef DEFERRED
+layout(location = 0) out vec4 gbufferAlbedo;
+layout(location = 1) out vec2 gbufferNormal;
+layout(location = 2) out vec2 gbufferMaterial;
+#else
 layout(location = 0) out vec4 fragmentColor;
+#endif
 
 layout(binding = 9) uniform sampler2D colormap;
 
-uniform float waterLevel;
-uniform float sandLevel;
-uniform float grassLevel;
-uniform float rockLevel;
-uniform float slopeThreshold = 0.7;
+// Weights of sand, grass, rock and snow, with water making up the rest,
+// classified on the CPU from the climate (see climate.h)
+layout(binding = 5) uniform sampler2D biomeWeights;
 
 layout(binding = 10) uniform sampler2D waterTexture;
 layout(binding = 11) uniform sampler2D sandTexture;
@@ -68,6 +73,16 @@ layout(binding = 12) uniform sampler2D grassTexture;
 layout(binding = 13) uniform sampler2D rockTexture;
 layout(binding = 14) uniform sampler2D snowTexture;
 
+// Lake depth in r and river strength in g, one texel per heightmap sample
+layout(binding = 15) uniform sampler2D drainageMap;
+uniform float terrainSize;
+uniform float terrainScale = 1.0;
+uniform float showDrainage = 1.0;
+
+// Depth in r and velocity in gb of the simulated water, on the same texels
+layout(binding = 4) uniform sampler2D waterSimulation;
+uniform float showWater = 1.0;
+
 uniform float textureScale = 10.0;
 
 
@@ -180,9 +195,7 @@ vec3 getTriplanarMapping(vec3 normal, vec3 position, sampler2D tex, float scale)
     return colorX * blendWeights.x + colorY * blendWeights.y + colorZ * blendWeights.z;
 }
 
-vec3 getTerrainColor(float height) {
-    
-    float slope = 1.0 - abs(dot(normalize(viewSpaceNormal), vec3(0.0, 1.0, 0.0)));
+vec3 getTerrainColor() {
     
     vec3 worldPos = vec3(viewInverse * vec4(viewSpacePosition, 1.0));
     
@@ -192,33 +205,50 @@ vec3 getTerrainColor(float height) {
     vec3 rockTex = getTriplanarMapping(normalize(viewSpaceNormal), worldPos, rockTexture, textureScale);
     vec3 snowTex = getTriplanarMapping(normalize(viewSpaceNormal), worldPos, snowTexture, textureScale);
     
-    float smoothing = 0.4;
-    float waterBlend = smoothstep(waterLevel - smoothing, waterLevel + smoothing, height);
-    float sandBlend = smoothstep(sandLevel - smoothing, sandLevel + smoothing, height);
-    float grassBlend = smoothstep(grassLevel - smoothing, grassLevel + smoothing, height);
-    float rockBlend = smoothstep(rockLevel - smoothing, rockLevel + smoothing, height);
-    
-    float slopeBlend = smoothstep(slopeThreshold - 0.1, slopeThreshold + 0.1, slope);
-    
-    vec3 color = waterTex;
-    
-    color = mix(color, sandTex, waterBlend);
-    color = mix(color, grassTex, sandBlend);
-    color = mix(color, rockTex, grassBlend);
-    color = mix(color, snowTex, rockBlend);
-    
-    color = mix(color, rockTex, slopeBlend);
+    vec2 mapCoord = (worldPos.xz / terrainScale + 0.5 * terrainSize + 0.5) / terrainSize;
+    vec4 weights = texture(biomeWeights, mapCoord);
+    vec3 color = sandTex * weights.r + grassTex * weights.g + rockTex * weights.b + snowTex * weights.a
+               + waterTex * max(0.0, 1.0 - dot(weights, vec4(1.0)));
+
+    vec2 drainage = texture(drainageMap, mapCoord).rg * showDrainage;
+    color = mix(color, waterTex, max(smoothstep(0.0, 0.2, drainage.r), drainage.g));
+
+    // Darker where deep, with foam where it runs fast
+    vec3 water = texture(waterSimulation, mapCoord).rgb * showWater;
+    vec3 waterColor = waterTex * mix(1.0, 0.4, smoothstep(0.5, 3.0, water.r));
+    waterColor = mix(waterColor, vec3(0.9), 0.5 * smoothstep(1.0, 4.0, length(water.gb)));
+    color = mix(color, waterColor, smoothstep(0.0, 0.15, water.r));
     
     return color;
 }
 
+// Octahedral normal encoding, mapped to [0, 1] for a UNORM target
+vec2 octWrap(vec2 v)
+{
+    return (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec2 encodeNormal(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    n.xy = n.z >= 0.0 ? n.xy : octWrap(n.xy);
+    return n.xy * 0.5 + 0.5;
+}
+
 void main()
 {
     vec3 wo = -normalize(viewSpacePosition);
     vec3 n = normalize(viewSpaceNormal);
 
-    vec3 terrainColor = getTerrainColor(worldHeight);
+    vec3 terrainColor = getTerrainColor();
 
+#ifdef DEFERRED
+    // Lighting is done once per pixel in deferred.frag
+    float roughness = sqrt(sqrt(2.0 / (material_shininess + 2.0)));
+    gbufferAlbedo = vec4(terrainColor, material_metalness);
+    gbufferNormal = encodeNormal(n);
+    gbufferMaterial = vec2(material_fresnel, roughness);
+#else
     // Direct illumination
     vec3 direct_illumination_term = calculateDirectIllumiunation(wo, n, terrainColor);
 
@@ -238,5 +268,5 @@ void main()
     float distance = length(viewSpacePosition);
 
     fragmentColor = vec4(shading, 1.0);
-    return;
+#endif
 }
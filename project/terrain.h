@@ -1,5 +1,7 @@
 #pragma once
 #include "Model.h"
+#include "erosion.h"
+#include "terrainquery.h"
 
 struct TerrainParams
 {
@@ -10,22 +12,62 @@ struct TerrainParams
     unsigned int seed = 0;
     float amplitude = 1.0f;
     float frequency = 0.05f;
+    // Run on the generated heights, in this order, before the normals are
+    // computed
+    DropletErosionParams dropletErosion;
+    PipeErosionParams pipeErosion;
+    ThermalErosionParams thermalErosion;
 };
 
 class Terrain
 {
 public:
     Terrain(const TerrainParams &params);
+    // Builds the terrain from params.size * params.size heights, row by row,
+    // instead of generating them from noise.
+    Terrain(const TerrainParams &params, const float *heights);
     labhelper::Model *getModel() const;
-    std::vector<std::vector<float>> getHeightMap() const;
+    int getSize() const { return params.size; }
+    const std::vector<float> &getHeightMap() const;
+    // Heights and normals between the samples, at world positions. Reads the
+    // heightmap in place, so it is only valid until the terrain changes or
+    // is deleted.
+    TerrainQuery getQuery() const
+    {
+        return TerrainQuery(heightMap.data(), params.size, params.scale);
+    }
+    // Takes rows [rowBegin, rowEnd) from a whole heightmap and re-uploads
+    // only the vertices whose positions or normals they change
+    void updateHeights(const float *heights, int rowBegin, int rowEnd);
+
+    // See labhelper::saveHeightfield() for the formats
+    bool saveHeightmap(const std::string &filename) const;
+
+    // The heights new Terrain(params) would have, without building a mesh
+    static std::vector<float> generateHeightMap(const TerrainParams &params);
+
+    // An indexed triangle list of the terrain surface that only lives on the
+    // CPU, for export. The caller deletes it.
+    labhelper::Model *createExportModel() const;
+    void saveToOBJ(const std::string &filename) const;
 
 private:
+    Terrain() : terrainModel(nullptr) {}
+
     TerrainParams params;
     labhelper::Model *terrainModel;
-    std::vector<std::vector<float>> heightMap;
+    std::vector<float> heightMap; // params.size * params.size, row by row
     static const int p[512]; // Permutation table for Perlin noise
 
-    void generateTerrain();
+    void generateHeights();
+    void erodeHeights();
+    void buildModel();
+    // Fills the vertices of triangle strips [zBegin, zEnd)
+    void fillStrips(int zBegin, int zEnd);
+    int stripStart(int z) const;
+    float height(int x, int z) const { return heightMap[z * params.size + x]; }
+    glm::vec3 vertexPosition(int x, int z) const;
+    glm::vec3 vertexNormal(int x, int z) const;
     float perlinOctaves(float x, float y, float persistance);
     float perlin(float x, float y);
     glm::vec2 grad(int x, int y);
@@ -22,6 +22,9 @@ out vec3 viewSpaceNormal;
 out vec3 viewSpacePosition;
 out float worldHeight;
 
+// Must match terrain_depth.vert bit for bit for the depth pre-pass.
+invariant gl_Position;
+
 void main()
 {
 	gl_Position = modelViewProjectionMatrix * vec4(position, 1.0);
@@ -0,0 +1,6 @@
+#version 420
+// Depth-only pass; nothing is written to the color buffers.
+
+void main()
+{
+}
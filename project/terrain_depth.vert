@@ -0,0 +1,16 @@
+#version 420
+///////////////////////////////////////////////////////////////////////////////
+// Position-only vertex shader for the terrain depth pre-pass. The position
+// must be computed exactly as in terrain.vert so that the shading pass can
+// use GL_EQUAL depth testing.
+///////////////////////////////////////////////////////////////////////////////
+layout(location = 0) in vec3 position;
+
+uniform mat4 modelViewProjectionMatrix;
+
+invariant gl_Position;
+
+void main()
+{
+	gl_Position = modelViewProjectionMatrix * vec4(position, 1.0);
+}
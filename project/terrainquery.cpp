@@ -0,0 +1,294 @@
+#include "terrainquery.h"
+#include <simd.h>
+#include <threadpool.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+
+using labhelper::simd::float4;
+using labhelper::simd::int4;
+namespace simd = labhelper::simd;
+using labhelper::forRange;
+using labhelper::hash;
+using labhelper::unitFloat;
+
+namespace
+{
+// Queries per task of a batch
+const int chunkSize = 4096;
+
+// Catmull-Rom weights of the samples at -1, 0, 1 and 2 for a point t in
+// [0, 1] past sample 0, and their derivatives
+void catmullRom(float t, float w[4], float d[4])
+{
+  float t2 = t * t, t3 = t2 * t;
+  w[0] = -0.5f * t + t2 - 0.5f * t3;
+  w[1] = 1.0f - 2.5f * t2 + 1.5f * t3;
+  w[2] = 0.5f * t + 2.0f * t2 - 1.5f * t3;
+  w[3] = -0.5f * t2 + 0.5f * t3;
+  d[0] = -0.5f + 2.0f * t - 1.5f * t2;
+  d[1] = -5.0f * t + 4.5f * t2;
+  d[2] = 0.5f + 4.0f * t - 4.5f * t2;
+  d[3] = -t + 1.5f * t2;
+}
+
+void catmullRom(float4 t, float4 w[4], float4 d[4])
+{
+  float4 t2 = t * t, t3 = t2 * t;
+  float4 half = simd::splat(0.5f), one = simd::splat(1.0f);
+  w[0] = t2 - half * t - half * t3;
+  w[1] = one - simd::splat(2.5f) * t2 + simd::splat(1.5f) * t3;
+  w[2] = half * t + simd::splat(2.0f) * t2 - simd::splat(1.5f) * t3;
+  w[3] = half * t3 - half * t2;
+  d[0] = simd::splat(2.0f) * t - half - simd::splat(1.5f) * t2;
+  d[1] = simd::splat(4.5f) * t2 - simd::splat(5.0f) * t;
+  d[2] = half + simd::splat(4.0f) * t - simd::splat(4.5f) * t2;
+  d[3] = simd::splat(1.5f) * t2 - t;
+}
+
+// The heights at four indices
+float4 gather(const float *heights, int4 index)
+{
+  int32_t i[4];
+  simd::store(i, index);
+  return simd::set(heights[i[0]], heights[i[1]], heights[i[2]],
+                   heights[i[3]]);
+}
+} // namespace
+
+TerrainQuery::TerrainQuery(const float *heights, int size, float cellSize)
+    : heights(heights), size(size), cellSize(cellSize)
+{
+}
+
+float TerrainQuery::height(float x, float z, TerrainFilter filter) const
+{
+  return sample(x, z, filter, nullptr);
+}
+
+float TerrainQuery::sample(float x, float z, TerrainFilter filter,
+                           glm::vec3 *normal) const
+{
+  // Grid coordinates, clamped to the map, split into the sample before and
+  // the fraction past it
+  float last = float(size - 1);
+  float gx = std::min(std::max(0.0f, x / cellSize + size / 2.0f), last);
+  float gz = std::min(std::max(0.0f, z / cellSize + size / 2.0f), last);
+  int i = std::min(int(gx), size - 2);
+  int j = std::min(int(gz), size - 2);
+  float fx = gx - i, fz = gz - j;
+
+  float h, slopeX, slopeZ;
+  if (filter == TerrainFilter::Bilinear)
+  {
+    const float *row = heights + j * size + i;
+    float nw = row[0], ne = row[1], sw = row[size], se = row[size + 1];
+    float north = nw + (ne - nw) * fx, south = sw + (se - sw) * fx;
+    h = north + (south - north) * fz;
+    slopeX = (ne - nw) + ((se - sw) - (ne - nw)) * fz;
+    slopeZ = south - north;
+  }
+  else
+  {
+    float wx[4], dx[4], wz[4], dz[4];
+    catmullRom(fx, wx, dx);
+    catmullRom(fz, wz, dz);
+    int columns[4];
+    for (int a = 0; a < 4; a++)
+    {
+      columns[a] = std::min(std::max(i + a - 1, 0), size - 1);
+    }
+    h = slopeX = slopeZ = 0.0f;
+    for (int b = 0; b < 4; b++)
+    {
+      const float *row = heights + std::min(std::max(j + b - 1, 0), size - 1) * size;
+      float across = 0.0f, acrossSlope = 0.0f;
+      for (int a = 0; a < 4; a++)
+      {
+        across += wx[a] * row[columns[a]];
+        acrossSlope += dx[a] * row[columns[a]];
+      }
+      h += wz[b] * across;
+      slopeX += wz[b] * acrossSlope;
+      slopeZ += dz[b] * across;
+    }
+  }
+  if (normal != nullptr)
+  {
+    *normal = glm::normalize(
+        glm::vec3(-slopeX / cellSize, 1.0f, -slopeZ / cellSize));
+  }
+  return h;
+}
+
+void TerrainQuery::sample(const float *x, const float *z, size_t count,
+                          TerrainFilter filter, float *heights,
+                          float *normalX, float *normalY, float *normalZ,
+                          labhelper::ThreadPool *pool) const
+{
+  int chunks = int((count + chunkSize - 1) / chunkSize);
+  forRange(pool, chunks, 1, [&](int begin, int end) {
+    for (int c = begin; c < end; c++)
+    {
+      size_t first = size_t(c) * chunkSize;
+      sampleRange(x, z, first, std::min(count, first + chunkSize), filter,
+                  heights, normalX, normalY, normalZ);
+    }
+  });
+}
+
+void TerrainQuery::sampleRange(const float *x, const float *z, size_t begin,
+                               size_t end, TerrainFilter filter,
+                               float *heights, float *normalX, float *normalY,
+                               float *normalZ) const
+{
+  // Divides like sample() does, so that both pick the same cell
+  float4 cell = simd::splat(cellSize);
+  float4 centre = simd::splat(size / 2.0f);
+  float4 zero = simd::splat(0.0f), last = simd::splat(float(size - 1));
+  float4 lastCell = simd::splat(float(size - 2));
+  int4 width = simd::splat(int32_t(size));
+  int4 firstIndex = simd::splat(int32_t(0));
+  int4 lastIndex = simd::splat(int32_t(size - 1));
+  size_t i = begin;
+  for (; i + 4 <= end; i += 4)
+  {
+    float4 gx = simd::clamp(simd::load(x + i) / cell + centre, zero, last);
+    float4 gz = simd::clamp(simd::load(z + i) / cell + centre, zero, last);
+    float4 cellX = simd::min(simd::floor(gx), lastCell);
+    float4 cellZ = simd::min(simd::floor(gz), lastCell);
+    float4 fx = gx - cellX, fz = gz - cellZ;
+    int4 column = simd::toInt(cellX), row = simd::toInt(cellZ);
+
+    float4 h, slopeX, slopeZ;
+    if (filter == TerrainFilter::Bilinear)
+    {
+      int4 index = row * width + column;
+      float4 nw = gather(this->heights, index);
+      float4 ne = gather(this->heights + 1, index);
+      float4 sw = gather(this->heights + size, index);
+      float4 se = gather(this->heights + size + 1, index);
+      float4 north = nw + (ne - nw) * fx, south = sw + (se - sw) * fx;
+      h = north + (south - north) * fz;
+      slopeX = (ne - nw) + ((se - sw) - (ne - nw)) * fz;
+      slopeZ = south - north;
+    }
+    else
+    {
+      float4 wx[4], dx[4], wz[4], dz[4];
+      catmullRom(fx, wx, dx);
+      catmullRom(fz, wz, dz);
+      int4 columns[4];
+      for (int a = 0; a < 4; a++)
+      {
+        columns[a] = simd::min(
+            simd::max(column + simd::splat(int32_t(a - 1)), firstIndex),
+            lastIndex);
+      }
+      h = slopeX = slopeZ = zero;
+      for (int b = 0; b < 4; b++)
+      {
+        int4 rowStart =
+            simd::min(simd::max(row + simd::splat(int32_t(b - 1)), firstIndex),
+                      lastIndex) *
+            width;
+        float4 across = zero, acrossSlope = zero;
+        for (int a = 0; a < 4; a++)
+        {
+          float4 sample = gather(this->heights, rowStart + columns[a]);
+          across = across + wx[a] * sample;
+          acrossSlope = acrossSlope + dx[a] * sample;
+        }
+        h = h + wz[b] * across;
+        slopeX = slopeX + wz[b] * acrossSlope;
+        slopeZ = slopeZ + dz[b] * across;
+      }
+    }
+    simd::store(heights + i, h);
+    if (normalX != nullptr)
+    {
+      float4 nx = -slopeX / cell, nz = -slopeZ / cell;
+      float4 inverseLength =
+          simd::splat(1.0f) /
+          simd::sqrt(nx * nx + nz * nz + simd::splat(1.0f));
+      simd::store(normalX + i, nx * inverseLength);
+      simd::store(normalY + i, inverseLength);
+      simd::store(normalZ + i, nz * inverseLength);
+    }
+  }
+  for (; i < end; i++)
+  {
+    glm::vec3 normal;
+    heights[i] = sample(x[i], z[i], filter, normalX != nullptr ? &normal : nullptr);
+    if (normalX != nullptr)
+    {
+      normalX[i] = normal.x;
+      normalY[i] = normal.y;
+      normalZ[i] = normal.z;
+    }
+  }
+}
+
+void benchmarkTerrainQueries(const std::vector<float> &heights, int size,
+                             float cellSize)
+{
+  const int count = 1 << 20;
+  std::vector<float> x(count), z(count);
+  float extent = size * cellSize;
+  for (int i = 0; i < count; i++)
+  {
+    x[i] = (unitFloat(hash(i, 0)) - 0.5f) * extent;
+    z[i] = (unitFloat(hash(i, 1)) - 0.5f) * extent;
+  }
+  TerrainQuery query(heights.data(), size, cellSize);
+  labhelper::ThreadPool &pool = labhelper::ThreadPool::global();
+  std::cout << "Terrain queries on " << size << "x" << size << ", " << count
+            << " random positions:\n";
+  const char *names[] = {"bilinear", "bicubic"};
+  for (TerrainFilter filter : {TerrainFilter::Bilinear, TerrainFilter::Bicubic})
+  {
+    std::vector<float> h(count), nx(count), ny(count), nz(count);
+    auto startTime = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < count; i++)
+    {
+      glm::vec3 normal;
+      h[i] = query.sample(x[i], z[i], filter, &normal);
+      nx[i] = normal.x;
+      ny[i] = normal.y;
+      nz[i] = normal.z;
+    }
+    std::chrono::duration<float, std::milli> singleMs =
+        std::chrono::high_resolution_clock::now() - startTime;
+
+    std::vector<float> bh(count), bx(count), by(count), bz(count);
+    startTime = std::chrono::high_resolution_clock::now();
+    query.sample(x.data(), z.data(), count, filter, bh.data(), bx.data(),
+                 by.data(), bz.data());
+    std::chrono::duration<float, std::milli> batchedMs =
+        std::chrono::high_resolution_clock::now() - startTime;
+
+    startTime = std::chrono::high_resolution_clock::now();
+    query.sample(x.data(), z.data(), count, filter, bh.data(), bx.data(),
+                 by.data(), bz.data(), &pool);
+    std::chrono::duration<float, std::milli> pooledMs =
+        std::chrono::high_resolution_clock::now() - startTime;
+
+    float heightError = 0.0f, normalError = 0.0f;
+    for (int i = 0; i < count; i++)
+    {
+      heightError = std::max(heightError, std::abs(bh[i] - h[i]));
+      normalError = std::max(
+          normalError, glm::length(glm::vec3(bx[i] - nx[i], by[i] - ny[i],
+                                             bz[i] - nz[i])));
+    }
+    std::cout << "  " << names[int(filter)] << ": single "
+              << count / (singleMs.count() * 1000.0) << ", batched "
+              << count / (batchedMs.count() * 1000.0) << ", batched on "
+              << pool.size() + 1 << " threads "
+              << count / (pooledMs.count() * 1000.0)
+              << " million queries/s, largest difference " << heightError
+              << " in height, " << normalError << " in normal\n";
+  }
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstddef>
+#include <vector>
+
+namespace labhelper
+{
+class ThreadPool;
+}
+
+enum class TerrainFilter
+{
+    Bilinear, // Between the four nearest samples
+    Bicubic, // Catmull-Rom through the sixteen nearest, smooth normals
+};
+
+// Heights and normals at world positions on a size * size heightmap with
+// cellSize between samples, centred on the origin like the terrain, so
+// sample (i, j) is at x = (i - size / 2) * cellSize, z = (j - size / 2) *
+// cellSize. Positions off the map get the height of its nearest edge.
+//
+// Only reads the heights, which it does not own, so any number of threads
+// can query at once, as long as nothing changes the heights meanwhile.
+class TerrainQuery
+{
+public:
+    TerrainQuery(const float *heights, int size, float cellSize);
+
+    float height(float x, float z,
+                 TerrainFilter filter = TerrainFilter::Bilinear) const;
+    // The height, and the unit normal in normal if it is not null
+    float sample(float x, float z, TerrainFilter filter,
+                 glm::vec3 *normal) const;
+
+    // Samples count positions (x[i], z[i]) four at a time, on the threads of
+    // pool, or only on the calling thread if pool is null. The normals are
+    // left out if normalX is null, otherwise all three must be given. Gives
+    // the same results as sample(), up to rounding.
+    void sample(const float *x, const float *z, size_t count,
+                TerrainFilter filter, float *heights, float *normalX,
+                float *normalY, float *normalZ,
+                labhelper::ThreadPool *pool = nullptr) const;
+
+private:
+    void sampleRange(const float *x, const float *z, size_t begin, size_t end,
+                     TerrainFilter filter, float *heights, float *normalX,
+                     float *normalY, float *normalZ) const;
+
+    const float *heights;
+    int size;
+    float cellSize;
+};
+
+// Prints queries per second of single and batched calls with both filters,
+// at random positions over the map, and the largest difference between
+// them.
+void benchmarkTerrainQueries(const std::vector<float> &heights, int size,
+                             float cellSize);
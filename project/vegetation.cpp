@@ -0,0 +1,407 @@
+#include "vegetation.h"
+#include "climate.h"
+#include <threadpool.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+using labhelper::forRange;
+using labhelper::hash;
+using labhelper::unitFloat;
+
+namespace
+{
+const uint8_t noType = 255;
+
+// Candidates in heightmap samples, at most one per cell. The cells are
+// spacing / sqrt(2) wide, so a point can only be too close to points in
+// the 5x5 cells around its own, less the corners. The grid has a ring of
+// two empty cells around it, so those need no bounds checks.
+class Sampler
+{
+public:
+  Sampler(const std::vector<float> &heights, int size, float cellSize,
+          const VegetationParams &params)
+      : heights(heights), size(size), cellSize(cellSize),
+        radius(params.spacing / cellSize),
+        cellSide(radius / std::sqrt(2.0f)),
+        cells(int(std::ceil((size - 1) / cellSide))),
+        tileCells(std::max(2, params.tileCells)),
+        tiles((cells + tileCells - 1) / tileCells), stride(cells + 4),
+        points(size_t(stride) * stride * 2, nowhere)
+  {
+    // Nearest first, as those are the likeliest to reject a dart, so the
+    // first eight are the cells next to it
+    for (int dy = -2; dy <= 2; dy++)
+    {
+      for (int dx = -2; dx <= 2; dx++)
+      {
+        if ((dx != 0 || dy != 0) && (std::abs(dx) != 2 || std::abs(dy) != 2))
+        {
+          neighbours.push_back(dy * stride + dx);
+        }
+      }
+    }
+    std::stable_sort(neighbours.begin(), neighbours.end(),
+                     [&](int a, int b) { return gap(a) < gap(b); });
+  }
+
+  // Empty cells hold a point too far away to reject anything
+  static constexpr float nowhere = -1e6f;
+
+  const std::vector<float> &heights;
+  int size;
+  float cellSize;
+  float radius;
+  float cellSide;
+  int cells; // Per side, not counting the ring
+  int tileCells;
+  int tiles; // Per side
+  int stride;
+  // x and y of the point in each cell
+  std::vector<float> points;
+  std::vector<int> neighbours; // Offsets to the cells a point may be near
+
+  size_t cell(int cx, int cy) const
+  {
+    return size_t(cy + 2) * stride + cx + 2;
+  }
+
+  void tileCellRange(int tile, int &x0, int &y0, int &x1, int &y1) const
+  {
+    x0 = tile % tiles * tileCells;
+    y0 = tile / tiles * tileCells;
+    x1 = std::min(cells, x0 + tileCells);
+    y1 = std::min(cells, y0 + tileCells);
+  }
+
+  void sampleTile(int tile, int attempts, uint32_t seed)
+  {
+    int x0, y0, x1, y1;
+    tileCellRange(tile, x0, y0, x1, y1);
+    // Hashes of a counter rather than std::mt19937, which took most of the
+    // time for the darts
+    uint32_t tileSeed =
+        hash(hash(seed, uint32_t(tile / tiles)), uint32_t(tile % tiles));
+    uint32_t counter = 0;
+    float limit = float(size - 1);
+    for (int cy = y0; cy < y1; cy++)
+    {
+      for (int cx = x0; cx < x1; cx++)
+      {
+        size_t c = cell(cx, cy);
+        if (covered(cx, cy, c))
+        {
+          continue;
+        }
+        for (int i = 0; i < attempts; i++)
+        {
+          float x = (cx + unitFloat(hash(tileSeed, counter++))) * cellSide;
+          float y = (cy + unitFloat(hash(tileSeed, counter++))) * cellSide;
+          if (x < limit && y < limit && !tooClose(x, y, c))
+          {
+            points[2 * c] = x;
+            points[2 * c + 1] = y;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  void heightAndSteepness(float x, float y, float &height,
+                          float &steepness) const
+  {
+    int ix = std::min(int(x), size - 2), iy = std::min(int(y), size - 2);
+    float u = x - ix, v = y - iy;
+    size_t i = size_t(iy) * size + ix;
+    float nw = heights[i], ne = heights[i + 1];
+    float sw = heights[i + size], se = heights[i + size + 1];
+    float slopeX = ((ne - nw) * (1 - v) + (se - sw) * v) / cellSize;
+    float slopeY = ((sw - nw) * (1 - u) + (se - ne) * u) / cellSize;
+    height = nw * (1 - u) * (1 - v) + ne * u * (1 - v) + sw * (1 - u) * v +
+             se * u * v;
+    steepness =
+        1.0f - 1.0f / std::sqrt(1.0f + slopeX * slopeX + slopeY * slopeY);
+  }
+
+private:
+  // Least squared distance, in cells, between the cells offset apart
+  int gap(int offset) const
+  {
+    int dy = (offset + 2 * stride + 2) / stride - 2;
+    int dx = offset - dy * stride;
+    int gx = std::max(0, std::abs(dx) - 1), gy = std::max(0, std::abs(dy) - 1);
+    return gx * gx + gy * gy;
+  }
+
+  // Whether a point next to the cell is too close to all of it, in which
+  // case no dart could land
+  bool covered(int cx, int cy, size_t c) const
+  {
+    float radius2 = radius * radius;
+    float x0 = cx * cellSide, y0 = cy * cellSide;
+    float x1 = x0 + cellSide, y1 = y0 + cellSide;
+    const float *point = &points[2 * c];
+    for (int i = 0; i < 8; i++)
+    {
+      float px = point[2 * neighbours[i]], py = point[2 * neighbours[i] + 1];
+      float ex = std::max(std::abs(px - x0), std::abs(px - x1));
+      float ey = std::max(std::abs(py - y0), std::abs(py - y1));
+      if (ex * ex + ey * ey < radius2)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool tooClose(float x, float y, size_t c) const
+  {
+    float radius2 = radius * radius;
+    const float *point = &points[2 * c];
+    for (int offset : neighbours)
+    {
+      float ex = point[2 * offset] - x, ey = point[2 * offset + 1] - y;
+      if (ex * ex + ey * ey < radius2)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+constexpr float Sampler::nowhere;
+} // namespace
+
+std::vector<VegetationType> defaultVegetationTypes()
+{
+  std::vector<VegetationType> types(4);
+  types[0].name = "Tree";
+  types[0].biome = 1;
+  types[0].maxSteepness = 0.15f;
+  types[0].density = 0.3f;
+  types[0].minScale = 0.8f;
+  types[0].maxScale = 1.4f;
+  types[1].name = "Bush";
+  types[1].biome = 1;
+  types[1].minCover = 0.3f;
+  types[1].maxSteepness = 0.25f;
+  types[1].density = 0.4f;
+  types[1].minScale = 0.5f;
+  types[1].maxScale = 1.0f;
+  types[2].name = "Shrub";
+  types[2].biome = 0;
+  types[2].maxSteepness = 0.2f;
+  types[2].density = 0.1f;
+  types[2].minScale = 0.4f;
+  types[2].maxScale = 0.8f;
+  types[3].name = "Boulder";
+  types[3].biome = 2;
+  types[3].minCover = 0.25f;
+  types[3].maxSteepness = 1.0f;
+  types[3].density = 0.2f;
+  types[3].minScale = 0.5f;
+  types[3].maxScale = 2.0f;
+  return types;
+}
+
+int64_t placeVegetation(const std::vector<float> &heights, int size,
+                        float cellSize, const ClimateMap *climate,
+                        const VegetationParams &params, unsigned int seed,
+                        VegetationInstances &instances,
+                        labhelper::ThreadPool *pool)
+{
+  instances = VegetationInstances();
+  if (size < 2 || params.spacing <= 0.0f)
+  {
+    return 0;
+  }
+  if (climate != nullptr && climate->size == 0)
+  {
+    climate = nullptr;
+  }
+  Sampler sampler(heights, size, cellSize, params);
+  int tiles = sampler.tiles;
+
+  // Sampling, a quarter of the tiles at a time
+  for (int colour = 0; colour < 4; colour++)
+  {
+    std::vector<int> colourTiles;
+    for (int ty = colour / 2; ty < tiles; ty += 2)
+    {
+      for (int tx = colour % 2; tx < tiles; tx += 2)
+      {
+        colourTiles.push_back(ty * tiles + tx);
+      }
+    }
+    forRange(pool, int(colourTiles.size()), 1, [&](int begin, int end) {
+      for (int i = begin; i < end; i++)
+      {
+        sampler.sampleTile(colourTiles[i], params.attempts, seed);
+      }
+    });
+  }
+
+  // The type of each candidate, from hashes of the cell rather than the
+  // tile's random numbers so that it does not depend on the sampling order
+  int typeCount = std::min(int(params.types.size()), int(noType));
+  std::vector<uint8_t> cellType(size_t(sampler.cells) * sampler.cells, noType);
+  std::vector<int64_t> candidates(size_t(tiles) * tiles);
+  std::vector<size_t> offsets(size_t(tiles) * tiles + 1, 0);
+  forRange(pool, tiles * tiles, 4, [&](int begin, int end) {
+    for (int tile = begin; tile < end; tile++)
+    {
+      int x0, y0, x1, y1;
+      sampler.tileCellRange(tile, x0, y0, x1, y1);
+      int64_t sampled = 0;
+      size_t placed = 0;
+      for (int cy = y0; cy < y1; cy++)
+      {
+        for (int cx = x0; cx < x1; cx++)
+        {
+          size_t c = size_t(cy) * sampler.cells + cx;
+          size_t p = sampler.cell(cx, cy);
+          float x = sampler.points[2 * p], y = sampler.points[2 * p + 1];
+          if (x < 0.0f)
+          {
+            continue;
+          }
+          sampled++;
+          float height, steepness;
+          sampler.heightAndSteepness(x, y, height, steepness);
+          const uint8_t *cover = nullptr;
+          if (climate != nullptr)
+          {
+            int n = climate->size;
+            int sx = std::min(n - 1, int(x * n / size));
+            int sy = std::min(n - 1, int(y * n / size));
+            cover = &climate->weights[(size_t(sy) * n + sx) * 4];
+          }
+          float choice = unitFloat(hash(seed, uint32_t(c)));
+          float share = 0.0f;
+          for (int t = 0; t < typeCount; t++)
+          {
+            const VegetationType &type = params.types[t];
+            float weight = cover != nullptr ? cover[type.biome & 3] / 255.0f
+                                            : 1.0f;
+            if (height < type.minHeight || height > type.maxHeight ||
+                steepness > type.maxSteepness || weight < type.minCover)
+            {
+              continue;
+            }
+            share += type.density * weight;
+            if (choice < share)
+            {
+              cellType[c] = uint8_t(t);
+              placed++;
+              break;
+            }
+          }
+        }
+      }
+      candidates[tile] = sampled;
+      offsets[tile + 1] = placed;
+    }
+  });
+  int64_t sampled = 0;
+  for (int tile = 0; tile < tiles * tiles; tile++)
+  {
+    sampled += candidates[tile];
+    offsets[tile + 1] += offsets[tile];
+  }
+
+  // Instances in the order of the tiles, each tile written by one thread
+  size_t count = offsets.back();
+  instances.x.resize(count);
+  instances.y.resize(count);
+  instances.z.resize(count);
+  instances.rotation.resize(count);
+  instances.scale.resize(count);
+  instances.type.resize(count);
+  float centre = size / 2.0f;
+  forRange(pool, tiles * tiles, 4, [&](int begin, int end) {
+    for (int tile = begin; tile < end; tile++)
+    {
+      int x0, y0, x1, y1;
+      sampler.tileCellRange(tile, x0, y0, x1, y1);
+      size_t out = offsets[tile];
+      for (int cy = y0; cy < y1; cy++)
+      {
+        for (int cx = x0; cx < x1; cx++)
+        {
+          size_t c = size_t(cy) * sampler.cells + cx;
+          if (cellType[c] == noType)
+          {
+            continue;
+          }
+          const VegetationType &type = params.types[cellType[c]];
+          size_t p = sampler.cell(cx, cy);
+          float x = sampler.points[2 * p], y = sampler.points[2 * p + 1];
+          float height, steepness;
+          sampler.heightAndSteepness(x, y, height, steepness);
+          uint32_t h = hash(hash(seed, uint32_t(c)), 1u);
+          instances.x[out] = (x - centre) * cellSize;
+          instances.y[out] = height;
+          instances.z[out] = (y - centre) * cellSize;
+          instances.rotation[out] = unitFloat(h) * 6.2831853f;
+          instances.scale[out] =
+              type.minScale + (type.maxScale - type.minScale) *
+                                  unitFloat(hash(h, 2u));
+          instances.type[out] = cellType[c];
+          out++;
+        }
+      }
+    }
+  });
+  return sampled;
+}
+
+void benchmarkVegetation(const std::vector<float> &heights, int size,
+                         float cellSize, const ClimateMap *climate,
+                         const VegetationParams &params, unsigned int seed)
+{
+  int maxThreads = std::max(4, int(std::thread::hardware_concurrency()));
+  std::cout << "Vegetation on " << size << "x" << size << ", spacing "
+            << params.spacing << ":\n";
+  VegetationInstances reference;
+  float singleThreadMs = 0.0f;
+  for (int threads = 1; threads <= maxThreads; threads *= 2)
+  {
+    std::unique_ptr<labhelper::ThreadPool> pool;
+    if (threads > 1)
+    {
+      pool.reset(new labhelper::ThreadPool(threads - 1));
+    }
+    VegetationInstances instances;
+    auto startTime = std::chrono::high_resolution_clock::now();
+    int64_t candidates = placeVegetation(heights, size, cellSize, climate,
+                                         params, seed, instances, pool.get());
+    std::chrono::duration<float, std::milli> elapsed =
+        std::chrono::high_resolution_clock::now() - startTime;
+    bool identical = true;
+    if (threads == 1)
+    {
+      reference = instances;
+      singleThreadMs = elapsed.count();
+    }
+    else
+    {
+      identical = instances.x == reference.x && instances.y == reference.y &&
+                  instances.z == reference.z &&
+                  instances.rotation == reference.rotation &&
+                  instances.scale == reference.scale &&
+                  instances.type == reference.type;
+    }
+    std::cout << "  " << threads << " threads: " << elapsed.count() << " ms, "
+              << candidates << " candidates, "
+              << candidates / (elapsed.count() * 1000.0)
+              << " million candidates/s, " << instances.size()
+              << " instances, speedup " << singleThreadMs / elapsed.count()
+              << (identical ? "" : ", DIFFERENT RESULT") << "\n";
+  }
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace labhelper
+{
+class ThreadPool;
+}
+struct ClimateMap;
+
+// Vegetation scattered over the terrain with Poisson-disk sampling: no two
+// candidate points are closer than the spacing, and each candidate becomes
+// an instance of at most one type, depending on its height, slope and the
+// climate where it stands.
+//
+// The candidates are thrown as darts into a grid of cells small enough to
+// hold one point each. The grid is split into tiles, which are sampled in
+// four passes, one for each corner of a 2x2 block of tiles, so that the
+// tiles sampled at the same time are a tile apart and never read or write
+// the same cells. Each tile has its own random numbers, seeded from the
+// seed and the tile, and sees the same neighbours whichever thread samples
+// it, so the result does not depend on the number of threads.
+struct VegetationType
+{
+    const char *name = "";
+    // Only placed where the climate weight of biome (sand, grass, rock and
+    // snow, see ClimateMap) is at least minCover, between the heights, and
+    // where 1 minus the y of the normal is at most maxSteepness
+    int biome = 1;
+    float minCover = 0.5f;
+    float minHeight = -1000.0f;
+    float maxHeight = 1000.0f;
+    float maxSteepness = 0.3f;
+    // Share of the candidates it takes where fully covered by its biome. The
+    // types are tried in order, so the shares should not sum to more than 1.
+    float density = 0.5f;
+    float minScale = 0.8f;
+    float maxScale = 1.2f;
+};
+
+// Trees, bushes, desert shrubs and boulders
+std::vector<VegetationType> defaultVegetationTypes();
+
+struct VegetationParams
+{
+    float spacing = 2.0f; // Least distance between candidates
+    int attempts = 8; // Darts thrown at each grid cell
+    int tileCells = 32; // Grid cells per tile side, at least 2
+    std::vector<VegetationType> types = defaultVegetationTypes();
+};
+
+// One array per attribute, for uploading and culling
+struct VegetationInstances
+{
+    // World position, on the ground
+    std::vector<float> x, y, z;
+    std::vector<float> rotation; // About the y axis, in radians
+    std::vector<float> scale;
+    std::vector<uint8_t> type; // Index into VegetationParams::types
+
+    size_t size() const { return type.size(); }
+};
+
+// Places vegetation on a size * size heightmap with cellSize between
+// samples, centred on the origin like the terrain, on the threads of pool,
+// or only on the calling thread if pool is null. Biomes are taken from
+// climate, or every biome covers everything if it is null. Returns the
+// number of candidates sampled.
+int64_t placeVegetation(const std::vector<float> &heights, int size,
+                        float cellSize, const ClimateMap *climate,
+                        const VegetationParams &params, unsigned int seed,
+                        VegetationInstances &instances,
+                        labhelper::ThreadPool *pool);
+
+// Places vegetation with 1, 2, 4... threads up to the hardware thread count
+// (at least 4), and prints candidates per second, the number of instances,
+// and whether every thread count gave the same instances.
+void benchmarkVegetation(const std::vector<float> &heights, int size,
+                         float cellSize, const ClimateMap *climate,
+                         const VegetationParams &params, unsigned int seed);
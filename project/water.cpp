@@ -0,0 +1,520 @@
+#include "water.h"
+#include <simd.h>
+#include <threadpool.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
+
+using labhelper::forRange;
+
+namespace
+{
+namespace simd = labhelper::simd;
+
+// The stencils are written once for V = float and V = simd::float4, like
+// the grid erosion ones, so the last few cells of each tile row run the
+// same code one at a time
+using simd::loadAs;
+using simd::splatAs;
+using simd::storeTo;
+using simd::maxOf;
+using simd::select;
+using simd::any;
+
+struct Grids
+{
+  float *terrain, *water;
+  float *fluxLeft, *fluxRight, *fluxUp, *fluxDown;
+  float *velocityX, *velocityY;
+  int size, stride;
+};
+
+// Runs kernel on the cells of tile (tileX, tileY) and returns whether it
+// returned true for any
+template <class Kernel>
+bool forTile(const Kernel &kernel, const Grids &grids, int tileX, int tileY)
+{
+  const int tileSize = ShallowWater::tileSize;
+  int xBegin = tileX * tileSize, xEnd = std::min(grids.size, xBegin + tileSize);
+  int yBegin = tileY * tileSize, yEnd = std::min(grids.size, yBegin + tileSize);
+  bool result = false;
+  for (int y = yBegin; y < yEnd; y++)
+  {
+    int row = (y + 1) * grids.stride + 1;
+    int x = xBegin;
+    for (; x + 4 <= xEnd; x += 4)
+    {
+      result |= kernel.template run<simd::float4>(row + x);
+    }
+    for (; x < xEnd; x++)
+    {
+      result |= kernel.template run<float>(row + x);
+    }
+  }
+  return result;
+}
+
+// Outflow towards each neighbour, accelerated by the difference in water
+// surface and scaled down where it would take more water than there is
+struct FluxKernel
+{
+  Grids g;
+  float flowFactor, keep, rainStep, cellArea, timeStep;
+
+  template <class V> bool run(int i) const
+  {
+    int s = g.stride;
+    V zero = splatAs<V>(0.0f);
+    V k = splatAs<V>(flowFactor);
+    V kept = splatAs<V>(keep);
+    V water = loadAs<V>(g.water + i);
+    V surface = loadAs<V>(g.terrain + i) + water;
+    V left = maxOf(zero, kept * loadAs<V>(g.fluxLeft + i) +
+                             k * (surface - loadAs<V>(g.terrain + i - 1) -
+                                  loadAs<V>(g.water + i - 1)));
+    V right = maxOf(zero, kept * loadAs<V>(g.fluxRight + i) +
+                              k * (surface - loadAs<V>(g.terrain + i + 1) -
+                                   loadAs<V>(g.water + i + 1)));
+    V up = maxOf(zero, kept * loadAs<V>(g.fluxUp + i) +
+                           k * (surface - loadAs<V>(g.terrain + i - s) -
+                                loadAs<V>(g.water + i - s)));
+    V down = maxOf(zero, kept * loadAs<V>(g.fluxDown + i) +
+                             k * (surface - loadAs<V>(g.terrain + i + s) -
+                                  loadAs<V>(g.water + i + s)));
+    V available = (water + splatAs<V>(rainStep)) * splatAs<V>(cellArea);
+    V outflow = (left + right + up + down) * splatAs<V>(timeStep);
+    V scale = select(outflow > available,
+                     available / maxOf(outflow, splatAs<V>(1e-20f)),
+                     splatAs<V>(1.0f));
+    storeTo(g.fluxLeft + i, left * scale);
+    storeTo(g.fluxRight + i, right * scale);
+    storeTo(g.fluxUp + i, up * scale);
+    storeTo(g.fluxDown + i, down * scale);
+    return false;
+  }
+};
+
+// Closes the pipes from the edge cells of tile (tileX, tileY) into the
+// neighbouring tiles that are not stepped, which would never take the water
+// in. The rest of the outflow of those cells was scaled with the closed
+// pipe counted, so it can only be a little smaller than needed.
+void closeEdges(const Grids &g, const std::vector<uint8_t> &stepped,
+                int tiles, int tileX, int tileY)
+{
+  const int tileSize = ShallowWater::tileSize;
+  int xBegin = tileX * tileSize, xEnd = std::min(g.size, xBegin + tileSize);
+  int yBegin = tileY * tileSize, yEnd = std::min(g.size, yBegin + tileSize);
+  size_t tile = size_t(tileY) * tiles + tileX;
+  if (tileX > 0 && !stepped[tile - 1])
+  {
+    for (int y = yBegin; y < yEnd; y++)
+    {
+      g.fluxLeft[size_t(y + 1) * g.stride + xBegin + 1] = 0.0f;
+    }
+  }
+  if (tileX + 1 < tiles && !stepped[tile + 1])
+  {
+    for (int y = yBegin; y < yEnd; y++)
+    {
+      g.fluxRight[size_t(y + 1) * g.stride + xEnd] = 0.0f;
+    }
+  }
+  if (tileY > 0 && !stepped[tile - tiles])
+  {
+    std::fill_n(g.fluxUp + size_t(yBegin + 1) * g.stride + xBegin + 1,
+                xEnd - xBegin, 0.0f);
+  }
+  if (tileY + 1 < tiles && !stepped[tile + tiles])
+  {
+    std::fill_n(g.fluxDown + size_t(yEnd) * g.stride + xBegin + 1,
+                xEnd - xBegin, 0.0f);
+  }
+}
+
+// New depth and velocity from the flow. Returns whether a depth moved, or
+// would move, by more than threshold in this step.
+struct DepthKernel
+{
+  Grids g;
+  float rainStep, timeStep, cellArea, cellSize, minDepth, evaporation;
+  float threshold;
+
+  template <class V> bool run(int i) const
+  {
+    int s = g.stride;
+    V left = loadAs<V>(g.fluxLeft + i), right = loadAs<V>(g.fluxRight + i);
+    V up = loadAs<V>(g.fluxUp + i), down = loadAs<V>(g.fluxDown + i);
+    V fromLeft = loadAs<V>(g.fluxRight + i - 1);
+    V fromRight = loadAs<V>(g.fluxLeft + i + 1);
+    V fromUp = loadAs<V>(g.fluxDown + i - s);
+    V fromDown = loadAs<V>(g.fluxUp + i + s);
+    V previous = loadAs<V>(g.water + i);
+    V before = previous + splatAs<V>(rainStep);
+    V outflow = left + right + up + down;
+    V netFlow = fromLeft + fromRight + fromUp + fromDown - outflow;
+    V zero = splatAs<V>(0.0f);
+    V after = maxOf(zero, before + netFlow * splatAs<V>(timeStep / cellArea)) *
+              splatAs<V>(evaporation);
+    storeTo(g.water + i, after);
+
+    V half = splatAs<V>(0.5f);
+    V depth = (before + after) * half;
+    V flowX = (fromLeft - left + right - fromRight) * half;
+    V flowY = (fromUp - up + down - fromDown) * half;
+    V shallow = splatAs<V>(minDepth);
+    V crossSection = maxOf(depth, shallow) * splatAs<V>(cellSize);
+    auto wet = depth > shallow;
+    storeTo(g.velocityX + i, select(wet, flowX / crossSection, zero));
+    storeTo(g.velocityY + i, select(wet, flowY / crossSection, zero));
+
+    // A river keeps its depth while water runs through it, so the water
+    // leaving counts as movement too
+    V moved = maxOf(after - previous, previous - after);
+    V leaving = outflow * splatAs<V>(timeStep / cellArea);
+    return any(maxOf(moved, leaving) > splatAs<V>(threshold));
+  }
+};
+
+// Takes the flow out of the pipes of a calm tile
+struct CalmKernel
+{
+  Grids g;
+
+  template <class V> bool run(int i) const
+  {
+    V zero = splatAs<V>(0.0f);
+    storeTo(g.fluxLeft + i, zero);
+    storeTo(g.fluxRight + i, zero);
+    storeTo(g.fluxUp + i, zero);
+    storeTo(g.fluxDown + i, zero);
+    storeTo(g.velocityX + i, zero);
+    storeTo(g.velocityY + i, zero);
+    return false;
+  }
+};
+
+const float noFlow = 1e30f;
+} // namespace
+
+ShallowWater::ShallowWater(const std::vector<float> &heights, int size,
+                           float cellSize, float seaLevel,
+                           const ShallowWaterParams &params)
+    : params(params), size(size), stride(size + 2),
+      tiles((size + tileSize - 1) / tileSize), cellSize(cellSize)
+{
+  size_t cells = size_t(stride) * (size + 2);
+  terrain.resize(cells, 0.0f);
+  water.resize(cells, 0.0f);
+  fluxLeft.resize(cells, 0.0f);
+  fluxRight.resize(cells, 0.0f);
+  fluxUp.resize(cells, 0.0f);
+  fluxDown.resize(cells, 0.0f);
+  velocityX.resize(cells, 0.0f);
+  velocityY.resize(cells, 0.0f);
+  calmSteps.resize(size_t(tiles) * tiles, 0);
+  stepped.resize(size_t(tiles) * tiles, 0);
+  moved.resize(size_t(tiles) * tiles, 0);
+  changedRows.resize(size, 1);
+  for (int y = 0; y < size; y++)
+  {
+    for (int x = 0; x < size; x++)
+    {
+      size_t i = size_t(y + 1) * stride + x + 1;
+      terrain[i] = heights[size_t(y) * size + x];
+      water[i] = std::max(0.0f, seaLevel - terrain[i]);
+    }
+  }
+  // Water never flows into the ring around the heightmap, as its surface
+  // is always higher
+  for (int x = 0; x < stride; x++)
+  {
+    water[x] = noFlow;
+    water[size_t(size + 1) * stride + x] = noFlow;
+  }
+  for (int y = 0; y < size + 2; y++)
+  {
+    water[size_t(y) * stride] = noFlow;
+    water[size_t(y) * stride + size + 1] = noFlow;
+  }
+}
+
+void ShallowWater::step(int iterations, labhelper::ThreadPool *pool)
+{
+  auto startTime = std::chrono::high_resolution_clock::now();
+  Grids grids = {terrain.data(),   water.data(),     fluxLeft.data(),
+                 fluxRight.data(), fluxUp.data(),    fluxDown.data(),
+                 velocityX.data(), velocityY.data(), size,
+                 stride};
+  FluxKernel flux;
+  flux.g = grids;
+  flux.flowFactor = params.timeStep * params.pipeArea * params.gravity / cellSize;
+  flux.keep = std::max(0.0f, 1.0f - params.friction * params.timeStep);
+  flux.rainStep = params.rain * params.timeStep;
+  flux.cellArea = cellSize * cellSize;
+  flux.timeStep = params.timeStep;
+  DepthKernel depth;
+  depth.g = grids;
+  depth.rainStep = flux.rainStep;
+  depth.timeStep = params.timeStep;
+  depth.cellArea = flux.cellArea;
+  depth.cellSize = cellSize;
+  depth.minDepth = 1e-4f;
+  depth.evaporation =
+      std::max(0.0f, 1.0f - params.evaporation * params.timeStep);
+  depth.threshold = params.sleepThreshold;
+  CalmKernel calm;
+  calm.g = grids;
+  int sleepSteps = std::max(1, std::min(255, params.sleepSteps));
+
+  std::vector<int> active;
+  lastStepCells = 0;
+  lastStepTiles = 0;
+  for (int i = 0; i < iterations; i++)
+  {
+    if (params.rain > 0.0f)
+    {
+      std::fill(calmSteps.begin(), calmSteps.end(), 0);
+    }
+    // Tiles that are awake, and their neighbours, which they may flow into
+    std::fill(stepped.begin(), stepped.end(), 0);
+    for (int ty = 0; ty < tiles; ty++)
+    {
+      for (int tx = 0; tx < tiles; tx++)
+      {
+        if (calmSteps[size_t(ty) * tiles + tx] >= sleepSteps)
+        {
+          continue;
+        }
+        for (int y = std::max(0, ty - 1); y <= std::min(tiles - 1, ty + 1); y++)
+        {
+          for (int x = std::max(0, tx - 1); x <= std::min(tiles - 1, tx + 1);
+               x++)
+          {
+            stepped[size_t(y) * tiles + x] = 1;
+          }
+        }
+      }
+    }
+    active.clear();
+    for (int t = 0; t < tiles * tiles; t++)
+    {
+      if (stepped[t])
+      {
+        active.push_back(t);
+      }
+    }
+
+    // Each stage reads neighbours the stage before wrote, so every stage
+    // finishes on all tiles before the next one starts. No water flows into
+    // a tile that is not stepped, as its depth is not updated.
+    int count = int(active.size());
+    forRange(pool, count, 4, [&](int begin, int end) {
+      for (int k = begin; k < end; k++)
+      {
+        forTile(flux, grids, active[k] % tiles, active[k] / tiles);
+        closeEdges(grids, stepped, tiles, active[k] % tiles, active[k] / tiles);
+      }
+    });
+    forRange(pool, count, 4, [&](int begin, int end) {
+      for (int k = begin; k < end; k++)
+      {
+        moved[active[k]] =
+            forTile(depth, grids, active[k] % tiles, active[k] / tiles);
+      }
+    });
+    // The flow is taken out of tiles as they fall asleep, and out of
+    // sleeping tiles next to awake ones after every step, so no water is in
+    // flight in a tile that is not stepped
+    forRange(pool, count, 4, [&](int begin, int end) {
+      for (int k = begin; k < end; k++)
+      {
+        int t = active[k];
+        calmSteps[t] =
+            moved[t] ? 0 : uint8_t(std::min(sleepSteps, calmSteps[t] + 1));
+        if (calmSteps[t] >= sleepSteps)
+        {
+          forTile(calm, grids, t % tiles, t / tiles);
+        }
+      }
+    });
+
+    for (int t : active)
+    {
+      int rowBegin = (t / tiles) * tileSize;
+      int rowEnd = std::min(size, rowBegin + tileSize);
+      std::fill(changedRows.begin() + rowBegin, changedRows.begin() + rowEnd,
+                1);
+      lastStepCells += (std::min(size, (t % tiles + 1) * tileSize) -
+                        (t % tiles) * tileSize) *
+                       (rowEnd - rowBegin);
+    }
+    lastStepTiles += count;
+  }
+  cellsStepped += lastStepCells;
+  std::chrono::duration<float, std::milli> elapsed =
+      std::chrono::high_resolution_clock::now() - startTime;
+  if (iterations > 0)
+  {
+    lastStepMs = elapsed.count() / iterations;
+    lastStepCells /= iterations;
+    lastStepTiles /= iterations;
+  }
+}
+
+int ShallowWater::stepFor(float budgetMs, labhelper::ThreadPool *pool)
+{
+  auto startTime = std::chrono::high_resolution_clock::now();
+  int steps = 0;
+  float elapsedMs = 0.0f;
+  do
+  {
+    step(1, pool);
+    steps++;
+    std::chrono::duration<float, std::milli> elapsed =
+        std::chrono::high_resolution_clock::now() - startTime;
+    elapsedMs = elapsed.count();
+  } while (elapsedMs + lastStepMs <= budgetMs);
+  return steps;
+}
+
+void ShallowWater::addWater(float x, float y, float radius, float depth)
+{
+  int xBegin = std::max(0, int(std::floor(x - radius)));
+  int xEnd = std::min(size - 1, int(std::ceil(x + radius)));
+  int yBegin = std::max(0, int(std::floor(y - radius)));
+  int yEnd = std::min(size - 1, int(std::ceil(y + radius)));
+  for (int cy = yBegin; cy <= yEnd; cy++)
+  {
+    for (int cx = xBegin; cx <= xEnd; cx++)
+    {
+      float dx = cx - x, dy = cy - y;
+      if (dx * dx + dy * dy > radius * radius)
+      {
+        continue;
+      }
+      water[size_t(cy + 1) * stride + cx + 1] += depth;
+      calmSteps[size_t(cy / tileSize) * tiles + cx / tileSize] = 0;
+      changedRows[cy] = 1;
+    }
+  }
+}
+
+bool ShallowWater::takeChangedRows(std::vector<float> &depthAndVelocity,
+                                   int &rowBegin, int &rowEnd)
+{
+  depthAndVelocity.resize(size_t(size) * size * 3);
+  rowBegin = size;
+  rowEnd = 0;
+  for (int y = 0; y < size; y++)
+  {
+    if (!changedRows[y])
+    {
+      continue;
+    }
+    changedRows[y] = 0;
+    rowBegin = std::min(rowBegin, y);
+    rowEnd = y + 1;
+    size_t row = size_t(y + 1) * stride + 1;
+    float *out = depthAndVelocity.data() + size_t(y) * size * 3;
+    for (int x = 0; x < size; x++)
+    {
+      out[3 * x] = water[row + x];
+      out[3 * x + 1] = velocityX[row + x];
+      out[3 * x + 2] = velocityY[row + x];
+    }
+  }
+  return rowBegin < rowEnd;
+}
+
+int ShallowWater::getAwakeTiles() const
+{
+  int sleepSteps = std::max(1, std::min(255, params.sleepSteps));
+  int awake = 0;
+  for (uint8_t steps : calmSteps)
+  {
+    awake += steps < sleepSteps ? 1 : 0;
+  }
+  return awake;
+}
+
+double ShallowWater::totalVolume() const
+{
+  double volume = 0.0;
+  for (int y = 0; y < size; y++)
+  {
+    const float *row = water.data() + size_t(y + 1) * stride + 1;
+    for (int x = 0; x < size; x++)
+    {
+      volume += row[x];
+    }
+  }
+  return volume * cellSize * cellSize;
+}
+
+void benchmarkShallowWater(const std::vector<float> &heightMap, int size,
+                           float cellSize, float seaLevel,
+                           const ShallowWaterParams &params, int iterations)
+{
+  // The same spots on the highest ground every time
+  std::vector<int> spots;
+  std::mt19937 random(1);
+  std::uniform_int_distribution<int> cell(0, size * size - 1);
+  for (int i = 0; i < 200 && spots.size() < 16; i++)
+  {
+    int c = cell(random);
+    if (heightMap[c] > seaLevel + 1.0f)
+    {
+      spots.push_back(c);
+    }
+  }
+
+  int maxThreads = std::max(4, int(std::thread::hardware_concurrency()));
+  std::cout << "Shallow water on " << size << "x" << size << ", "
+            << spots.size() << " sources, " << iterations << " steps:\n";
+  std::vector<float> reference;
+  float singleThreadMs = 0.0f;
+  for (int threads = 1; threads <= maxThreads; threads *= 2)
+  {
+    std::unique_ptr<labhelper::ThreadPool> pool;
+    if (threads > 1)
+    {
+      pool.reset(new labhelper::ThreadPool(threads - 1));
+    }
+    ShallowWater water(heightMap, size, cellSize, seaLevel, params);
+    for (int c : spots)
+    {
+      water.addWater(float(c % size), float(c / size), 8.0f, 2.0f);
+    }
+    double volume = water.totalVolume();
+    double cells = 0.0;
+    auto startTime = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+      water.step(1, pool.get());
+      cells += water.getLastStepCells();
+    }
+    std::chrono::duration<float, std::milli> elapsed =
+        std::chrono::high_resolution_clock::now() - startTime;
+    std::vector<float> depths;
+    int rowBegin, rowEnd;
+    water.takeChangedRows(depths, rowBegin, rowEnd);
+    if (threads == 1)
+    {
+      reference = depths;
+      singleThreadMs = elapsed.count();
+    }
+    std::cout << "  " << threads << " threads: " << elapsed.count() << " ms, "
+              << cells / (elapsed.count() * 1000.0)
+              << " million cells/s stepped, "
+              << cells / (double(size) * size * iterations) * 100.0
+              << "% of the cells stepped, " << water.getAwakeTiles()
+              << " tiles awake at the end, volume changed by "
+              << (water.totalVolume() - volume) / volume * 100.0
+              << "%, speedup " << singleThreadMs / elapsed.count()
+              << (depths == reference ? "" : ", DIFFERENT RESULT") << "\n";
+  }
+}
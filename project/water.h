@@ -0,0 +1,100 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+namespace labhelper
+{
+class ThreadPool;
+}
+
+// Shallow water flowing over a fixed heightfield, with the same virtual
+// pipes as the grid erosion: each cell holds a water depth and the outflow
+// through a pipe to each of its four neighbours, accelerated by the
+// difference in water surface and slowed by friction.
+//
+// The grid is split into square tiles. A tile falls asleep once no depth in
+// it has moved for a while, and only tiles that are awake or next to one
+// are stepped, so a calm sea costs nothing. Sleeping tiles have no flow in
+// their pipes, so water in a tile that is not stepped stays where it is.
+// Stepped tiles run in parallel on the thread pool, four cells at a time,
+// and the result does not depend on the number of threads.
+struct ShallowWaterParams
+{
+    float timeStep = 0.05f;
+    float gravity = 9.81f;
+    float pipeArea = 1.0f;
+    // Fraction of the flow lost per unit of time
+    float friction = 0.5f;
+    float rain = 0.0f; // Water height per unit of time, wakes every tile
+    float evaporation = 0.0f; // Fraction of the depth per unit of time
+    // A tile falls asleep after sleepSteps steps in which no depth in it
+    // moved by more than sleepThreshold
+    float sleepThreshold = 1e-4f;
+    int sleepSteps = 16;
+};
+
+class ShallowWater
+{
+public:
+    static const int tileSize = 32;
+
+    // A size * size heightmap with cellSize between samples, with the sea
+    // filled up to seaLevel
+    ShallowWater(const std::vector<float> &heights, int size, float cellSize,
+                 float seaLevel, const ShallowWaterParams &params);
+
+    ShallowWaterParams params;
+
+    // Runs iterations steps on the threads of pool, or only on the calling
+    // thread if pool is null.
+    void step(int iterations, labhelper::ThreadPool *pool);
+    // Steps for as long as another step is expected to fit in budgetMs, but
+    // at least once, and returns the number of steps.
+    int stepFor(float budgetMs, labhelper::ThreadPool *pool);
+
+    // Adds depth to the cells within radius of (x, y), in cells
+    void addWater(float x, float y, float radius, float depth);
+
+    // Copies depth, velocity x and velocity y of the cells in the rows
+    // stepped since the last call into depthAndVelocity, three floats per
+    // cell for the whole grid. Returns false if no row was, and otherwise
+    // the rows in [rowBegin, rowEnd) that may have changed.
+    bool takeChangedRows(std::vector<float> &depthAndVelocity, int &rowBegin,
+                         int &rowEnd);
+
+    int getSize() const { return size; }
+    float getLastStepMs() const { return lastStepMs; }
+    // Cells and tiles stepped by the last step, and cells stepped in all
+    int getLastStepCells() const { return lastStepCells; }
+    int getLastStepTiles() const { return lastStepTiles; }
+    int64_t getCellsStepped() const { return cellsStepped; }
+    int getAwakeTiles() const;
+    double totalVolume() const;
+
+private:
+    // The grids have a ring of cells around the heightmap that water can
+    // not flow into, so the stencils need no special cases at the edges
+    int size;
+    int stride;
+    int tiles; // Per side
+    float cellSize;
+    float lastStepMs = 0.0f;
+    int lastStepCells = 0;
+    int lastStepTiles = 0;
+    int64_t cellsStepped = 0;
+    std::vector<float> terrain, water;
+    std::vector<float> fluxLeft, fluxRight, fluxUp, fluxDown;
+    std::vector<float> velocityX, velocityY;
+    // Per tile, the number of steps it has been calm for, up to
+    // params.sleepSteps, whether it was stepped and whether it moved
+    std::vector<uint8_t> calmSteps, stepped, moved;
+    std::vector<char> changedRows;
+};
+
+// Pours water onto the hills of a heightmap and steps it with 1, 2, 4...
+// threads up to the hardware thread count (at least 4), and prints cells
+// per second, how many tiles are stepped, and whether every thread count
+// gave the same depths.
+void benchmarkShallowWater(const std::vector<float> &heightMap, int size,
+                           float cellSize, float seaLevel,
+                           const ShallowWaterParams &params, int iterations);